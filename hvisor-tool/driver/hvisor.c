@@ -9,11 +9,15 @@
 #include "hvisor.h"
 #include "zone_config.h"
 #include <asm/cacheflush.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/file.h>
 #include <linux/gfp.h>
 #include <linux/io.h>
 #include <linux/of.h>
 #include <linux/of_irq.h>
 #include <linux/of_reserved_mem.h>
+#include <linux/scatterlist.h>
 #include <linux/sched/signal.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
@@ -154,6 +158,121 @@ out:
   return ret;
 }
 
+// A dma-buf of physically contiguous zone memory, so that display controllers
+// can scan out guest framebuffers without a copy. Zone memory may have no
+// struct page, so it is mapped for importers with dma_map_resource.
+struct hvisor_dmabuf {
+  phys_addr_t phys;
+  size_t size;
+};
+
+static struct sg_table *hvisor_dmabuf_map(struct dma_buf_attachment *attach,
+                                          enum dma_data_direction dir) {
+  struct hvisor_dmabuf *buf = attach->dmabuf->priv;
+  struct sg_table *sgt;
+  dma_addr_t addr;
+
+  sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+  if (sgt == NULL)
+    return ERR_PTR(-ENOMEM);
+  if (sg_alloc_table(sgt, 1, GFP_KERNEL)) {
+    kfree(sgt);
+    return ERR_PTR(-ENOMEM);
+  }
+  addr = dma_map_resource(attach->dev, buf->phys, buf->size, dir, 0);
+  if (dma_mapping_error(attach->dev, addr)) {
+    pr_err("hvisor: failed to map dma-buf for %s\n", dev_name(attach->dev));
+    sg_free_table(sgt);
+    kfree(sgt);
+    return ERR_PTR(-ENOMEM);
+  }
+  sgt->sgl->length = buf->size;
+  sg_dma_address(sgt->sgl) = addr;
+  sg_dma_len(sgt->sgl) = buf->size;
+  return sgt;
+}
+
+static void hvisor_dmabuf_unmap(struct dma_buf_attachment *attach,
+                                struct sg_table *sgt,
+                                enum dma_data_direction dir) {
+  struct hvisor_dmabuf *buf = attach->dmabuf->priv;
+  dma_unmap_resource(attach->dev, sg_dma_address(sgt->sgl), buf->size, dir, 0);
+  sg_free_table(sgt);
+  kfree(sgt);
+}
+
+static int hvisor_dmabuf_mmap(struct dma_buf *dmabuf,
+                              struct vm_area_struct *vma) {
+  struct hvisor_dmabuf *buf = dmabuf->priv;
+  size_t size = vma->vm_end - vma->vm_start;
+  if ((vma->vm_pgoff << PAGE_SHIFT) + size > buf->size)
+    return -EINVAL;
+  return remap_pfn_range(vma, vma->vm_start,
+                         (buf->phys >> PAGE_SHIFT) + vma->vm_pgoff, size,
+                         vma->vm_page_prot);
+}
+
+static void hvisor_dmabuf_release(struct dma_buf *dmabuf) {
+  kfree(dmabuf->priv);
+}
+
+static const struct dma_buf_ops hvisor_dmabuf_ops = {
+    .map_dma_buf = hvisor_dmabuf_map,
+    .unmap_dma_buf = hvisor_dmabuf_unmap,
+    .mmap = hvisor_dmabuf_mmap,
+    .release = hvisor_dmabuf_release,
+};
+
+static int hvisor_export_dmabuf(export_dmabuf_args_t __user *arg) {
+  DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+  export_dmabuf_args_t args;
+  struct hvisor_dmabuf *buf;
+  struct dma_buf *dmabuf;
+  int fd;
+
+  if (copy_from_user(&args, arg, sizeof(export_dmabuf_args_t))) {
+    pr_err("hvisor: failed to copy from user\n");
+    return -EFAULT;
+  }
+  // Like mmap, the range is trusted to be zone memory.
+  if (args.size == 0 || !PAGE_ALIGNED(args.phys) || !PAGE_ALIGNED(args.size))
+    return -EINVAL;
+
+  buf = kmalloc(sizeof(struct hvisor_dmabuf), GFP_KERNEL);
+  if (buf == NULL)
+    return -ENOMEM;
+  buf->phys = args.phys;
+  buf->size = args.size;
+
+  exp_info.ops = &hvisor_dmabuf_ops;
+  exp_info.size = args.size;
+  exp_info.flags = O_RDWR;
+  exp_info.priv = buf;
+  dmabuf = dma_buf_export(&exp_info);
+  if (IS_ERR(dmabuf)) {
+    pr_err("hvisor: failed to export dma-buf\n");
+    kfree(buf);
+    return PTR_ERR(dmabuf);
+  }
+
+  // Install the fd only after user space can see it.
+  fd = get_unused_fd_flags(O_CLOEXEC);
+  if (fd < 0) {
+    // release frees buf
+    dma_buf_put(dmabuf);
+    return fd;
+  }
+  args.fd = fd;
+  if (copy_to_user(arg, &args, sizeof(export_dmabuf_args_t))) {
+    pr_err("hvisor: failed to copy to user\n");
+    put_unused_fd(fd);
+    dma_buf_put(dmabuf);
+    return -EFAULT;
+  }
+  fd_install(fd, dmabuf->file);
+  return 0;
+}
+
 static long hvisor_ioctl(struct file *file, unsigned int ioctl,
                          unsigned long arg) {
   int err = 0;
@@ -174,6 +293,9 @@ static long hvisor_ioctl(struct file *file, unsigned int ioctl,
   case HVISOR_FINISH_REQ:
     err = hvisor_finish_req();
     break;
+  case HVISOR_EXPORT_DMABUF:
+    err = hvisor_export_dmabuf((export_dmabuf_args_t __user *)arg);
+    break;
   default:
     err = -EINVAL;
     break;
@@ -303,6 +425,7 @@ module_init(hvisor_init);
 module_exit(hvisor_exit);
 
 MODULE_LICENSE("GPL");
+MODULE_IMPORT_NS(DMA_BUF);
 MODULE_AUTHOR("KouweiLee <15035660024@163.com>");
 MODULE_DESCRIPTION("The hvisor device driver");
 MODULE_VERSION("1:0.0");
\ No newline at end of file
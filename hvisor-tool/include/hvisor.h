@@ -63,12 +63,23 @@ struct ioctl_zone_list_args {
 
 typedef struct ioctl_zone_list_args zone_list_args_t;
 
+// 将zone0物理内存中的一段导出为dma-buf，使显示控制器等设备可以直接访问
+struct ioctl_export_dmabuf_args {
+	__u64 phys;	// 起始物理地址，需要页对齐
+	__u64 size;	// 大小，需要页对齐
+	__s32 fd;	// 返回的dma-buf fd
+	__u32 padding;
+};
+
+typedef struct ioctl_export_dmabuf_args export_dmabuf_args_t;
+
 #define HVISOR_INIT_VIRTIO    _IO(1, 0) // virtio device init
 #define HVISOR_GET_TASK       _IO(1, 1)	
 #define HVISOR_FINISH_REQ     _IO(1, 2)		  // finish one virtio req	
 #define HVISOR_ZONE_START     _IOW(1, 3, zone_config_t*)
 #define HVISOR_ZONE_SHUTDOWN  _IOW(1, 4, __u64)
 #define HVISOR_ZONE_LIST      _IOR(1, 5, zone_list_args_t*)
+#define HVISOR_EXPORT_DMABUF  _IOWR(1, 6, export_dmabuf_args_t*)
 
 #define HVISOR_HC_INIT_VIRTIO    0
 #define HVISOR_HC_FINISH_REQ     1
@@ -8,15 +8,35 @@ static int epoll_fd;
 static int events_num;
 pthread_t emonitor_tid;
 int closing;
-#define	MAX_EVENTS	16
-struct hvisor_event *events[MAX_EVENTS];
+// The most events handled by one epoll_wait
+#define	EPOLL_BATCH	16
+// All the registered events, which grows as devices, ports and clients add
+// events. events_mtx protects it, as events are added by several threads.
+static struct hvisor_event **events;
+static int events_cap;
+static pthread_mutex_t events_mtx = PTHREAD_MUTEX_INITIALIZER;
+// Deleted events, which may still be in the batch being handled. They are
+// freed by the epoll thread once the batch is done.
+static struct hvisor_event *dead_events;
+static void free_dead_events(void)
+{
+	struct hvisor_event *hevent, *next;
+	pthread_mutex_lock(&events_mtx);
+	hevent = dead_events;
+	dead_events = NULL;
+	pthread_mutex_unlock(&events_mtx);
+	for (; hevent != NULL; hevent = next) {
+		next = hevent->next_dead;
+		free(hevent);
+	}
+}
 static void *epoll_loop()
 {
-    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event events[EPOLL_BATCH];
     struct hvisor_event *hevent;
     int ret, i;
     for (;;) {
-        ret = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        ret = epoll_wait(epoll_fd, events, EPOLL_BATCH, -1);
         if (ret < 0 && errno != EINTR)
             log_error("epoll_wait failed, errno is %d", errno);
         for (i = 0; i < ret; ++i) {
@@ -24,8 +44,16 @@ static void *epoll_loop()
             hevent = events[i].data.ptr;
             if (hevent == NULL) 
                 log_error("hevent shouldn't be null");
-			hevent->handler(hevent->fd, hevent->epoll_type, hevent->param);
+			// deleted by an earlier handler of this batch or by another thread
+			if (hevent->dead)
+				continue;
+			// a paused event is only woken up by a hangup of its fd
+			hevent->handler(hevent->fd,
+					hevent->paused ? EPOLLHUP : hevent->epoll_type,
+					hevent->param);
         }
+		// no hevent of this batch is referenced any more
+		free_dead_events();
     }
 	pthread_exit(NULL);
 	return NULL;
@@ -34,13 +62,9 @@ static void *epoll_loop()
 struct hvisor_event *add_event(int fd, int epoll_type,
         void (*handler)(int, int, void *), void *param)
 {
-    struct hvisor_event *hevent;
+    struct hvisor_event *hevent, **new_events;
     struct epoll_event eevent;
     int ret;
-	if (events_num >= MAX_EVENTS) {
-		log_error("events are full");
-		return NULL;
-	}
     if (fd < 0 || handler == NULL) {
 		log_error("invalid fd or handler");
         return NULL;
@@ -51,19 +75,101 @@ struct hvisor_event *add_event(int fd, int epoll_type,
     hevent->fd = fd;
     hevent->epoll_type = epoll_type;
 
+    pthread_mutex_lock(&events_mtx);
+	if (events_num >= events_cap) {
+		new_events = realloc(events, sizeof(*events) * (events_cap ? 2 * events_cap : EPOLL_BATCH));
+		if (new_events == NULL) {
+			pthread_mutex_unlock(&events_mtx);
+			log_error("events are full");
+			free(hevent);
+			return NULL;
+		}
+		events = new_events;
+		events_cap = events_cap ? 2 * events_cap : EPOLL_BATCH;
+	}
     eevent.events = epoll_type;
     eevent.data.ptr = hevent;
     ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, hevent->fd, &eevent);
     if (ret < 0) {
+        pthread_mutex_unlock(&events_mtx);
         log_error("epoll_ctl failed, errno is %d", errno);
         free(hevent);
         return NULL;
     }
-    else {
-		events[events_num] = hevent;
-		events_num++;
-        return hevent;
-    }
+	events[events_num++] = hevent;
+    pthread_mutex_unlock(&events_mtx);
+    return hevent;
+}
+
+// Stop monitoring hevent. The fd is not closed. hevent may already be in the
+// batch returned by epoll_wait, so it is only marked dead here, and the epoll
+// thread skips it and frees it after the batch. The handler of hevent may
+// still be running when del_event is called from another thread; the caller
+// has to make sure that it does no harm.
+void del_event(struct hvisor_event *hevent)
+{
+	int i;
+	if (hevent == NULL)
+		return;
+	hevent->dead = 1;
+	// remove it before queuing it, so that no later epoll_wait returns it
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, hevent->fd, NULL);
+	pthread_mutex_lock(&events_mtx);
+	for (i = 0; i < events_num; i++) {
+		if (events[i] == hevent) {
+			events[i] = events[--events_num];
+			break;
+		}
+	}
+	hevent->next_dead = dead_events;
+	dead_events = hevent;
+	pthread_mutex_unlock(&events_mtx);
+}
+
+// Stop or restart monitoring hevent without freeing it, so that a device can
+// leave data in the fd until it has somewhere to put it. With keep == 0 the fd
+// is removed from epoll rather than given an empty mask, as epoll always
+// reports EPOLLHUP. Otherwise only the events in keep (e.g. EPOLLRDHUP) stay
+// armed, and the handler is called with EPOLLHUP when one of them fires. Pause
+// hevent only in the epoll thread; resume it in any thread. Both are
+// idempotent.
+int pause_event(struct hvisor_event *hevent, int keep)
+{
+	struct epoll_event eevent;
+	int ret;
+	hevent->paused = 1;
+	if (keep == 0) {
+		ret = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, hevent->fd, NULL);
+		if (ret < 0 && errno == ENOENT)
+			ret = 0;
+	} else {
+		eevent.events = keep;
+		eevent.data.ptr = hevent;
+		ret = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, hevent->fd, &eevent);
+	}
+	if (ret < 0) {
+		log_error("epoll_ctl failed, errno is %d", errno);
+		return -1;
+	}
+	return 0;
+}
+
+int resume_event(struct hvisor_event *hevent)
+{
+	struct epoll_event eevent;
+	int ret;
+	// clear it first, a wakeup after the mask is restored is a real one
+	hevent->paused = 0;
+	eevent.events = hevent->epoll_type;
+	eevent.data.ptr = hevent;
+	ret = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, hevent->fd, &eevent);
+	if (ret < 0 && errno == ENOENT)
+		ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, hevent->fd, &eevent);
+	if (ret < 0 && errno != EEXIST) {
+		log_error("epoll_ctl failed, errno is %d", errno);
+		return -1;
+	}
+	return 0;
 }
 
 // Create a thread monitoring events.
@@ -82,8 +188,10 @@ int initialize_event_monitor()
 
 void destroy_event_monitor() {
 	int i;
+	pthread_mutex_lock(&events_mtx);
 	for (i = 0; i < events_num; i++)
 		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i]->fd, NULL);
+	pthread_mutex_unlock(&events_mtx);
 	close(epoll_fd);
 	// When the main thread exits, the epoll thread will also exit. Therefore, we do not directly terminate the epoll thread here.
 }
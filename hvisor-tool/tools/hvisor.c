@@ -3,6 +3,7 @@
 #include "event_monitor.h"
 #include "log.h"
 #include "virtio.h"
+#include "virtio_gpu.h"
 #include "zone_config.h"
 #include <errno.h>
 #include <fcntl.h>
@@ -569,6 +570,8 @@ int main(int argc, char *argv[]) {
   } else if (strcmp(argv[1], "virtio") == 0) {
     if (strcmp(argv[2], "start") == 0) {
       err = virtio_start(argc, argv);
+    } else if (strcmp(argv[2], "gpu-replay") == 0) {
+      err = virtio_gpu_replay(argc - 3, &argv[3]);
     } else {
       help(1);
     }
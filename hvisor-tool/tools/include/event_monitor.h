@@ -7,6 +7,10 @@ struct hvisor_event {
   void *param;
   int fd;
   int epoll_type;
+  volatile int paused;
+  // set by del_event, the hevent is freed after the current epoll batch
+  volatile int dead;
+  struct hvisor_event *next_dead;
 };
 
 int initialize_event_monitor(void);
@@ -16,4 +20,10 @@ void destroy_event_monitor();
 struct hvisor_event *add_event(int fd, int epoll_type,
                                void (*handler)(int, int, void *), void *param);
 
+void del_event(struct hvisor_event *hevent);
+
+int pause_event(struct hvisor_event *hevent, int keep);
+
+int resume_event(struct hvisor_event *hevent);
+
 #endif // HVISOR_EVENT_H
@@ -12,6 +12,9 @@
 
 #define VIRT_QUEUE_SIZE 512
 
+// RAM regions of each zone that can be mapped into this process
+#define MAX_RAMS 4
+
 typedef struct VirtMmioRegs {
   uint32_t device_id; // 设备类型id，见VirtioDeviceType
   uint32_t
@@ -50,6 +53,26 @@ typedef struct VirtIODevice VirtIODevice;
 struct VirtQueue;
 typedef struct VirtQueue VirtQueue;
 
+// Interrupt moderation of a queue's completions, see virtio_irq.c
+typedef struct virtio_irq_policy {
+  uint32_t max_packets; // inject once this many requests are completed
+  uint32_t max_usecs;   // the longest a completion may wait for its interrupt
+  bool adaptive; // inject at once while the completion rate is low, so that
+                 // an interactive guest doesn't see the delay
+} IrqPolicy;
+typedef struct virtio_irq_moderation IrqModeration;
+
+#define VIRTIO_IRQ_DEFAULT_MAX_PACKETS 32
+#define VIRTIO_IRQ_DEFAULT_MAX_USECS 200
+// Below this many completions per second an adaptive queue isn't moderated
+#define VIRTIO_IRQ_ADAPTIVE_RATE 2000
+// Maximum number of moderated queues of all the devices
+#define VIRTIO_IRQ_MAX_MODERATED 32
+// Bounds of "irq_coalesce" in json. No queue has more requests than this in
+// flight, and a longer delay makes the guest think the device is stuck.
+#define VIRTIO_IRQ_MAX_PACKETS 256
+#define VIRTIO_IRQ_MAX_USECS 100000
+
 struct VirtQueue {
   VirtIODevice *dev;      // virtqueue所属的设备
   uint64_t vq_idx;        // virtqueue的idx
@@ -77,6 +100,7 @@ struct VirtQueue {
                              // Ring上的元素位置，从而告知前端驱动后端处理的进度
                              // 启用该特性会改变avail_ring的flags字段
   pthread_mutex_t used_ring_lock; // 已用环锁
+  IrqModeration *irq_mod; // 中断合并的状态，为NULL时每次完成都注入中断
 };
 
 // The highest representations of virtio device
@@ -94,6 +118,10 @@ struct VirtIODevice {
   void *dev; // according to device type, blk is BlkDev, net is NetDev, console
              // is ConsoleDev // 指向特定设备的特殊config指针
   void (*virtio_close)(VirtIODevice *vdev); // 关闭virtio设备时所调用的函数
+  void (*virtio_dump_stats)(VirtIODevice *vdev); // 输出设备的统计信息，可为NULL
+  // 驱动前端写设备config时调用，offset相对于config的起始，可为NULL
+  void (*virtio_config_write)(VirtIODevice *vdev, uint64_t offset,
+                              uint64_t value, unsigned size);
   bool activated;                           // 当前的virtio设备是否激活
 };
 
@@ -149,6 +177,21 @@ bool desc_is_writable(volatile VirtqDesc *desc_table, uint16_t idx);
 
 void *get_virt_addr(void *zonex_ipa, int zone_id);
 
+/// Copy the RAM regions of zone_id that are mapped into this process to
+/// zonex_ipa and size, which hold MAX_RAMS entries. Return the region count.
+int virtio_zone_ram_regions(int zone_id, uint64_t *zonex_ipa, uint64_t *size);
+
+/// Map the RAM region idx of zone_id to virt without the hvisor driver, so
+/// that a recorded zone can be replayed. A size of 0 removes the region.
+void virtio_zone_ram_set(int zone_id, int idx, void *virt, uint64_t zonex_ipa,
+                         uint64_t size);
+
+/// Export the zone memory [zonex_ipa, zonex_ipa + size) as a dma-buf. The
+/// dma-buf starts at the page of zonex_ipa, whose offset in the page is
+/// returned in offset. Return the dma-buf fd, or -1 with errno set.
+int virtio_export_dmabuf(void *zonex_ipa, uint64_t size, int zone_id,
+                         uint32_t *offset);
+
 void virtqueue_set_avail(VirtQueue *vq);
 
 void virtqueue_set_used(VirtQueue *vq);
@@ -169,7 +212,23 @@ void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t value,
 
 bool in_range(uint64_t value, uint64_t lower, uint64_t len);
 
-void virtio_inject_irq(VirtQueue *vq); // unused
+bool virtio_inject_irq(VirtQueue *vq);
+
+/// Tell the driver that the config space of vdev has changed.
+void virtio_inject_config_irq(VirtIODevice *vdev);
+
+/// Attach an interrupt moderation policy to vq. Completions of vq must then be
+/// reported by virtio_irq_complete() instead of virtio_inject_irq().
+int virtio_irq_moderate(VirtQueue *vq, const IrqPolicy *policy);
+
+/// Report that n requests of vq are completed. The interrupt is injected now
+/// or deferred according to vq's policy. Return true if it's injected now.
+bool virtio_irq_complete(VirtQueue *vq, uint32_t n);
+
+/// Drop the completions waiting for an interrupt, used when vq is reset.
+void virtio_irq_cancel(VirtQueue *vq);
+
+void virtio_irq_unmoderate(VirtQueue *vq);
 
 void virtio_finish_cfg_req(uint32_t target_cpu, uint64_t value);
 
@@ -177,6 +236,9 @@ int virtio_handle_req(volatile struct device_req *req);
 
 void virtio_close();
 
+// Print the statistics of all the virtio devices, triggered by SIGUSR2.
+void virtio_dump_stats();
+
 void handle_virtio_requests();
 
 void initialize_log();
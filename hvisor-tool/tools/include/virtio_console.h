@@ -2,24 +2,114 @@
 #define _HVISOR_VIRTIO_CONSOLE_H
 #include "event_monitor.h"
 #include "virtio.h"
+#include <limits.h>
 #include <linux/virtio_console.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
+// VIRTIO_CONSOLE_F_MULTIPORT is added when json configures "ports".
 #define CONSOLE_SUPPORTED_FEATURES                                             \
   ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_CONSOLE_F_SIZE))
-#define CONSOLE_MAX_QUEUES 2
-#define VIRTQUEUE_CONSOLE_MAX_SIZE 64
+// Maximum number of ports of a multiport console
+#define CONSOLE_MAX_PORTS 8
+// port0's rx and tx, the control rx and tx, and rx and tx of other ports
+#define CONSOLE_MAX_QUEUES (2 * (CONSOLE_MAX_PORTS + 1))
+#define VIRTQUEUE_CONSOLE_MAX_SIZE 256
 #define CONSOLE_QUEUE_RX 0
 #define CONSOLE_QUEUE_TX 1
+#define CONSOLE_QUEUE_CTRL_RX 2
+#define CONSOLE_QUEUE_CTRL_TX 3
+// Queue idx of a port's rx and tx, see "Device Operation: Multiport Device
+// Operation" in virtio specification
+#define CONSOLE_PORT_RXQ(port) ((port) == 0 ? 0 : 2 * (port) + 2)
+#define CONSOLE_PORT_TXQ(port) (CONSOLE_PORT_RXQ(port) + 1)
+#define CONSOLE_QUEUE_TO_PORT(idx) ((idx) < 2 ? 0 : (idx) / 2 - 1)
+
+#define CONSOLE_PORT_NAME_LEN 32
+// Control messages waiting for the driver to provide buffers, must be a power
+// of 2
+#define CONSOLE_CTRL_PENDING_MAX 64
+// Maximum number of iovs written by one writev when draining tx
+#define CONSOLE_TX_BATCH_IOV 256
+// How long tx waits for a full backend before dropping the data
+#define CONSOLE_TX_TIMEOUT_MS 100
+
+typedef enum {
+  ConsoleBackendPty,  // a pseudo terminal, see /dev/pts/x in the log
+  ConsoleBackendUnix, // a unix socket server accepting one client
+  ConsoleBackendFile  // a file the output is appended to, no input
+} ConsoleBackendType;
+
+// A port requested by json
+typedef struct virtio_console_port_config {
+  char name[CONSOLE_PORT_NAME_LEN];
+  ConsoleBackendType backend;
+  char path[PATH_MAX]; // the path of unix socket or file
+} ConsolePortConfig;
+
+// The ports requested by json. nr_ports is 0 if "ports" is not given, then the
+// console has only one pty port and VIRTIO_CONSOLE_F_MULTIPORT is disabled.
+typedef struct virtio_console_requested_ports {
+  int nr_ports;
+  ConsolePortConfig ports[CONSOLE_MAX_PORTS];
+} ConsoleRequestedPorts;
+
+// tx requests gathered to be written by a single writev. If the backend is
+// full, the rest is kept here and written by the epoll thread.
+typedef struct virtio_console_tx_batch {
+  struct iovec iov[CONSOLE_TX_BATCH_IOV];
+  int nr_iov;
+  int iov_done; // iovs completely written
+  uint16_t req_idx[VIRTQUEUE_CONSOLE_MAX_SIZE];
+  int req_end[VIRTQUEUE_CONSOLE_MAX_SIZE]; // the iov after each request's last
+  int nr_req;
+  int req_done; // requests completed
+} ConsoleTxBatch;
+
+typedef struct virtio_console_port {
+  VirtIODevice *vdev;
+  int id;
+  char name[CONSOLE_PORT_NAME_LEN];
+  ConsoleBackendType backend;
+  char *path;    // the path of unix socket or file
+  int fd;        // pty master, connected unix client or file, -1 if not open
+  int listen_fd; // the listening socket of unix backend
+  volatile int rx_ready; // the driver has set up rx, see rxq notify handler
+  bool guest_open; // the guest has opened the port, multiport only
+  struct hvisor_event *event;
+  struct hvisor_event *listen_event;
+  ConsoleTxBatch tx;
+  int tx_fd; // a dup of fd polled for EPOLLOUT while the backend is full
+  struct hvisor_event *tx_event; // not NULL while the backend is full
+  int tx_timerfd; // drops the tx batch when the backend stays full
+  struct hvisor_event *tx_timer_event;
+  // protect fd, event and tx, which the epoll thread may use
+  pthread_mutex_t mtx;
+} ConsolePort;
+
+typedef struct virtio_console_ctrl_msg {
+  struct virtio_console_control ctrl;
+  char name[CONSOLE_PORT_NAME_LEN]; // only for VIRTIO_CONSOLE_PORT_NAME
+} ConsoleCtrlMsg;
 
 typedef struct virtio_console_config ConsoleConfig;
 typedef struct virtio_console_dev {
   ConsoleConfig config;
-  int master_fd;
-  int rx_ready;
-  struct hvisor_event *event;
+  bool multiport;
+  int nr_ports;
+  ConsolePort ports[CONSOLE_MAX_PORTS];
+  // control messages that can't be sent because control rx is empty
+  ConsoleCtrlMsg ctrl_pending[CONSOLE_CTRL_PENDING_MAX];
+  unsigned int ctrl_front, ctrl_rear;
+  pthread_mutex_t ctrl_mtx;
 } ConsoleDev;
 
-ConsoleDev *init_console_dev();
+// The number of virtqueues used by dev
+static inline int console_queue_num(ConsoleDev *dev) {
+  return dev->multiport ? 2 * (dev->nr_ports + 1) : 2;
+}
+
+ConsoleDev *init_console_dev(ConsoleRequestedPorts *requested);
 
 int virtio_console_init(VirtIODevice *vdev);
 
@@ -27,6 +117,10 @@ int virtio_console_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
 
 int virtio_console_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
 
+int virtio_console_ctrl_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+
+int virtio_console_ctrl_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
+
 void virtio_console_close(VirtIODevice *vdev);
 
-#endif
\ No newline at end of file
+#endif
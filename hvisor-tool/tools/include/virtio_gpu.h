@@ -1,10 +1,11 @@
 #ifndef _HVISOR_VIRTIO_GPU_H
 #define _HVISOR_VIRTIO_GPU_H
-#include "bits/pthreadtypes.h"
 #include "linux/types.h"
 #include "sys/queue.h"
 #include "virtio.h"
+#include <limits.h>
 #include <linux/virtio_gpu.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -30,46 +31,122 @@
 #define VIRTIO_GPU_MAX_REQUEST_BEFORE_KICK 16
 
 // hvisor的virtio_gpu实现所支持的最大scanouts数量
-#define HVISOR_VIRTIO_GPU_MAX_SCANOUTS 1
+// 每个scanout对应card上的一个connector和CRTC
+#define HVISOR_VIRTIO_GPU_MAX_SCANOUTS 4
 
 // 一个virtio gpu设备所能占用的最大用于存储resource的内存
+// json中没有"hostmem"时使用，包括resource和host上的交换链
 #define VIRTIO_GPU_MAX_HOSTMEM 536870912 // 512MB
 
 // 支持的virtio features
 // 可选VIRTIO_RING_F_INDIRECT_DESC和VIRTIO_RING_F_EVENT_IDX
-// 待支持VIRTIO_GPU_F_EDID、VIRTIO_GPU_F_RESOURCE_UUID、VIRTIO_GPU_F_RESOURCE_BLOB、VIRTIO_GPU_F_VIRGL、VIRTIO_GPU_F_CONTEXT_INIT
+// VIRTIO_GPU_F_RESOURCE_BLOB只支持VIRTIO_GPU_BLOB_MEM_GUEST
+// virglrenderer初始化成功后再加上GPU_VIRGL_FEATURES
+// 待支持VIRTIO_GPU_F_RESOURCE_UUID
 #define GPU_SUPPORTED_FEATURES                                                 \
-  ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_RING_F_INDIRECT_DESC))
+  ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |       \
+   (1ULL << VIRTIO_GPU_F_RESOURCE_BLOB) | (1ULL << VIRTIO_GPU_F_EDID))
+
+#define GPU_VIRGL_FEATURES                                                     \
+  ((1ULL << VIRTIO_GPU_F_VIRGL) | (1ULL << VIRTIO_GPU_F_CONTEXT_INIT))
 
 // scanout[0]的默认配置
 #define SCANOUT_DEFAULT_WIDTH 1280
 
 #define SCANOUT_DEFAULT_HEIGHT 800
 
+// resource哈希表的初始槽数，必须是2的幂
+#define VIRTIO_GPU_RESOURCE_TABLE_INIT_SIZE 64
+
+// virtio_gpu_formats都是32bits pp，即4bytes pp
+#define VIRTIO_GPU_BYTES_PP 4
+
+// 每个resource在两次flush之间最多记录的damage区域数，超过后合并为一个区域
+#define VIRTIO_GPU_MAX_DAMAGE_RECTS 16
+
+// 每个scanout交换链中的缓冲区数量，2为双缓冲，3为三缓冲
+#define VIRTIO_GPU_SWAPCHAIN_LEN 3
+
+// 每个scanout最多缓存的不使用的交换链，guest在几种分辨率之间切换时不必重新分配
+#define VIRTIO_GPU_FB_CACHE_LEN 2
+
+// 交换链状态中表示resource自身的framebuffer(零拷贝扫描guest backing)的缓冲区编号
+#define VIRTIO_GPU_DIRECT_BUFFER VIRTIO_GPU_SWAPCHAIN_LEN
+
+// 等待page flip完成的最长时间，超时则认为vblank事件丢失
+#define VIRTIO_GPU_FLIP_TIMEOUT_MS 100
+
+// 显示设备没有报告刷新率时使用的刷新率(Hz)，一个刷新周期内的flush合并为一次显示
+#define VIRTIO_GPU_DEFAULT_REFRESH 60
+
+// 带fence的命令等待画面显示的最长时间，超时后不再等待直接完成
+#define VIRTIO_GPU_FENCE_TIMEOUT_MS (2 * VIRTIO_GPU_FLIP_TIMEOUT_MS)
+
+// 同时有fence等待完成的context数量上限，超过的context按顺序等待
+#define VIRTIO_GPU_MAX_FENCE_CONTEXTS 16
+
+// card没有报告光标大小时使用的光标平面大小
+#define VIRTIO_GPU_CURSOR_SIZE 64
+
+// json没有指定card时，drm后端依次尝试/dev/dri/card0到card(N-1)
+#define VIRTIO_GPU_MAX_DRM_CARDS 8
+
+// 共享内存后端memfd开头的GPUShmHeader所占的大小，其后是光标和交换链缓冲区
+#define VIRTIO_GPU_SHM_HEADER_SIZE 4096
+
+#define VIRTIO_GPU_SHM_MAGIC 0x4d485356 // "VSHM"
+
+#define VIRTIO_GPU_SHM_VERSION 1
+
+// EDID的每个block的大小，以及virtio_gpu_resp_edid能容纳的大小
+#define VIRTIO_GPU_EDID_BLOCK_SIZE 128
+
+#define VIRTIO_GPU_EDID_MAX_SIZE 1024
+
+// 不知道显示器的物理尺寸时，按该DPI计算EDID中的尺寸
+#define VIRTIO_GPU_DEFAULT_DPI 96
+
+// 流式后端将画面切分成这个大小的正方形tile，只发送内容变化的tile
+#define VIRTIO_GPU_STREAM_TILE 64
+
+#define VIRTIO_GPU_STREAM_MAGIC 0x54534756 // "VGST"
+
+// 等待发送给viewer的消息最多占用的字节数，超过时丢弃新的画面
+// viewer跟上之后重新发送整个画面
+#define VIRTIO_GPU_STREAM_QUEUE_BYTES (32 * 1024 * 1024)
+
 // 求最小值宏
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-// virtio_gpu_formats和drm格式转换
-#define VIRTIO_GPU_FORMAT_TO_DRM_FORMAT(format)                                 \
-  ((format == VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM)                                 \
-       ? DRM_FORMAT_XRGB8888                                                    \
-       : (format == VIRTIO_GPU_FORMAT_X8B8G8R8_UNORM)                           \
-             ? DRM_FORMAT_XBGR8888                                              \
-             : (format == VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM)                     \
-                   ? DRM_FORMAT_RGBX8888                                        \
-                   : (format == VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM)               \
-                         ? DRM_FORMAT_BGRX8888                                  \
-                         : (format == VIRTIO_GPU_FORMAT_A8R8G8B8_UNORM)         \
-                               ? DRM_FORMAT_ARGB8888                            \
-                               : (format == VIRTIO_GPU_FORMAT_A8B8G8R8_UNORM)   \
-                                     ? DRM_FORMAT_ABGR8888                      \
-                                     : (format ==                               \
-                                        VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM)       \
-                                           ? DRM_FORMAT_RGBA8888                \
-                                           : (format ==                         \
-                                              VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM) \
-                                                 ? DRM_FORMAT_BGRA8888          \
-                                                 : 0 /* 未知格式 */)
+// 求最大值宏
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// 大于该字节数的拷贝由多个线程分担
+#define VIRTIO_GPU_BLIT_PARALLEL_BYTES (256 * 1024)
+
+// 命令记录文件的大小上限，超过后停止记录
+#define VIRTIO_GPU_TRACE_MAX_BYTES (1ULL << 30)
+
+// 回放时每种命令的延迟按2的幂微秒分桶，最后一个桶包含更大的延迟
+#define VIRTIO_GPU_TRACE_BUCKETS 16
+
+// backing的内存块多于该数量时建立偏移索引，少时顺序查找
+#define VIRTIO_GPU_IOV_INDEX_MIN 8
+
+// 分担拷贝的线程数上限，不包括GPU处理线程
+#define VIRTIO_GPU_BLIT_MAX_THREADS 3
+
+// virglrenderer提供的capset(VIRGL和VIRGL2)数量上限
+#define VIRTIO_GPU_MAX_CAPSETS 2
+
+// 有3D fence未完成时，virgl线程调用virgl_renderer_poll的间隔
+#define VIRTIO_GPU_VIRGL_POLL_US 1000
+
+// 并行执行互不相关命令的工作线程数上限
+#define VIRTIO_GPU_MAX_WORKERS 4
+
+// 调度时最多记录的被阻塞命令所访问的resource数，超过后之后的命令都等待
+#define VIRTIO_GPU_MAX_BLOCKED_RESOURCES 32
 
 /*********************************************************************
     结构体
@@ -91,31 +168,90 @@ typedef struct virtio_gpu_config GPUConfig;
 typedef struct virtio_gpu_ctrl_hdr GPUControlHeader;
 typedef struct virtio_gpu_update_cursor GPUUpdateCursor;
 
+// transfer_to_host_2d记录的一块待flush区域
+// offset为区域左上角在guest backing中的偏移，每行相距resource的stride
+typedef struct virtio_gpu_damage {
+  struct virtio_gpu_rect r;
+  uint64_t offset;
+} GPUDamage;
+
 // 渲染时存储在内存中的资源对象(图片等)
 // 在使用时，需要从iov转换成一个drm_mode_create_dumb对象来输出
 typedef struct virtio_gpu_simple_resource {
   uint32_t resource_id;   // 资源id
   uint32_t width, height; // 资源的宽和高
   uint32_t format; // 资源的format，结合宽高计算存储资源所用的内存大小
+  uint32_t stride; // 每行在guest backing中的字节数
   // addrs为资源在guest的物理地址数组，因为zonex会直接映射到hvisor-tool的虚拟内存空间，因此暂时不需要该字段
   // uint64_t *addrs;
   struct iovec *iov; // 用iov来存储资源
   unsigned int iov_cnt;
+  // iov_offsets[i]为iov[i]在backing中的起始偏移，拷贝时二分查找，可以为NULL
+  uint64_t *iov_offsets;
+  // backing在guest中物理连续时为其起始地址，否则为0
+  // 物理连续的backing可以导出为dma-buf，由显示控制器直接扫描，不需要拷贝
+  uint64_t backing_addr;
+  uint32_t direct_fb_id;     // 直接扫描backing的framebuffer，0表示还没有创建
+  uint32_t direct_handle;    // dma-buf导入card后的gem handle
+  int direct_card_fd;        // direct_fb_id所属的card
+  bool direct_failed;        // 无法直接扫描，flush时总是拷贝
   uint64_t hostmem;                     // 资源在host中所占的大小
+  // blob资源由guest内存直接构成，不需要transfer，宽高和格式由set_scanout_blob指定
+  bool blob;
+  uint32_t blob_mem; // VIRTIO_GPU_BLOB_MEM_*，guest内存构成的blob不计入hostmem预算
+  uint64_t blob_size;
+  uint64_t blob_offset; // 显示的图像在blob中的偏移
   uint32_t scanout_bitmask;             // 标记resource被哪个scanout使用
-  struct virtio_gpu_rect transfer_rect; // transfer_to_2d中，决定最终要flush
-                                        // guest内存中的图像的哪一部分
-  uint64_t transfer_offset;
+  // 上次flush后transfer_to_2d累积的区域，flush时只拷贝其中被flush的部分
+  GPUDamage damage[VIRTIO_GPU_MAX_DAMAGE_RECTS];
+  uint32_t damage_cnt;
+  // 由RESOURCE_CREATE_3D创建，内容在virglrenderer中，guest backing也交给它
+  // 可显示的3D resource在flush时读回到iov指向的host缓冲区，再按2D的流程拷贝
+  bool virgl;
+  struct iovec *virgl_iov;
+  uint32_t virgl_iov_cnt;
+  void *shadow;
   TAILQ_ENTRY(virtio_gpu_simple_resource) next;
 } GPUSimpleResource;
 
+// resource_id到resource的哈希表，开放寻址并使用线性探测
+// 删除时将后面的元素前移，因此不需要墓碑
+typedef struct virtio_gpu_resource_table {
+  GPUSimpleResource **slots; // NULL表示空槽
+  uint32_t size;             // 槽数，2的幂
+  uint32_t shift;            // 32 - log2(size)，用于计算哈希
+  uint32_t count;            // 已有的resource数量
+} GPUResourceTable;
+
+// 拷贝时每个像素的字节重排，将guest的格式转换为framebuffer的格式
+typedef enum {
+  GPU_SWIZZLE_NONE,    // 格式相同，直接拷贝
+  GPU_SWIZZLE_SWAP_RB, // 交换第0和第2字节，如RGBX到BGRX
+  GPU_SWIZZLE_REVERSE, // 4个字节逆序，如XRGB到BGRX
+  GPU_SWIZZLE_ROTATE,  // 字节依次前移一位，如XBGR到BGRX
+} GPUSwizzle;
+
+// 一次从resource的guest backing到framebuffer的区域拷贝
+typedef struct virtio_gpu_blit {
+  const struct iovec *iov; // resource的guest backing
+  unsigned int iov_cnt;
+  const uint64_t *iov_offsets; // 见GPUSimpleResource，为NULL时顺序查找
+  uint64_t src_offset; // 区域左上角在guest backing中的偏移
+  uint32_t src_stride;
+  uint8_t *dst; // 区域左上角在framebuffer中的地址
+  uint32_t dst_stride;
+  uint32_t width, height; // 区域的宽(像素)和高
+  GPUSwizzle swizzle;
+} GPUBlit;
+
 typedef struct virtio_gpu_framebuffer {
-  // TODO: 双缓冲区
   uint32_t fb_id; // framebuffer的id
   // TODO: format格式
   // format主要决定了每一个像素占多少字节
   // virtio_gpu_formats提供的都是4bytes per pixel大小的格式
   uint32_t format;        // virtio_gpu_formats
+  uint32_t drm_format;    // card实际使用的格式，card不支持format时为XRGB8888
+  GPUSwizzle swizzle;     // 从format转换到drm_format的字节重排
   uint32_t bytes_pp;      // 每像素(per pixel)的字节大小
   uint32_t width, height; // 帧缓存的宽和高
   uint32_t stride; // stride(步幅)指图像的每一行在内存中所占的字节数，stride *
@@ -126,8 +262,73 @@ typedef struct virtio_gpu_framebuffer {
   uint32_t drm_dumb_handle; // 指向drm帧缓冲区的handle
   void *fb_addr;            // 缓存区在本进程内的虚拟地址
   bool enabled;             // 是否启用该缓冲区
+  uint64_t hostmem; // 交换链所有缓冲区占用的内存，只记录在frame_buffer中
+  // 交换链中的缓冲区上次绘制后，其他缓冲区更新过的区域
+  GPUDamage damage[VIRTIO_GPU_MAX_DAMAGE_RECTS];
+  uint32_t damage_cnt;
 } GPUFrameBuffer;
 
+// scanout不再使用的交换链，SET_SCANOUT到宽、高和格式都相同的resource时复用
+typedef struct virtio_gpu_fb_cache_entry {
+  GPUFrameBuffer frame_buffer;
+  GPUFrameBuffer swapchain[VIRTIO_GPU_SWAPCHAIN_LEN];
+} GPUFrameBufferCache;
+
+// 共享内存后端中每个scanout的memfd开头的信息，viewer据此读取画面
+// viewer可以通过/proc/<pid>/fd/<fd>打开memfd并mmap，fd见hvisor-tool的日志
+// 缓冲区正在重建时buffers为0，viewer在读取画面前后比较frame_seq以检查一致性
+typedef struct virtio_gpu_shm_header {
+  uint32_t magic;   // VIRTIO_GPU_SHM_MAGIC
+  uint32_t version; // VIRTIO_GPU_SHM_VERSION
+  uint32_t width, height;
+  uint32_t stride;
+  uint32_t drm_format; // 缓冲区的drm格式
+  uint32_t buffers;    // 有效的缓冲区数量
+  uint32_t front;      // 正在显示的缓冲区
+  uint64_t buffer_offset[VIRTIO_GPU_SWAPCHAIN_LEN]; // 缓冲区在memfd中的偏移
+  uint64_t frame_seq; // 每显示一帧加1
+  // 最近一帧更新的区域
+  uint32_t damage_x1, damage_y1, damage_x2, damage_y2;
+  // 光标，ARGB8888，位于memfd中cursor_offset处
+  uint64_t cursor_offset;
+  uint32_t cursor_width, cursor_height, cursor_pitch;
+  uint32_t cursor_visible;
+  int32_t cursor_x, cursor_y;       // 光标图像左上角的位置
+  int32_t cursor_hot_x, cursor_hot_y;
+} GPUShmHeader;
+
+// 流式后端通过unix socket发送的消息，字段均为小端序
+// 每次显示发送一个GPUStreamFrame，其后紧跟tiles个GPUStreamTile及其数据
+typedef struct virtio_gpu_stream_frame {
+  uint32_t magic; // VIRTIO_GPU_STREAM_MAGIC
+  uint32_t scanout_id;
+  uint32_t width, height; // scanout的分辨率
+  uint32_t drm_format;    // tile解码后像素的drm格式
+  uint32_t tiles;
+  uint64_t frame_seq;
+  uint32_t size; // 其后所有tile及其数据的总字节数
+  uint32_t padding;
+} GPUStreamFrame;
+
+typedef enum {
+  GPU_STREAM_RAW, // 按行紧密排列的像素
+  GPU_STREAM_LZ4, // 对上述像素做LZ4 block压缩，不带frame头
+} GPUStreamEncoding;
+
+typedef struct virtio_gpu_stream_tile {
+  uint32_t x, y;          // tile左上角在scanout中的位置
+  uint32_t width, height; // 画面边缘的tile可能小于VIRTIO_GPU_STREAM_TILE
+  uint32_t encoding;      // GPUStreamEncoding
+  uint32_t size;          // 其后数据的字节数
+} GPUStreamTile;
+
+// 已编码、等待发送给viewer的消息
+typedef struct virtio_gpu_stream_msg {
+  TAILQ_ENTRY(virtio_gpu_stream_msg) next;
+  size_t len;
+  uint8_t data[];
+} GPUStreamMsg;
+
 // 32-bit RGBA
 typedef struct hvisor_cursor {
   uint16_t width, height;
@@ -141,23 +342,173 @@ typedef struct virtio_gpu_scanout {
   uint32_t width, height;
   uint32_t x, y;
   uint32_t resource_id;
-  GPUUpdateCursor cursor;
+  GPUUpdateCursor cursor; // 最近一次的光标命令
   HvCursor *current_cursor;
+  // 光标平面使用的dumb buffer，第一次设置光标图像时创建
+  uint32_t cursor_handle;
+  uint32_t cursor_width, cursor_height; // card支持的光标大小
+  uint32_t cursor_pitch;
+  uint64_t cursor_size;
+  void *cursor_addr;
+  bool cursor_visible;
+  // 交换链共同的参数，enabled表示交换链已经创建
   GPUFrameBuffer frame_buffer;
+  // 交换链，绘制在不显示的缓冲区中进行，然后在vblank时翻页
+  GPUFrameBuffer swapchain[VIRTIO_GPU_SWAPCHAIN_LEN];
+  // 缓存的交换链，fb_cache[0]是最近使用的
+  GPUFrameBufferCache fb_cache[VIRTIO_GPU_FB_CACHE_LEN];
+  int fb_cache_cnt;
+  int front;      // 正在显示的缓冲区，-1表示没有
+  int flipping;   // 已提交page flip，等待vblank的缓冲区，-1表示没有
+  int ready;      // 已绘制完，等待上一次翻页完成的缓冲区，-1表示没有
+  bool page_flip; // CRTC是否支持page flip，不支持时只使用一个缓冲区
+  pthread_mutex_t flip_mutex; // 保护交换链状态，翻页事件在epoll线程处理
+  pthread_cond_t flip_cond;
+  // CRTC正在显示的framebuffer，framebuffer改变时才需要SetCrtc
+  uint32_t crtc_fb_id;
+  // 交换链状态为VIRTIO_GPU_DIRECT_BUFFER时对应的resource framebuffer
+  uint32_t direct_fb_id;
+  // 画面序号，每次显示加1，带fence的flush等到其画面真正显示后才完成
+  uint64_t present_seq;   // 最近一次提交显示的画面
+  uint64_t displayed_seq; // 已经显示(或被放弃)的最新画面
+  uint64_t buffer_seq[VIRTIO_GPU_SWAPCHAIN_LEN + 1]; // 各缓冲区中画面的序号
+  // 帧节奏，距上次显示不到一个刷新周期的flush推迟到周期结束时一起显示
+  // 由flip_mutex保护，推迟的显示由调度线程执行
+  uint64_t frame_ns;        // 显示设备的刷新周期
+  uint64_t last_present_ns; // 最近一次显示的时间
+  bool pace_pending;        // 有推迟的显示
+  uint32_t pace_resource_id;
+  struct virtio_gpu_rect pace_rect; // 推迟的flush区域的并集
+  uint64_t pace_seq; // 推迟的显示完成后，等待它的fence可以完成
+  uint64_t paced_flushes; // 被合并的flush数
+  // 所属的设备，翻页完成时唤醒GPU处理线程完成fence
+  struct virtio_gpu_dev *gdev;
+  // 显示设备的分辨率和连接状态，GET_DISPLAY_INFO返回这里的值
+  // 由显示后端在初始化和显示设备改变时设置，由flip_mutex保护
+  uint32_t display_width, display_height;
+  bool connected;
+  // GET_EDID返回的EDID，与上面的分辨率一起更新
+  uint8_t edid[VIRTIO_GPU_EDID_MAX_SIZE];
+  uint32_t edid_size;
   // 使用的输出card
   int card0_fd;
   // drm相关
   drmModeCrtc *crtc;
   drmModeEncoder *encoder;
   drmModeConnector *connector;
+  // 共享内存后端相关，memfd包括GPUShmHeader、光标和交换链缓冲区
+  int shm_fd;
+  GPUShmHeader *shm_header; // 映射了header和光标
+  uint64_t shm_buffer_size; // 每个交换链缓冲区在memfd中所占的大小
+  // 流式后端相关，tile数组在创建交换链时按分辨率分配
+  uint32_t stream_tiles_x, stream_tiles_y;
+  uint64_t *stream_tile_hash; // viewer已有的各tile内容的hash
+  uint8_t *stream_tile_dirty; // 本次显示需要检查的tile
+  uint8_t *stream_tile;       // 拷贝单个tile的像素
+  uint8_t *stream_msg;        // 组装GPUStreamFrame消息
+  uint64_t stream_frame_seq;
+  bool stream_resync; // 新的viewer连接或丢弃过画面，需要发送整个画面
 } GPUScanout;
 
 // 由json指定的显示设备的设置
 typedef struct virtio_gpu_requested_state {
   uint32_t width, height;
   int x, y;
+  uint32_t connector_id; // 使用的drm connector，0表示任意一个空闲的connector
 } GPURequestedState;
 
+// 显示后端，即scanout的画面输出到哪里
+typedef enum {
+  GPU_BACKEND_AUTO, // 使用drm，没有可用的显示设备时使用null
+  GPU_BACKEND_DRM,  // 通过drm/kms输出到显示器，也可以是vkms
+  GPU_BACKEND_SHM,  // 输出到memfd，由其他进程读取
+  GPU_BACKEND_NULL, // 丢弃画面，用于没有显示设备的环境和测试
+  GPU_BACKEND_STREAM, // 将变化的区域压缩后发送给unix socket上的viewer
+} GPUBackendType;
+
+// 由json指定的所有scanout及其显示后端
+typedef struct virtio_gpu_requested_scanouts {
+  int nr_scanouts;
+  GPURequestedState states[HVISOR_VIRTIO_GPU_MAX_SCANOUTS];
+  GPUBackendType backend;
+  char card[PATH_MAX]; // drm后端使用的card，空字符串表示自动选择
+  char socket[PATH_MAX]; // 流式后端监听的unix socket
+  uint64_t hostmem;      // 内存预算，0表示VIRTIO_GPU_MAX_HOSTMEM
+  bool virgl;            // 使用virglrenderer支持3D命令
+  char trace[PATH_MAX];  // 记录命令的文件，空字符串表示不记录
+  bool unpaced;          // 每个flush都立刻显示，不按刷新周期合并
+} GPURequestedScanouts;
+
+// 将控制队列和光标队列的命令，以及transfer时guest backing的内容记录到文件
+// 由hvisor virtio gpu-replay在没有zone的环境中回放，见virtio_gpu_trace.c
+typedef struct virtio_gpu_trace {
+  int fd;
+  pthread_mutex_t mtx; // 多个工作线程同时记录
+  uint64_t start_ns;   // 记录中的时间相对于此
+  uint64_t size;       // 已写入的字节数
+  bool stopped;        // 写入失败或达到大小上限
+} GPUTrace;
+
+// GET_CAPSET_INFO返回的capset信息
+typedef struct virtio_gpu_capset {
+  uint32_t id; // VIRTIO_GPU_CAPSET_*
+  uint32_t max_version;
+  uint32_t max_size;
+} GPUCapset;
+
+// 内存使用的统计，设备关闭时输出
+typedef struct virtio_gpu_mem_stats {
+  uint64_t peak;         // hostmem的最大值
+  uint64_t oom;          // 因超出预算而失败的分配
+  uint64_t evictions;    // 为腾出内存或缓存已满而销毁的缓存交换链
+  uint64_t cache_hits;   // SET_SCANOUT复用了缓存中的交换链
+  uint64_t cache_misses; // SET_SCANOUT需要新建交换链
+} GPUMemStats;
+
+// virgl线程中virglrenderer的初始化状态
+typedef enum {
+  GPU_VIRGL_INIT,
+  GPU_VIRGL_READY,
+  GPU_VIRGL_FAILED,
+} GPUVirglState;
+
+// 显示后端的操作，virtio_gpu.c中的交换链状态机通过它们输出画面
+// 缓冲区编号为交换链中的编号，或者VIRTIO_GPU_DIRECT_BUFFER
+typedef struct virtio_gpu_display_backend {
+  const char *name;
+  // 缓冲区是否只依赖自身的字段，这样交换链不显示时可以缓存起来复用
+  // 按scanout保存缓冲区状态的后端(如共享内存)不能缓存
+  bool cacheable;
+  // 打开显示设备，为每个scanout设置输出和分辨率
+  int (*init)(struct virtio_gpu_dev *gdev);
+  // 释放init获得的所有资源
+  void (*close)(struct virtio_gpu_dev *gdev);
+  // 按fb中的宽高和格式创建交换链中的第index个缓冲区
+  // 需要填写fb_addr、stride、drm_format和swizzle
+  int (*create_buffer)(GPUScanout *scanout, GPUFrameBuffer *fb, int index);
+  void (*destroy_buffer)(GPUScanout *scanout, GPUFrameBuffer *fb, int index);
+  // 立刻显示buffer，clips为更新的区域，调用者持有flip_mutex
+  int (*show)(GPUScanout *scanout, int buffer, drmModeClip *clips,
+              uint32_t clips_cnt);
+  // 在下一次vblank时显示buffer，完成后调用virtio_gpu_flip_done
+  // 调用者持有flip_mutex，NULL表示不支持
+  int (*flip)(GPUScanout *scanout, int buffer);
+  // scanout被guest关闭，停止输出画面，调用者持有flip_mutex
+  // NULL表示不需要额外的操作
+  void (*blank)(GPUScanout *scanout);
+  // 将guest内存导出的dma-buf作为res的direct framebuffer，NULL表示不支持
+  int (*import_dmabuf)(GPUScanout *scanout, GPUSimpleResource *res,
+                       int dmabuf_fd, uint32_t offset);
+  void (*release_dmabuf)(struct virtio_gpu_dev *gdev, GPUSimpleResource *res);
+  // 光标平面，cursor_create需要填写scanout的cursor_addr等字段
+  // NULL表示不支持光标
+  int (*cursor_create)(GPUScanout *scanout);
+  void (*cursor_destroy)(GPUScanout *scanout);
+  int (*cursor_show)(GPUScanout *scanout, int hot_x, int hot_y);
+  void (*cursor_hide)(GPUScanout *scanout);
+  void (*cursor_move)(GPUScanout *scanout, int x, int y);
+} GPUDisplayBackend;
+
 // GPU设备结构体
 typedef struct virtio_gpu_dev {
   GPUConfig config;
@@ -169,21 +520,93 @@ typedef struct virtio_gpu_dev {
   GPURequestedState requested_states[HVISOR_VIRTIO_GPU_MAX_SCANOUTS];
   // virtio gpu拥有的resource
   TAILQ_HEAD(, virtio_gpu_simple_resource) resource_list;
+  // 按resource_id索引resource_list，每个命令都需要查找resource
+  GPUResourceTable resource_table;
+  // 最近一次查找到的resource，通常是scanout正在显示的resource
+  GPUSimpleResource *last_resource;
   // virtio gpu需要异步处理的命令队列
   TAILQ_HEAD(, virtio_gpu_control_cmd) command_queue;
+  // cursorq的命令，由调度线程直接处理，不在控制命令之后排队
+  TAILQ_HEAD(, virtio_gpu_control_cmd) cursor_queue;
+  // 已交给工作线程，还没有执行完的命令，前者还没有线程开始执行
+  TAILQ_HEAD(, virtio_gpu_control_cmd) run_queue;
+  TAILQ_HEAD(, virtio_gpu_control_cmd) running_queue;
+  // 所有还没有响应的带fence命令，按到达顺序排列
+  TAILQ_HEAD(, virtio_gpu_control_cmd) fence_queue;
+  // 有命令执行完或者翻页完成，调度线程需要重新检查各队列
+  bool wakeup;
+  // 显示设备的连接状态或分辨率改变，调度线程需要通知前端
+  bool display_changed;
+  // 是否按刷新周期合并flush，见GPUScanout的pace_pending
+  bool pacing;
+  // 各queue已完成但还没有通知前端的请求数
+  uint32_t done_cnt[GPU_MAX_QUEUES];
   // scanout的具体数目
-  int scanouts_num;
-  // virtio设备所占有的总内存
+  uint32_t scanouts_num;
+  // 显示后端
+  const GPUDisplayBackend *backend;
+  GPUBackendType backend_type;
+  char card_path[PATH_MAX]; // drm后端，json指定的card
+  // 所有scanout共用的card，page flip事件都从这里读取
+  int card_fd;
+  // drm后端，接收内核hotplug uevent的netlink socket
+  int uevent_fd;
+  struct hvisor_event *uevent_event;
+  // 流式后端，同一时间只有一个viewer，新的viewer替换旧的
+  char stream_path[PATH_MAX];
+  char trace_path[PATH_MAX]; // json指定的记录文件
+  GPUTrace *trace;           // NULL表示不记录
+  int stream_listen_fd;
+  struct hvisor_event *stream_listen_event;
+  int stream_fd;                // viewer的连接，-1表示没有
+  pthread_mutex_t stream_mutex; // 保护stream_fd及发送队列
+  // viewer连接的事件，由epoll线程在socket可写时发送队列中的消息
+  // 队列为空时只监听连接断开
+  struct hvisor_event *stream_event;
+  TAILQ_HEAD(, virtio_gpu_stream_msg) stream_queue;
+  size_t stream_queued; // 队列中消息的总字节数
+  size_t stream_sent;   // 队首消息已发送的字节数
+  bool stream_dropped;  // 队列满时丢弃过画面，发送完后需要重新同步
+  // virtio设备所占有的总内存，包括resource和交换链
+  // 交换链在与其他scanout并行的flush中创建，因此原子地修改
   uint64_t hostmem;
+  uint64_t hostmem_budget; // 预算，由json的"hostmem"指定
+  GPUMemStats mem_stats;
   // 启用的scanout
   int enabled_scanout_bitmask;
   // async
+  // gpu_thread按依赖关系调度命令，由workers执行
+  // 以下命令队列和调度状态都由queue_mutex保护
   pthread_t gpu_thread;
-  pthread_cond_t gpu_cond;
+  bool gpu_thread_started;
+  pthread_t workers[VIRTIO_GPU_MAX_WORKERS];
+  int nr_workers;
+  pthread_cond_t gpu_cond;    // 有新的命令、命令执行完或者翻页完成
+  pthread_cond_t worker_cond; // run_queue中有命令
   pthread_mutex_t queue_mutex;
   bool close;
+  // virglrenderer不是线程安全的，其GL上下文也只在初始化它的线程中有效
+  // 因此3D命令和访问3D resource的命令都由virgl_thread依次执行
+  bool virgl; // json要求使用virgl，初始化失败时改为false
+  GPUVirglState virgl_state;
+  pthread_t virgl_thread;
+  bool virgl_thread_started;
+  TAILQ_HEAD(, virtio_gpu_control_cmd) virgl_queue;
+  pthread_cond_t virgl_cond; // virgl_queue中有命令，或virgl初始化完成
+  // 已创建和已完成的virglrenderer fence，由virgl_thread写入
+  uint64_t virgl_fence_seq;
+  uint64_t virgl_fence_done;
+  GPUCapset capsets[VIRTIO_GPU_MAX_CAPSETS];
 } GPUDev;
 
+// 命令访问的对象，访问相同resource或scanout的命令按到达顺序依次执行
+typedef struct virtio_gpu_cmd_deps {
+  uint32_t resource_id;  // 0表示不访问resource
+  uint32_t scanout_mask; // 访问的scanout
+  bool exclusive; // 修改resource表或scanout设置，需要单独执行
+  bool virgl;     // 需要调用virglrenderer，由virgl线程执行
+} GPUCommandDeps;
+
 typedef struct virtio_gpu_control_cmd {
   GPUControlHeader control_header;
   struct iovec *resp_iov;    // 响应要写的iov
@@ -193,14 +616,27 @@ typedef struct virtio_gpu_control_cmd {
       finished; // 表示当前cmd经处理后是否完成响应，如果没有则统一使用no_data响应
   uint32_t error;                           // 报错类型
   uint32_t from_queue;                      // 从哪个queue传来的请求
+  GPUCommandDeps deps;                      // 由调度线程填写
+  // 带fence的命令需要等待各scanout显示到的画面序号，0表示不需要等待
+  uint64_t wait_seq[HVISOR_VIRTIO_GPU_MAX_SCANOUTS];
+  uint64_t fence_time_ns; // 执行完，开始等待画面显示的时间
+  // 带fence的3D命令等待的virglrenderer fence，0表示不需要等待
+  uint64_t virgl_fence;
+  // 命令在fence_queue中，由virtio_gpu_fence_process响应和释放
+  bool deferred;
+  bool processed;     // 已经执行完，由queue_mutex保护
+  uint32_t resp_type; // 推迟的无数据响应的类型
   TAILQ_ENTRY(virtio_gpu_control_cmd) next; // 命令队列上的下一个cmd
+  TAILQ_ENTRY(virtio_gpu_control_cmd) fence_next; // fence_queue上的下一个cmd
+  // 执行中读取的guest内存，由virtio_gpu_trace_cmd与命令一起记录并释放
+  struct virtio_gpu_trace_snapshot *trace_mem;
 } GPUCommand;
 
 /*********************************************************************
   virtio_gpu_base.c
  */
 // 初始化GPUDev结构体
-GPUDev *init_gpu_dev(GPURequestedState *requested_states);
+GPUDev *init_gpu_dev(GPURequestedScanouts *requested);
 
 // 初始化virtio-gpu设备
 int virtio_gpu_init(VirtIODevice *vdev);
@@ -208,6 +644,10 @@ int virtio_gpu_init(VirtIODevice *vdev);
 // 关闭virtio-gpu设备
 void virtio_gpu_close(VirtIODevice *vdev);
 
+// 驱动前端写virtio_gpu_config，只有events_clear可写
+void virtio_gpu_config_write(VirtIODevice *vdev, uint64_t offset,
+                             uint64_t value, unsigned size);
+
 // 重置virtio-gpu设备
 void virtio_gpu_reset();
 
@@ -296,6 +736,12 @@ void virtio_gpu_resource_create_2d(VirtIODevice *vdev, GPUCommand *gcmd);
 // 若没有，则返回NULL
 GPUSimpleResource *virtio_gpu_find_resource(GPUDev *gdev, uint32_t resource_id);
 
+// 将resource加入gdev的哈希表，成功返回0
+int virtio_gpu_resource_table_insert(GPUDev *gdev, GPUSimpleResource *res);
+
+// 将resource从gdev的哈希表中移除
+void virtio_gpu_resource_table_remove(GPUDev *gdev, GPUSimpleResource *res);
+
 // 检查指定id的resource是否已经绑定，如果是，则返回其指针
 // 否则，若id没有对应的resource，或者该resource没有绑定，则返回NULL
 GPUSimpleResource *virtio_gpu_check_resource(VirtIODevice *vdev,
@@ -304,9 +750,17 @@ GPUSimpleResource *virtio_gpu_check_resource(VirtIODevice *vdev,
                                              uint32_t *error);
 
 // 计算resource在host所占用的内存大小
-uint32_t calc_image_hostmem(int bits_per_pixel, uint32_t width,
+uint64_t calc_image_hostmem(uint32_t bits_per_pixel, uint32_t width,
                             uint32_t height);
 
+// 在预算内为size字节的内存记账，超出预算时先销毁缓存的交换链
+// scanout不为NULL时只销毁该scanout缓存的交换链，用于与其他scanout并行的命令
+// 否则调用者需是独占的命令，内存仍然不足时返回false
+bool virtio_gpu_hostmem_charge(GPUDev *gdev, GPUScanout *scanout,
+                               uint64_t size);
+
+void virtio_gpu_hostmem_uncharge(GPUDev *gdev, uint64_t size);
+
 // 对应VIRTIO_GPU_CMD_RESOURCE_UNREF
 // 销毁一个resource
 void virtio_gpu_resource_unref(VirtIODevice *vdev, GPUCommand *gcmd);
@@ -325,15 +779,51 @@ void virtio_gpu_cleanup_mapping(GPUDev *gdev, GPUSimpleResource *res);
 void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd);
 
 // 为scanout创建一个drm_framebuffer
-void virtio_gpu_create_drm_framebuffer(GPUScanout *scanout, uint32_t *error);
+// 交换链缓冲区第一次使用时从res拷贝整个图像
+void virtio_gpu_create_drm_framebuffer(GPUScanout *scanout,
+                                       GPUSimpleResource *res,
+                                       uint32_t *error);
+
+// 直接扫描resource的guest backing，不需要拷贝
+// 若backing不连续或无法导入card，则返回false，由调用者拷贝
+bool virtio_gpu_direct_flush(VirtIODevice *vdev, GPUScanout *scanout,
+                             GPUSimpleResource *res,
+                             struct virtio_gpu_rect *r, uint32_t *error);
+
+// 销毁直接扫描resource backing的framebuffer
+void virtio_gpu_destroy_direct_fb(GPUDev *gdev, GPUSimpleResource *res);
 
-// 将resource资源拷贝到scanout的drm_framebuffer并flush
+// 将resource在r内的damage拷贝到scanout交换链的缓冲区，并在vblank时翻页
 void virtio_gpu_copy_and_flush(GPUScanout *scanout, GPUSimpleResource *res,
-                               uint32_t *error);
+                               struct virtio_gpu_rect *r, uint32_t *error);
+
+// 执行scanout推迟的显示，由调度线程在刷新周期结束时调用
+// resource已经销毁或不再绑定到scanout时放弃该画面
+void virtio_gpu_paced_present(VirtIODevice *vdev, GPUScanout *scanout);
+
+// 让调度线程尽快重新显示scanout正在显示的画面，可以在任何线程中调用
+// 用于显示后端需要重新输出画面但guest没有flush的情况
+void virtio_gpu_request_present(GPUScanout *scanout);
+
+// 向damage数组加入一个区域，与已有的区域合并
+// offset为区域在guest backing中的偏移，stride为resource的stride
+void virtio_gpu_damage_add(GPUDamage *damage, uint32_t *damage_cnt,
+                           struct virtio_gpu_rect *r, uint64_t offset,
+                           uint32_t stride);
+
+// 移除完全位于r内的damage区域
+void virtio_gpu_damage_clear(GPUDamage *damage, uint32_t *damage_cnt,
+                             struct virtio_gpu_rect *r);
+
+// 显示后端的翻页完成时调用，若有已经绘制完的画面则继续翻页
+void virtio_gpu_flip_done(GPUScanout *scanout);
 
 // 移除scanout的drm_framebuffer
 void virtio_gpu_remove_drm_framebuffer(GPUScanout *scanout);
 
+// 销毁scanout缓存的所有交换链
+void virtio_gpu_fb_cache_release(GPUScanout *scanout);
+
 // 对应VIRTIO_GPU_CMD_SET_SCANOUT
 // 设置scanout的display参数，为scanout绑定resource
 void virtio_gpu_set_scanout(VirtIODevice *vdev, GPUCommand *gcmd);
@@ -348,6 +838,18 @@ void virtio_gpu_update_scanout(VirtIODevice *vdev, uint32_t scanout_id,
                                GPUFrameBuffer *fb, GPUSimpleResource *res,
                                struct virtio_gpu_rect *r);
 
+// 对应VIRTIO_GPU_CMD_RESOURCE_CREATE_BLOB
+// 用guest给定的内存创建一个blob资源
+void virtio_gpu_resource_create_blob(VirtIODevice *vdev, GPUCommand *gcmd);
+
+// 对应VIRTIO_GPU_CMD_SET_SCANOUT_BLOB
+// 以guest给定的宽高、格式和布局显示一个blob资源
+void virtio_gpu_set_scanout_blob(VirtIODevice *vdev, GPUCommand *gcmd);
+
+// 对应VIRTIO_GPU_CMD_RESOURCE_MAP_BLOB和VIRTIO_GPU_CMD_RESOURCE_UNMAP_BLOB
+// 没有host visible的共享内存区域，总是返回错误
+void virtio_gpu_resource_map_blob(VirtIODevice *vdev, GPUCommand *gcmd);
+
 // 对应VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D
 // 将在guest内存中的内容转移到host的resource中
 void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd);
@@ -357,10 +859,11 @@ void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd);
 void virtio_gpu_resource_attach_backing(VirtIODevice *vdev, GPUCommand *gcmd);
 
 // 将guest内存映射到host的iov
+// addr不为NULL时，返回每个iov在guest中的物理地址，由调用者释放
 int virtio_gpu_create_mapping_iov(VirtIODevice *vdev, uint32_t nr_entries,
-                                  uint32_t offset,
-                                  GPUCommand *gcmd, /*uint64_t **addr,*/
-                                  struct iovec **iov, uint32_t *niov);
+                                  uint32_t offset, GPUCommand *gcmd,
+                                  uint64_t **addr, struct iovec **iov,
+                                  uint32_t *niov);
 
 // ! reserved
 // 清除映射
@@ -374,10 +877,176 @@ void virtio_gpu_resource_detach_backing(VirtIODevice *vdev, GPUCommand *gcmd);
 // 根据control header处理请求
 void virtio_gpu_simple_process_cmd(GPUCommand *gcmd, VirtIODevice *vdev);
 
+/*********************************************************************
+  virtio_gpu_blit.c
+ */
+// virtio gpu格式对应的drm格式，未知格式返回0
+uint32_t virtio_gpu_drm_format(uint32_t format);
+
+// virtio gpu格式每像素的位数，未知格式返回0
+uint32_t virtio_gpu_format_bpp(uint32_t format);
+
+// 将virtio gpu格式转换为XRGB8888所需的字节重排
+GPUSwizzle virtio_gpu_swizzle_to_xrgb(uint32_t format);
+
+// 为内存块较多的backing建立偏移索引，不需要或内存不足时返回NULL
+uint64_t *virtio_gpu_iov_index(const struct iovec *iov, unsigned int iov_cnt);
+
+// 二分查找offset所在的iov，超出backing时返回iov_cnt
+unsigned int virtio_gpu_iov_find(const uint64_t *offsets,
+                                 const struct iovec *iov, unsigned int iov_cnt,
+                                 uint64_t offset);
+
+// 创建分担拷贝的线程
+int virtio_gpu_blit_pool_init(void);
+
+// 结束分担拷贝的线程
+void virtio_gpu_blit_pool_destroy(void);
+
+// 拷贝一块区域，并转换格式，较大的区域按行切分给多个线程
+void virtio_gpu_blit(GPUBlit *blit);
+
+/*********************************************************************
+  virtio_gpu_drm.c, virtio_gpu_shm.c, virtio_gpu_stream.c
+ */
+// 通过drm/kms输出
+extern const GPUDisplayBackend virtio_gpu_drm_backend;
+
+// 输出到memfd
+extern const GPUDisplayBackend virtio_gpu_shm_backend;
+
+// 丢弃画面
+extern const GPUDisplayBackend virtio_gpu_null_backend;
+
+// 压缩后发送给viewer
+extern const GPUDisplayBackend virtio_gpu_stream_backend;
+
+// 没有显示器决定分辨率的后端，使用json中指定的宽高
+void virtio_gpu_requested_mode(GPUDev *gdev);
+
+// 在普通内存中创建和销毁交换链缓冲区，画面不直接交给显示设备的后端使用
+int virtio_gpu_mem_create_buffer(GPUScanout *scanout, GPUFrameBuffer *fb,
+                                 int index);
+void virtio_gpu_mem_destroy_buffer(GPUScanout *scanout, GPUFrameBuffer *fb,
+                                   int index);
+
+/*********************************************************************
+  virtio_gpu_cursor.c
+ */
+// 对应VIRTIO_GPU_CMD_UPDATE_CURSOR和VIRTIO_GPU_CMD_MOVE_CURSOR
+// 设置光标平面的图像和位置，cursorq的命令没有响应数据
+void virtio_gpu_process_cursor(VirtIODevice *vdev, GPUCommand *gcmd);
+
+// 隐藏光标并释放光标平面的dumb buffer
+void virtio_gpu_cursor_release(GPUScanout *scanout);
+
 /*********************************************************************
   virtio_gpu_async.c
  */
-// 处理线程
+// CLOCK_MONOTONIC的当前时间
+uint64_t virtio_gpu_now_ns(void);
+
+// 调度线程，将不冲突的命令交给工作线程并行执行
 void *virtio_gpu_handler(void *vdev);
 
+// 工作线程，执行run_queue中的命令
+void *virtio_gpu_worker(void *vdev);
+
+// virgl线程，初始化virglrenderer并执行virgl_queue中的命令
+void *virtio_gpu_virgl_worker(void *vdev);
+
+// 创建调度线程和工作线程
+int virtio_gpu_async_init(VirtIODevice *vdev);
+
+// 结束调度线程和工作线程，释放还没有完成的命令
+void virtio_gpu_async_close(VirtIODevice *vdev);
+
+// 按到达顺序完成fence_queue中已执行完且画面已经显示的命令
+// 调用者需持有queue_mutex，返回完成的数量
+uint32_t virtio_gpu_fence_process(VirtIODevice *vdev);
+
+// 翻页完成后由epoll线程调用，唤醒调度线程检查fence
+void virtio_gpu_fence_wakeup(GPUDev *gdev);
+
+// 显示设备的连接状态或分辨率改变后调用
+// 由调度线程设置VIRTIO_GPU_EVENT_DISPLAY并通知前端
+void virtio_gpu_display_changed(GPUDev *gdev);
+
+/*********************************************************************
+  virtio_gpu_edid.c
+ */
+// 按modes生成EDID，modes[0]为首选的分辨率，width_mm和height_mm为0时按DPI计算
+// 返回EDID的字节数
+uint32_t virtio_gpu_edid_generate(uint8_t *edid, const drmModeModeInfo *modes,
+                                  int count, uint32_t width_mm,
+                                  uint32_t height_mm);
+
+// 生成width x height、60Hz的显示模式，用于没有真实显示器的后端
+void virtio_gpu_default_mode(drmModeModeInfo *mode, uint32_t width,
+                             uint32_t height);
+
+/*********************************************************************
+  virtio_gpu_virgl.c
+  没有定义HVISOR_VIRTIO_GPU_VIRGL(make VIRGL=y)时virgl_init总是失败
+ */
+// 在virgl线程中初始化virglrenderer，并查询capset
+int virtio_gpu_virgl_init(GPUDev *gdev);
+
+void virtio_gpu_virgl_cleanup(GPUDev *gdev);
+
+// 处理virglrenderer完成的fence，在virgl线程中调用
+void virtio_gpu_virgl_poll(void);
+
+// 为刚执行完的带fence的命令创建virglrenderer fence，返回其序号
+uint64_t virtio_gpu_virgl_create_fence(GPUDev *gdev, GPUCommand *gcmd);
+
+// 命令是否需要由virgl线程执行，调度线程调用
+bool virtio_gpu_virgl_cmd(GPUDev *gdev, GPUCommand *gcmd);
+
+// 3D命令，以及2D命令中访问3D resource的部分
+void virtio_gpu_virgl_process_cmd(VirtIODevice *vdev, GPUCommand *gcmd);
+
+void virtio_gpu_get_capset_info(VirtIODevice *vdev, GPUCommand *gcmd);
+
+// 将3D resource中rect的画面读回shadow，之后按2D resource拷贝
+int virtio_gpu_virgl_readback(GPUDev *gdev, GPUSimpleResource *res,
+                              struct virtio_gpu_rect *r);
+
+// backing交给virglrenderer，不用于2D的拷贝
+void virtio_gpu_virgl_attach_backing(VirtIODevice *vdev, GPUCommand *gcmd,
+                                     GPUSimpleResource *res,
+                                     uint32_t nr_entries);
+
+void virtio_gpu_virgl_detach_backing(GPUSimpleResource *res);
+
+// 3D resource的TRANSFER_TO_HOST_2D，由virglrenderer从backing中读取
+void virtio_gpu_virgl_transfer_to_host_2d(
+    GPUSimpleResource *res, struct virtio_gpu_transfer_to_host_2d *transfer,
+    uint32_t *error);
+
+// 从virglrenderer中销毁3D resource，并释放shadow
+void virtio_gpu_virgl_resource_destroy(GPUDev *gdev, GPUSimpleResource *res);
+
+/*********************************************************************
+  virtio_gpu_trace.c
+  trace为NULL时记录函数直接返回
+ */
+GPUTrace *virtio_gpu_trace_open(const char *path, VirtIODevice *vdev);
+
+void virtio_gpu_trace_close(GPUTrace *trace);
+
+// 在命令执行完后记录其完整的描述符链，之前先记录执行中读取的guest内存
+// 访问相同对象的命令不会同时执行，因此记录的顺序与它们执行的顺序相同
+void virtio_gpu_trace_cmd(GPUTrace *trace, GPUCommand *gcmd);
+
+// 保存resource中从offset开始的rows行，每行row_bytes字节，行间隔为stride
+// 由之后gcmd的virtio_gpu_trace_cmd记录
+void virtio_gpu_trace_mem(GPUTrace *trace, GPUCommand *gcmd,
+                          GPUSimpleResource *res, uint64_t offset,
+                          uint32_t stride, uint32_t row_bytes, uint32_t rows);
+
+// hvisor virtio gpu-replay <trace> [display] [socket]
+// 使用null或指定的显示后端依次执行记录的命令，输出每种命令的延迟分布和帧率
+int virtio_gpu_replay(int argc, char *argv[]);
+
 #endif /* _HVISOR_VIRTIO_GPU_H */
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "virtio.h"
 #include <linux/virtio_net.h>
 #include "event_monitor.h"
+#include <pthread.h>
 
 // Queue idx for virtio net.
 #define NET_QUEUE_RX    0
@@ -15,16 +16,92 @@
 // VIRTIO_RING_F_INDIRECT_DESC and VIRTIO_RING_F_EVENT_IDX are supported, for some reason we cancel them.
 #define NET_SUPPORTED_FEATURES ( (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_NET_F_MAC) | (1ULL << VIRTIO_NET_F_STATUS) )
 
+// Maximum number of virtio net devices attached to the in-daemon switch.
+#define NET_SWITCH_MAX_PORTS 8
+// Size of the switch's MAC learning table, must be a power of 2.
+#define NET_SWITCH_MAC_TABLE_SIZE 256
+// A learned MAC address expires after this many seconds without traffic.
+#define NET_SWITCH_AGEING_SEC 300
+// Frames kept for a switch port whose driver has no rx buffer, delivered when
+// it provides some. Must be a power of 2.
+#define NET_SWITCH_BACKLOG 64
+
+// Bytes of each packet kept by the pcapng writer.
+#define NET_PCAP_SNAPLEN 256
+// When a pcapng file exceeds this size, it is renamed to <path>.1 and a new
+// one is started, so at most twice this size is used on disk.
+#define NET_PCAP_MAX_SIZE (16 << 20)
+// Bytes of sampled packets buffered in memory, must be a power of 2.
+#define NET_PCAP_RING_SIZE (1 << 20)
+// How often the buffered packets are written to the pcapng file.
+#define NET_PCAP_FLUSH_MS 100
+
 typedef struct virtio_net_config NetConfig;
 typedef struct virtio_net_hdr_v1 NetHdr;
 
+// Where the frames sent by a virtio net device go.
+typedef enum {
+    NetBackendTap,      // a host tap device, see "tap" in json
+    NetBackendSwitch    // the in-daemon switch shared by all zones
+} NetBackendType;
+
+struct net_switch_port;
+
+// Statistics of a virtio net queue. A queue is only handled by one thread at
+// a time, so they are updated without locks.
+typedef struct virtio_net_queue_stats {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t drops;     // packets dropped by the device
+    uint64_t ring_full; // times a packet arrived but the driver gave no buffer
+    uint64_t irqs;      // interrupts injected at once, not by the irq timer
+    uint64_t batches;   // times the queue was processed
+    uint64_t batch_max; // the most packets processed in one batch
+} NetQueueStats;
+
+// A sampling pcapng writer, see virtio_net_pcap.c
+typedef struct virtio_net_pcap {
+    int fd;
+    char *path;
+    uint32_t sample;  // capture one of every sample packets
+    uint32_t counter;
+    uint64_t size;    // bytes written to the current file
+    // Sampled packets are copied to ring on the datapath, and a timer in the
+    // epoll thread writes them to the file.
+    uint8_t *ring;
+    uint64_t head;    // bytes ever put into ring
+    uint64_t tail;    // bytes ever written from ring to the file
+    uint64_t dropped; // sampled packets that didn't fit in ring
+    pthread_mutex_t mtx; // protects the fields above, rx and tx are handled by
+                         // different threads
+    pthread_mutex_t flush_mtx; // serializes writing the file
+    int timerfd;
+    struct hvisor_event *event;
+} NetPcap;
+
+// Packet direction recorded in pcapng
+#define NET_PCAP_INBOUND 1
+#define NET_PCAP_OUTBOUND 2
+
 typedef struct virtio_net_dev {
     NetConfig config;
     int tapfd;
     int rx_ready;   
     struct hvisor_event *event;
+    NetBackendType backend;
+    struct net_switch_port *port; // valid only if backend is NetBackendSwitch
+    NetQueueStats stats[NET_MAX_QUEUES];
+    NetPcap *pcap; // NULL if packet capture is disabled
 } NetDev;
 
+static inline void net_stats_batch(NetQueueStats *stats, uint64_t n) {
+    if (n == 0)
+        return;
+    stats->batches++;
+    if (n > stats->batch_max)
+        stats->batch_max = n;
+}
+
 NetDev *init_net_dev(uint8_t mac[]);
 
 int virtio_net_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
@@ -33,8 +110,46 @@ int virtio_net_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq);
 
 void virtio_net_event_handler(int fd, int epoll_type, void *param);
 
+/// devname is the tap device name. If devname is NULL, the device is attached
+/// to the in-daemon switch instead of a tap device.
 int virtio_net_init(VirtIODevice *vdev, char *devname);
 
 void virtio_net_close(VirtIODevice *vdev);
 
+void virtio_net_dump_stats(VirtIODevice *vdev);
+
+/// Start capturing one of every sample packets of vdev to a pcapng file.
+int virtio_net_enable_pcap(VirtIODevice *vdev, const char *path,
+                           uint32_t sample);
+
+NetPcap *net_pcap_open(const char *path, uint32_t sample);
+
+/// Record a packet if it is sampled. iov doesn't include the virtio net
+/// header. dir is NET_PCAP_INBOUND or NET_PCAP_OUTBOUND. The packet is only
+/// copied to memory, it reaches the file within NET_PCAP_FLUSH_MS.
+void net_pcap_write(NetPcap *pcap, const struct iovec *iov, int niov,
+                    int packet_len, int dir);
+
+/// Write the recorded packets to the file.
+void net_pcap_flush(NetPcap *pcap);
+
+void net_pcap_close(NetPcap *pcap);
+
+/// The in-daemon L2 switch, see virtio_net_switch.c
+int net_switch_attach(VirtIODevice *vdev);
+
+void net_switch_detach(VirtIODevice *vdev);
+
+/// The driver of vdev provided rx buffers, deliver the frames waiting for them.
+void net_switch_rx_notify(VirtIODevice *vdev);
+
+/// Forward a frame sent by net. iov doesn't include the virtio net header.
+/// The receivers are notified by net_switch_flush_irqs().
+void net_switch_forward(NetDev *net, const struct iovec *iov, int niov,
+                        int packet_len);
+
+/// Report the frames forwarded from net to the other ports since the last
+/// call, with one rx interrupt per port.
+void net_switch_flush_irqs(NetDev *net);
+
 #endif //_HVISOR_VIRTIO_NET_H
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Replay a small virtio-gpu trace with the shm and stream display backends.
+
+The trace creates a 64x64 resource in the guest memory, transfers it and
+flushes it to scanout 0. The transfer's guest memory is recorded right before
+it, as virtio_gpu_trace_cmd does. Each replay must show exactly one frame, and
+every memory record must find its resource and backing.
+
+usage: gpu_replay_test.py <path to hvisor built for this machine>
+"""
+
+import os
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+
+GPU_TRACE_MAGIC = 0x54475648
+GPU_TRACE_VERSION = 2
+GPU_TRACE_CMD = 1
+GPU_TRACE_MEM = 2
+MAX_SCANOUTS = 4
+MAX_RAMS = 4
+
+CMD_RESOURCE_CREATE_2D = 0x0101
+CMD_SET_SCANOUT = 0x0103
+CMD_RESOURCE_FLUSH = 0x0104
+CMD_TRANSFER_TO_HOST_2D = 0x0105
+CMD_RESOURCE_ATTACH_BACKING = 0x0106
+FORMAT_B8G8R8X8_UNORM = 2
+
+ZONE_ID = 1
+RAM_IPA = 0x40000000
+RAM_SIZE = 0x1000000
+BACKING_IPA = RAM_IPA + 0x100000
+RESOURCE_ID = 1
+WIDTH = HEIGHT = 64
+STRIDE = WIDTH * 4
+
+
+def header():
+    widths = [640] + [0] * (MAX_SCANOUTS - 1)
+    heights = [480] + [0] * (MAX_SCANOUTS - 1)
+    ram_ipa = [RAM_IPA] + [0] * (MAX_RAMS - 1)
+    ram_size = [RAM_SIZE] + [0] * (MAX_RAMS - 1)
+    return struct.pack(
+        "<IIII%dI%dIQII%dQ%dQ" % (MAX_SCANOUTS, MAX_SCANOUTS, MAX_RAMS,
+                                   MAX_RAMS),
+        GPU_TRACE_MAGIC, GPU_TRACE_VERSION, ZONE_ID, 1, *widths, *heights, 0,
+        1, 0, *ram_ipa, *ram_size)
+
+
+def record(rtype, payload, time_ns):
+    return struct.pack("<IIQ", rtype, len(payload), time_ns) + payload
+
+
+def ctrl_hdr(cmd_type):
+    return struct.pack("<IIQIB3x", cmd_type, 0, 0, 0, 0)
+
+
+def cmd(request, time_ns):
+    # the request is in the read-only iov[0], the response goes to iov[1]
+    iovs = [request, bytes(24)]
+    payload = struct.pack("<II", 0, len(iovs))
+    payload += struct.pack("<%dI" % len(iovs), *[len(i) for i in iovs])
+    payload += b"".join(iovs)
+    return record(GPU_TRACE_CMD, payload, time_ns)
+
+
+def mem(offset, pixels, time_ns):
+    payload = struct.pack("<IIQII", RESOURCE_ID, STRIDE, offset, STRIDE,
+                          HEIGHT) + pixels
+    return record(GPU_TRACE_MEM, payload, time_ns)
+
+
+def rect(x, y, w, h):
+    return struct.pack("<IIII", x, y, w, h)
+
+
+def build_trace(path):
+    pixels = bytes((x * 4 + y) & 0xff for y in range(HEIGHT)
+                   for x in range(STRIDE))
+    records = [
+        cmd(ctrl_hdr(CMD_RESOURCE_CREATE_2D) +
+            struct.pack("<IIII", RESOURCE_ID, FORMAT_B8G8R8X8_UNORM, WIDTH,
+                        HEIGHT), 1000),
+        cmd(ctrl_hdr(CMD_RESOURCE_ATTACH_BACKING) +
+            struct.pack("<II", RESOURCE_ID, 1) +
+            struct.pack("<QII", BACKING_IPA, STRIDE * HEIGHT, 0), 2000),
+        cmd(ctrl_hdr(CMD_SET_SCANOUT) + rect(0, 0, WIDTH, HEIGHT) +
+            struct.pack("<II", 0, RESOURCE_ID), 3000),
+        mem(0, pixels, 4000),
+        cmd(ctrl_hdr(CMD_TRANSFER_TO_HOST_2D) + rect(0, 0, WIDTH, HEIGHT) +
+            struct.pack("<QII", 0, RESOURCE_ID, 0), 4000),
+        cmd(ctrl_hdr(CMD_RESOURCE_FLUSH) + rect(0, 0, WIDTH, HEIGHT) +
+            struct.pack("<II", RESOURCE_ID, 0), 5000),
+    ]
+    with open(path, "wb") as f:
+        f.write(header())
+        f.write(b"".join(records))
+
+
+def replay(hvisor, args):
+    proc = subprocess.run([hvisor, "virtio", "gpu-replay"] + args,
+                          stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                          timeout=30, universal_newlines=True)
+    return proc.returncode, proc.stdout
+
+
+def check(name, hvisor, args):
+    code, out = replay(hvisor, args)
+    errors = []
+    if code != 0:
+        errors.append("exit status %d" % code)
+    m = re.search(r"replayed (\d+) commands .* (\d+) memory records without "
+                  r"backing", out)
+    if m is None or m.group(1) != "5" or m.group(2) != "0":
+        errors.append("expected 5 commands and no memory record misses")
+    if re.search(r"^1 frames", out, re.M) is None:
+        errors.append("expected 1 frame")
+    if errors:
+        print("FAIL %s: %s\n%s" % (name, ", ".join(errors), out))
+        return False
+    print("PASS %s" % name)
+    return True
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__)
+        return 2
+    hvisor = os.path.abspath(sys.argv[1])
+    with tempfile.TemporaryDirectory() as tmp:
+        trace = os.path.join(tmp, "gpu.trace")
+        build_trace(trace)
+        ok = check("shm", hvisor, [trace, "shm"])
+        ok = check("stream", hvisor,
+                   [trace, "stream", os.path.join(tmp, "gpu.sock")]) and ok
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -38,7 +38,6 @@ int vdevs_num;
 #define ZONEX_IPA 2
 #define MEM_SIZE 3
 
-#define MAX_RAMS 4
 unsigned long long zone_mem[MAX_ZONES][MAX_RAMS][4];
 
 #define WAIT_TIME 1000 // 1ms
@@ -166,14 +165,15 @@ VirtIODevice *create_virtio_device(VirtioDeviceType dev_type, uint32_t zone_id,
 
   case VirtioTConsole:
     vdev->regs.dev_feature = CONSOLE_SUPPORTED_FEATURES;
-    vdev->dev = init_console_dev();
+    vdev->dev = init_console_dev((ConsoleRequestedPorts *)arg0);
+    free(arg0);
     init_virtio_queue(vdev, dev_type);
     is_err = virtio_console_init(vdev);
     break;
 
   case VirtioTGPU:
     vdev->regs.dev_feature = GPU_SUPPORTED_FEATURES;
-    vdev->dev = init_gpu_dev((GPURequestedState *)arg0);
+    vdev->dev = init_gpu_dev((GPURequestedScanouts *)arg0);
     free(arg0);
     init_virtio_queue(vdev, dev_type);
     is_err = virtio_gpu_init(vdev);
@@ -218,7 +218,7 @@ void init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type) {
   switch (type) {
   case VirtioTBlock:
     vdev->vqs_len = 1;
-    vqs = malloc(sizeof(VirtQueue));
+    vqs = calloc(1, sizeof(VirtQueue));
     virtqueue_reset(vqs, 0);
     vqs->queue_num_max = VIRTQUEUE_BLK_MAX_SIZE;
     vqs->notify_handler = virtio_blk_notify_handler;
@@ -228,7 +228,7 @@ void init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type) {
 
   case VirtioTNet:
     vdev->vqs_len = NET_MAX_QUEUES;
-    vqs = malloc(sizeof(VirtQueue) * NET_MAX_QUEUES);
+    vqs = calloc(NET_MAX_QUEUES, sizeof(VirtQueue));
     for (int i = 0; i < NET_MAX_QUEUES; ++i) {
       virtqueue_reset(vqs, i);
       vqs[i].queue_num_max = VIRTQUEUE_NET_MAX_SIZE;
@@ -240,21 +240,28 @@ void init_virtio_queue(VirtIODevice *vdev, VirtioDeviceType type) {
     break;
 
   case VirtioTConsole:
-    vdev->vqs_len = CONSOLE_MAX_QUEUES;
-    vqs = malloc(sizeof(VirtQueue) * CONSOLE_MAX_QUEUES);
-    for (int i = 0; i < CONSOLE_MAX_QUEUES; ++i) {
+    vdev->vqs_len = console_queue_num(vdev->dev);
+    vqs = calloc(vdev->vqs_len, sizeof(VirtQueue));
+    for (uint32_t i = 0; i < vdev->vqs_len; ++i) {
       virtqueue_reset(vqs, i);
       vqs[i].queue_num_max = VIRTQUEUE_CONSOLE_MAX_SIZE;
       vqs[i].dev = vdev;
+      // even queues are rx of ports, odd queues are tx of ports
+      vqs[i].notify_handler = (i % 2 == 0) ? virtio_console_rxq_notify_handler
+                                           : virtio_console_txq_notify_handler;
+    }
+    if (vdev->vqs_len > CONSOLE_QUEUE_CTRL_TX) {
+      vqs[CONSOLE_QUEUE_CTRL_RX].notify_handler =
+          virtio_console_ctrl_rxq_notify_handler;
+      vqs[CONSOLE_QUEUE_CTRL_TX].notify_handler =
+          virtio_console_ctrl_txq_notify_handler;
     }
-    vqs[CONSOLE_QUEUE_RX].notify_handler = virtio_console_rxq_notify_handler;
-    vqs[CONSOLE_QUEUE_TX].notify_handler = virtio_console_txq_notify_handler;
     vdev->vqs = vqs;
     break;
 
   case VirtioTGPU:
     vdev->vqs_len = GPU_MAX_QUEUES;
-    vqs = malloc(sizeof(VirtQueue) * GPU_MAX_QUEUES);
+    vqs = calloc(GPU_MAX_QUEUES, sizeof(VirtQueue));
     for (int i = 0; i < GPU_MAX_QUEUES; ++i) {
       virtqueue_reset(vqs, i);
       vqs[i].queue_num_max = VIRTQUEUE_GPU_MAX_SIZE;
@@ -296,13 +303,17 @@ void virtqueue_reset(VirtQueue *vq, int idx) {
   void *addr = vq->notify_handler;
   VirtIODevice *dev = vq->dev;
   uint32_t queue_num_max = vq->queue_num_max;
+  IrqModeration *irq_mod = vq->irq_mod;
 
+  // completions of the old ring must not be notified after the reset
+  virtio_irq_cancel(vq);
   // 清空除上述字段外的全部字段
   memset(vq, 0, sizeof(VirtQueue));
   vq->vq_idx = idx;
   vq->notify_handler = addr;
   vq->dev = dev;
   vq->queue_num_max = queue_num_max;
+  vq->irq_mod = irq_mod;
   pthread_mutex_init(&vq->used_ring_lock, NULL);
 }
 
@@ -333,6 +344,48 @@ void *get_virt_addr(void *zonex_ipa, int zone_id) {
          zone_mem[zone_id][ram_idx][ZONEX_IPA] + zonex_ipa;
 }
 
+int virtio_export_dmabuf(void *zonex_ipa, uint64_t size, int zone_id,
+                         uint32_t *offset) {
+  export_dmabuf_args_t args;
+  unsigned long long phys, page_size = sysconf(_SC_PAGESIZE);
+  int ram_idx = get_zone_ram_index(zonex_ipa, zone_id);
+  if (ram_idx < 0 || (unsigned long long)zonex_ipa + size >
+                         zone_mem[zone_id][ram_idx][ZONEX_IPA] +
+                             zone_mem[zone_id][ram_idx][MEM_SIZE]) {
+    errno = EINVAL;
+    return -1;
+  }
+  phys = zone_mem[zone_id][ram_idx][ZONE0_IPA] -
+         zone_mem[zone_id][ram_idx][ZONEX_IPA] + (unsigned long long)zonex_ipa;
+  args.phys = phys & ~(page_size - 1);
+  args.size = (phys + size - args.phys + page_size - 1) & ~(page_size - 1);
+  args.fd = -1;
+  if (ioctl(ko_fd, HVISOR_EXPORT_DMABUF, &args) < 0)
+    return -1;
+  *offset = phys - args.phys;
+  return args.fd;
+}
+
+int virtio_zone_ram_regions(int zone_id, uint64_t *zonex_ipa, uint64_t *size) {
+  int cnt = 0;
+  for (int i = 0; i < MAX_RAMS; i++) {
+    if (zone_mem[zone_id][i][MEM_SIZE] == 0)
+      continue;
+    zonex_ipa[cnt] = zone_mem[zone_id][i][ZONEX_IPA];
+    size[cnt] = zone_mem[zone_id][i][MEM_SIZE];
+    cnt++;
+  }
+  return cnt;
+}
+
+void virtio_zone_ram_set(int zone_id, int idx, void *virt, uint64_t zonex_ipa,
+                         uint64_t size) {
+  zone_mem[zone_id][idx][VIRT_ADDR] = (unsigned long long)virt;
+  zone_mem[zone_id][idx][ZONE0_IPA] = 0;
+  zone_mem[zone_id][idx][ZONEX_IPA] = zonex_ipa;
+  zone_mem[zone_id][idx][MEM_SIZE] = size;
+}
+
 // When virtio device is processing virtqueue, driver adding an elem to
 // virtqueue is no need to notify device.
 void virtqueue_disable_notify(VirtQueue *vq) {
@@ -598,6 +651,10 @@ void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t value,
 
   if (offset >= VIRTIO_MMIO_CONFIG) {
     offset -= VIRTIO_MMIO_CONFIG;
+    if (vdev->virtio_config_write != NULL) {
+      vdev->virtio_config_write(vdev, offset, value, size);
+      return;
+    }
     log_error("virtio_mmio_write: can't write config space");
     return;
   }
@@ -678,6 +735,14 @@ void virtio_mmio_write(VirtIODevice *vdev, uint64_t offset, uint64_t value,
   case VIRTIO_MMIO_INTERRUPT_ACK:
     log_debug("write VIRTIO_MMIO_INTERRUPT_ACK");
 
+    // A config change isn't counted, the driver has read the config space by
+    // the time it acks.
+    if (value & VIRTIO_MMIO_INT_CONFIG) {
+      regs->interrupt_status &= ~VIRTIO_MMIO_INT_CONFIG;
+      value &= ~VIRTIO_MMIO_INT_CONFIG;
+      if (value == 0)
+        break;
+    }
     if (value == regs->interrupt_status && regs->interrupt_count > 0) {
       regs->interrupt_count--;
       break;
@@ -748,27 +813,27 @@ inline bool in_range(uint64_t value, uint64_t lower, uint64_t len) {
 }
 
 // Inject irq_id to target zone. It will add to res list, and notify hypervisor
-// through ioctl.
-void virtio_inject_irq(VirtQueue *vq) {
+// through ioctl. Return true if an irq is actually injected.
+bool virtio_inject_irq(VirtQueue *vq) {
   uint16_t last_used_idx, idx, event_idx;
   last_used_idx = vq->last_used_idx;
   vq->last_used_idx = idx = vq->used_ring->idx;
   // read_barrier();
   if (idx == last_used_idx) {
     log_debug("idx equals last_used_idx");
-    return;
+    return false;
   }
   if (!vq->event_idx_enabled &&
       (vq->avail_ring->flags & VRING_AVAIL_F_NO_INTERRUPT)) {
     log_debug("no interrupt");
-    return;
+    return false;
   }
   if (vq->event_idx_enabled) {
     event_idx = VQ_USED_EVENT(vq);
     log_debug("idx is %d, event_idx is %d, last_used_idx is %d", idx, event_idx,
               last_used_idx);
     if (!vring_need_event(event_idx, idx, last_used_idx)) {
-      return;
+      return false;
     }
   }
   volatile struct device_res *res;
@@ -783,12 +848,37 @@ void virtio_inject_irq(VirtQueue *vq) {
   write_barrier();
   virtio_bridge->res_rear = (res_rear + 1) & (MAX_REQ - 1);
   write_barrier();
-  vq->dev->regs.interrupt_status = VIRTIO_MMIO_INT_VRING;
+  // keep a config change that the driver hasn't acked yet
+  vq->dev->regs.interrupt_status =
+      VIRTIO_MMIO_INT_VRING |
+      (vq->dev->regs.interrupt_status & VIRTIO_MMIO_INT_CONFIG);
   vq->dev->regs.interrupt_count++;
   pthread_mutex_unlock(&RES_MUTEX);
   log_debug("inject irq to device %s, vq is %d",
             virtio_device_type_to_string(vq->dev->type), vq->vq_idx);
   ioctl(ko_fd, HVISOR_FINISH_REQ);
+  return true;
+}
+
+void virtio_inject_config_irq(VirtIODevice *vdev) {
+  volatile struct device_res *res;
+  while (
+      is_queue_full(virtio_bridge->res_front, virtio_bridge->res_rear, MAX_REQ))
+    ;
+  pthread_mutex_lock(&RES_MUTEX);
+  unsigned int res_rear = virtio_bridge->res_rear;
+  res = &virtio_bridge->res_list[res_rear];
+  res->irq_id = vdev->irq_id;
+  res->target_zone = vdev->zone_id;
+  write_barrier();
+  virtio_bridge->res_rear = (res_rear + 1) & (MAX_REQ - 1);
+  write_barrier();
+  vdev->regs.generation++;
+  vdev->regs.interrupt_status |= VIRTIO_MMIO_INT_CONFIG;
+  pthread_mutex_unlock(&RES_MUTEX);
+  log_debug("inject config irq to device %s",
+            virtio_device_type_to_string(vdev->type));
+  ioctl(ko_fd, HVISOR_FINISH_REQ);
 }
 
 void virtio_finish_cfg_req(uint32_t target_cpu, uint64_t value) {
@@ -868,6 +958,13 @@ void virtio_close() {
   log_warn("virtio daemon exit successfully");
 }
 
+void virtio_dump_stats() {
+  for (int i = 0; i < vdevs_num; i++) {
+    if (vdevs[i]->virtio_dump_stats)
+      vdevs[i]->virtio_dump_stats(vdevs[i]);
+  }
+}
+
 void handle_virtio_requests() {
   int sig;
   sigset_t wait_set;
@@ -879,6 +976,7 @@ void handle_virtio_requests() {
   sigemptyset(&wait_set);
   sigaddset(&wait_set, SIGHVI);
   sigaddset(&wait_set, SIGTERM);
+  sigaddset(&wait_set, SIGUSR2);
   virtio_bridge->need_wakeup = 1;
 
   int signal_count = 0, proc_count = 0;
@@ -890,6 +988,9 @@ void handle_virtio_requests() {
     if (sig == SIGTERM) {
       virtio_close();
       break;
+    } else if (sig == SIGUSR2) {
+      virtio_dump_stats();
+      continue;
     } else if (sig != SIGHVI) {
       log_error("unknown signal %d", sig);
       continue;
@@ -982,12 +1083,195 @@ unmap:
   return -1;
 }
 
+// Parse "ports" of a console, each of which is like
+// {"name": "log", "backend": "file", "path": "zone1.log"}
+static ConsoleRequestedPorts *console_ports_from_json(cJSON *ports_json) {
+  ConsoleRequestedPorts *requested = NULL;
+  int num_ports = cJSON_GetArraySize(ports_json);
+  if (num_ports < 1 || num_ports > CONSOLE_MAX_PORTS) {
+    log_error("console ports number should be in [1, %d]", CONSOLE_MAX_PORTS);
+    return NULL;
+  }
+  requested = calloc(1, sizeof(ConsoleRequestedPorts));
+  requested->nr_ports = num_ports;
+  for (int i = 0; i < num_ports; i++) {
+    cJSON *port_json = cJSON_GetArrayItem(ports_json, i);
+    cJSON *name_json = cJSON_GetObjectItem(port_json, "name");
+    cJSON *backend_json = cJSON_GetObjectItem(port_json, "backend");
+    cJSON *path_json = cJSON_GetObjectItem(port_json, "path");
+    ConsolePortConfig *port = &requested->ports[i];
+    if (name_json != NULL)
+      strncpy(port->name, name_json->valuestring, CONSOLE_PORT_NAME_LEN - 1);
+    if (path_json != NULL)
+      strncpy(port->path, path_json->valuestring, PATH_MAX - 1);
+    if (backend_json == NULL || strcmp(backend_json->valuestring, "pty") == 0) {
+      port->backend = ConsoleBackendPty;
+    } else if (strcmp(backend_json->valuestring, "unix") == 0) {
+      port->backend = ConsoleBackendUnix;
+    } else if (strcmp(backend_json->valuestring, "file") == 0) {
+      port->backend = ConsoleBackendFile;
+    } else {
+      log_error("unknown console backend %s", backend_json->valuestring);
+      free(requested);
+      return NULL;
+    }
+    if (port->backend != ConsoleBackendPty && path_json == NULL) {
+      log_error("console port %d needs a path", i);
+      free(requested);
+      return NULL;
+    }
+  }
+  return requested;
+}
+
+// 解析gpu的"scanouts"，如[{"width": 1280, "height": 800, "connector": 33}]
+// "connector"可选，为drm connector的id。没有"scanouts"时，使用gpu的"width"和
+// "height"作为唯一的scanout
+static GPURequestedScanouts *gpu_scanouts_from_json(cJSON *device_json) {
+  GPURequestedScanouts *requested = NULL;
+  cJSON *scanouts_json = cJSON_GetObjectItem(device_json, "scanouts");
+  int num_scanouts = 1;
+
+  if (scanouts_json != NULL) {
+    num_scanouts = cJSON_GetArraySize(scanouts_json);
+    if (num_scanouts < 1 || num_scanouts > HVISOR_VIRTIO_GPU_MAX_SCANOUTS) {
+      log_error("gpu scanouts number should be in [1, %d]",
+                HVISOR_VIRTIO_GPU_MAX_SCANOUTS);
+      return NULL;
+    }
+  }
+  requested = calloc(1, sizeof(GPURequestedScanouts));
+  requested->nr_scanouts = num_scanouts;
+  for (int i = 0; i < num_scanouts; i++) {
+    cJSON *scanout_json = scanouts_json != NULL
+                              ? cJSON_GetArrayItem(scanouts_json, i)
+                              : device_json;
+    cJSON *width_json = cJSON_GetObjectItem(scanout_json, "width");
+    cJSON *height_json = cJSON_GetObjectItem(scanout_json, "height");
+    cJSON *connector_json = cJSON_GetObjectItem(scanout_json, "connector");
+    if (width_json == NULL || height_json == NULL) {
+      log_error("gpu scanout %d needs width and height", i);
+      free(requested);
+      return NULL;
+    }
+    requested->states[i].width = width_json->valueint;
+    requested->states[i].height = height_json->valueint;
+    if (connector_json != NULL)
+      requested->states[i].connector_id = connector_json->valueint;
+  }
+
+  // "display"为"drm"、"shm"、"null"或"stream"，没有时优先使用drm，没有可用的
+  // card时使用null
+  cJSON *display_json = cJSON_GetObjectItem(device_json, "display");
+  cJSON *card_json = cJSON_GetObjectItem(device_json, "card");
+  cJSON *socket_json = cJSON_GetObjectItem(device_json, "socket");
+  cJSON *hostmem_json = cJSON_GetObjectItem(device_json, "hostmem");
+  cJSON *virgl_json = cJSON_GetObjectItem(device_json, "virgl");
+  cJSON *trace_json = cJSON_GetObjectItem(device_json, "trace");
+  cJSON *pacing_json = cJSON_GetObjectItem(device_json, "pacing");
+  requested->backend = GPU_BACKEND_AUTO;
+  if (display_json != NULL) {
+    if (strcmp(display_json->valuestring, "drm") == 0) {
+      requested->backend = GPU_BACKEND_DRM;
+    } else if (strcmp(display_json->valuestring, "shm") == 0) {
+      requested->backend = GPU_BACKEND_SHM;
+    } else if (strcmp(display_json->valuestring, "null") == 0) {
+      requested->backend = GPU_BACKEND_NULL;
+    } else if (strcmp(display_json->valuestring, "stream") == 0) {
+      requested->backend = GPU_BACKEND_STREAM;
+    } else {
+      log_error("unknown gpu display %s", display_json->valuestring);
+      free(requested);
+      return NULL;
+    }
+  }
+  // "card"如"/dev/dri/card0"，只用于drm，没有时自动选择
+  if (card_json != NULL)
+    strncpy(requested->card, card_json->valuestring,
+            sizeof(requested->card) - 1);
+  // "socket"为stream监听的unix socket，viewer连接后接收画面
+  if (socket_json != NULL)
+    strncpy(requested->socket, socket_json->valuestring,
+            sizeof(requested->socket) - 1);
+  // "hostmem"为该zone的gpu所能使用的内存(MiB)，包括resource和显示用的缓冲区
+  if (hostmem_json != NULL)
+    requested->hostmem = (uint64_t)hostmem_json->valueint << 20;
+  // "virgl"为true时使用virglrenderer支持3D命令，需要以VIRGL=y编译
+  requested->virgl = cJSON_IsTrue(virgl_json);
+  // "trace"为记录命令的文件，可由hvisor virtio gpu-replay回放
+  if (trace_json != NULL)
+    strncpy(requested->trace, trace_json->valuestring,
+            sizeof(requested->trace) - 1);
+  // "pacing"为false时每个flush都立刻显示，默认在一个刷新周期内合并flush
+  requested->unpaced = cJSON_IsFalse(pacing_json);
+  return requested;
+}
+
+// Parse "irq_coalesce" of a net or console, which is like
+// {"max_packets": 32, "max_usecs": 200, "adaptive": true}. Omitted fields keep
+// the default values.
+static int irq_policy_from_json(cJSON *policy_json, IrqPolicy *policy) {
+  policy->max_packets = VIRTIO_IRQ_DEFAULT_MAX_PACKETS;
+  policy->max_usecs = VIRTIO_IRQ_DEFAULT_MAX_USECS;
+  policy->adaptive = true;
+  if (policy_json == NULL)
+    return 0;
+  cJSON *max_packets_json = cJSON_GetObjectItem(policy_json, "max_packets");
+  cJSON *max_usecs_json = cJSON_GetObjectItem(policy_json, "max_usecs");
+  cJSON *adaptive_json = cJSON_GetObjectItem(policy_json, "adaptive");
+  if (max_packets_json != NULL) {
+    if (!cJSON_IsNumber(max_packets_json) || max_packets_json->valueint < 1 ||
+        max_packets_json->valueint > VIRTIO_IRQ_MAX_PACKETS) {
+      log_error("irq_coalesce max_packets should be in [1, %d]",
+                VIRTIO_IRQ_MAX_PACKETS);
+      return -1;
+    }
+    policy->max_packets = max_packets_json->valueint;
+  }
+  if (max_usecs_json != NULL) {
+    if (!cJSON_IsNumber(max_usecs_json) || max_usecs_json->valueint < 0 ||
+        max_usecs_json->valueint > VIRTIO_IRQ_MAX_USECS) {
+      log_error("irq_coalesce max_usecs should be in [0, %d]",
+                VIRTIO_IRQ_MAX_USECS);
+      return -1;
+    }
+    policy->max_usecs = max_usecs_json->valueint;
+  }
+  if (adaptive_json != NULL)
+    policy->adaptive = cJSON_IsTrue(adaptive_json);
+  return 0;
+}
+
+// Moderate the tx completion interrupts of a net or console, and the rx
+// interrupts of a net attached to the switch, whose frames come in batches
+// from the other guests' tx queues.
+static int moderate_irqs(VirtIODevice *vdev, const IrqPolicy *policy) {
+  if (vdev->type == VirtioTNet) {
+    NetDev *net = vdev->dev;
+    if (net->backend == NetBackendSwitch &&
+        virtio_irq_moderate(&vdev->vqs[NET_QUEUE_RX], policy) < 0)
+      return -1;
+    return virtio_irq_moderate(&vdev->vqs[NET_QUEUE_TX], policy);
+  }
+  ConsoleDev *dev = vdev->dev;
+  for (int i = 0; i < dev->nr_ports; i++) {
+    if (CONSOLE_PORT_TXQ(i) >= (int)vdev->vqs_len)
+      break;
+    if (virtio_irq_moderate(&vdev->vqs[CONSOLE_PORT_TXQ(i)], policy) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 int create_virtio_device_from_json(cJSON *device_json, int zone_id) {
   VirtioDeviceType dev_type = VirtioTNone;
   uint64_t base_addr = 0, len = 0;
   uint32_t irq_id = 0;
 
-  GPURequestedState *requested_state = NULL;
+  VirtIODevice *vdev = NULL;
+  char *pcap = NULL;
+  uint32_t pcap_sample = 1;
+  IrqPolicy irq_policy;
 
   char *status = cJSON_GetObjectItem(device_json, "status")->valuestring;
   if (strcmp(status, "disable") == 0)
@@ -1017,6 +1301,12 @@ int create_virtio_device_from_json(cJSON *device_json, int zone_id) {
   len = strtoul(cJSON_GetObjectItem(device_json, "len")->valuestring, NULL, 16);
   irq_id = cJSON_GetObjectItem(device_json, "irq")->valueint;
 
+  // "irq_coalesce" is optional, see irq_policy_from_json
+  if ((dev_type == VirtioTNet || dev_type == VirtioTConsole) &&
+      irq_policy_from_json(cJSON_GetObjectItem(device_json, "irq_coalesce"),
+                           &irq_policy) < 0)
+    return -1;
+
   // 根据设备类型具体处理其他字段
   if (dev_type == VirtioTBlock) {
     // virtio-blk
@@ -1024,7 +1314,23 @@ int create_virtio_device_from_json(cJSON *device_json, int zone_id) {
     arg0 = img, arg1 = NULL;
   } else if (dev_type == VirtioTNet) {
     // virtio-net
-    char *tap = cJSON_GetObjectItem(device_json, "tap")->valuestring;
+    // "backend" is optional, the default backend is a tap device
+    char *tap = NULL;
+    cJSON *backend_json = cJSON_GetObjectItem(device_json, "backend");
+    if (backend_json == NULL || strcmp(backend_json->valuestring, "tap") == 0) {
+      tap = cJSON_GetObjectItem(device_json, "tap")->valuestring;
+    } else if (strcmp(backend_json->valuestring, "switch") != 0) {
+      log_error("unknown net backend %s", backend_json->valuestring);
+      return -1;
+    }
+    // "pcap" and "pcap_sample" are optional, capture one of every pcap_sample
+    // packets to the pcapng file pcap
+    cJSON *pcap_json = cJSON_GetObjectItem(device_json, "pcap");
+    cJSON *pcap_sample_json = cJSON_GetObjectItem(device_json, "pcap_sample");
+    if (pcap_json != NULL)
+      pcap = pcap_json->valuestring;
+    if (pcap_sample_json != NULL)
+      pcap_sample = pcap_sample_json->valueint;
     cJSON *mac_json = cJSON_GetObjectItem(device_json, "mac");
     uint8_t mac[6];
     for (int i = 0; i < 6; i++) {
@@ -1033,18 +1339,20 @@ int create_virtio_device_from_json(cJSON *device_json, int zone_id) {
     arg0 = mac, arg1 = tap;
   } else if (dev_type == VirtioTConsole) {
     // virtio-console
+    // "ports" is optional, if it is given the console becomes multiport
+    cJSON *ports_json = cJSON_GetObjectItem(device_json, "ports");
     arg0 = arg1 = NULL;
+    if (ports_json != NULL) {
+      arg0 = console_ports_from_json(ports_json);
+      if (arg0 == NULL)
+        return -1;
+    }
   } else if (dev_type == VirtioTGPU) {
     // virtio-gpu
-    // TODO: 增加显示设备的设置
-    requested_state = (GPURequestedState *)malloc(sizeof(GPURequestedState));
-    memset(requested_state, 0, sizeof(GPURequestedState));
-    requested_state->width =
-        cJSON_GetObjectItem(device_json, "width")->valueint;
-    requested_state->height =
-        cJSON_GetObjectItem(device_json, "height")->valueint;
-    arg0 = requested_state;
+    arg0 = gpu_scanouts_from_json(device_json);
     arg1 = NULL;
+    if (arg0 == NULL)
+      return -1;
   }
 
   // 是否缺少相应字段
@@ -1054,11 +1362,22 @@ int create_virtio_device_from_json(cJSON *device_json, int zone_id) {
   }
 
   // 创建virtio_device
-  if (!create_virtio_device(dev_type, zone_id, base_addr, len, irq_id, arg0,
-                            arg1)) {
+  vdev = create_virtio_device(dev_type, zone_id, base_addr, len, irq_id, arg0,
+                              arg1);
+  if (!vdev) {
     return -1;
   }
 
+  if (pcap && virtio_net_enable_pcap(vdev, pcap, pcap_sample) < 0) {
+    log_warn("packet capture of zone %d virtio net is disabled", zone_id);
+  }
+
+  if ((dev_type == VirtioTNet || dev_type == VirtioTConsole) &&
+      moderate_irqs(vdev, &irq_policy) < 0) {
+    log_warn("irqs of zone %d %s are not moderated", zone_id,
+             virtio_device_type_to_string(dev_type));
+  }
+
   return 0;
 }
 
@@ -5,80 +5,453 @@
 #include<fcntl.h>
 #include "log.h"
 #include <errno.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <termios.h>
-static uint8_t trashbuf[1024];
+#include <unistd.h>
 
-ConsoleDev *init_console_dev() {
-    ConsoleDev *dev = (ConsoleDev *)malloc(sizeof(ConsoleDev));
+ConsoleDev *init_console_dev(ConsoleRequestedPorts *requested) {
+    ConsoleDev *dev = (ConsoleDev *)calloc(1, sizeof(ConsoleDev));
     dev->config.cols = 80;
     dev->config.rows = 25;
-    dev->master_fd = -1;
-    dev->rx_ready = -1;
-    dev->event = NULL;
+    if (requested != NULL && requested->nr_ports > 0) {
+        dev->multiport = true;
+        dev->nr_ports = requested->nr_ports;
+        dev->config.max_nr_ports = dev->nr_ports;
+    } else {
+        dev->multiport = false;
+        dev->nr_ports = 1;
+    }
+    for (int i = 0; i < dev->nr_ports; i++) {
+        ConsolePort *port = &dev->ports[i];
+        port->id = i;
+        port->fd = -1;
+        port->listen_fd = -1;
+        port->tx_fd = -1;
+        port->tx_timerfd = -1;
+        port->rx_ready = -1;
+        port->event = NULL;
+        port->listen_event = NULL;
+        port->backend = ConsoleBackendPty;
+        pthread_mutex_init(&port->mtx, NULL);
+        if (dev->multiport) {
+            strncpy(port->name, requested->ports[i].name, CONSOLE_PORT_NAME_LEN - 1);
+            port->backend = requested->ports[i].backend;
+            if (requested->ports[i].path[0])
+                port->path = strdup(requested->ports[i].path);
+        }
+    }
+    dev->ctrl_front = dev->ctrl_rear = 0;
+    pthread_mutex_init(&dev->ctrl_mtx, NULL);
     return dev;
 }
 
+/// Copy a control message to the driver. Caller must hold dev->ctrl_mtx.
+static void console_flush_ctrl(VirtIODevice *vdev) {
+    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
+    VirtQueue *vq = &vdev->vqs[CONSOLE_QUEUE_CTRL_RX];
+    ConsoleCtrlMsg *msg;
+    struct iovec *iov = NULL;
+    size_t len, done, s;
+    uint16_t idx;
+    int n, i;
+    bool sent = false;
+
+    if (!vq->ready || vq->avail_ring == NULL)
+        return;
+    while (!is_queue_empty(dev->ctrl_front, dev->ctrl_rear) && !virtqueue_is_empty(vq)) {
+        n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+        if (n < 1)
+            break;
+        msg = &dev->ctrl_pending[dev->ctrl_front];
+        len = sizeof(msg->ctrl);
+        if (msg->ctrl.event == VIRTIO_CONSOLE_PORT_NAME)
+            len += strlen(msg->name);
+        for (i = 0, done = 0; i < n && done < len; i++) {
+            s = MIN(iov[i].iov_len, len - done);
+            memcpy(iov[i].iov_base, (char *)msg + done, s);
+            done += s;
+        }
+        update_used_ring(vq, idx, done);
+        free(iov);
+        dev->ctrl_front = (dev->ctrl_front + 1) & (CONSOLE_CTRL_PENDING_MAX - 1);
+        sent = true;
+    }
+    if (sent)
+        virtio_inject_irq(vq);
+}
+
+/// Send a control message to the driver. If the driver hasn't provided a
+/// buffer yet, the message is sent when it does.
+static void console_send_ctrl(VirtIODevice *vdev, uint32_t id, uint16_t event,
+                              uint16_t value, const char *name) {
+    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
+    ConsoleCtrlMsg *msg;
+    if (!dev->multiport)
+        return;
+    pthread_mutex_lock(&dev->ctrl_mtx);
+    if (is_queue_full(dev->ctrl_front, dev->ctrl_rear, CONSOLE_CTRL_PENDING_MAX)) {
+        log_error("console control queue is full, event %d of port %d is dropped", event, id);
+        pthread_mutex_unlock(&dev->ctrl_mtx);
+        return;
+    }
+    msg = &dev->ctrl_pending[dev->ctrl_rear];
+    memset(msg, 0, sizeof(*msg));
+    msg->ctrl.id = id;
+    msg->ctrl.event = event;
+    msg->ctrl.value = value;
+    if (name != NULL)
+        strncpy(msg->name, name, CONSOLE_PORT_NAME_LEN - 1);
+    dev->ctrl_rear = (dev->ctrl_rear + 1) & (CONSOLE_CTRL_PENDING_MAX - 1);
+    console_flush_ctrl(vdev);
+    pthread_mutex_unlock(&dev->ctrl_mtx);
+}
+
+// A descriptor chain is never longer than the queue, so every request fits
+// into an empty batch.
+_Static_assert(CONSOLE_TX_BATCH_IOV >= VIRTQUEUE_CONSOLE_MAX_SIZE,
+               "a console tx request must fit into one batch");
+
+/// Gather the requests of tx into port->tx, so that they are written to the
+/// backend by a single writev. Caller must hold port->mtx.
+static void console_tx_gather(ConsolePort *port, VirtQueue *vq) {
+    ConsoleTxBatch *b = &port->tx;
+    struct iovec *iov = NULL;
+    uint16_t idx;
+    int n;
+
+    b->nr_iov = b->iov_done = b->nr_req = b->req_done = 0;
+    while (b->nr_req < VIRTQUEUE_CONSOLE_MAX_SIZE && !virtqueue_is_empty(vq)) {
+        n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+        if (n < 1)
+            break;
+        if (b->nr_iov + n > CONSOLE_TX_BATCH_IOV) {
+            vq->last_avail_idx--;
+            free(iov);
+            break;
+        }
+        memcpy(&b->iov[b->nr_iov], iov, sizeof(struct iovec) * n);
+        free(iov);
+        b->nr_iov += n;
+        b->req_idx[b->nr_req] = idx;
+        b->req_end[b->nr_req++] = b->nr_iov;
+    }
+}
+
+/// Complete the requests of port->tx that have been written or dropped.
+static void console_tx_complete(ConsolePort *port, VirtQueue *vq,
+                                uint32_t *completed) {
+    ConsoleTxBatch *b = &port->tx;
+    while (b->req_done < b->nr_req && b->req_end[b->req_done] <= b->iov_done) {
+        update_used_ring(vq, b->req_idx[b->req_done++], 0);
+        (*completed)++;
+    }
+}
+
+/// Write port->tx to the backend. The output is dropped if the port isn't
+/// connected or the write fails. Return false if the backend is full, then
+/// the rest of the batch is kept.
+static bool console_tx_write(ConsolePort *port) {
+    ConsoleTxBatch *b = &port->tx;
+    struct iovec *iov;
+    ssize_t len;
+
+    while (b->iov_done < b->nr_iov) {
+        if (port->fd < 0) {
+            log_debug("console port %d is not connected, drop the output", port->id);
+            b->iov_done = b->nr_iov;
+            break;
+        }
+        len = writev(port->fd, &b->iov[b->iov_done], b->nr_iov - b->iov_done);
+        if (len < 0 && errno == EAGAIN) {
+            return false;
+        } else if (len < 0) {
+            log_error("Failed to write to console, errno is %d", errno);
+            b->iov_done = b->nr_iov;
+            break;
+        }
+        // skip what has been written
+        while (b->iov_done < b->nr_iov && (size_t)len >= b->iov[b->iov_done].iov_len)
+            len -= b->iov[b->iov_done++].iov_len;
+        if (b->iov_done < b->nr_iov) {
+            iov = &b->iov[b->iov_done];
+            iov->iov_base = (char *)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+    return true;
+}
+
+static void console_tx_handler(int fd, int epoll_type, void *param);
+static void console_tx_timer_handler(int fd, int epoll_type, void *param);
+
+/// The backend of port is full, go on with tx in the epoll thread once it can
+/// take more, or drop the batch if it stays full for CONSOLE_TX_TIMEOUT_MS.
+/// The request thread never waits for the backend, as it serves all the zones.
+static int console_tx_wait(ConsolePort *port) {
+    struct itimerspec its = {
+        .it_value = {.tv_sec = CONSOLE_TX_TIMEOUT_MS / 1000,
+                     .tv_nsec = CONSOLE_TX_TIMEOUT_MS % 1000 * 1000000L},
+    };
+    if (port->tx_timerfd < 0) {
+        port->tx_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (port->tx_timerfd < 0) {
+            log_error("Failed to create console tx timer, errno is %d", errno);
+            return -1;
+        }
+        port->tx_timer_event = add_event(port->tx_timerfd, EPOLLIN, console_tx_timer_handler, port);
+        if (port->tx_timer_event == NULL) {
+            log_error("Can't register console tx timer");
+            close(port->tx_timerfd);
+            port->tx_timerfd = -1;
+            return -1;
+        }
+    }
+    if (port->tx_event == NULL) {
+        // fd is already in epoll for rx, a dup can be added for EPOLLOUT
+        port->tx_fd = dup(port->fd);
+        if (port->tx_fd < 0) {
+            log_error("Failed to dup console port %d, errno is %d", port->id, errno);
+            return -1;
+        }
+        port->tx_event = add_event(port->tx_fd, EPOLLOUT, console_tx_handler, port);
+        if (port->tx_event == NULL) {
+            log_error("Can't register console tx event");
+            close(port->tx_fd);
+            port->tx_fd = -1;
+            return -1;
+        }
+    }
+    // the backend took something since the timer was armed, so restart it
+    timerfd_settime(port->tx_timerfd, 0, &its, NULL);
+    return 0;
+}
+
+static void console_tx_unwait(ConsolePort *port) {
+    struct itimerspec its;
+    if (port->tx_event == NULL)
+        return;
+    del_event(port->tx_event);
+    port->tx_event = NULL;
+    close(port->tx_fd);
+    port->tx_fd = -1;
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(port->tx_timerfd, 0, &its, NULL);
+}
+
+/// Drain tx into the backend of port until tx is empty or the backend is full.
+/// With drop, the rest of the current batch is dropped first. Caller must hold
+/// port->mtx.
+static void console_port_tx(ConsolePort *port, VirtQueue *vq, bool drop) {
+    uint32_t completed = 0;
+
+    if (drop) {
+        log_warn("console port %d is full, drop the output", port->id);
+        port->tx.iov_done = port->tx.nr_iov;
+    }
+    virtqueue_disable_notify(vq);
+    for (;;) {
+        if (!console_tx_write(port)) {
+            console_tx_complete(port, vq, &completed);
+            // tx notify stays disabled until the epoll thread drains tx
+            if (console_tx_wait(port) == 0)
+                break;
+            log_warn("console port %d is full, drop the output", port->id);
+            port->tx.iov_done = port->tx.nr_iov;
+        }
+        console_tx_complete(port, vq, &completed);
+        if (virtqueue_is_empty(vq)) {
+            virtqueue_enable_notify(vq);
+            // The driver may have posted buffers before it saw the notify enabled.
+            if (virtqueue_is_empty(vq)) {
+                console_tx_unwait(port);
+                break;
+            }
+            virtqueue_disable_notify(vq);
+        }
+        console_tx_gather(port, vq);
+    }
+    // hvc polls the used ring of port0, so the interrupt may be coalesced
+    virtio_irq_complete(vq, completed);
+}
+
+/// Go on with the tx of port in the epoll thread. Caller must hold port->mtx.
+static void console_port_tx_resume(ConsolePort *port, bool drop) {
+    VirtQueue *vq = &port->vdev->vqs[CONSOLE_PORT_TXQ(port->id)];
+    if (port->tx_event == NULL)
+        return;
+    if (vq->used_ring == NULL) {
+        // the driver has reset the device, the batch is gone with the ring
+        port->tx.nr_iov = port->tx.iov_done = 0;
+        port->tx.nr_req = port->tx.req_done = 0;
+        console_tx_unwait(port);
+        return;
+    }
+    console_port_tx(port, vq, drop);
+}
+
+static void console_tx_handler(int fd, int epoll_type, void *param) {
+    ConsolePort *port = (ConsolePort *)param;
+    (void)fd;
+    (void)epoll_type;
+    pthread_mutex_lock(&port->mtx);
+    console_port_tx_resume(port, false);
+    pthread_mutex_unlock(&port->mtx);
+}
+
+static void console_tx_timer_handler(int fd, int epoll_type, void *param) {
+    ConsolePort *port = (ConsolePort *)param;
+    uint64_t expirations;
+    (void)epoll_type;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        log_error("Failed to read console tx timer, errno is %d", errno);
+    pthread_mutex_lock(&port->mtx);
+    console_port_tx_resume(port, true);
+    pthread_mutex_unlock(&port->mtx);
+}
+
+/// The client of a unix socket port went away, wait for the next one.
+static void console_port_hangup(ConsolePort *port) {
+    if (port->backend != ConsoleBackendUnix)
+        return;
+    struct hvisor_event *event;
+    log_info("console port %d client disconnected", port->id);
+    pthread_mutex_lock(&port->mtx);
+    event = port->event;
+    port->event = NULL;
+    close(port->fd);
+    port->fd = -1;
+    // the output waiting for the client is dropped
+    console_port_tx_resume(port, false);
+    pthread_mutex_unlock(&port->mtx);
+    del_event(event);
+    console_send_ctrl(port->vdev, port->id, VIRTIO_CONSOLE_PORT_OPEN, 0, NULL);
+}
+
+/// The driver has no rx buffer, stop reading port until it provides some. The
+/// input stays in the kernel buffer of the pty or socket, which throttles the
+/// writer like a tty with flow control, instead of being read and dropped.
+/// A unix socket port keeps EPOLLRDHUP armed, so a client going away while the
+/// port is throttled is still noticed and the next one can connect.
+static void console_port_rx_throttle(ConsolePort *port, VirtQueue *vq) {
+    pause_event(port->event,
+                port->backend == ConsoleBackendUnix ? EPOLLRDHUP : 0);
+    // the rxq notify handler resumes the port once the driver is ready
+    if (port->rx_ready <= 0)
+        return;
+    virtqueue_enable_notify(vq);
+    // The driver may have posted buffers before it saw the notify enabled.
+    if (!virtqueue_is_empty(vq)) {
+        virtqueue_disable_notify(vq);
+        resume_event(port->event);
+    }
+}
+
 static void virtio_console_event_handler(int fd, int epoll_type, void *param) {
     log_debug("%s", __func__);
-    VirtIODevice *vdev = (VirtIODevice *)param;
-    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
-    VirtQueue *vq = &vdev->vqs[CONSOLE_QUEUE_RX];
+    ConsolePort *port = (ConsolePort *)param;
+    VirtIODevice *vdev = port->vdev;
+    VirtQueue *vq = &vdev->vqs[CONSOLE_PORT_RXQ(port->id)];
     int n;
     ssize_t len;
     struct iovec *iov = NULL;
     uint16_t idx;
-    if (epoll_type != EPOLLIN || fd != dev->master_fd) {
+    bool filled = false;
+    if (epoll_type == EPOLLHUP && fd == port->fd) {
+        // the client went away while the port was throttled, the input it
+        // left has nowhere to go
+        console_port_hangup(port);
+        return ;
+    }
+    if (epoll_type != EPOLLIN || fd != port->fd) {
         log_error("Invalid console event");
         return ;
     }
-    if (dev->master_fd <= 0 || vdev->type != VirtioTConsole) {
+    if (port->fd < 0 || vdev->type != VirtioTConsole) {
         log_error("console event handler should not be called");
         return ;
-    } 
-    if (dev->rx_ready <= 0) {
-        read(dev->master_fd, trashbuf, sizeof(trashbuf));
-        return ;
     }
-    if (virtqueue_is_empty(vq)) {
-        read(dev->master_fd, trashbuf, sizeof(trashbuf));
-        virtio_inject_irq(vq);
+    if (port->rx_ready <= 0 || virtqueue_is_empty(vq)) {
+        console_port_rx_throttle(port, vq);
         return ;
     }
-    
+
     while (!virtqueue_is_empty(vq)) {
         n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
         if (n < 1) {
             log_error("process_descriptor_chain failed");
             break;
         }
-        len = readv(dev->master_fd, iov, n);
+        len = readv(port->fd, iov, n);
         if (len < 0 && errno == EWOULDBLOCK) {
             log_debug("no more bytes");
 			vq->last_avail_idx--;
             free(iov);
 			break;
-        } else if (len < 0) {
+        } else if (len <= 0) {
             log_trace("Failed to read from console, errno is %d", errno);
 			vq->last_avail_idx--;
             free(iov);
+            if (len == 0)
+                console_port_hangup(port);
             break;
-        } 
+        }
         update_used_ring(vq, idx, len);
         free(iov);
+        filled = true;
     }
-    virtio_inject_irq(vq);
+    if (filled)
+        virtio_inject_irq(vq);
     return ;
 }
 
-int virtio_console_init(VirtIODevice *vdev) {
-    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
-    int master_fd, slave_fd, flags;
+static void virtio_console_accept_handler(int fd, int epoll_type, void *param) {
+    ConsolePort *port = (ConsolePort *)param;
+    int client_fd;
+    if (epoll_type != EPOLLIN || fd != port->listen_fd) {
+        log_error("Invalid console event");
+        return ;
+    }
+    client_fd = accept(port->listen_fd, NULL, NULL);
+    if (client_fd < 0) {
+        log_error("Failed to accept console port %d client, errno is %d", port->id, errno);
+        return ;
+    }
+    if (port->fd >= 0) {
+        log_warn("console port %d already has a client", port->id);
+        close(client_fd);
+        return ;
+    }
+    if (set_nonblocking(client_fd) < 0) {
+        close(client_fd);
+        return ;
+    }
+    pthread_mutex_lock(&port->mtx);
+    port->event = add_event(client_fd, EPOLLIN, virtio_console_event_handler, port);
+    if (port->event == NULL) {
+        pthread_mutex_unlock(&port->mtx);
+        log_error("Can't register console event");
+        close(client_fd);
+        return ;
+    }
+    port->fd = client_fd;
+    pthread_mutex_unlock(&port->mtx);
+    log_info("console port %d client connected", port->id);
+    console_send_ctrl(port->vdev, port->id, VIRTIO_CONSOLE_PORT_OPEN, 1, NULL);
+}
+
+static int console_open_pty(ConsolePort *port) {
+    int master_fd, slave_fd;
     char *slave_name;
     struct termios term_io;
 
     master_fd = posix_openpt(O_RDWR | O_NOCTTY);
     if (master_fd < 0) {
         log_error("Failed to open master pty, errno is %d", errno);
+        return -1;
     }
     if (grantpt(master_fd) < 0) {
         log_error("Failed to grant pty, errno is %d", errno);
@@ -86,34 +459,111 @@ int virtio_console_init(VirtIODevice *vdev) {
     if (unlockpt(master_fd) < 0) {
         log_error("Failed to unlock pty, errno is %d", errno);
     }
-    dev->master_fd = master_fd;
 
     slave_name = ptsname(master_fd);
     if (slave_name == NULL) {
         log_error("Failed to get slave name, errno is %d", errno);
+        close(master_fd);
+        return -1;
     }
-    log_warn("char device redirected to %s", slave_name);
-    // Disable line discipline to prevent the TTY 
+    log_warn("char device %s redirected to %s", port->name, slave_name);
+    // Disable line discipline to prevent the TTY
     // from echoing the characters sent from the master back to the master.
     slave_fd = open(slave_name, O_RDWR);
     tcgetattr(slave_fd, &term_io);
     cfmakeraw(&term_io);
-    tcsetattr(slave_fd, TCSAFLUSH, &term_io); 
+    tcsetattr(slave_fd, TCSAFLUSH, &term_io);
     close(slave_fd);
 
-    if (set_nonblocking(dev->master_fd) < 0) {
-        dev->master_fd = -1;
-        close(dev->master_fd);
+    if (set_nonblocking(master_fd) < 0) {
+        close(master_fd);
+        return -1;
     }
 
-    dev->event = add_event(dev->master_fd, EPOLLIN, virtio_console_event_handler, vdev);
-
-    if (dev->event == NULL) {
+    port->event = add_event(master_fd, EPOLLIN, virtio_console_event_handler, port);
+    if (port->event == NULL) {
         log_error("Can't register console event");
         close(master_fd);
-        dev->master_fd = -1;
         return -1;
     }
+    port->fd = master_fd;
+    return 0;
+}
+
+static int console_open_unix(ConsolePort *port) {
+    struct sockaddr_un addr;
+    int listen_fd;
+
+    if (port->path == NULL || strlen(port->path) >= sizeof(addr.sun_path)) {
+        log_error("invalid unix socket path of console port %d", port->id);
+        return -1;
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        log_error("Failed to create unix socket, errno is %d", errno);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, port->path);
+    unlink(port->path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 1) < 0 || set_nonblocking(listen_fd) < 0) {
+        log_error("Failed to listen on %s, errno is %d", port->path, errno);
+        close(listen_fd);
+        return -1;
+    }
+    port->listen_event = add_event(listen_fd, EPOLLIN, virtio_console_accept_handler, port);
+    if (port->listen_event == NULL) {
+        log_error("Can't register console event");
+        close(listen_fd);
+        return -1;
+    }
+    port->listen_fd = listen_fd;
+    log_warn("char device %s listens on %s", port->name, port->path);
+    return 0;
+}
+
+static int console_open_file(ConsolePort *port) {
+    if (port->path == NULL) {
+        log_error("invalid file path of console port %d", port->id);
+        return -1;
+    }
+    port->fd = open(port->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (port->fd < 0) {
+        log_error("Failed to open %s, errno is %d", port->path, errno);
+        return -1;
+    }
+    log_warn("char device %s redirected to %s", port->name, port->path);
+    return 0;
+}
+
+int virtio_console_init(VirtIODevice *vdev) {
+    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
+    int err = 0;
+
+    if (dev->multiport)
+        vdev->regs.dev_feature |= (1ULL << VIRTIO_CONSOLE_F_MULTIPORT);
+
+    for (int i = 0; i < dev->nr_ports; i++) {
+        ConsolePort *port = &dev->ports[i];
+        port->vdev = vdev;
+        switch (port->backend) {
+        case ConsoleBackendPty:
+            err = console_open_pty(port);
+            break;
+        case ConsoleBackendUnix:
+            err = console_open_unix(port);
+            break;
+        case ConsoleBackendFile:
+            err = console_open_file(port);
+            break;
+        }
+        if (err) {
+            log_error("Failed to open console port %d", i);
+            return -1;
+        }
+    }
 
     vdev->virtio_close = virtio_console_close;
     return 0;
@@ -122,52 +572,107 @@ int virtio_console_init(VirtIODevice *vdev) {
 int virtio_console_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
     log_debug("%s", __func__);
     ConsoleDev *dev = (ConsoleDev *)vdev->dev;
-    if (dev->rx_ready <= 0) {
-        dev->rx_ready = 1;
-        virtqueue_disable_notify(vq);
-    }
+    ConsolePort *port = &dev->ports[CONSOLE_QUEUE_TO_PORT(vq->vq_idx)];
+    port->rx_ready = 1;
+    virtqueue_disable_notify(vq);
+    // The driver provided buffers, go on reading the input held back.
+    pthread_mutex_lock(&port->mtx);
+    if (port->event != NULL)
+        resume_event(port->event);
+    pthread_mutex_unlock(&port->mtx);
     return 0;
 }
 
-static void virtq_tx_handle_one_request(ConsoleDev *dev, VirtQueue *vq) {
-    int i, n;
-    uint16_t idx;
-    ssize_t len;
-    struct iovec *iov = NULL;
-    static int count = 0;
-    count++;
-    if (dev->master_fd <= 0) {
-        log_error("Console master fd is not ready");
+int virtio_console_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    log_debug("%s", __func__);
+    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
+    ConsolePort *port = &dev->ports[CONSOLE_QUEUE_TO_PORT(vq->vq_idx)];
+    pthread_mutex_lock(&port->mtx);
+    // while the backend is full, the epoll thread goes on with the queue
+    if (port->tx_event == NULL)
+        console_port_tx(port, vq, false);
+    pthread_mutex_unlock(&port->mtx);
+    return 0;
+}
+
+int virtio_console_ctrl_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+    (void)vq;
+    log_debug("%s", __func__);
+    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
+    // The driver provided buffers, send the pending control messages.
+    pthread_mutex_lock(&dev->ctrl_mtx);
+    console_flush_ctrl(vdev);
+    pthread_mutex_unlock(&dev->ctrl_mtx);
+    return 0;
+}
+
+static void console_handle_ctrl(VirtIODevice *vdev, struct virtio_console_control *ctrl) {
+    ConsoleDev *dev = (ConsoleDev *)vdev->dev;
+    ConsolePort *port;
+    log_debug("console control event %d, port %d, value %d", ctrl->event, ctrl->id, ctrl->value);
+
+    if (ctrl->event == VIRTIO_CONSOLE_DEVICE_READY) {
+        if (ctrl->value != 1) {
+            log_error("console driver failed to initialize");
+            return ;
+        }
+        for (int i = 0; i < dev->nr_ports; i++)
+            console_send_ctrl(vdev, i, VIRTIO_CONSOLE_PORT_ADD, 0, NULL);
         return ;
     }
 
-    n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
-    // if (count % 100 == 0) {
-    //     log_info("console txq: n is %d, data is ", n);
-    //     for (int i=0; i<iov->iov_len; i++)
-    //         log_printf("%c", *(char*)&iov->iov_base[i]);
-    //     log_printf("\n");
-    // }
-    if (n < 1) {
+    if (ctrl->id >= (uint32_t)dev->nr_ports) {
+        log_error("console control event %d with invalid port %d", ctrl->event, ctrl->id);
         return ;
     }
+    port = &dev->ports[ctrl->id];
 
-    len = writev(dev->master_fd, iov, n);
-    if (len < 0) {
-        log_error("Failed to write to console, errno is %d", errno);
+    switch (ctrl->event) {
+    case VIRTIO_CONSOLE_PORT_READY:
+        if (ctrl->value != 1) {
+            log_error("console driver failed to add port %d", ctrl->id);
+            break;
+        }
+        // port 0 is always the console, i.e. hvc0 in linux
+        if (port->id == 0)
+            console_send_ctrl(vdev, port->id, VIRTIO_CONSOLE_CONSOLE_PORT, 1, NULL);
+        if (port->name[0])
+            console_send_ctrl(vdev, port->id, VIRTIO_CONSOLE_PORT_NAME, 1, port->name);
+        if (port->fd >= 0)
+            console_send_ctrl(vdev, port->id, VIRTIO_CONSOLE_PORT_OPEN, 1, NULL);
+        break;
+    case VIRTIO_CONSOLE_PORT_OPEN:
+        port->guest_open = ctrl->value;
+        break;
+    default:
+        log_warn("unsupported console control event %d", ctrl->event);
+        break;
     }
-    update_used_ring(vq, idx, 0);
-    free(iov);
 }
 
-int virtio_console_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
+int virtio_console_ctrl_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
     log_debug("%s", __func__);
+    struct virtio_console_control ctrl;
+    struct iovec *iov = NULL;
+    size_t done, s;
+    uint16_t idx;
+    int i, n;
+
     while (!virtqueue_is_empty(vq)) {
-        virtqueue_disable_notify(vq);
-        while(!virtqueue_is_empty(vq)) {
-            virtq_tx_handle_one_request(vdev->dev, vq);
+        n = process_descriptor_chain(vq, &idx, &iov, NULL, 0, false);
+        if (n < 1)
+            break;
+        for (i = 0, done = 0; i < n && done < sizeof(ctrl); i++) {
+            s = MIN(iov[i].iov_len, sizeof(ctrl) - done);
+            memcpy((char *)&ctrl + done, iov[i].iov_base, s);
+            done += s;
         }
-        virtqueue_enable_notify(vq);
+        if (done == sizeof(ctrl))
+            console_handle_ctrl(vdev, &ctrl);
+        else
+            log_error("invalid console control message");
+        update_used_ring(vq, idx, 0);
+        free(iov);
     }
     virtio_inject_irq(vq);
     return 0;
@@ -175,9 +680,29 @@ int virtio_console_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
 
 void virtio_console_close(VirtIODevice *vdev) {
     ConsoleDev *dev = vdev->dev;
-    close(dev->master_fd);
-    free(dev->event);
+    for (int i = 0; i < dev->nr_ports; i++) {
+        ConsolePort *port = &dev->ports[i];
+        if (port->fd >= 0)
+            close(port->fd);
+        if (port->listen_fd >= 0) {
+            close(port->listen_fd);
+            unlink(port->path);
+        }
+        if (port->tx_fd >= 0)
+            close(port->tx_fd);
+        if (port->tx_timerfd >= 0)
+            close(port->tx_timerfd);
+        free(port->event);
+        free(port->listen_event);
+        free(port->tx_event);
+        free(port->tx_timer_event);
+        free(port->path);
+        pthread_mutex_destroy(&port->mtx);
+    }
+    pthread_mutex_destroy(&dev->ctrl_mtx);
+    for (uint32_t i = 0; i < vdev->vqs_len; i++)
+        virtio_irq_unmoderate(&vdev->vqs[i]);
     free(dev);
     free(vdev->vqs);
     free(vdev);
-}
\ No newline at end of file
+}
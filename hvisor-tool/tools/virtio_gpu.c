@@ -8,11 +8,15 @@
 #include <drm/drm.h>
 #include <drm/drm_fourcc.h>
 #include <drm/drm_mode.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -21,6 +25,13 @@ void virtio_gpu_ctrl_response(VirtIODevice *vdev, GPUCommand *gcmd,
   log_debug("sending response");
   // 因为每个response结构体的头部都是GPUControlHeader，因此其地址就是response结构体的地址
 
+  if (gcmd->control_header.flags & VIRTIO_GPU_FLAG_FENCE) {
+    // 带fence的命令需要在响应中返回相同的fence_id和ctx_id
+    resp->flags |= VIRTIO_GPU_FLAG_FENCE;
+    resp->fence_id = gcmd->control_header.fence_id;
+    resp->ctx_id = gcmd->control_header.ctx_id;
+  }
+
   // iov[0]所对应的第一个描述符一定是只读的，因此从第二个开始
   size_t s =
       buf_to_iov(&gcmd->resp_iov[1], gcmd->resp_iov_cnt - 1, 0, resp, resp_len);
@@ -30,7 +41,10 @@ void virtio_gpu_ctrl_response(VirtIODevice *vdev, GPUCommand *gcmd,
     // 继续返回，交由前端处理
   }
   
+  // 多个工作线程可能同时返回响应
+  pthread_mutex_lock(&vdev->vqs[gcmd->from_queue].used_ring_lock);
   update_used_ring(&vdev->vqs[gcmd->from_queue], gcmd->resp_idx, resp_len);
+  pthread_mutex_unlock(&vdev->vqs[gcmd->from_queue].used_ring_lock);
 
   gcmd->finished = true;
 }
@@ -56,15 +70,21 @@ void virtio_gpu_get_display_info(VirtIODevice *vdev, GPUCommand *gcmd) {
   display_info.hdr.type = VIRTIO_GPU_RESP_OK_DISPLAY_INFO;
 
   // 向响应结构体填入display信息
-  for (int i = 0; i < HVISOR_VIRTIO_GPU_MAX_SCANOUTS; ++i) {
-    if (gdev->enabled_scanout_bitmask & (1 << i)) {
+  // 分辨率来自显示设备的当前模式，位置仍使用json中的设置
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    GPUScanout *scanout = &gdev->scanouts[i];
+    pthread_mutex_lock(&scanout->flip_mutex);
+    if ((gdev->enabled_scanout_bitmask & (1 << i)) && scanout->connected) {
       display_info.pmodes[i].enabled = 1;
-      display_info.pmodes[i].r.width = gdev->requested_states[i].width;
-      display_info.pmodes[i].r.height = gdev->requested_states[i].height;
+      display_info.pmodes[i].r.x = gdev->requested_states[i].x;
+      display_info.pmodes[i].r.y = gdev->requested_states[i].y;
+      display_info.pmodes[i].r.width = scanout->display_width;
+      display_info.pmodes[i].r.height = scanout->display_height;
       log_debug("return display info of scanout %d with width %d, height %d", i,
                 display_info.pmodes[i].r.width,
                 display_info.pmodes[i].r.height);
     }
+    pthread_mutex_unlock(&scanout->flip_mutex);
   }
 
   virtio_gpu_ctrl_response(vdev, gcmd, &display_info.hdr, sizeof(display_info));
@@ -72,7 +92,33 @@ void virtio_gpu_get_display_info(VirtIODevice *vdev, GPUCommand *gcmd) {
 
 void virtio_gpu_get_edid(VirtIODevice *vdev, GPUCommand *gcmd) {
   log_debug("entering %s", __func__);
-  // TODO(root):
+
+  struct virtio_gpu_cmd_get_edid get_edid;
+  struct virtio_gpu_resp_edid edid;
+  GPUDev *gdev = vdev->dev;
+
+  VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, get_edid);
+
+  if (get_edid.scanout >= gdev->scanouts_num) {
+    log_error("%s trying to get edid of scanout %d", __func__,
+              get_edid.scanout);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_SCANOUT_ID;
+    return;
+  }
+
+  GPUScanout *scanout = &gdev->scanouts[get_edid.scanout];
+
+  memset(&edid, 0, sizeof(edid));
+  edid.hdr.type = VIRTIO_GPU_RESP_OK_EDID;
+  // 显示设备改变时EDID在epoll线程更新
+  pthread_mutex_lock(&scanout->flip_mutex);
+  edid.size = scanout->edid_size;
+  memcpy(edid.edid, scanout->edid, scanout->edid_size);
+  pthread_mutex_unlock(&scanout->flip_mutex);
+  log_debug("return edid of scanout %d with size %d", get_edid.scanout,
+            edid.size);
+
+  virtio_gpu_ctrl_response(vdev, gcmd, &edid.hdr, sizeof(edid));
 }
 
 void virtio_gpu_resource_create_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
@@ -81,6 +127,7 @@ void virtio_gpu_resource_create_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
   GPUSimpleResource *res = NULL;
   GPUDev *gdev = vdev->dev;
   struct virtio_gpu_resource_create_2d create_2d;
+  uint32_t bpp = 0;
 
   VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, create_2d);
 
@@ -113,33 +160,162 @@ void virtio_gpu_resource_create_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
   res->iov_cnt = 0;
 
   // 计算resource所占用的内存大小
-  // 默认只支持bpp为4 bytes大小的format
-  res->hostmem = calc_image_hostmem(32, create_2d.width, create_2d.height);
-  if (res->hostmem + gdev->hostmem >= VIRTIO_GPU_MAX_HOSTMEM) {
+  bpp = virtio_gpu_format_bpp(create_2d.format);
+  if (bpp == 0) {
+    log_error("%s trying to create resource %d with unknown format %d",
+              __func__, create_2d.resource_id, create_2d.format);
+    free(res);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    return;
+  }
+  res->hostmem = calc_image_hostmem(bpp, create_2d.width, create_2d.height);
+  res->stride = res->height ? res->hostmem / res->height : 0;
+  if (!virtio_gpu_hostmem_charge(gdev, NULL, res->hostmem)) {
     log_error("virtio gpu for zone %d out of hostmem when trying to create "
               "resource %d",
               vdev->zone_id, create_2d.resource_id);
     free(res);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
     return;
   }
 
   // 内存足够，将res加入virtio gpu下管理
+  if (virtio_gpu_resource_table_insert(gdev, res) != 0) {
+    log_error("%s cannot alloc memory for resource table", __func__);
+    virtio_gpu_hostmem_uncharge(gdev, res->hostmem);
+    free(res);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+    return;
+  }
   TAILQ_INSERT_HEAD(&gdev->resource_list, res, next);
-  gdev->hostmem += res->hostmem;
 
   log_debug("add a resource %d to gpu dev of zone %d, width: %d height: %d "
-            "format: %d mem: %d bytes host-hostmem: %d bytes",
+            "format: %d mem: %lu bytes host-hostmem: %lu bytes",
             res->resource_id, vdev->zone_id, res->width, res->height,
             res->format, res->hostmem, gdev->hostmem);
 }
 
+// Fibonacci哈希，guest通常按顺序分配resource_id，取乘积的高位使其分散
+static inline uint32_t virtio_gpu_resource_hash(GPUResourceTable *table,
+                                                uint32_t resource_id) {
+  return (resource_id * 2654435769U) >> table->shift;
+}
+
+// 将table扩展为size个槽，并重新插入所有resource
+static int virtio_gpu_resource_table_resize(GPUResourceTable *table,
+                                            uint32_t size) {
+  GPUSimpleResource **old_slots = table->slots;
+  uint32_t old_size = table->size;
+  uint32_t shift = 32;
+  uint32_t i, j;
+
+  for (i = size; i > 1; i >>= 1) {
+    shift--;
+  }
+
+  table->slots = calloc(size, sizeof(GPUSimpleResource *));
+  if (table->slots == NULL) {
+    table->slots = old_slots;
+    return -1;
+  }
+  table->size = size;
+  table->shift = shift;
+
+  for (i = 0; i < old_size; ++i) {
+    if (old_slots[i] == NULL) {
+      continue;
+    }
+    j = virtio_gpu_resource_hash(table, old_slots[i]->resource_id);
+    while (table->slots[j] != NULL) {
+      j = (j + 1) & (size - 1);
+    }
+    table->slots[j] = old_slots[i];
+  }
+  free(old_slots);
+  return 0;
+}
+
+int virtio_gpu_resource_table_insert(GPUDev *gdev, GPUSimpleResource *res) {
+  GPUResourceTable *table = &gdev->resource_table;
+  uint32_t i;
+
+  // 装载因子不超过3/4，保证探测序列较短
+  if (table->size == 0 ||
+      (uint64_t)(table->count + 1) * 4 > (uint64_t)table->size * 3) {
+    if (virtio_gpu_resource_table_resize(
+            table, table->size ? table->size * 2
+                               : VIRTIO_GPU_RESOURCE_TABLE_INIT_SIZE) != 0) {
+      return -1;
+    }
+  }
+
+  i = virtio_gpu_resource_hash(table, res->resource_id);
+  while (table->slots[i] != NULL) {
+    i = (i + 1) & (table->size - 1);
+  }
+  table->slots[i] = res;
+  table->count++;
+  return 0;
+}
+
+void virtio_gpu_resource_table_remove(GPUDev *gdev, GPUSimpleResource *res) {
+  GPUResourceTable *table = &gdev->resource_table;
+  uint32_t mask = table->size - 1;
+  uint32_t i, j, k;
+
+  if (gdev->last_resource == res) {
+    gdev->last_resource = NULL;
+  }
+  if (table->size == 0) {
+    return;
+  }
+
+  i = virtio_gpu_resource_hash(table, res->resource_id);
+  while (table->slots[i] != res) {
+    if (table->slots[i] == NULL) {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+  table->slots[i] = NULL;
+  table->count--;
+
+  // 后面同一探测序列上的元素前移到空出的槽，使查找不会提前遇到空槽
+  for (j = (i + 1) & mask; table->slots[j] != NULL; j = (j + 1) & mask) {
+    k = virtio_gpu_resource_hash(table, table->slots[j]->resource_id);
+    // k在(i, j]之间时，元素不能移动到i
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+      continue;
+    }
+    table->slots[i] = table->slots[j];
+    table->slots[j] = NULL;
+    i = j;
+  }
+}
+
 GPUSimpleResource *virtio_gpu_find_resource(GPUDev *gdev,
                                             uint32_t resource_id) {
-  GPUSimpleResource *temp_res = NULL;
-  TAILQ_FOREACH(temp_res, &gdev->resource_list, next) {
-    if (temp_res->resource_id == resource_id) {
-      return temp_res;
+  GPUResourceTable *table = &gdev->resource_table;
+  // 不同resource的命令可能在多个工作线程中同时查找
+  GPUSimpleResource *res = __atomic_load_n(&gdev->last_resource,
+                                           __ATOMIC_RELAXED);
+  uint32_t i;
+
+  // transfer和flush通常连续操作同一个resource
+  if (res && res->resource_id == resource_id) {
+    return res;
+  }
+  if (table->size == 0) {
+    return NULL;
+  }
+
+  i = virtio_gpu_resource_hash(table, resource_id);
+  while ((res = table->slots[i]) != NULL) {
+    if (res->resource_id == resource_id) {
+      __atomic_store_n(&gdev->last_resource, res, __ATOMIC_RELAXED);
+      return res;
     }
+    i = (i + 1) & (table->size - 1);
   }
   return NULL;
 }
@@ -172,11 +348,12 @@ GPUSimpleResource *virtio_gpu_check_resource(VirtIODevice *vdev,
   return res;
 }
 
-uint32_t calc_image_hostmem(int bits_per_pixel, uint32_t width,
+uint64_t calc_image_hostmem(uint32_t bits_per_pixel, uint32_t width,
                             uint32_t height) {
   // 0x1f = 31, >> 5等价于除32，即将每行的bits数对齐到4 bytes的倍数
-  // 最后乘sizeof(uint32)获得字节数
-  int stride = ((width * bits_per_pixel + 0x1f) >> 5) * sizeof(uint32_t);
+  // 最后乘sizeof(uint32)获得字节数，宽高都很大时32位会溢出
+  uint64_t stride =
+      (((uint64_t)width * bits_per_pixel + 0x1f) >> 5) * sizeof(uint32_t);
   // 返回所占内存的总大小
   return height * stride;
 }
@@ -201,6 +378,15 @@ void virtio_gpu_resource_unref(VirtIODevice *vdev, GPUCommand *gcmd) {
   virtio_gpu_resource_destory(gdev, res);
 }
 
+// resource计入hostmem预算的大小
+// guest内存构成的blob只是映射了zone的内存，不占用host内存
+static uint64_t virtio_gpu_resource_charged(const GPUSimpleResource *res) {
+  if (res->blob && res->blob_mem == VIRTIO_GPU_BLOB_MEM_GUEST) {
+    return 0;
+  }
+  return res->hostmem;
+}
+
 void virtio_gpu_resource_destory(GPUDev *gdev, GPUSimpleResource *res) {
   if (res->scanout_bitmask) {
     for (int i = 0; i < HVISOR_VIRTIO_GPU_MAX_SCANOUTS; ++i) {
@@ -210,38 +396,111 @@ void virtio_gpu_resource_destory(GPUDev *gdev, GPUSimpleResource *res) {
     }
   }
 
+  if (res->virgl) {
+    virtio_gpu_virgl_resource_destroy(gdev, res);
+  }
   virtio_gpu_cleanup_mapping(gdev, res);
+  virtio_gpu_resource_table_remove(gdev, res);
   TAILQ_REMOVE(&gdev->resource_list, res, next);
-  gdev->hostmem -= res->hostmem;
+  virtio_gpu_hostmem_uncharge(gdev, virtio_gpu_resource_charged(res));
   free(res);
 }
 
-void virtio_gpu_disable_scanout(GPUDev *gdev, int scanout_id) {
-  GPUScanout *scanout = &gdev->scanouts[scanout_id];
-  GPUSimpleResource *res = NULL;
+void virtio_gpu_cleanup_mapping(GPUDev *gdev, GPUSimpleResource *res) {
+  virtio_gpu_destroy_direct_fb(gdev, res);
+  res->backing_addr = 0;
+  res->direct_failed = false;
 
-  if (scanout->resource_id == 0) {
-    return;
+  if (res->iov) {
+    free(res->iov);
+    // iov对应的内存块由guest处理
   }
 
-  res = virtio_gpu_find_resource(gdev, scanout->resource_id);
-  if (res) {
-    res->scanout_bitmask &= ~(1 << scanout_id);
+  free(res->iov_offsets);
+  res->iov = NULL;
+  res->iov_offsets = NULL;
+  res->iov_cnt = 0;
+}
+
+// 将resource在r内的更新显示到scanout，无法创建交换链时返回false
+static bool virtio_gpu_flush_scanout(VirtIODevice *vdev, GPUScanout *scanout,
+                                     GPUSimpleResource *res,
+                                     struct virtio_gpu_rect *r,
+                                     uint32_t *error) {
+  if (virtio_gpu_direct_flush(vdev, scanout, res, r, error)) {
+    return true;
   }
 
-  scanout->resource_id = 0;
-  scanout->width = 0;
-  scanout->height = 0;
+  // 交换链在SET_SCANOUT时按resource的大小选出，缓存中没有时在这里创建
+  if (!scanout->frame_buffer.enabled) {
+    virtio_gpu_create_drm_framebuffer(scanout, res, error);
+    if (*error) {
+      return false;
+    }
+  }
+  virtio_gpu_copy_and_flush(scanout, res, r, error);
+  return true;
 }
 
-void virtio_gpu_cleanup_mapping(GPUDev *gdev, GPUSimpleResource *res) {
-  if (res->iov) {
-    free(res->iov);
-    // iov对应的内存块由guest处理
+// 距上次显示不到一个刷新周期时，将r合并到推迟的显示中并返回true
+// seq为推迟的画面序号，带fence的flush等到该画面显示后再响应
+static bool virtio_gpu_pace_flush(GPUScanout *scanout, GPUSimpleResource *res,
+                                  struct virtio_gpu_rect *r, uint64_t *seq) {
+  uint64_t now = virtio_gpu_now_ns();
+  bool paced = true;
+  uint32_t x2, y2;
+
+  pthread_mutex_lock(&scanout->flip_mutex);
+  if (scanout->pace_pending &&
+      scanout->pace_resource_id == res->resource_id &&
+      scanout->pace_rect.width == 0) {
+    // virtio_gpu_request_present推迟的显示没有区域
+    scanout->pace_rect = *r;
+  } else if (scanout->pace_pending &&
+             scanout->pace_resource_id == res->resource_id) {
+    x2 = MAX(scanout->pace_rect.x + scanout->pace_rect.width, r->x + r->width);
+    y2 = MAX(scanout->pace_rect.y + scanout->pace_rect.height,
+             r->y + r->height);
+    scanout->pace_rect.x = MIN(scanout->pace_rect.x, r->x);
+    scanout->pace_rect.y = MIN(scanout->pace_rect.y, r->y);
+    scanout->pace_rect.width = x2 - scanout->pace_rect.x;
+    scanout->pace_rect.height = y2 - scanout->pace_rect.y;
+  } else if (!scanout->pace_pending &&
+             now - scanout->last_present_ns < scanout->frame_ns) {
+    scanout->pace_pending = true;
+    scanout->pace_resource_id = res->resource_id;
+    scanout->pace_rect = *r;
+    scanout->pace_seq = scanout->present_seq + 1;
+  } else {
+    // 已经过了一个刷新周期，或者推迟的是另一个resource，立刻显示
+    paced = false;
+  }
+  if (paced) {
+    *seq = scanout->pace_seq;
+    scanout->paced_flushes++;
   }
+  pthread_mutex_unlock(&scanout->flip_mutex);
+  return paced;
+}
 
-  res->iov = NULL;
-  res->iov_cnt = 0;
+void virtio_gpu_request_present(GPUScanout *scanout) {
+  pthread_mutex_lock(&scanout->flip_mutex);
+  if (scanout->resource_id == 0 || scanout->front < 0) {
+    // 还没有显示过画面，guest第一次flush时自然会显示
+    pthread_mutex_unlock(&scanout->flip_mutex);
+    return;
+  }
+  if (!scanout->pace_pending) {
+    scanout->pace_pending = true;
+    scanout->pace_seq = scanout->present_seq + 1;
+    // 空的区域不拷贝guest还没有flush的更新，只重新显示交换链中的画面
+    memset(&scanout->pace_rect, 0, sizeof(scanout->pace_rect));
+  } else if (scanout->pace_resource_id != scanout->resource_id) {
+    memset(&scanout->pace_rect, 0, sizeof(scanout->pace_rect));
+  }
+  scanout->pace_resource_id = scanout->resource_id;
+  pthread_mutex_unlock(&scanout->flip_mutex);
+  virtio_gpu_fence_wakeup(scanout->gdev);
 }
 
 void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd) {
@@ -252,6 +511,7 @@ void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd) {
   GPUSimpleResource *res = NULL;
   GPUScanout *scanout = NULL;
   struct virtio_gpu_resource_flush resource_flush;
+  bool paced = false;
 
   VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, resource_flush);
 
@@ -275,6 +535,24 @@ void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd) {
     return;
   }
 
+  if (res->blob) {
+    // blob没有transfer，guest直接在其中绘制，flush的区域就是更新的区域
+    uint64_t offset = res->blob_offset +
+                      (uint64_t)resource_flush.r.y * res->stride +
+                      resource_flush.r.x * VIRTIO_GPU_BYTES_PP;
+    virtio_gpu_damage_add(res->damage, &res->damage_cnt, &resource_flush.r,
+                          offset, res->stride);
+    virtio_gpu_trace_mem(gdev->trace, gcmd, res, offset, res->stride,
+                         resource_flush.r.width * VIRTIO_GPU_BYTES_PP,
+                         resource_flush.r.height);
+  } else if (res->virgl && res->scanout_bitmask) {
+    // 3D resource的画面在virglrenderer中，先读回shadow
+    if (virtio_gpu_virgl_readback(gdev, res, &resource_flush.r) < 0) {
+      gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+      return;
+    }
+  }
+
   for (int i = 0; i < HVISOR_VIRTIO_GPU_MAX_SCANOUTS; ++i) {
     // 遍历resource所对应的scanout
     if (!(res->scanout_bitmask & (1 << i))) {
@@ -282,191 +560,560 @@ void virtio_gpu_resource_flush(VirtIODevice *vdev, GPUCommand *gcmd) {
     }
     scanout = &gdev->scanouts[i];
 
-    if (!scanout->frame_buffer.enabled) {
-      virtio_gpu_create_drm_framebuffer(scanout, &gcmd->error);
-      if (gcmd->error) {
-        return;
-      }
+    // guest在一帧内多次flush时只拷贝和显示一次，之前的flush立刻响应
+    if (gdev->pacing && virtio_gpu_pace_flush(scanout, res, &resource_flush.r,
+                                              &gcmd->wait_seq[i])) {
+      paced = true;
+      continue;
+    }
+    if (!virtio_gpu_flush_scanout(vdev, scanout, res, &resource_flush.r,
+                                  &gcmd->error)) {
+      return;
+    }
+    // 带fence时等到该画面显示后再响应
+    gcmd->wait_seq[i] = scanout->present_seq;
+  }
 
-      virtio_gpu_copy_and_flush(scanout, res, &gcmd->error);
-    } else {
-      // TODO: 已经分配过一次framebuffer，若大小不合适，则需要重新分配
-      // TODO: 包括munmap，以及调用drm的销毁函数
-      // TODO: 将没分配过的情况封装
+  // 所有scanout都已更新，flush区域内的damage不再需要
+  // 推迟的显示还要拷贝这些damage，由virtio_gpu_paced_present清除
+  if (!paced) {
+    virtio_gpu_damage_clear(res->damage, &res->damage_cnt, &resource_flush.r);
+  }
+}
 
-      virtio_gpu_copy_and_flush(scanout, res, &gcmd->error);
-    }
+void virtio_gpu_paced_present(VirtIODevice *vdev, GPUScanout *scanout) {
+  GPUDev *gdev = vdev->dev;
+  GPUSimpleResource *res = NULL;
+  struct virtio_gpu_rect r;
+  uint32_t resource_id = 0;
+  uint32_t error = 0;
+  uint64_t seq = 0;
+
+  pthread_mutex_lock(&scanout->flip_mutex);
+  resource_id = scanout->pace_resource_id;
+  r = scanout->pace_rect;
+  seq = scanout->pace_seq;
+  scanout->pace_pending = false;
+  pthread_mutex_unlock(&scanout->flip_mutex);
+
+  // 推迟期间scanout可能已经改为显示其他resource
+  res = virtio_gpu_find_resource(gdev, resource_id);
+  if (res != NULL && scanout->resource_id == resource_id &&
+      virtio_gpu_flush_scanout(vdev, scanout, res, &r, &error)) {
+    virtio_gpu_damage_clear(res->damage, &res->damage_cnt, &r);
   }
+  if (error) {
+    log_error("%s failed to present resource %d, error type is %d", __func__,
+              resource_id, error);
+  }
+
+  // 画面没有显示时，等待它的fence也不必再等
+  pthread_mutex_lock(&scanout->flip_mutex);
+  if (scanout->present_seq < seq) {
+    scanout->present_seq = seq;
+    scanout->displayed_seq = MAX(scanout->displayed_seq, seq);
+  }
+  pthread_mutex_unlock(&scanout->flip_mutex);
 }
 
-void virtio_gpu_create_drm_framebuffer(GPUScanout *scanout, uint32_t *error) {
+void virtio_gpu_create_drm_framebuffer(GPUScanout *scanout,
+                                       GPUSimpleResource *res,
+                                       uint32_t *error) {
   if (scanout->frame_buffer.enabled) {
     return;
   }
 
   // 若scanout的frame_buffer还没有初始化过
+  // frame_buffer保存交换链中所有缓冲区共同的参数
   GPUFrameBuffer *fb = &scanout->frame_buffer;
-
-  struct drm_mode_create_dumb dumb = {0};
-  struct drm_mode_map_dumb map = {0};
-  dumb.width = fb->width;
-  dumb.height = fb->height;
-  dumb.bpp = fb->bytes_pp * 8;
-  uint32_t offsets[4] = {0};
-  uint32_t fb_id = 0;
-
-  if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_CREATE_DUMB, &dumb) < 0) {
-    log_error("%s failed to create a drm dumb", __func__);
-    *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+  struct virtio_gpu_rect full = {0, 0, res->width, res->height};
+
+  const GPUDisplayBackend *backend = scanout->gdev->backend;
+  // 按紧密排列估计，后端按行对齐时实际会稍大一些
+  uint64_t hostmem = (uint64_t)fb->width * fb->height * VIRTIO_GPU_BYTES_PP *
+                     VIRTIO_GPU_SWAPCHAIN_LEN;
+
+  // 与其他scanout的flush并行执行，只能腾出自己缓存的交换链
+  if (!virtio_gpu_hostmem_charge(scanout->gdev, scanout, hostmem)) {
+    log_error("%s out of hostmem for %dx%d swapchain", __func__, fb->width,
+              fb->height);
+    *error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
     return;
-  } // 创建一个dumb对象
+  }
 
-  map.handle = dumb.handle;
-  // 将显存与framebuffer绑定，根据handle获得offset
-  if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
-    log_error("%s failed to map a drm dumb", __func__);
-    virtio_gpu_remove_drm_framebuffer(scanout);
-    *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-    return;
+  for (int i = 0; i < VIRTIO_GPU_SWAPCHAIN_LEN; ++i) {
+    GPUFrameBuffer *buf = &scanout->swapchain[i];
+    *buf = *fb;
+    buf->damage_cnt = 0;
+    if (backend->create_buffer(scanout, buf, i) < 0) {
+      for (int j = 0; j < i; ++j) {
+        backend->destroy_buffer(scanout, &scanout->swapchain[j], j);
+      }
+      virtio_gpu_hostmem_uncharge(scanout->gdev, hostmem);
+      *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+      return;
+    }
+    buf->enabled = true;
+    // 新的缓冲区是空的，第一次使用时需要拷贝整个resource
+    virtio_gpu_damage_add(buf->damage, &buf->damage_cnt, &full,
+                          res->blob_offset, res->stride);
   }
 
-  // ! legacy
-  // uint32_t drm_format = VIRTIO_GPU_FORMAT_TO_DRM_FORMAT(fb->format);
-  // if (!drm_format) {
-  //   log_error("%s found drm_framebuffer has an unknown format", __func__);
-  //   *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-  //   return;
-  // }
+  pthread_mutex_lock(&scanout->flip_mutex);
+  scanout->front = -1;
+  scanout->flipping = -1;
+  scanout->ready = -1;
+  pthread_mutex_unlock(&scanout->flip_mutex);
+
+  fb->stride = scanout->swapchain[0].stride;
+  fb->fb_addr = scanout->swapchain[0].fb_addr;
+  fb->hostmem = hostmem;
+  fb->enabled = true;
+}
 
-  // 向drm设备注册一个新缓冲区
-  // ! legacy
-  // if (drmModeAddFB2(scanout->card0_fd, dumb.width, dumb.height, drm_format,
-  //                   &dumb.handle, &dumb.pitch, offsets, &fb_id, 0) < 0) {
-  //   log_error("%s failed to add a drm_framebuffer to card0", __func__);
-  //   *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-  //   return;
-  // }
+// buffer中的画面已经显示，或者不会再显示，调用者需持有flip_mutex
+// 等待该画面及更早画面的fence可以完成
+static void virtio_gpu_frame_done(GPUScanout *scanout, int buffer) {
+  scanout->displayed_seq =
+      MAX(scanout->displayed_seq, scanout->buffer_seq[buffer]);
+}
 
-  if (drmModeAddFB(scanout->card0_fd, dumb.width, dumb.height, 24, 32,
-                   dumb.pitch, dumb.handle, &fb_id) < 0) {
-    log_error("%s failed to add a drm_framebuffer to card0", __func__);
-    *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-    return;
+// 等待正在进行的翻页完成，调用者需持有flip_mutex
+// 超时说明vblank事件丢失，此时认为翻页已经完成
+static void virtio_gpu_wait_flip(GPUScanout *scanout) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += VIRTIO_GPU_FLIP_TIMEOUT_MS * 1000000L;
+  ts.tv_sec += ts.tv_nsec / 1000000000L;
+  ts.tv_nsec %= 1000000000L;
+  if (pthread_cond_timedwait(&scanout->flip_cond, &scanout->flip_mutex, &ts) ==
+          ETIMEDOUT &&
+      scanout->flipping >= 0) {
+    log_warn("%s page flip of %s backend timed out", __func__,
+             scanout->gdev->backend->name);
+    virtio_gpu_frame_done(scanout, scanout->flipping);
+    scanout->front = scanout->flipping;
+    scanout->flipping = -1;
   }
+}
 
-  ///
-  log_debug("%s create a drm_framebuffer with width: %d, height: %d, "
-            "format: %d, handle: %d, fb_id: %d",
-            __func__, dumb.width, dumb.height, fb->format, dumb.handle, fb_id);
-  ///
+// 选择一个既不在显示，也不在等待翻页的缓冲区用于绘制
+static int virtio_gpu_acquire_back_buffer(GPUScanout *scanout) {
+  int back = -1;
+
+  pthread_mutex_lock(&scanout->flip_mutex);
+  if (!scanout->page_flip && scanout->front >= 0 &&
+      scanout->front != VIRTIO_GPU_DIRECT_BUFFER) {
+    // 不支持page flip时只使用一个缓冲区
+    back = scanout->front;
+  } else if (scanout->ready >= 0) {
+    // 还没来得及翻页的画面直接被新的画面替换
+    back = scanout->ready;
+    scanout->ready = -1;
+  }
+  while (back < 0) {
+    for (int i = 0; i < VIRTIO_GPU_SWAPCHAIN_LEN; ++i) {
+      if (i != scanout->front && i != scanout->flipping) {
+        back = i;
+        break;
+      }
+    }
+    if (back < 0) {
+      // 双缓冲时两个缓冲区可能都在使用，等待vblank
+      virtio_gpu_wait_flip(scanout);
+    }
+  }
+  pthread_mutex_unlock(&scanout->flip_mutex);
+  return back;
+}
 
-  void *vaddr = mmap(0, dumb.size, PROT_READ | PROT_WRITE, MAP_SHARED,
-                     scanout->card0_fd, map.offset);
+// 显示back缓冲区，可以是交换链中的缓冲区，或者VIRTIO_GPU_DIRECT_BUFFER
+static void virtio_gpu_present(GPUScanout *scanout, int back,
+                               drmModeClip *clips, uint32_t clips_cnt,
+                               uint32_t *error) {
+  const GPUDisplayBackend *backend = scanout->gdev->backend;
+
+  pthread_mutex_lock(&scanout->flip_mutex);
+  scanout->buffer_seq[back] = ++scanout->present_seq;
+  scanout->last_present_ns = virtio_gpu_now_ns();
+  if ((scanout->front >= 0 || scanout->flipping >= 0) && scanout->page_flip &&
+      backend->flip != NULL) {
+    if (scanout->flipping >= 0) {
+      // 上一次翻页还没有完成，在其vblank事件中翻页
+      scanout->ready = back;
+      goto out;
+    }
+    if (scanout->front == back && back == VIRTIO_GPU_DIRECT_BUFFER) {
+      // 直接扫描的framebuffer已经在显示，只需要通知更新的区域
+      goto show;
+    }
+    if (backend->flip(scanout, back) == 0) {
+      scanout->flipping = back;
+      goto out;
+    }
+    log_warn("%s %s backend failed to flip, fall back to showing directly",
+             __func__, backend->name);
+    scanout->page_flip = false;
+  }
 
-  if (!vaddr) {
-    log_error("%s cannot map drm_framebuffer of scanout", __func__);
-    virtio_gpu_remove_drm_framebuffer(scanout);
+show:
+  // 第一次显示，或者不支持page flip，直接显示
+  if (backend->show(scanout, back, clips, clips_cnt) < 0) {
+    log_error("%s %s backend failed to show buffer %d", __func__,
+              backend->name, back);
     *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
-    return;
+    virtio_gpu_frame_done(scanout, back);
+    goto out;
   }
+  scanout->front = back;
+  virtio_gpu_frame_done(scanout, back);
 
-  log_debug("%s map drm_framebuffer to %x with size %d", __func__, vaddr,
-            dumb.size);
+out:
+  pthread_mutex_unlock(&scanout->flip_mutex);
+}
 
-  fb->fb_id = fb_id;
-  fb->drm_dumb_handle = dumb.handle;
-  fb->drm_dumb_size = dumb.size;
-  fb->fb_addr = vaddr;
-  fb->enabled = true;
+// 从resource的guest backing拷贝区域d到framebuffer的相同位置
+static void virtio_gpu_copy_rect(GPUSimpleResource *res, GPUFrameBuffer *fb,
+                                 GPUDamage *d) {
+  GPUBlit blit;
+
+  blit.iov = res->iov;
+  blit.iov_cnt = res->iov_cnt;
+  blit.iov_offsets = res->iov_offsets;
+  blit.src_offset = d->offset;
+  blit.src_stride = res->stride;
+  blit.dst = (uint8_t *)fb->fb_addr + (uint64_t)d->r.y * fb->stride +
+             d->r.x * VIRTIO_GPU_BYTES_PP;
+  blit.dst_stride = fb->stride;
+  blit.width = d->r.width;
+  blit.height = d->r.height;
+  blit.swizzle = fb->swizzle;
+  virtio_gpu_blit(&blit);
+
+  log_debug("%s copy (%d, %d) + %d, %d from resource %d to drm_framebuffer",
+            __func__, d->r.x, d->r.y, d->r.width, d->r.height,
+            res->resource_id);
 }
 
 void virtio_gpu_copy_and_flush(GPUScanout *scanout, GPUSimpleResource *res,
-                               uint32_t *error) {
-
-  uint32_t format = 0;
-  uint32_t stride = 0;
-  uint32_t src_offset = 0;
-  uint32_t dst_offset = 0;
-  int bpp = 0;
-
-  GPUFrameBuffer *fb = &scanout->frame_buffer;
+                               struct virtio_gpu_rect *r, uint32_t *error) {
+  uint32_t src_stride = 0;
+  uint32_t x, y;
+  drmModeClip clips[VIRTIO_GPU_MAX_DAMAGE_RECTS];
+  uint32_t clips_cnt = 0;
+  GPUDamage d;
+  GPUFrameBuffer *fb = NULL;
+  int back = 0;
 
   if (!res || !res->iov || res->hostmem <= 0) {
-    log_error("%s found res is not create yet");
+    log_error("%s found res is not create yet", __func__);
     *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
     return;
   }
 
-  if (!fb || !fb->enabled || !fb->fb_addr) {
-    log_error("%s found drm_framebuffer is not enabled yet");
+  if (!scanout->frame_buffer.enabled) {
+    log_error("%s found drm_framebuffer is not enabled yet", __func__);
     *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
     return;
   }
 
-  format = res->format;
-  bpp = 32;
-  stride = res->hostmem / res->height;
+  if (res->width > scanout->frame_buffer.width ||
+      res->height > scanout->frame_buffer.height) {
+    log_error("%s found resource %d larger than drm_framebuffer", __func__,
+              res->resource_id);
+    *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+    return;
+  }
+
+  src_stride = res->stride;
+  back = virtio_gpu_acquire_back_buffer(scanout);
+  fb = &scanout->swapchain[back];
+
+  // 先补上该缓冲区显示过之后其他缓冲区更新过的区域
+  for (uint32_t i = 0; i < fb->damage_cnt; ++i) {
+    virtio_gpu_copy_rect(res, fb, &fb->damage[i]);
+  }
+  fb->damage_cnt = 0;
+
+  // 再拷贝flush区域内被transfer过的部分
+  for (uint32_t i = 0; i < res->damage_cnt; ++i) {
+    GPUDamage *rd = &res->damage[i];
+    x = MAX(rd->r.x, r->x);
+    y = MAX(rd->r.y, r->y);
+    if (MIN(rd->r.x + rd->r.width, r->x + r->width) <= x ||
+        MIN(rd->r.y + rd->r.height, r->y + r->height) <= y) {
+      continue;
+    }
+    d.r.x = x;
+    d.r.y = y;
+    d.r.width = MIN(rd->r.x + rd->r.width, r->x + r->width) - x;
+    d.r.height = MIN(rd->r.y + rd->r.height, r->y + r->height) - y;
+    d.offset = rd->offset + (uint64_t)(y - rd->r.y) * src_stride +
+               (x - rd->r.x) * VIRTIO_GPU_BYTES_PP;
+    virtio_gpu_copy_rect(res, fb, &d);
+
+    // 交换链中的其他缓冲区下次使用时也需要更新该区域
+    for (int j = 0; j < VIRTIO_GPU_SWAPCHAIN_LEN; ++j) {
+      if (j != back) {
+        virtio_gpu_damage_add(scanout->swapchain[j].damage,
+                              &scanout->swapchain[j].damage_cnt, &d.r,
+                              d.offset, src_stride);
+      }
+    }
+
+    clips[clips_cnt].x1 = d.r.x;
+    clips[clips_cnt].y1 = d.r.y;
+    clips[clips_cnt].x2 = d.r.x + d.r.width;
+    clips[clips_cnt].y2 = d.r.y + d.r.height;
+    clips_cnt++;
+  }
+
+  virtio_gpu_present(scanout, back, clips, clips_cnt, error);
+
+  log_debug("%s flush %d rects to buffer %d with %s backend", __func__,
+            clips_cnt, back, scanout->gdev->backend->name);
+}
+
+// 将resource的guest backing导出为dma-buf，由显示后端导入并创建framebuffer
+static int virtio_gpu_create_direct_fb(VirtIODevice *vdev, GPUScanout *scanout,
+                                       GPUSimpleResource *res) {
+  // 内核模块不支持导出dma-buf时不再尝试
+  static bool export_unsupported = false;
+  const GPUDisplayBackend *backend = scanout->gdev->backend;
+  uint32_t offset = 0;
+  int dmabuf_fd = -1;
+  int ret = 0;
+
+  if (export_unsupported || backend->import_dmabuf == NULL ||
+      res->backing_addr == 0 || virtio_gpu_drm_format(res->format) == 0) {
+    return -1;
+  }
+
+  dmabuf_fd = virtio_export_dmabuf((void *)res->backing_addr, res->hostmem,
+                                   vdev->zone_id, &offset);
+  if (dmabuf_fd < 0) {
+    log_warn("%s cannot export guest memory as dma-buf, errno is %d, fall "
+             "back to copying",
+             __func__, errno);
+    export_unsupported = true;
+    return -1;
+  }
+
+  // 导入后由显示后端持有dma-buf的引用
+  ret = backend->import_dmabuf(scanout, res, dmabuf_fd, offset);
+  close(dmabuf_fd);
+  if (ret < 0) {
+    return -1;
+  }
+
+  log_debug("%s created direct framebuffer %d for resource %d", __func__,
+            res->direct_fb_id, res->resource_id);
+  return 0;
+}
+
+bool virtio_gpu_direct_flush(VirtIODevice *vdev, GPUScanout *scanout,
+                             GPUSimpleResource *res,
+                             struct virtio_gpu_rect *r, uint32_t *error) {
+  struct virtio_gpu_rect full = {0, 0, res->width, res->height};
+  drmModeClip clip;
 
-  // 从res拷贝到缓冲区
-  if (res->transfer_rect.x || res->transfer_rect.width != res->width) {
-    for (int h = 0; h < res->transfer_rect.height; h++) {
-      src_offset = res->transfer_offset + stride * h;
-      dst_offset =
-          (res->transfer_rect.y + h) * stride + (res->transfer_rect.x * bpp);
+  if (res->direct_failed) {
+    return false;
+  }
+  if (res->direct_fb_id == 0 &&
+      virtio_gpu_create_direct_fb(vdev, scanout, res) < 0) {
+    res->direct_failed = true;
+    return false;
+  }
 
-      size_t s =
-          iov_to_buf(res->iov, res->iov_cnt, src_offset,
-                     fb->fb_addr + dst_offset, res->transfer_rect.width * bpp);
+  pthread_mutex_lock(&scanout->flip_mutex);
+  if (scanout->direct_fb_id != res->direct_fb_id) {
+    // scanout换了一个直接扫描的resource
+    if (scanout->flipping == VIRTIO_GPU_DIRECT_BUFFER) {
+      virtio_gpu_wait_flip(scanout);
+    }
+    if (scanout->ready == VIRTIO_GPU_DIRECT_BUFFER) {
+      virtio_gpu_frame_done(scanout, scanout->ready);
+      scanout->ready = -1;
+    }
+    if (scanout->front == VIRTIO_GPU_DIRECT_BUFFER) {
+      scanout->front = -1;
+    }
+    scanout->direct_fb_id = res->direct_fb_id;
+  }
+  pthread_mutex_unlock(&scanout->flip_mutex);
 
-      // debug
-      log_debug("%s copy %d bytes from resource %d to drm_framebuffer, "
-                "src_offset: %d, dst_offset: %d",
-                __func__, s, res->resource_id, src_offset, dst_offset);
+  // 交换链的内容已经过时，之后回退到拷贝时需要拷贝整个resource
+  if (scanout->frame_buffer.enabled) {
+    for (int i = 0; i < VIRTIO_GPU_SWAPCHAIN_LEN; ++i) {
+      virtio_gpu_damage_add(scanout->swapchain[i].damage,
+                            &scanout->swapchain[i].damage_cnt, &full,
+                            res->blob_offset, res->stride);
     }
-  } else {
-    src_offset = res->transfer_offset;
-    dst_offset = res->transfer_rect.y * stride + res->transfer_rect.x * bpp;
+  }
 
-    size_t s =
-        iov_to_buf(res->iov, res->iov_cnt, src_offset, fb->fb_addr + dst_offset,
-                   stride * res->transfer_rect.height);
+  clip.x1 = r->x;
+  clip.y1 = r->y;
+  clip.x2 = r->x + r->width;
+  clip.y2 = r->y + r->height;
+  virtio_gpu_present(scanout, VIRTIO_GPU_DIRECT_BUFFER, &clip, 1, error);
 
-    // debug
-    log_debug("%s copy %d bytes from resource %d to drm_framebuffer, "
-              "src_offset: %d, dst_offset: %d",
-              __func__, s, res->resource_id, src_offset, dst_offset);
+  log_debug("%s flush (%d, %d) + %d, %d of resource %d without copying",
+            __func__, r->x, r->y, r->width, r->height, res->resource_id);
+  return true;
+}
+
+void virtio_gpu_destroy_direct_fb(GPUDev *gdev, GPUSimpleResource *res) {
+  if (res->direct_fb_id == 0) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    GPUScanout *scanout = &gdev->scanouts[i];
+    pthread_mutex_lock(&scanout->flip_mutex);
+    if (scanout->direct_fb_id == res->direct_fb_id) {
+      // 不能销毁正在等待翻页的framebuffer
+      if (scanout->flipping == VIRTIO_GPU_DIRECT_BUFFER) {
+        virtio_gpu_wait_flip(scanout);
+      }
+      if (scanout->ready == VIRTIO_GPU_DIRECT_BUFFER) {
+        virtio_gpu_frame_done(scanout, scanout->ready);
+        scanout->ready = -1;
+      }
+      if (scanout->front == VIRTIO_GPU_DIRECT_BUFFER) {
+        // 显示后端会在移除framebuffer时关闭输出，下一次flush时重新显示
+        scanout->front = -1;
+      }
+      scanout->direct_fb_id = 0;
+    }
+    pthread_mutex_unlock(&scanout->flip_mutex);
   }
 
-  // TODO(root): 控制CRTC输出
-  drmModeModeInfo mode = scanout->connector->modes[0];
-  drmModeSetCrtc(scanout->card0_fd, scanout->crtc->crtc_id, fb->fb_id, 0, 0,
-                 &scanout->connector->connector_id, 1, &mode);
+  log_debug("%s destroyed direct framebuffer %d of resource %d", __func__,
+            res->direct_fb_id, res->resource_id);
+  gdev->backend->release_dmabuf(gdev, res);
 
-  log_debug("%s flush with card0_fd: %d, crtc_id: %d, fb_id: %d, "
-            "connector_id: %d",
-            __func__, scanout->card0_fd, scanout->crtc->crtc_id, fb->fb_id,
-            scanout->connector->connector_id);
+  res->direct_fb_id = 0;
+  res->direct_handle = 0;
 }
 
-void virtio_gpu_remove_drm_framebuffer(GPUScanout *scanout) {
-  GPUFrameBuffer *fb = &scanout->frame_buffer;
+void virtio_gpu_flip_done(GPUScanout *scanout) {
+  const GPUDisplayBackend *backend = scanout->gdev->backend;
 
-  if (!fb || !fb->enabled || !fb->fb_addr) {
-    log_error("%s found drm_framebuffer is not enabled yet");
+  pthread_mutex_lock(&scanout->flip_mutex);
+  if (scanout->flipping >= 0) {
+    virtio_gpu_frame_done(scanout, scanout->flipping);
+    scanout->front = scanout->flipping;
+    scanout->flipping = -1;
+  }
+  if (scanout->ready >= 0) {
+    if (backend->flip(scanout, scanout->ready) == 0) {
+      scanout->flipping = scanout->ready;
+    } else {
+      // 该画面的区域仍记录在其他缓冲区中，会在下一次flush时显示
+      log_error("%s %s backend failed to flip", __func__, backend->name);
+      virtio_gpu_frame_done(scanout, scanout->ready);
+    }
+    scanout->ready = -1;
+  }
+  pthread_cond_broadcast(&scanout->flip_cond);
+  pthread_mutex_unlock(&scanout->flip_mutex);
+
+  // 等待该画面的fence可以完成了
+  virtio_gpu_fence_wakeup(scanout->gdev);
+}
+
+void virtio_gpu_damage_add(GPUDamage *damage, uint32_t *damage_cnt,
+                           struct virtio_gpu_rect *r, uint64_t offset,
+                           uint32_t stride) {
+  // offset相对于按resource布局计算出的偏移的差值，通常为0
+  int64_t base = (int64_t)offset - ((uint64_t)r->y * stride +
+                                    r->x * VIRTIO_GPU_BYTES_PP);
+  uint32_t x1, y1, x2, y2;
+  uint32_t i = 0;
+
+  if (r->width == 0 || r->height == 0) {
     return;
   }
 
-  struct drm_mode_destroy_dumb destory = {0};
-  destory.handle = fb->drm_dumb_handle;
+  // 去掉被新区域覆盖的旧区域
+  virtio_gpu_damage_clear(damage, damage_cnt, r);
 
-  drmModeRmFB(scanout->card0_fd, fb->fb_id);
-  if (fb->fb_addr != NULL) {
-    munmap(fb->fb_addr, fb->drm_dumb_size);
+  if (*damage_cnt < VIRTIO_GPU_MAX_DAMAGE_RECTS) {
+    damage[*damage_cnt].r = *r;
+    damage[*damage_cnt].offset = offset;
+    (*damage_cnt)++;
+    return;
   }
-  drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
 
-  log_debug("%s destoryed drm_framebuffer with id: %d, handle: %d, size: %d",
-            __func__, fb->fb_id, fb->drm_dumb_handle, fb->drm_dumb_size);
+  // 区域过多，合并为包含所有区域的一个区域
+  x1 = r->x, y1 = r->y;
+  x2 = r->x + r->width, y2 = r->y + r->height;
+  for (i = 0; i < *damage_cnt; ++i) {
+    struct virtio_gpu_rect *d = &damage[i].r;
+    x1 = MIN(x1, d->x);
+    y1 = MIN(y1, d->y);
+    x2 = MAX(x2, d->x + d->width);
+    y2 = MAX(y2, d->y + d->height);
+  }
+  damage[0].r.x = x1;
+  damage[0].r.y = y1;
+  damage[0].r.width = x2 - x1;
+  damage[0].r.height = y2 - y1;
+  damage[0].offset = base + (uint64_t)y1 * stride + x1 * VIRTIO_GPU_BYTES_PP;
+  *damage_cnt = 1;
+}
+
+void virtio_gpu_damage_clear(GPUDamage *damage, uint32_t *damage_cnt,
+                             struct virtio_gpu_rect *r) {
+  uint32_t i = 0;
+  while (i < *damage_cnt) {
+    struct virtio_gpu_rect *d = &damage[i].r;
+    if (d->x >= r->x && d->y >= r->y && d->x + d->width <= r->x + r->width &&
+        d->y + d->height <= r->y + r->height) {
+      damage[i] = damage[--(*damage_cnt)];
+    } else {
+      i++;
+    }
+  }
+}
+
+// 停止显示交换链中的画面，调用者需持有flip_mutex
+// 不能销毁或交出正在等待翻页的缓冲区
+static void virtio_gpu_detach_swapchain(GPUScanout *scanout) {
+  if (scanout->flipping >= 0) {
+    virtio_gpu_wait_flip(scanout);
+  }
+  scanout->front = -1;
+  scanout->flipping = -1;
+  scanout->ready = -1;
+  // 交换链中还没有显示的画面不会再显示
+  scanout->displayed_seq = scanout->present_seq;
+}
+
+// 销毁一条交换链的缓冲区，fb为其共同的参数，调用者需持有flip_mutex
+static void virtio_gpu_destroy_swapchain(GPUScanout *scanout,
+                                         GPUFrameBuffer *fb,
+                                         GPUFrameBuffer *swapchain) {
+  for (int i = 0; i < VIRTIO_GPU_SWAPCHAIN_LEN; ++i) {
+    scanout->gdev->backend->destroy_buffer(scanout, &swapchain[i], i);
+  }
+  virtio_gpu_hostmem_uncharge(scanout->gdev, fb->hostmem);
+  fb->hostmem = 0;
+}
+
+void virtio_gpu_remove_drm_framebuffer(GPUScanout *scanout) {
+  GPUFrameBuffer *fb = &scanout->frame_buffer;
+
+  if (!fb || !fb->enabled) {
+    log_error("%s found drm_framebuffer is not enabled yet", __func__);
+    return;
+  }
+
+  pthread_mutex_lock(&scanout->flip_mutex);
+  virtio_gpu_detach_swapchain(scanout);
+  virtio_gpu_destroy_swapchain(scanout, fb, scanout->swapchain);
+  pthread_mutex_unlock(&scanout->flip_mutex);
 
   // 保留其他信息
   fb->fb_id = 0;
@@ -476,6 +1123,195 @@ void virtio_gpu_remove_drm_framebuffer(GPUScanout *scanout) {
   fb->enabled = false;
 }
 
+// 交换链的缓冲区按resource的宽、高和格式创建
+static bool virtio_gpu_fb_match(GPUFrameBuffer *a, GPUFrameBuffer *b) {
+  return a->width == b->width && a->height == b->height &&
+         a->format == b->format;
+}
+
+// 销毁scanout缓存中最久没有使用的交换链，缓存为空时返回false
+static bool virtio_gpu_fb_cache_evict(GPUScanout *scanout) {
+  GPUFrameBufferCache *lru = NULL;
+
+  pthread_mutex_lock(&scanout->flip_mutex);
+  if (scanout->fb_cache_cnt == 0) {
+    pthread_mutex_unlock(&scanout->flip_mutex);
+    return false;
+  }
+  lru = &scanout->fb_cache[--scanout->fb_cache_cnt];
+  log_debug("%s evict %dx%d swapchain of format %d", __func__,
+            lru->frame_buffer.width, lru->frame_buffer.height,
+            lru->frame_buffer.format);
+  virtio_gpu_destroy_swapchain(scanout, &lru->frame_buffer, lru->swapchain);
+  pthread_mutex_unlock(&scanout->flip_mutex);
+
+  __atomic_add_fetch(&scanout->gdev->mem_stats.evictions, 1,
+                     __ATOMIC_RELAXED);
+  return true;
+}
+
+// 将scanout当前的交换链放入缓存，缓存已满时销毁最久没有使用的一条
+// 后端不能缓存时直接销毁
+static void virtio_gpu_fb_cache_put(GPUScanout *scanout) {
+  GPUFrameBufferCache *cache = scanout->fb_cache;
+
+  if (!scanout->gdev->backend->cacheable) {
+    virtio_gpu_remove_drm_framebuffer(scanout);
+    return;
+  }
+
+  pthread_mutex_lock(&scanout->flip_mutex);
+  virtio_gpu_detach_swapchain(scanout);
+  pthread_mutex_unlock(&scanout->flip_mutex);
+  if (scanout->fb_cache_cnt == VIRTIO_GPU_FB_CACHE_LEN) {
+    virtio_gpu_fb_cache_evict(scanout);
+  }
+
+  memmove(&cache[1], &cache[0], scanout->fb_cache_cnt * sizeof(*cache));
+  cache[0].frame_buffer = scanout->frame_buffer;
+  memcpy(cache[0].swapchain, scanout->swapchain, sizeof(scanout->swapchain));
+  scanout->fb_cache_cnt++;
+  scanout->frame_buffer.enabled = false;
+  scanout->frame_buffer.hostmem = 0;
+}
+
+// 解除scanout与resource的绑定，交换链放入缓存，显示后端停止输出
+void virtio_gpu_disable_scanout(GPUDev *gdev, int scanout_id) {
+  GPUScanout *scanout = &gdev->scanouts[scanout_id];
+  GPUSimpleResource *res = NULL;
+
+  if (scanout->resource_id == 0) {
+    return;
+  }
+
+  res = virtio_gpu_find_resource(gdev, scanout->resource_id);
+  if (res) {
+    res->scanout_bitmask &= ~(1 << scanout_id);
+  }
+
+  scanout->resource_id = 0;
+  scanout->width = 0;
+  scanout->height = 0;
+
+  // 再次启用相同大小的resource时可以从缓存中取回
+  if (scanout->frame_buffer.enabled) {
+    virtio_gpu_fb_cache_put(scanout);
+  }
+
+  pthread_mutex_lock(&scanout->flip_mutex);
+  // 直接扫描的resource也不再显示
+  virtio_gpu_detach_swapchain(scanout);
+  if (gdev->backend->blank != NULL) {
+    gdev->backend->blank(scanout);
+  }
+  pthread_mutex_unlock(&scanout->flip_mutex);
+  log_debug("%s disabled scanout %d", __func__, scanout_id);
+}
+
+// 从缓存中取出与fb宽、高和格式相同的交换链作为scanout的交换链
+static bool virtio_gpu_fb_cache_get(GPUScanout *scanout, GPUFrameBuffer *fb) {
+  GPUFrameBufferCache *cache = scanout->fb_cache;
+
+  for (int i = 0; i < scanout->fb_cache_cnt; ++i) {
+    if (!virtio_gpu_fb_match(&cache[i].frame_buffer, fb)) {
+      continue;
+    }
+    scanout->frame_buffer = cache[i].frame_buffer;
+    memcpy(scanout->swapchain, cache[i].swapchain, sizeof(scanout->swapchain));
+    memmove(&cache[i], &cache[i + 1],
+            (scanout->fb_cache_cnt - i - 1) * sizeof(*cache));
+    scanout->fb_cache_cnt--;
+    return true;
+  }
+  return false;
+}
+
+void virtio_gpu_fb_cache_release(GPUScanout *scanout) {
+  while (virtio_gpu_fb_cache_evict(scanout)) {
+  }
+}
+
+bool virtio_gpu_hostmem_charge(GPUDev *gdev, GPUScanout *scanout,
+                               uint64_t size) {
+  uint64_t used = __atomic_load_n(&gdev->hostmem, __ATOMIC_RELAXED);
+
+  for (;;) {
+    if (size <= gdev->hostmem_budget && used <= gdev->hostmem_budget - size) {
+      if (__atomic_compare_exchange_n(&gdev->hostmem, &used, used + size,
+                                      false, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+      continue;
+    }
+
+    // 缓存的交换链只是为了加快切换，比新的分配次要
+    bool evicted = false;
+    if (scanout != NULL) {
+      evicted = virtio_gpu_fb_cache_evict(scanout);
+    } else {
+      for (uint32_t i = 0; i < gdev->scanouts_num && !evicted; ++i) {
+        evicted = virtio_gpu_fb_cache_evict(&gdev->scanouts[i]);
+      }
+    }
+    if (!evicted) {
+      __atomic_add_fetch(&gdev->mem_stats.oom, 1, __ATOMIC_RELAXED);
+      log_warn("%s %lu bytes exceed the budget, %lu of %lu bytes in use",
+               __func__, size, used, gdev->hostmem_budget);
+      return false;
+    }
+    used = __atomic_load_n(&gdev->hostmem, __ATOMIC_RELAXED);
+  }
+
+  // 记录峰值
+  used += size;
+  uint64_t peak = __atomic_load_n(&gdev->mem_stats.peak, __ATOMIC_RELAXED);
+  while (peak < used &&
+         !__atomic_compare_exchange_n(&gdev->mem_stats.peak, &peak, used, false,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  return true;
+}
+
+void virtio_gpu_hostmem_uncharge(GPUDev *gdev, uint64_t size) {
+  __atomic_sub_fetch(&gdev->hostmem, size, __ATOMIC_RELAXED);
+}
+
+// scanout改为显示res，使用宽、高和格式与fb相同的交换链
+// 当前的交换链不合适时放入缓存，缓存中也没有时在第一次flush时创建
+static void virtio_gpu_switch_swapchain(GPUScanout *scanout,
+                                        GPUFrameBuffer *fb,
+                                        GPUSimpleResource *res) {
+  struct virtio_gpu_rect full = {0, 0, res->width, res->height};
+
+  if (scanout->frame_buffer.enabled &&
+      !virtio_gpu_fb_match(&scanout->frame_buffer, fb)) {
+    virtio_gpu_fb_cache_put(scanout);
+  }
+
+  if (!scanout->frame_buffer.enabled) {
+    if (!virtio_gpu_fb_cache_get(scanout, fb)) {
+      __atomic_add_fetch(&scanout->gdev->mem_stats.cache_misses, 1,
+                         __ATOMIC_RELAXED);
+      scanout->frame_buffer = *fb;
+      return;
+    }
+    __atomic_add_fetch(&scanout->gdev->mem_stats.cache_hits, 1,
+                       __ATOMIC_RELAXED);
+  }
+
+  // 复用的缓冲区中是其他resource的画面，第一次flush时拷贝整个resource
+  for (int i = 0; i < VIRTIO_GPU_SWAPCHAIN_LEN; ++i) {
+    GPUFrameBuffer *buf = &scanout->swapchain[i];
+    buf->damage_cnt = 0;
+    virtio_gpu_damage_add(buf->damage, &buf->damage_cnt, &full,
+                          res->blob_offset, res->stride);
+  }
+  log_debug("%s reuse %dx%d swapchain of format %d", __func__,
+            scanout->frame_buffer.width, scanout->frame_buffer.height,
+            scanout->frame_buffer.format);
+}
+
 void virtio_gpu_set_scanout(VirtIODevice *vdev, GPUCommand *gcmd) {
   log_debug("entering %s", __func__);
 
@@ -495,10 +1331,11 @@ void virtio_gpu_set_scanout(VirtIODevice *vdev, GPUCommand *gcmd) {
     return;
   }
 
-  // 不能使用id为0的resource
-  // if (set_scanout.resource_id == 0) {
-
-  // }
+  // resource_id为0表示关闭scanout
+  if (set_scanout.resource_id == 0) {
+    virtio_gpu_disable_scanout(gdev, set_scanout.scanout_id);
+    return;
+  }
 
   res = virtio_gpu_check_resource(vdev, set_scanout.resource_id, __func__,
                                   &gcmd->error);
@@ -513,7 +1350,7 @@ void virtio_gpu_set_scanout(VirtIODevice *vdev, GPUCommand *gcmd) {
   fb.bytes_pp = 4; // format都是32bits pp，即4bytes pp
   fb.width = res->width;
   fb.height = res->height;
-  fb.stride = res->hostmem / res->height; // hostmem = height * stride
+  fb.stride = res->stride;
   fb.offset = set_scanout.r.x * fb.bytes_pp + set_scanout.r.y * fb.stride;
   fb.fb_addr = NULL;
   fb.enabled = false;
@@ -546,8 +1383,6 @@ bool virtio_gpu_do_set_scanout(VirtIODevice *vdev, uint32_t scanout_id,
             "%d, %d",
             __func__, r->x, r->y, r->width, r->height, fb->width, fb->height);
 
-  // TODO(root): blob相关逻辑(若支持VIRTIO_GPU_F_RESOURCE_BLOB特性)
-
   // 更新scanout
   virtio_gpu_update_scanout(vdev, scanout_id, fb, res, r);
   return true;
@@ -578,7 +1413,222 @@ void virtio_gpu_update_scanout(VirtIODevice *vdev, uint32_t scanout_id,
   scanout->y = r->y;
   scanout->width = r->width;
   scanout->height = r->height;
-  scanout->frame_buffer = *fb;
+  virtio_gpu_switch_swapchain(scanout, fb, res);
+}
+
+// 检查guest内存块是否首尾相接，连续的backing可以直接扫描
+// addrs为每个iov在guest中的物理地址
+static void virtio_gpu_check_backing(GPUSimpleResource *res, uint64_t *addrs) {
+  uint64_t len = 0;
+
+  res->backing_addr = 0;
+  for (uint32_t i = 0; i < res->iov_cnt; ++i) {
+    if (addrs[i] != addrs[0] + len) {
+      break;
+    }
+    len += res->iov[i].iov_len;
+  }
+  if (res->iov_cnt > 0 && len >= res->hostmem) {
+    res->backing_addr = addrs[0];
+  }
+  log_debug("%s resource %d backing is %s", __func__, res->resource_id,
+            res->backing_addr ? "contiguous" : "fragmented");
+}
+
+void virtio_gpu_resource_create_blob(VirtIODevice *vdev, GPUCommand *gcmd) {
+  log_debug("entering %s", __func__);
+
+  GPUSimpleResource *res = NULL;
+  GPUDev *gdev = vdev->dev;
+  struct virtio_gpu_resource_create_blob create_blob;
+  uint64_t *addrs = NULL;
+  uint64_t len = 0;
+  uint64_t charged = 0;
+
+  VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, create_blob);
+
+  if (create_blob.resource_id == 0) {
+    log_error("%s trying to create blob resource with id 0", __func__);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+    return;
+  }
+
+  // 只支持由guest内存构成的blob
+  // zonex的内存已经映射到hvisor-tool，因此这种blob本身就是host visible的
+  // host3d blob需要virgl和共享内存区域
+  if (create_blob.blob_mem != VIRTIO_GPU_BLOB_MEM_GUEST ||
+      (create_blob.blob_flags & VIRTIO_GPU_BLOB_FLAG_USE_MAPPABLE)) {
+    log_error("%s unsupported blob mem %d with flags %#x", __func__,
+              create_blob.blob_mem, create_blob.blob_flags);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    return;
+  }
+
+  res = virtio_gpu_find_resource(gdev, create_blob.resource_id);
+  if (res) {
+    log_error("%s trying to create an existing resource with id %d", __func__,
+              create_blob.resource_id);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+    return;
+  }
+
+  if (create_blob.size == 0) {
+    log_error("%s blob resource %d has size 0", __func__,
+              create_blob.resource_id);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    return;
+  }
+
+  res = calloc(1, sizeof(GPUSimpleResource));
+  res->resource_id = create_blob.resource_id;
+  res->blob = true;
+  res->blob_mem = create_blob.blob_mem;
+  res->blob_size = create_blob.size;
+  res->hostmem = create_blob.size;
+  charged = virtio_gpu_resource_charged(res);
+
+  if (charged > 0 && !virtio_gpu_hostmem_charge(gdev, NULL, charged)) {
+    log_error("virtio gpu for zone %d out of hostmem when trying to create "
+              "blob resource %d with size %llu",
+              vdev->zone_id, create_blob.resource_id, create_blob.size);
+    free(res);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+    return;
+  }
+
+  // blob的内存入口紧跟在create_blob之后
+  if (virtio_gpu_create_mapping_iov(vdev, create_blob.nr_entries,
+                                    sizeof(create_blob), gcmd, &addrs,
+                                    &res->iov, &res->iov_cnt) != 0) {
+    log_error("%s failed to map guest memory to iov", __func__);
+    free(res);
+    virtio_gpu_hostmem_uncharge(gdev, charged);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+    return;
+  }
+  for (uint32_t i = 0; i < res->iov_cnt; ++i) {
+    len += res->iov[i].iov_len;
+  }
+  if (len < res->blob_size) {
+    log_error("%s blob resource %d has only %llu bytes of %llu", __func__,
+              res->resource_id, (unsigned long long)len,
+              (unsigned long long)res->blob_size);
+    free(addrs);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    goto err;
+  }
+  virtio_gpu_check_backing(res, addrs);
+  res->iov_offsets = virtio_gpu_iov_index(res->iov, res->iov_cnt);
+  free(addrs);
+
+  if (virtio_gpu_resource_table_insert(gdev, res) != 0) {
+    log_error("%s cannot alloc memory for resource table", __func__);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+    goto err;
+  }
+  TAILQ_INSERT_HEAD(&gdev->resource_list, res, next);
+
+  log_debug("add a blob resource %d to gpu dev of zone %d, size: %llu "
+            "host-hostmem: %lu bytes",
+            res->resource_id, vdev->zone_id,
+            (unsigned long long)res->blob_size, gdev->hostmem);
+  return;
+
+err:
+  // 释放映射时分配的iov、iov_offsets等
+  virtio_gpu_cleanup_mapping(gdev, res);
+  free(res);
+  virtio_gpu_hostmem_uncharge(gdev, charged);
+}
+
+void virtio_gpu_set_scanout_blob(VirtIODevice *vdev, GPUCommand *gcmd) {
+  log_debug("entering %s", __func__);
+
+  GPUDev *gdev = vdev->dev;
+
+  GPUSimpleResource *res = NULL;
+  GPUFrameBuffer fb = {0};
+  struct virtio_gpu_set_scanout_blob ss;
+
+  VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, ss);
+
+  if (ss.scanout_id >= gdev->scanouts_num) {
+    log_error("%s setting invalid scanout with scanout_id %d", __func__,
+              ss.scanout_id);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_SCANOUT_ID;
+    return;
+  }
+
+  // resource_id为0表示关闭scanout
+  if (ss.resource_id == 0) {
+    virtio_gpu_disable_scanout(gdev, ss.scanout_id);
+    return;
+  }
+
+  res = virtio_gpu_check_resource(vdev, ss.resource_id, __func__,
+                                  &gcmd->error);
+  if (!res) {
+    return;
+  }
+
+  if (!res->blob) {
+    log_error("%s resource %d is not a blob", __func__, ss.resource_id);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+    return;
+  }
+
+  // 检查格式和布局，图像必须完全位于blob内
+  if (virtio_gpu_drm_format(ss.format) == 0 || ss.width == 0 ||
+      ss.height == 0 || ss.strides[0] < ss.width * VIRTIO_GPU_BYTES_PP ||
+      (uint64_t)ss.offsets[0] + (uint64_t)ss.strides[0] * (ss.height - 1) +
+              ss.width * VIRTIO_GPU_BYTES_PP >
+          res->blob_size) {
+    log_error("%s found illegal layout of blob %d, format %d, %d x %d, "
+              "stride %d, offset %d, size %llu",
+              __func__, ss.resource_id, ss.format, ss.width, ss.height,
+              ss.strides[0], ss.offsets[0],
+              (unsigned long long)res->blob_size);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    return;
+  }
+
+  if (res->width != ss.width || res->height != ss.height ||
+      res->format != ss.format || res->stride != ss.strides[0] ||
+      res->blob_offset != ss.offsets[0]) {
+    // 布局改变，原来的damage和直接扫描的framebuffer都不再有效
+    virtio_gpu_destroy_direct_fb(gdev, res);
+    res->direct_failed = false;
+    res->damage_cnt = 0;
+    res->width = ss.width;
+    res->height = ss.height;
+    res->format = ss.format;
+    res->stride = ss.strides[0];
+    res->blob_offset = ss.offsets[0];
+  }
+
+  log_debug("%s setting scanout %d with blob %d", __func__, ss.scanout_id,
+            ss.resource_id);
+
+  fb.format = res->format;
+  fb.bytes_pp = VIRTIO_GPU_BYTES_PP;
+  fb.width = res->width;
+  fb.height = res->height;
+  fb.stride = res->stride;
+  fb.offset = res->blob_offset + ss.r.x * fb.bytes_pp + ss.r.y * fb.stride;
+  fb.fb_addr = NULL;
+  fb.enabled = false;
+
+  virtio_gpu_do_set_scanout(vdev, ss.scanout_id, &fb, res, &ss.r,
+                            &gcmd->error);
+}
+
+void virtio_gpu_resource_map_blob(VirtIODevice *vdev, GPUCommand *gcmd) {
+  (void)vdev;
+  log_debug("entering %s", __func__);
+
+  // 只有VIRTIO_GPU_BLOB_FLAG_USE_MAPPABLE的blob可以映射，而创建时已经拒绝了
+  log_error("%s found no host visible memory region", __func__);
+  gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
 }
 
 void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
@@ -593,12 +1643,24 @@ void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
 
   VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, transfer_2d);
 
+  // 3D resource不一定有shadow，由virglrenderer检查边界
+  res = virtio_gpu_find_resource(gdev, transfer_2d.resource_id);
+  if (res && res->virgl) {
+    virtio_gpu_virgl_transfer_to_host_2d(res, &transfer_2d, &gcmd->error);
+    return;
+  }
+
   res = virtio_gpu_check_resource(vdev, transfer_2d.resource_id, __func__,
                                   &gcmd->error);
   if (!res) {
     return;
   }
 
+  if (res->blob) {
+    // blob就是guest内存，flush时直接从中拷贝
+    return;
+  }
+
   if (transfer_2d.r.x > res->width || transfer_2d.r.y > res->height ||
       transfer_2d.r.width > res->width || transfer_2d.r.height > res->height ||
       transfer_2d.r.x + transfer_2d.r.width > res->width ||
@@ -616,12 +1678,15 @@ void virtio_gpu_transfer_to_host_2d(VirtIODevice *vdev, GPUCommand *gcmd) {
             __func__, transfer_2d.r.x, transfer_2d.r.y, transfer_2d.r.width,
             transfer_2d.r.height, res->resource_id, res->width, res->height);
 
+  // 回放时从记录中恢复transfer区域在guest backing中的内容
+  virtio_gpu_trace_mem(gdev->trace, gcmd, res, transfer_2d.offset,
+                       res->stride, transfer_2d.r.width * VIRTIO_GPU_BYTES_PP,
+                       transfer_2d.r.height);
+
   // 保留transfer的信息，到flush时再真正拷贝
-  res->transfer_rect.x = transfer_2d.r.x;
-  res->transfer_rect.y = transfer_2d.r.y;
-  res->transfer_rect.width = transfer_2d.r.width;
-  res->transfer_rect.height = transfer_2d.r.height;
-  res->transfer_offset = transfer_2d.offset;
+  // 两次flush之间可能有多次transfer，因此累积所有transfer的区域
+  virtio_gpu_damage_add(res->damage, &res->damage_cnt, &transfer_2d.r,
+                        transfer_2d.offset, res->stride);
 }
 
 void virtio_gpu_resource_attach_backing(VirtIODevice *vdev, GPUCommand *gcmd) {
@@ -642,6 +1707,12 @@ void virtio_gpu_resource_attach_backing(VirtIODevice *vdev, GPUCommand *gcmd) {
     return;
   }
 
+  if (res->virgl) {
+    virtio_gpu_virgl_attach_backing(vdev, gcmd, res,
+                                    attach_backing.nr_entries);
+    return;
+  }
+
   if (res->iov) {
     log_error("%s found resource %d already has iov", __func__,
               attach_backing.resource_id);
@@ -652,20 +1723,25 @@ void virtio_gpu_resource_attach_backing(VirtIODevice *vdev, GPUCommand *gcmd) {
   log_debug("attaching guest mem to resource %d of gpu dev from zone %d",
             res->resource_id, vdev->zone_id);
 
+  uint64_t *addrs = NULL;
   int err = virtio_gpu_create_mapping_iov(vdev, attach_backing.nr_entries,
-                                          sizeof(attach_backing), gcmd,
+                                          sizeof(attach_backing), gcmd, &addrs,
                                           &res->iov, &res->iov_cnt);
   if (err != 0) {
     log_error("%s failed to map guest memory to iov", __func__);
     gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
     return;
   }
+
+  virtio_gpu_check_backing(res, addrs);
+  res->iov_offsets = virtio_gpu_iov_index(res->iov, res->iov_cnt);
+  free(addrs);
 }
 
 int virtio_gpu_create_mapping_iov(VirtIODevice *vdev, uint32_t nr_entries,
-                                  uint32_t offset,
-                                  GPUCommand *gcmd, /*uint64_t **addr,*/
-                                  struct iovec **iov, uint32_t *niov) {
+                                  uint32_t offset, GPUCommand *gcmd,
+                                  uint64_t **addr, struct iovec **iov,
+                                  uint32_t *niov) {
   log_debug("entering %s", __func__);
   GPUDev *gdev = vdev->dev;
 
@@ -673,6 +1749,7 @@ int virtio_gpu_create_mapping_iov(VirtIODevice *vdev, uint32_t nr_entries,
   size_t entries_size = 0;
   int e = 0;
   int v = 0;
+  uint64_t prev_end = 0; // 上一个iov在guest中的结束地址
 
   if (nr_entries > 16384) {
     log_error(
@@ -696,49 +1773,56 @@ int virtio_gpu_create_mapping_iov(VirtIODevice *vdev, uint32_t nr_entries,
     return -1;
   }
 
-  *iov = NULL;
-  // if (addr) {
-  //   *addr = NULL;
-  // }
+  // iov数量不会超过entries数量，一次分配，不需要在循环中realloc
+  *iov = malloc(sizeof(struct iovec) * MAX(nr_entries, 1));
+  if (addr) {
+    *addr = malloc(sizeof(uint64_t) * MAX(nr_entries, 1));
+  }
+  if (*iov == NULL || (addr && *addr == NULL)) {
+    log_error("%s cannot alloc enough memory for iov", __func__);
+    free(*iov);
+    free(entries);
+    *iov = NULL;
+    if (addr) {
+      free(*addr);
+      *addr = NULL;
+    }
+    return -1;
+  }
 
-  for (e = 0, v = 0; e < nr_entries; ++e, ++v) {
+  for (e = 0, v = 0; e < nr_entries; ++e) {
     uint64_t e_addr = entries[e].addr;     // guest内存块的起始位置
     uint32_t e_length = entries[e].length; // guest内存块的长度
 
     // 由于zonex的全部内存会映射到zone0
     // 而zone start时会将zonex的所有内存映射到hvisor-tool的虚拟内存空间
     // 因此这里只需要将zonex用来存储资源数据的内存块的虚拟地址用iov管理即可
-
-    // iov以16个为一组进行分配，如果不够则重新分配内存
-    if (!(v % 16)) {
-      struct iovec *temp = realloc(*iov, (v + 16) * sizeof(struct iovec));
-      if (temp == NULL) {
-        // 无法分配
-        log_error("%s cannot alloc enough memory for iov", __func__);
-        free(*iov); // 直接释放iov数组
-        free(entries);
-        *iov = NULL;
-        return -1;
-      }
-      *iov = temp;
-      // if (addr) {
-      //   *addr = realloc(*addr, (v * 16) * sizeof(uint64_t));
-      // }
+    void *base = get_virt_addr((void *)e_addr, vdev->zone_id);
+
+    // guest和host中都与上一块首尾相接时合并为一个iov
+    // 按页分配的backing通常有大段连续，合并后拷贝时查找和跨块的次数都更少
+    if (v > 0 && e_addr == prev_end &&
+        base == (uint8_t *)(*iov)[v - 1].iov_base + (*iov)[v - 1].iov_len) {
+      (*iov)[v - 1].iov_len += e_length;
+      prev_end += e_length;
+      continue;
     }
 
-    (*iov)[v].iov_base = get_virt_addr((void *)e_addr, vdev->zone_id);
+    (*iov)[v].iov_base = base;
     (*iov)[v].iov_len = e_length;
     log_debug("guest addr %x map to %x with size %d", e_addr,
               (*iov)[v].iov_base, (*iov)[v].iov_len);
-    // if (addr) {
-    //   (*addr)[v] = e_addr;
-    // }
+    if (addr) {
+      (*addr)[v] = e_addr;
+    }
+    prev_end = e_addr + e_length;
+    v++;
 
     // 考虑到后期更改时，也许zonex到zone0的映射并不是直接的，而是通过dma等方式重新分配
     // 因此保留e、v来应对entries和iov不一一对应的情况
   }
   *niov = v;
-  log_debug("%d memory blocks mapped", *niov);
+  log_debug("%d memory entries mapped to %d blocks", nr_entries, *niov);
 
   // 释放entries
   free(entries);
@@ -760,6 +1844,13 @@ void virtio_gpu_resource_detach_backing(VirtIODevice *vdev, GPUCommand *gcmd) {
 
   VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, detach);
 
+  // 3D resource的shadow不是guest的backing，不能释放
+  res = virtio_gpu_find_resource(gdev, detach.resource_id);
+  if (res && res->virgl) {
+    virtio_gpu_virgl_detach_backing(res);
+    return;
+  }
+
   res = virtio_gpu_check_resource(vdev, detach.resource_id, __func__,
                                   &gcmd->error);
   if (!res) {
@@ -772,8 +1863,11 @@ void virtio_gpu_resource_detach_backing(VirtIODevice *vdev, GPUCommand *gcmd) {
 void virtio_gpu_simple_process_cmd(GPUCommand *gcmd, VirtIODevice *vdev) {
   log_debug("------ entering %s ------", __func__);
 
+  GPUDev *gdev = vdev->dev;
+
   gcmd->error = 0;
   gcmd->finished = false;
+  memset(gcmd->wait_seq, 0, sizeof(gcmd->wait_seq));
 
   // 先填充每个请求都有的cmd_hdr
   VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, gcmd->control_header);
@@ -811,11 +1905,38 @@ void virtio_gpu_simple_process_cmd(GPUCommand *gcmd, VirtIODevice *vdev) {
   case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
     virtio_gpu_resource_detach_backing(vdev, gcmd);
     break;
+  case VIRTIO_GPU_CMD_RESOURCE_CREATE_BLOB:
+    virtio_gpu_resource_create_blob(vdev, gcmd);
+    break;
+  case VIRTIO_GPU_CMD_SET_SCANOUT_BLOB:
+    virtio_gpu_set_scanout_blob(vdev, gcmd);
+    break;
+  case VIRTIO_GPU_CMD_RESOURCE_MAP_BLOB:
+  case VIRTIO_GPU_CMD_RESOURCE_UNMAP_BLOB:
+    virtio_gpu_resource_map_blob(vdev, gcmd);
+    break;
+  case VIRTIO_GPU_CMD_GET_CAPSET_INFO:
+    virtio_gpu_get_capset_info(vdev, gcmd);
+    break;
+  case VIRTIO_GPU_CMD_GET_CAPSET:
+  case VIRTIO_GPU_CMD_CTX_CREATE:
+  case VIRTIO_GPU_CMD_CTX_DESTROY:
+  case VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE:
+  case VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE:
+  case VIRTIO_GPU_CMD_RESOURCE_CREATE_3D:
+  case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D:
+  case VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D:
+  case VIRTIO_GPU_CMD_SUBMIT_3D:
+    // 由virgl线程执行，见virtio_gpu_virgl_cmd
+    virtio_gpu_virgl_process_cmd(vdev, gcmd);
+    break;
   default:
     log_error("unknown request type");
     gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
     break;
   }
+  // 记录完整的命令及其读取的guest内存，之后访问相同对象的命令才能开始执行
+  virtio_gpu_trace_cmd(gdev->trace, gcmd);
 
   if (!gcmd->finished) {
     // 如果没有直接返回有data的响应，那么检查是否产生错误并返回无data响应
@@ -824,12 +1945,23 @@ void virtio_gpu_simple_process_cmd(GPUCommand *gcmd, VirtIODevice *vdev) {
                 "type is %d, error type is %d",
                 vdev->zone_id, gcmd->control_header.type, gcmd->error);
     }
+    if (gcmd->deferred) {
+      // 带fence的命令按顺序并在画面显示后由virtio_gpu_fence_process响应
+      gcmd->resp_type = gcmd->error ? gcmd->error : VIRTIO_GPU_RESP_OK_NODATA;
+      log_debug("------ leaving %s, fence %llu deferred ------", __func__,
+                (unsigned long long)gcmd->control_header.fence_id);
+      return;
+    }
     virtio_gpu_ctrl_response_nodata(
         vdev, gcmd, gcmd->error ? gcmd->error : VIRTIO_GPU_RESP_OK_NODATA);
   }
 
   // 处理完毕，不需要iov
-  free(gcmd->resp_iov);
+  // 带fence的命令由virtio_gpu_fence_process释放
+  if (!gcmd->deferred) {
+    free(gcmd->resp_iov);
+    gcmd->resp_iov = NULL;
+  }
 
   log_debug("------ leaving %s ------", __func__);
 }
\ No newline at end of file
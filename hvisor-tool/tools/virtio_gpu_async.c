@@ -4,59 +4,615 @@
 #include "virtio_gpu.h"
 #include <pthread.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
-void *virtio_gpu_handler(void *dev) {
+uint64_t virtio_gpu_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 3D命令的渲染是否还没有完成
+static bool virtio_gpu_virgl_pending(GPUDev *gdev, GPUCommand *gcmd) {
+  return gcmd->virgl_fence >
+         __atomic_load_n(&gdev->virgl_fence_done, __ATOMIC_ACQUIRE);
+}
+
+// 命令等待的画面是否都已经显示
+static bool virtio_gpu_fence_signaled(GPUDev *gdev, GPUCommand *gcmd) {
+  bool signaled = !virtio_gpu_virgl_pending(gdev, gcmd);
+
+  for (uint32_t i = 0; i < gdev->scanouts_num && signaled; ++i) {
+    GPUScanout *scanout = &gdev->scanouts[i];
+    if (gcmd->wait_seq[i] == 0) {
+      continue;
+    }
+    pthread_mutex_lock(&scanout->flip_mutex);
+    signaled = scanout->displayed_seq >= gcmd->wait_seq[i];
+    pthread_mutex_unlock(&scanout->flip_mutex);
+  }
+  return signaled;
+}
+
+uint32_t virtio_gpu_fence_process(VirtIODevice *vdev) {
+  GPUDev *gdev = vdev->dev;
+  GPUCommand *gcmd = NULL, *tmp = NULL;
+  // 本轮中已有fence未完成的context，其之后的fence都要继续等待
+  // 驱动收到一个fence时会认为同一context中更早的fence都已完成
+  uint32_t blocked[VIRTIO_GPU_MAX_FENCE_CONTEXTS];
+  int blocked_cnt = 0;
+  uint32_t completed = 0;
+  uint64_t now = virtio_gpu_now_ns();
+
+  gcmd = TAILQ_FIRST(&gdev->fence_queue);
+  while (gcmd != NULL) {
+    bool skip = !gcmd->processed;
+    tmp = TAILQ_NEXT(gcmd, fence_next);
+
+    for (int i = 0; i < blocked_cnt && !skip; ++i) {
+      skip = blocked[i] == gcmd->control_header.ctx_id;
+    }
+
+    // 出错的命令不需要等待画面显示
+    if (!skip && gcmd->resp_type == VIRTIO_GPU_RESP_OK_NODATA &&
+        !virtio_gpu_fence_signaled(gdev, gcmd)) {
+      // 渲染时间与画面无关，3D fence不会超时
+      if (now - gcmd->fence_time_ns <
+              VIRTIO_GPU_FENCE_TIMEOUT_MS * 1000000ULL ||
+          virtio_gpu_virgl_pending(gdev, gcmd)) {
+        skip = true;
+      } else {
+        log_warn("%s fence %llu of ctx %d timed out", __func__,
+                 (unsigned long long)gcmd->control_header.fence_id,
+                 gcmd->control_header.ctx_id);
+      }
+    }
+
+    if (skip) {
+      if (blocked_cnt == VIRTIO_GPU_MAX_FENCE_CONTEXTS) {
+        // context过多，之后的fence都等到下一轮
+        break;
+      }
+      blocked[blocked_cnt++] = gcmd->control_header.ctx_id;
+      gcmd = tmp;
+      continue;
+    }
+
+    TAILQ_REMOVE(&gdev->fence_queue, gcmd, fence_next);
+    if (!gcmd->finished) {
+      virtio_gpu_ctrl_response_nodata(vdev, gcmd, gcmd->resp_type);
+    }
+    log_debug("%s fence %llu of ctx %d completed", __func__,
+              (unsigned long long)gcmd->control_header.fence_id,
+              gcmd->control_header.ctx_id);
+    gdev->done_cnt[gcmd->from_queue]++;
+    free(gcmd->resp_iov);
+    free(gcmd);
+    completed++;
+    gcmd = tmp;
+  }
+  return completed;
+}
+
+void virtio_gpu_fence_wakeup(GPUDev *gdev) {
+  pthread_mutex_lock(&gdev->queue_mutex);
+  gdev->wakeup = true;
+  pthread_cond_signal(&gdev->gpu_cond);
+  pthread_mutex_unlock(&gdev->queue_mutex);
+}
+
+void virtio_gpu_display_changed(GPUDev *gdev) {
+  pthread_mutex_lock(&gdev->queue_mutex);
+  gdev->display_changed = true;
+  gdev->wakeup = true;
+  pthread_cond_signal(&gdev->gpu_cond);
+  pthread_mutex_unlock(&gdev->queue_mutex);
+}
+
+// 根据命令类型找出命令访问的resource和scanout，无法判断的命令都是独占的
+static void virtio_gpu_cmd_deps(GPUDev *gdev, GPUCommand *gcmd) {
+  GPUCommandDeps *deps = &gcmd->deps;
+  struct virtio_gpu_transfer_to_host_2d transfer;
+  struct virtio_gpu_resource_flush flush;
+  GPUSimpleResource *res = NULL;
+
+  memset(deps, 0, sizeof(*deps));
+  deps->exclusive = true;
+  if (gcmd->from_queue != GPU_CONTROL_QUEUE) {
+    return;
+  }
+  // 3D命令可能访问任意resource和context，依次单独执行
+  if (virtio_gpu_virgl_cmd(gdev, gcmd)) {
+    deps->virgl = true;
+    return;
+  }
+
+  switch (gcmd->control_header.type) {
+  case VIRTIO_GPU_CMD_GET_DISPLAY_INFO:
+  case VIRTIO_GPU_CMD_GET_EDID:
+    // 只读取scanout的设置，而修改设置的命令是独占的
+    deps->exclusive = false;
+    break;
+  case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
+    if (iov_to_buf(gcmd->resp_iov, gcmd->resp_iov_cnt, 0, &transfer,
+                   sizeof(transfer)) == sizeof(transfer)) {
+      deps->resource_id = transfer.resource_id;
+      deps->exclusive = false;
+    }
+    break;
+  case VIRTIO_GPU_CMD_RESOURCE_FLUSH:
+    if (iov_to_buf(gcmd->resp_iov, gcmd->resp_iov_cnt, 0, &flush,
+                   sizeof(flush)) == sizeof(flush)) {
+      // 调度时没有独占的命令在执行，resource表和scanout的绑定不会改变
+      res = virtio_gpu_find_resource(gdev, flush.resource_id);
+      deps->resource_id = flush.resource_id;
+      deps->scanout_mask = res ? res->scanout_bitmask : 0;
+      deps->exclusive = false;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static bool virtio_gpu_deps_conflict(GPUCommandDeps *a, GPUCommandDeps *b) {
+  return a->exclusive || b->exclusive ||
+         (a->resource_id != 0 && a->resource_id == b->resource_id) ||
+         (a->scanout_mask & b->scanout_mask);
+}
+
+// 访问deps中对象的操作是否与已经交给工作线程的命令冲突
+static bool virtio_gpu_inflight_conflict(GPUDev *gdev, GPUCommandDeps *deps) {
+  GPUCommand *other = NULL;
+
+  TAILQ_FOREACH(other, &gdev->run_queue, next) {
+    if (virtio_gpu_deps_conflict(deps, &other->deps)) {
+      return true;
+    }
+  }
+  TAILQ_FOREACH(other, &gdev->running_queue, next) {
+    if (virtio_gpu_deps_conflict(deps, &other->deps)) {
+      return true;
+    }
+  }
+  TAILQ_FOREACH(other, &gdev->virgl_queue, next) {
+    if (virtio_gpu_deps_conflict(deps, &other->deps)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 处理cursor_queue中的所有命令，调用者需持有queue_mutex
+// 光标命令很短，由调度线程直接处理，不占用工作线程
+static void virtio_gpu_process_cursor_queue(VirtIODevice *vdev) {
+  GPUDev *gdev = vdev->dev;
+  GPUCommand *gcmd = NULL;
+  TAILQ_HEAD(, virtio_gpu_control_cmd) cmds = TAILQ_HEAD_INITIALIZER(cmds);
+
+  if (TAILQ_EMPTY(&gdev->cursor_queue)) {
+    return;
+  }
+  // 设置光标图像需要读取resource，等待修改resource表的命令执行完
+  TAILQ_FOREACH(gcmd, &gdev->running_queue, next) {
+    if (gcmd->deps.exclusive) {
+      return;
+    }
+  }
+  TAILQ_FOREACH(gcmd, &gdev->run_queue, next) {
+    if (gcmd->deps.exclusive) {
+      return;
+    }
+  }
+  if (!TAILQ_EMPTY(&gdev->virgl_queue)) {
+    return;
+  }
+
+  // 处理时不持有锁，只有调度线程交出命令，此时不会有新的独占命令执行
+  TAILQ_CONCAT(&cmds, &gdev->cursor_queue, next);
+  pthread_mutex_unlock(&gdev->queue_mutex);
+  while (!TAILQ_EMPTY(&cmds)) {
+    gcmd = TAILQ_FIRST(&cmds);
+    TAILQ_REMOVE(&cmds, gcmd, next);
+    virtio_gpu_process_cursor(vdev, gcmd);
+    free(gcmd);
+    pthread_mutex_lock(&gdev->queue_mutex);
+    gdev->done_cnt[GPU_CURSOR_QUEUE]++;
+    pthread_mutex_unlock(&gdev->queue_mutex);
+  }
+  pthread_mutex_lock(&gdev->queue_mutex);
+}
+
+// 执行已到刷新周期的推迟显示，返回最早的未到期显示的时间，0表示没有
+// 与flush一样不能和访问相同resource或scanout的命令同时执行
+// 调用者需持有queue_mutex
+static uint64_t virtio_gpu_pace_process(VirtIODevice *vdev) {
+  GPUDev *gdev = vdev->dev;
+  GPUCommandDeps deps;
+  uint64_t next = 0, deadline = 0;
+  bool pending = false;
+
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    GPUScanout *scanout = &gdev->scanouts[i];
+
+    memset(&deps, 0, sizeof(deps));
+    pthread_mutex_lock(&scanout->flip_mutex);
+    pending = scanout->pace_pending;
+    deadline = scanout->last_present_ns + scanout->frame_ns;
+    deps.resource_id = scanout->pace_resource_id;
+    pthread_mutex_unlock(&scanout->flip_mutex);
+    deps.scanout_mask = 1 << i;
+    if (!pending) {
+      continue;
+    }
+    if (virtio_gpu_now_ns() < deadline) {
+      next = next == 0 ? deadline : MIN(next, deadline);
+      continue;
+    }
+    // 冲突的命令执行完时会唤醒调度线程，届时再显示
+    if (virtio_gpu_inflight_conflict(gdev, &deps)) {
+      continue;
+    }
+
+    // 与光标命令一样，不持有锁执行时调度线程不会交出新的命令
+    pthread_mutex_unlock(&gdev->queue_mutex);
+    virtio_gpu_paced_present(vdev, scanout);
+    pthread_mutex_lock(&gdev->queue_mutex);
+  }
+  return next;
+}
+
+// 将command_queue中与执行中的命令和之前等待的命令都不冲突的命令交给工作线程
+// 访问相同resource或scanout的命令因此按到达顺序执行，调用者需持有queue_mutex
+static void virtio_gpu_schedule(GPUDev *gdev) {
+  GPUCommand *gcmd = NULL, *tmp = NULL;
+  // 本轮被阻塞的命令访问的对象，之后访问相同对象的命令也要等待
+  uint32_t blocked_res[VIRTIO_GPU_MAX_BLOCKED_RESOURCES];
+  int blocked_cnt = 0;
+  uint32_t blocked_scanouts = 0;
+  int inflight = 0;
+
+  TAILQ_FOREACH(gcmd, &gdev->run_queue, next) {
+    inflight++;
+  }
+  TAILQ_FOREACH(gcmd, &gdev->running_queue, next) {
+    inflight++;
+  }
+  TAILQ_FOREACH(gcmd, &gdev->virgl_queue, next) {
+    inflight++;
+  }
+
+  for (gcmd = TAILQ_FIRST(&gdev->command_queue);
+       gcmd != NULL && inflight < gdev->nr_workers; gcmd = tmp) {
+    bool blocked = false;
+    tmp = TAILQ_NEXT(gcmd, next);
+
+    if (iov_to_buf(gcmd->resp_iov, gcmd->resp_iov_cnt, 0,
+                   &gcmd->control_header, sizeof(gcmd->control_header)) !=
+        sizeof(gcmd->control_header)) {
+      // 由virtio_gpu_simple_process_cmd报告错误
+      memset(&gcmd->control_header, 0, sizeof(gcmd->control_header));
+    }
+    virtio_gpu_cmd_deps(gdev, gcmd);
+
+    if (gcmd->deps.exclusive) {
+      // 独占的命令等待之前的所有命令完成，之后的命令也都等待它
+      if (inflight != 0 || gcmd != TAILQ_FIRST(&gdev->command_queue)) {
+        break;
+      }
+    } else if (blocked_scanouts & gcmd->deps.scanout_mask) {
+      blocked = true;
+    } else {
+      for (int i = 0; i < blocked_cnt && !blocked; ++i) {
+        blocked = blocked_res[i] == gcmd->deps.resource_id;
+      }
+      blocked = blocked || virtio_gpu_inflight_conflict(gdev, &gcmd->deps);
+    }
+
+    if (blocked) {
+      if (blocked_cnt == VIRTIO_GPU_MAX_BLOCKED_RESOURCES) {
+        break;
+      }
+      if (gcmd->deps.resource_id != 0) {
+        blocked_res[blocked_cnt++] = gcmd->deps.resource_id;
+      }
+      blocked_scanouts |= gcmd->deps.scanout_mask;
+      continue;
+    }
+
+    TAILQ_REMOVE(&gdev->command_queue, gcmd, next);
+    if (gcmd->control_header.flags & VIRTIO_GPU_FLAG_FENCE) {
+      // fence按到达顺序完成，而不是按执行完的顺序
+      gcmd->deferred = true;
+      gcmd->processed = false;
+      gcmd->resp_type = VIRTIO_GPU_RESP_ERR_UNSPEC;
+      TAILQ_INSERT_TAIL(&gdev->fence_queue, gcmd, fence_next);
+    }
+    if (gcmd->deps.virgl) {
+      TAILQ_INSERT_TAIL(&gdev->virgl_queue, gcmd, next);
+      pthread_cond_signal(&gdev->virgl_cond);
+    } else {
+      TAILQ_INSERT_TAIL(&gdev->run_queue, gcmd, next);
+      pthread_cond_signal(&gdev->worker_cond);
+    }
+    inflight++;
+
+    if (gcmd->deps.exclusive) {
+      break;
+    }
+  }
+}
+
+// 命令执行完，从running_queue中移除，调用者需持有queue_mutex
+static void virtio_gpu_cmd_done(GPUDev *gdev, GPUCommand *gcmd) {
+  TAILQ_REMOVE(&gdev->running_queue, gcmd, next);
+  if (gcmd->deferred) {
+    // 由调度线程按顺序响应并释放
+    gcmd->processed = true;
+    gcmd->fence_time_ns = virtio_gpu_now_ns();
+  } else {
+    gdev->done_cnt[gcmd->from_queue]++;
+    free(gcmd);
+  }
+  // 通知调度线程，被该命令阻塞的命令可以执行了
+  gdev->wakeup = true;
+  pthread_cond_signal(&gdev->gpu_cond);
+}
+
+void *virtio_gpu_worker(void *dev) {
   VirtIODevice *vdev = (VirtIODevice *)dev;
   GPUDev *gdev = vdev->dev;
   GPUCommand *gcmd = NULL;
 
-  uint32_t request_cnt = 0;
+  pthread_mutex_lock(&gdev->queue_mutex);
+  for (;;) {
+    while (TAILQ_EMPTY(&gdev->run_queue) && !gdev->close) {
+      pthread_cond_wait(&gdev->worker_cond, &gdev->queue_mutex);
+    }
+    if (gdev->close) {
+      break;
+    }
+
+    gcmd = TAILQ_FIRST(&gdev->run_queue);
+    TAILQ_REMOVE(&gdev->run_queue, gcmd, next);
+    TAILQ_INSERT_TAIL(&gdev->running_queue, gcmd, next);
+    pthread_mutex_unlock(&gdev->queue_mutex);
+
+    // 释放锁并开始处理
+    // iov由virtio_gpu_simple_process_cmd释放
+    virtio_gpu_simple_process_cmd(gcmd, vdev);
+
+    pthread_mutex_lock(&gdev->queue_mutex);
+    virtio_gpu_cmd_done(gdev, gcmd);
+  }
+  pthread_mutex_unlock(&gdev->queue_mutex);
+  return NULL;
+}
+
+void *virtio_gpu_virgl_worker(void *dev) {
+  VirtIODevice *vdev = (VirtIODevice *)dev;
+  GPUDev *gdev = vdev->dev;
+  GPUCommand *gcmd = NULL;
+  uint64_t fence = 0;
+  struct timespec ts;
+  int ret = virtio_gpu_virgl_init(gdev);
 
+  pthread_mutex_lock(&gdev->queue_mutex);
+  gdev->virgl_state = ret < 0 ? GPU_VIRGL_FAILED : GPU_VIRGL_READY;
+  pthread_cond_broadcast(&gdev->virgl_cond);
+  if (ret < 0) {
+    pthread_mutex_unlock(&gdev->queue_mutex);
+    return NULL;
+  }
+
+  for (;;) {
+    while (TAILQ_EMPTY(&gdev->virgl_queue) && !gdev->close) {
+      if (__atomic_load_n(&gdev->virgl_fence_done, __ATOMIC_ACQUIRE) ==
+          gdev->virgl_fence_seq) {
+        pthread_cond_wait(&gdev->virgl_cond, &gdev->queue_mutex);
+        continue;
+      }
+      // 还有3D fence未完成，定期检查，write_fence回调会获取queue_mutex
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += VIRTIO_GPU_VIRGL_POLL_US * 1000L;
+      ts.tv_sec += ts.tv_nsec / 1000000000L;
+      ts.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&gdev->virgl_cond, &gdev->queue_mutex, &ts);
+      pthread_mutex_unlock(&gdev->queue_mutex);
+      virtio_gpu_virgl_poll();
+      pthread_mutex_lock(&gdev->queue_mutex);
+    }
+    if (gdev->close) {
+      break;
+    }
+
+    gcmd = TAILQ_FIRST(&gdev->virgl_queue);
+    TAILQ_REMOVE(&gdev->virgl_queue, gcmd, next);
+    TAILQ_INSERT_TAIL(&gdev->running_queue, gcmd, next);
+    pthread_mutex_unlock(&gdev->queue_mutex);
+
+    virtio_gpu_simple_process_cmd(gcmd, vdev);
+    // 带fence的命令等到其之前提交的渲染都完成后再响应
+    fence = gcmd->deferred ? virtio_gpu_virgl_create_fence(gdev, gcmd) : 0;
+    virtio_gpu_virgl_poll();
+
+    pthread_mutex_lock(&gdev->queue_mutex);
+    gcmd->virgl_fence = fence;
+    virtio_gpu_cmd_done(gdev, gcmd);
+  }
+  pthread_mutex_unlock(&gdev->queue_mutex);
+
+  virtio_gpu_virgl_cleanup(gdev);
+  return NULL;
+}
+
+void *virtio_gpu_handler(void *dev) {
+  VirtIODevice *vdev = (VirtIODevice *)dev;
+  GPUDev *gdev = vdev->dev;
+  struct timespec ts;
+  uint64_t next_present = 0, wait_ns = 0, now = 0;
+
+  // 除了等待时，调度线程一直持有queue_mutex
   pthread_mutex_lock(&gdev->queue_mutex);
   for (;;) {
     // 检查设备是否关闭
     if (gdev->close) {
       pthread_mutex_unlock(&gdev->queue_mutex);
-      pthread_exit(NULL);
       return NULL;
     }
 
-    // 试图获取一个命令
-    // 此时持有锁
-    while (!TAILQ_EMPTY(&gdev->command_queue)) {
-      gcmd = TAILQ_FIRST(&gdev->command_queue);
-      TAILQ_REMOVE(&gdev->command_queue, gcmd, next);
-
-      pthread_mutex_unlock(&gdev->queue_mutex);
+    gdev->wakeup = false;
+    virtio_gpu_process_cursor_queue(vdev);
+    virtio_gpu_schedule(gdev);
+    next_present = virtio_gpu_pace_process(vdev);
+    // 完成画面已经显示的fence
+    if (!TAILQ_EMPTY(&gdev->fence_queue)) {
+      virtio_gpu_fence_process(vdev);
+    }
+    // 显示设备改变，前端收到配置中断后重新GET_DISPLAY_INFO和GET_EDID
+    if (gdev->display_changed) {
+      gdev->display_changed = false;
+      __atomic_or_fetch(&gdev->config.events_read, VIRTIO_GPU_EVENT_DISPLAY,
+                        __ATOMIC_RELAXED);
+      virtio_inject_config_irq(vdev);
+    }
 
-      // 释放锁并开始处理
-      virtio_gpu_simple_process_cmd(gcmd, vdev);
-      // 命令完成后通知前端并释放内存
-      // iov由virtio_gpu_simple_process_cmd释放
+    for (int i = 0; i < GPU_MAX_QUEUES; ++i) {
+      // 处理了一定数量的请求，或者没有命令在等待工作线程，kick前端
+      // 执行时间长的命令不会推迟其他命令的通知
+      if (gdev->done_cnt[i] >= VIRTIO_GPU_MAX_REQUEST_BEFORE_KICK ||
+          (gdev->done_cnt[i] != 0 && TAILQ_EMPTY(&gdev->run_queue))) {
+        virtio_inject_irq(&vdev->vqs[i]);
+        log_debug("%s: %d requests done, kick frontend", __func__,
+                  gdev->done_cnt[i]);
+        gdev->done_cnt[i] = 0;
+      }
+    }
 
-      request_cnt++;
+    if (gdev->wakeup) {
+      continue;
+    }
 
-      if (request_cnt >= VIRTIO_GPU_MAX_REQUEST_BEFORE_KICK) {
-        // 已经处理了一定数量的请求，kick前端
-        virtio_inject_irq(&vdev->vqs[gcmd->from_queue]);
-        request_cnt = 0;
-        log_info("%s: processed request >= 16, kick frontend", __func__);
+    if (TAILQ_EMPTY(&gdev->fence_queue) && next_present == 0) {
+      pthread_cond_wait(&gdev->gpu_cond, &gdev->queue_mutex);
+    } else {
+      // 还有fence在等待，vblank事件丢失时也要定期检查超时
+      // 有推迟的显示时，最晚在其刷新周期结束时醒来
+      wait_ns = VIRTIO_GPU_FLIP_TIMEOUT_MS * 1000000ULL;
+      if (next_present != 0) {
+        now = virtio_gpu_now_ns();
+        wait_ns = next_present > now ? MIN(wait_ns, next_present - now) : 0;
       }
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += wait_ns;
+      ts.tv_sec += ts.tv_nsec / 1000000000L;
+      ts.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&gdev->gpu_cond, &gdev->queue_mutex, &ts);
+    }
+  }
+}
 
-      free(gcmd);
+int virtio_gpu_async_init(VirtIODevice *vdev) {
+  GPUDev *gdev = vdev->dev;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int nr = cpus > 1 ? MIN(cpus, VIRTIO_GPU_MAX_WORKERS) : 1;
 
-      // 由于我们仍在处理循环中，此时不用担心lose awake
-      // 下一次检查时重新获得锁
+  // virglrenderer在virgl线程中初始化，失败时只支持2D命令
+  if (gdev->virgl) {
+    gdev->virgl_state = GPU_VIRGL_INIT;
+    if (pthread_create(&gdev->virgl_thread, NULL, virtio_gpu_virgl_worker,
+                       vdev) != 0) {
+      gdev->virgl_state = GPU_VIRGL_FAILED;
+    } else {
+      gdev->virgl_thread_started = true;
       pthread_mutex_lock(&gdev->queue_mutex);
+      while (gdev->virgl_state == GPU_VIRGL_INIT) {
+        pthread_cond_wait(&gdev->virgl_cond, &gdev->queue_mutex);
+      }
+      pthread_mutex_unlock(&gdev->queue_mutex);
+    }
+    if (gdev->virgl_state == GPU_VIRGL_FAILED) {
+      log_warn("%s virgl is unavailable, only 2d commands are supported",
+               __func__);
+      gdev->virgl = false;
     }
+  }
+
+  gdev->nr_workers = 0;
+  while (gdev->nr_workers < nr) {
+    if (pthread_create(&gdev->workers[gdev->nr_workers], NULL,
+                       virtio_gpu_worker, vdev) != 0) {
+      break;
+    }
+    gdev->nr_workers++;
+  }
+  if (gdev->nr_workers == 0) {
+    log_error("%s cannot create virtio gpu worker", __func__);
+    return -1;
+  }
 
-    if (request_cnt != 0) {
-      // 已经处理了请求但是任务队列为空，立刻kick前端
-      virtio_inject_irq(&vdev->vqs[gcmd->from_queue]);
-      request_cnt = 0;
-      log_info("%s: request queue empty, kick frontend", __func__);
+  if (pthread_create(&gdev->gpu_thread, NULL, virtio_gpu_handler, vdev) != 0) {
+    log_error("%s cannot create virtio gpu thread", __func__);
+    virtio_gpu_async_close(vdev);
+    return -1;
+  }
+  gdev->gpu_thread_started = true;
+
+  log_info("virtio gpu uses %d workers", gdev->nr_workers);
+  return 0;
+}
+
+// 释放还没有交给fence_queue的命令
+static void virtio_gpu_free_cmds(GPUCommand *gcmd) {
+  GPUCommand *tmp = NULL;
+
+  for (; gcmd != NULL; gcmd = tmp) {
+    tmp = TAILQ_NEXT(gcmd, next);
+    if (!gcmd->deferred) {
+      free(gcmd->resp_iov);
+      free(gcmd);
     }
+  }
+}
+
+void virtio_gpu_async_close(VirtIODevice *vdev) {
+  GPUDev *gdev = vdev->dev;
+
+  pthread_mutex_lock(&gdev->queue_mutex);
+  gdev->close = true;
+  pthread_cond_broadcast(&gdev->worker_cond);
+  pthread_cond_broadcast(&gdev->virgl_cond);
+  pthread_cond_signal(&gdev->gpu_cond);
+  pthread_mutex_unlock(&gdev->queue_mutex);
+
+  // 工作线程执行完当前的命令后退出
+  if (gdev->gpu_thread_started) {
+    pthread_join(gdev->gpu_thread, NULL);
+    gdev->gpu_thread_started = false;
+  }
+  for (int i = 0; i < gdev->nr_workers; ++i) {
+    pthread_join(gdev->workers[i], NULL);
+  }
+  gdev->nr_workers = 0;
+  if (gdev->virgl_thread_started) {
+    pthread_join(gdev->virgl_thread, NULL);
+    gdev->virgl_thread_started = false;
+  }
 
-    pthread_cond_wait(&gdev->gpu_cond, &gdev->queue_mutex);
+  // 回收命令队列内存
+  virtio_gpu_free_cmds(TAILQ_FIRST(&gdev->cursor_queue));
+  virtio_gpu_free_cmds(TAILQ_FIRST(&gdev->command_queue));
+  virtio_gpu_free_cmds(TAILQ_FIRST(&gdev->run_queue));
+  virtio_gpu_free_cmds(TAILQ_FIRST(&gdev->virgl_queue));
+  TAILQ_INIT(&gdev->cursor_queue);
+  TAILQ_INIT(&gdev->command_queue);
+  TAILQ_INIT(&gdev->run_queue);
+  TAILQ_INIT(&gdev->virgl_queue);
+  while (!TAILQ_EMPTY(&gdev->fence_queue)) {
+    GPUCommand *temp = TAILQ_FIRST(&gdev->fence_queue);
+    TAILQ_REMOVE(&gdev->fence_queue, temp, fence_next);
+    free(temp->resp_iov);
+    free(temp);
   }
-}
\ No newline at end of file
+}
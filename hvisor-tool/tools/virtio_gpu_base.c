@@ -1,3 +1,4 @@
+#include "event_monitor.h"
 #include "log.h"
 #include "sys/queue.h"
 #include "unistd.h"
@@ -5,6 +6,7 @@
 #include "virtio_gpu.h"
 #include <fcntl.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,10 +14,10 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
-GPUDev *init_gpu_dev(GPURequestedState *requested_state) {
+GPUDev *init_gpu_dev(GPURequestedScanouts *requested) {
   log_info("initializing GPUDev");
 
-  if (requested_state == NULL) {
+  if (requested == NULL) {
     log_error("null requested state");
     return NULL;
   }
@@ -35,42 +37,77 @@ GPUDev *init_gpu_dev(GPURequestedState *requested_state) {
   // 初始化config
   gdev->config.events_read = 0;
   gdev->config.events_clear = 0;
-  gdev->config.num_scanouts = HVISOR_VIRTIO_GPU_MAX_SCANOUTS;
+  gdev->config.num_scanouts = requested->nr_scanouts;
   gdev->config.num_capsets = 0;
 
   // 初始化scanouts数量
-  gdev->scanouts_num = 1;
-
-  // 初始化scanout 0
-  // TODO(root): 使用json初始化，或者读取设备
-  gdev->scanouts[0].width = SCANOUT_DEFAULT_WIDTH;
-  gdev->scanouts[0].height = SCANOUT_DEFAULT_HEIGHT;
-
-  log_debug("set scanouts[0] width: %d height: %d", gdev->scanouts[0].width,
-            gdev->scanouts[0].height);
-
-  // dev->scanouts[0].x = 0;
-  // dev->scanouts[0].y = 0;
-  // dev->scanouts[0].resource_id = 0;
-  gdev->scanouts[0].current_cursor = NULL;
-  gdev->scanouts[0].card0_fd = -1;
-  gdev->enabled_scanout_bitmask |= (1 << 0); // 启用scanout 0
-
-  // scanout的framebuffer由驱动前端设置，见virtio_gpu_set_scanout
-
-  // TODO(root): 多组requested_states(需要更改json解析)
-  gdev->requested_states[0].width = requested_state->width;
-  gdev->requested_states[0].height = requested_state->height;
-
-  log_debug("requested state from json, width: %d height: %d",
-            gdev->requested_states[0].width, gdev->requested_states[0].height);
+  gdev->scanouts_num = requested->nr_scanouts;
+  gdev->card_fd = -1;
+  gdev->uevent_fd = -1;
+
+  // 显示后端在virtio_gpu_init中打开
+  gdev->backend_type = requested->backend;
+  strncpy(gdev->card_path, requested->card, sizeof(gdev->card_path) - 1);
+  strncpy(gdev->stream_path, requested->socket, sizeof(gdev->stream_path) - 1);
+  strncpy(gdev->trace_path, requested->trace, sizeof(gdev->trace_path) - 1);
+  gdev->stream_listen_fd = -1;
+  gdev->stream_fd = -1;
+
+  // 初始化scanouts，其显示设备在virtio_gpu_init中设置
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    GPUScanout *scanout = &gdev->scanouts[i];
+    scanout->width = SCANOUT_DEFAULT_WIDTH;
+    scanout->height = SCANOUT_DEFAULT_HEIGHT;
+    scanout->current_cursor = NULL;
+    scanout->card0_fd = -1;
+    scanout->shm_fd = -1;
+    scanout->front = -1;
+    scanout->flipping = -1;
+    scanout->ready = -1;
+    scanout->page_flip = true;
+    scanout->frame_ns = 1000000000ULL / VIRTIO_GPU_DEFAULT_REFRESH;
+    scanout->gdev = gdev;
+    pthread_mutex_init(&scanout->flip_mutex, NULL);
+    pthread_cond_init(&scanout->flip_cond, NULL);
+    gdev->enabled_scanout_bitmask |= (1 << i); // 启用scanout i
+
+    // scanout的framebuffer由驱动前端设置，见virtio_gpu_set_scanout
+
+    gdev->requested_states[i] = requested->states[i];
+    log_debug("requested state of scanout %d from json, width: %d height: %d "
+              "connector: %d",
+              i, gdev->requested_states[i].width,
+              gdev->requested_states[i].height,
+              gdev->requested_states[i].connector_id);
+  }
 
   // 初始化资源列表和命令队列
   TAILQ_INIT(&gdev->resource_list);
   TAILQ_INIT(&gdev->command_queue);
+  TAILQ_INIT(&gdev->cursor_queue);
+  TAILQ_INIT(&gdev->run_queue);
+  TAILQ_INIT(&gdev->running_queue);
+  TAILQ_INIT(&gdev->fence_queue);
+  gdev->wakeup = false;
+  gdev->display_changed = false;
+  gdev->pacing = !requested->unpaced;
+  // 显示后端初始化后，hotplug事件就可能唤醒调度线程
+  pthread_mutex_init(&gdev->queue_mutex, NULL);
+  pthread_cond_init(&gdev->gpu_cond, NULL);
+  pthread_cond_init(&gdev->worker_cond, NULL);
+
+  // virglrenderer在virtio_gpu_async_init中初始化
+  gdev->virgl = requested->virgl;
+  gdev->virgl_state = GPU_VIRGL_INIT;
+  TAILQ_INIT(&gdev->virgl_queue);
+  pthread_cond_init(&gdev->virgl_cond, NULL);
 
   // 初始化内存计数
   gdev->hostmem = 0;
+  gdev->hostmem_budget =
+      requested->hostmem != 0 ? requested->hostmem : VIRTIO_GPU_MAX_HOSTMEM;
+  log_info("virtio gpu hostmem budget is %lu MiB",
+           gdev->hostmem_budget >> 20);
 
   // 初始化async部分
   gdev->close = false;
@@ -81,136 +118,134 @@ GPUDev *init_gpu_dev(GPURequestedState *requested_state) {
 int virtio_gpu_init(VirtIODevice *vdev) {
   log_info("entering %s", __func__);
 
-  // TODO(root): 显示设备初始化
   GPUDev *gdev = vdev->dev;
 
   // 设置virtio gpu的关闭函数
   vdev->virtio_close = virtio_gpu_close;
-
-  int drm_fd = 0;
-
-  // 打开card0
-  drm_fd = open("/dev/dri/card1", O_RDWR | O_CLOEXEC);
-  if (drm_fd < 0) {
-    log_error("%s failed to open /dev/dri/card1", __func__);
-    return -1;
+  vdev->virtio_config_write = virtio_gpu_config_write;
+
+  // 选择显示后端，并为每个scanout设置输出
+  switch (gdev->backend_type) {
+  case GPU_BACKEND_DRM:
+    gdev->backend = &virtio_gpu_drm_backend;
+    break;
+  case GPU_BACKEND_SHM:
+    gdev->backend = &virtio_gpu_shm_backend;
+    break;
+  case GPU_BACKEND_NULL:
+    gdev->backend = &virtio_gpu_null_backend;
+    break;
+  case GPU_BACKEND_STREAM:
+    gdev->backend = &virtio_gpu_stream_backend;
+    break;
+  default:
+    gdev->backend = &virtio_gpu_drm_backend;
+    break;
   }
-
-  // 获取drm资源
-  // 需要获得设备的连接器(connector)、显示控制器(CRTC)、encoder、framebuffer
-  drmModeRes *res = drmModeGetResources(drm_fd);
-  if (!res) {
-    log_error("%s cannot get card0 resource", __func__);
-    close(drm_fd);
-    return -1;
+  if (gdev->backend->init(gdev) < 0) {
+    if (gdev->backend_type != GPU_BACKEND_AUTO) {
+      log_error("%s failed to init %s display backend", __func__,
+                gdev->backend->name);
+      return -1;
+    }
+    // 没有指定后端时，没有显示设备也能运行guest
+    log_warn("%s no display is available, frames will be discarded",
+             __func__);
+    gdev->backend = &virtio_gpu_null_backend;
+    gdev->backend->init(gdev);
   }
-
-  // 获取connector
-  drmModeConnector *connector = NULL;
-  for (int i = 0; i < res->count_connectors; ++i) {
-    connector = drmModeGetConnector(drm_fd, res->connectors[i]);
-    if (connector->connection == DRM_MODE_CONNECTED) {
-      break;
+  log_info("virtio gpu uses %s display backend", gdev->backend->name);
+
+  // 后端没有提供EDID时，按scanout的分辨率生成
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    GPUScanout *scanout = &gdev->scanouts[i];
+    if (scanout->edid_size == 0) {
+      drmModeModeInfo mode;
+      virtio_gpu_default_mode(&mode, scanout->display_width,
+                              scanout->display_height);
+      scanout->edid_size = virtio_gpu_edid_generate(scanout->edid, &mode, 1, 0,
+                                                    0);
     }
-    drmModeFreeConnector(connector);
   }
 
-  if (!connector || connector->connection != DRM_MODE_CONNECTED) {
-    log_error("%s cannot find a connector", __func__);
-    drmModeFreeResources(res);
-    close(drm_fd);
-    return -1;
+  // 记录在工作线程启动前打开，第一个命令也能被记录
+  if (gdev->trace_path[0] != '\0') {
+    gdev->trace = virtio_gpu_trace_open(gdev->trace_path, vdev);
   }
 
-  // 获取encoder
-  drmModeEncoder *encoder = drmModeGetEncoder(drm_fd, connector->encoder_id);
-  if (!encoder) {
-    log_error("%s cannot get encoder", __func__);
-    drmModeFreeConnector(connector);
-    drmModeFreeResources(res);
-    close(drm_fd);
-    return -1;
-  }
+  // 分担大区域拷贝和格式转换的线程
+  virtio_gpu_blit_pool_init();
 
-  // 获取CRTC
-  drmModeCrtc *crtc = drmModeGetCrtc(drm_fd, encoder->crtc_id);
-  if (!crtc) {
-    log_error("%s cannot get CRTC", __func__);
-    drmModeFreeEncoder(encoder);
-    drmModeFreeConnector(connector);
-    drmModeFreeResources(res);
-    close(drm_fd);
+  // async
+  if (virtio_gpu_async_init(vdev) != 0) {
     return -1;
   }
-  // drmModeModeInfo mode = connector->modes[0];
-
-  gdev->scanouts[0].card0_fd = drm_fd;
-  gdev->scanouts[0].crtc = crtc;
-  gdev->scanouts[0].connector = connector;
-  gdev->scanouts[0].encoder = encoder;
-
-  ///
-  log_debug("%s set scanout[0] card0_fd %d", __func__, drm_fd);
-  log_debug("%s set scanout[0] crtc %x with id %d", __func__, crtc,
-            crtc->crtc_id);
-  log_debug("%s set scanout[0] connector %x with id %d", __func__, connector,
-            connector->connector_id);
-  log_debug("%s get scanout[0] connector mode hdisplay: %d, vdisplay: %d",
-            __func__, connector->modes[0].hdisplay,
-            connector->modes[0].vdisplay);
-  log_debug("%s set scanout[0] encoder %x", __func__, encoder);
-  ///
-
-  gdev->scanouts[0].width = connector->modes[0].hdisplay;
-  gdev->scanouts[0].height = connector->modes[0].vdisplay;
-
-  // async
-  pthread_create(&gdev->gpu_thread, NULL, virtio_gpu_handler, vdev);
-  pthread_cond_init(&gdev->gpu_cond, NULL);
-  pthread_mutex_init(&gdev->queue_mutex, NULL);
-
+  // 只有virglrenderer可用时才让驱动使用3D命令
+  if (gdev->virgl) {
+    vdev->regs.dev_feature |= GPU_VIRGL_FEATURES;
+    log_info("virtio gpu supports 3d commands with %d capsets",
+             gdev->config.num_capsets);
+  }
   return 0;
 }
 
 void virtio_gpu_close(VirtIODevice *vdev) {
   log_info("virtio_gpu close");
 
-  // 回收scanouts相关内存
   GPUDev *gdev = (GPUDev *)vdev->dev;
-  for (int i = 0; i < gdev->scanouts_num; ++i) {
+
+  // 先结束正在执行命令的线程，并回收命令队列内存
+  virtio_gpu_async_close(vdev);
+  virtio_gpu_blit_pool_destroy();
+  virtio_gpu_trace_close(gdev->trace);
+
+  // 回收scanouts相关内存
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    if (gdev->scanouts[i].paced_flushes != 0) {
+      log_info("virtio gpu scanout %d merged %lu flushes into later frames", i,
+               gdev->scanouts[i].paced_flushes);
+    }
     free(gdev->scanouts[i].current_cursor);
+    virtio_gpu_cursor_release(&gdev->scanouts[i]);
 
     virtio_gpu_remove_drm_framebuffer(&gdev->scanouts[i]);
+    virtio_gpu_fb_cache_release(&gdev->scanouts[i]);
 
-    drmModeFreeCrtc(gdev->scanouts[i].crtc);
-    drmModeFreeEncoder(gdev->scanouts[i].encoder);
-    drmModeFreeConnector(gdev->scanouts[i].connector);
+    pthread_mutex_destroy(&gdev->scanouts[i].flip_mutex);
+    pthread_cond_destroy(&gdev->scanouts[i].flip_cond);
+  }
 
-    // 释放card0_fd
-    if (gdev->scanouts[i].card0_fd != -1) {
-      close(gdev->scanouts[i].card0_fd);
-    }
+  // 释放显示后端打开的设备
+  if (gdev->backend != NULL) {
+    gdev->backend->close(gdev);
   }
 
   // 回收resource相关内存
   while (!TAILQ_EMPTY(&gdev->resource_list)) {
     GPUSimpleResource *temp = TAILQ_FIRST(&gdev->resource_list);
     TAILQ_REMOVE(&gdev->resource_list, temp, next);
+    // virglrenderer已经随virgl线程退出而清理
+    free(temp->iov);
+    free(temp->iov_offsets);
+    free(temp->virgl_iov);
+    free(temp->shadow);
     free(temp);
   }
-
-  // 回收命令队列内存
-  while (!TAILQ_EMPTY(&gdev->command_queue)) {
-    GPUCommand *temp = TAILQ_FIRST(&gdev->command_queue);
-    TAILQ_REMOVE(&gdev->command_queue, temp, next);
-    free(temp);
-  }
-
-  // 回收async部分
-  gdev->close = true;
-  pthread_cond_signal(&gdev->gpu_cond);
-  pthread_join(gdev->gpu_thread, NULL);
+  free(gdev->resource_table.slots);
+  gdev->resource_table.slots = NULL;
+  gdev->last_resource = NULL;
+
+  log_info("virtio gpu of zone %d hostmem peak %lu of %lu bytes, %lu "
+           "allocations over budget, swapchain cache %lu hits %lu misses %lu "
+           "evictions",
+           vdev->zone_id, gdev->mem_stats.peak, gdev->hostmem_budget,
+           gdev->mem_stats.oom, gdev->mem_stats.cache_hits,
+           gdev->mem_stats.cache_misses, gdev->mem_stats.evictions);
+
+  // 翻页事件可能在移除framebuffer时到达，最后再销毁唤醒调度线程用的锁
   pthread_cond_destroy(&gdev->gpu_cond);
+  pthread_cond_destroy(&gdev->worker_cond);
+  pthread_cond_destroy(&gdev->virgl_cond);
   pthread_mutex_destroy(&gdev->queue_mutex);
 
   free(gdev);
@@ -221,6 +256,19 @@ void virtio_gpu_close(VirtIODevice *vdev) {
   free(vdev);
 }
 
+void virtio_gpu_config_write(VirtIODevice *vdev, uint64_t offset,
+                             uint64_t value, unsigned size) {
+  GPUDev *gdev = vdev->dev;
+
+  // 只有events_clear可写，写入的位从events_read中清除
+  if (offset != offsetof(GPUConfig, events_clear) || size != 4) {
+    log_error("%s config offset %#lx is read-only", __func__, offset);
+    return;
+  }
+  __atomic_and_fetch(&gdev->config.events_read, ~(uint32_t)value,
+                     __ATOMIC_RELAXED);
+}
+
 void virtio_gpu_reset(GPUDev *gdev) {
   // TODO(root):
   for (int i = 0; i < HVISOR_VIRTIO_GPU_MAX_SCANOUTS; ++i) {
@@ -263,6 +311,8 @@ int virtio_gpu_ctrl_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
 int virtio_gpu_cursor_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
   log_debug("entering %s", __func__);
 
+  GPUDev *gdev = vdev->dev;
+
   virtqueue_disable_notify(vq);
   while (!virtqueue_is_empty(vq)) {
     int err = virtio_gpu_handle_single_request(vdev, vq, GPU_CURSOR_QUEUE);
@@ -274,7 +324,10 @@ int virtio_gpu_cursor_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
   }
   virtqueue_enable_notify(vq);
 
-  virtio_inject_irq(vq);
+  // 光标命令由调度线程立刻处理，处理完再通知前端
+  pthread_mutex_lock(&gdev->queue_mutex);
+  pthread_cond_signal(&gdev->gpu_cond);
+  pthread_mutex_unlock(&gdev->queue_mutex);
 
   return 0;
 }
@@ -332,7 +385,11 @@ int virtio_gpu_handle_single_request(VirtIODevice *vdev, VirtQueue *vq,
 
   // 加入命令队列
   pthread_mutex_lock(&gdev->queue_mutex);
-  TAILQ_INSERT_TAIL(&gdev->command_queue, gcmd, next);
+  if (from == GPU_CURSOR_QUEUE) {
+    TAILQ_INSERT_TAIL(&gdev->cursor_queue, gcmd, next);
+  } else {
+    TAILQ_INSERT_TAIL(&gdev->command_queue, gcmd, next);
+  }
   pthread_mutex_unlock(&gdev->queue_mutex);
 
   free(flags);
@@ -0,0 +1,365 @@
+#include "log.h"
+#include "virtio_gpu.h"
+#include <drm/drm_fourcc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+// 每种重排下，16字节(4个像素)中输出的每个字节来自输入的哪个字节
+static const uint8_t swizzle_tables[][16] = {
+    [GPU_SWIZZLE_NONE] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+                          15},
+    [GPU_SWIZZLE_SWAP_RB] = {2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12,
+                             15},
+    [GPU_SWIZZLE_REVERSE] = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13,
+                             12},
+    [GPU_SWIZZLE_ROTATE] = {1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15,
+                            12},
+};
+
+// 大区域的拷贝按行切分，由这些线程和提交拷贝的线程一起完成
+// 同一时间只处理一个任务，多个工作线程同时提交时，后来者自己完成拷贝
+static struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t work_cond; // 有新的任务，或者需要退出
+  pthread_cond_t done_cond; // 任务的所有部分都已完成
+  pthread_t threads[VIRTIO_GPU_BLIT_MAX_THREADS];
+  int nr_threads;
+  GPUBlit *blit;       // 当前的任务，NULL表示没有
+  uint32_t bands;      // 任务被切分成的部分数
+  uint32_t next_band;  // 下一个还没有线程处理的部分
+  uint32_t done_bands; // 已完成的部分数
+  bool stop;
+} blit_pool = {.mtx = PTHREAD_MUTEX_INITIALIZER,
+               .work_cond = PTHREAD_COND_INITIALIZER,
+               .done_cond = PTHREAD_COND_INITIALIZER};
+
+uint32_t virtio_gpu_drm_format(uint32_t format) {
+  // virtio gpu的格式按字节在内存中的顺序命名
+  // 而drm的格式按小端序下32位整数从高到低的顺序命名
+  switch (format) {
+  case VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM:
+    return DRM_FORMAT_XRGB8888;
+  case VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM:
+    return DRM_FORMAT_ARGB8888;
+  case VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM:
+    return DRM_FORMAT_BGRX8888;
+  case VIRTIO_GPU_FORMAT_A8R8G8B8_UNORM:
+    return DRM_FORMAT_BGRA8888;
+  case VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM:
+    return DRM_FORMAT_XBGR8888;
+  case VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM:
+    return DRM_FORMAT_ABGR8888;
+  case VIRTIO_GPU_FORMAT_X8B8G8R8_UNORM:
+    return DRM_FORMAT_RGBX8888;
+  case VIRTIO_GPU_FORMAT_A8B8G8R8_UNORM:
+    return DRM_FORMAT_RGBA8888;
+  default:
+    return 0; // 未知格式
+  }
+}
+
+uint32_t virtio_gpu_format_bpp(uint32_t format) {
+  switch (format) {
+  case VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM:
+  case VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM:
+  case VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM:
+  case VIRTIO_GPU_FORMAT_A8R8G8B8_UNORM:
+  case VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM:
+  case VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM:
+  case VIRTIO_GPU_FORMAT_X8B8G8R8_UNORM:
+  case VIRTIO_GPU_FORMAT_A8B8G8R8_UNORM:
+    return 32;
+  default:
+    return 0; // 未知格式
+  }
+}
+
+GPUSwizzle virtio_gpu_swizzle_to_xrgb(uint32_t format) {
+  // XRGB8888在内存中为B、G、R、X，alpha通道直接忽略
+  switch (format) {
+  case VIRTIO_GPU_FORMAT_R8G8B8X8_UNORM:
+  case VIRTIO_GPU_FORMAT_R8G8B8A8_UNORM:
+    return GPU_SWIZZLE_SWAP_RB;
+  case VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM:
+  case VIRTIO_GPU_FORMAT_A8R8G8B8_UNORM:
+    return GPU_SWIZZLE_REVERSE;
+  case VIRTIO_GPU_FORMAT_X8B8G8R8_UNORM:
+  case VIRTIO_GPU_FORMAT_A8B8G8R8_UNORM:
+    return GPU_SWIZZLE_ROTATE;
+  default:
+    return GPU_SWIZZLE_NONE;
+  }
+}
+
+// 重排n个像素，每次用向量指令处理4个像素
+static void blit_swizzle(uint8_t *dst, const uint8_t *src, uint32_t n,
+                         GPUSwizzle swizzle) {
+  const uint8_t *t = swizzle_tables[swizzle];
+  uint32_t i = 0;
+
+#if defined(__aarch64__)
+  uint8x16_t tbl = vld1q_u8(t);
+  for (; i + 4 <= n; i += 4) {
+    vst1q_u8(dst + i * 4, vqtbl1q_u8(vld1q_u8(src + i * 4), tbl));
+  }
+#elif defined(__SSSE3__)
+  __m128i tbl = _mm_loadu_si128((const __m128i *)t);
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+    _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_shuffle_epi8(v, tbl));
+  }
+#endif
+
+  for (; i < n; i++) {
+    dst[i * 4] = src[i * 4 + t[0]];
+    dst[i * 4 + 1] = src[i * 4 + t[1]];
+    dst[i * 4 + 2] = src[i * 4 + t[2]];
+    dst[i * 4 + 3] = src[i * 4 + t[3]];
+  }
+}
+
+uint64_t *virtio_gpu_iov_index(const struct iovec *iov, unsigned int iov_cnt) {
+  uint64_t *offsets = NULL;
+  uint64_t offset = 0;
+
+  // 内存块很少时顺序查找已经足够快
+  if (iov_cnt <= VIRTIO_GPU_IOV_INDEX_MIN) {
+    return NULL;
+  }
+  offsets = malloc(sizeof(*offsets) * iov_cnt);
+  if (offsets == NULL) {
+    log_warn("%s cannot alloc index of %d iovs", __func__, iov_cnt);
+    return NULL;
+  }
+  for (unsigned int i = 0; i < iov_cnt; ++i) {
+    offsets[i] = offset;
+    offset += iov[i].iov_len;
+  }
+  return offsets;
+}
+
+unsigned int virtio_gpu_iov_find(const uint64_t *offsets,
+                                 const struct iovec *iov, unsigned int iov_cnt,
+                                 uint64_t offset) {
+  unsigned int lo = 0, hi = iov_cnt;
+
+  if (iov_cnt == 0 ||
+      offset >= offsets[iov_cnt - 1] + iov[iov_cnt - 1].iov_len) {
+    return iov_cnt;
+  }
+  // 找到最后一个起始偏移不大于offset的iov
+  while (hi - lo > 1) {
+    unsigned int mid = lo + (hi - lo) / 2;
+    if (offsets[mid] <= offset) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// 在iov中定位offset，返回其地址，avail为该iov中之后的连续字节数
+// idx和base(iov[idx]的起始偏移)记录上次的位置，offset递增时不需要从头查找
+// 有索引时，跳过的不止下一个内存块就直接二分查找
+static uint8_t *blit_locate(const GPUBlit *blit, uint64_t offset,
+                            unsigned int *idx, uint64_t *base, size_t *avail) {
+  if (blit->iov_offsets != NULL && *idx + 1 < blit->iov_cnt &&
+      offset >= blit->iov_offsets[*idx + 1] + blit->iov[*idx + 1].iov_len) {
+    *idx = virtio_gpu_iov_find(blit->iov_offsets, blit->iov, blit->iov_cnt,
+                               offset);
+    if (*idx >= blit->iov_cnt) {
+      return NULL;
+    }
+    *base = blit->iov_offsets[*idx];
+  }
+  while (*idx < blit->iov_cnt &&
+         offset >= *base + blit->iov[*idx].iov_len) {
+    *base += blit->iov[*idx].iov_len;
+    (*idx)++;
+  }
+  if (*idx >= blit->iov_cnt) {
+    return NULL;
+  }
+  *avail = *base + blit->iov[*idx].iov_len - offset;
+  return (uint8_t *)blit->iov[*idx].iov_base + (offset - *base);
+}
+
+// 从blit_locate找到的位置开始拷贝n字节，跨越内存块时接着拷贝之后的内存块
+static size_t blit_gather(const GPUBlit *blit, unsigned int idx, uint64_t base,
+                          uint64_t offset, uint8_t *dst, size_t n) {
+  size_t done = 0;
+
+  for (; idx < blit->iov_cnt && done < n;
+       base += blit->iov[idx].iov_len, idx++) {
+    size_t skip = offset + done - base;
+    size_t len = MIN(blit->iov[idx].iov_len - skip, n - done);
+    memcpy(dst + done, (uint8_t *)blit->iov[idx].iov_base + skip, len);
+    done += len;
+  }
+  return done;
+}
+
+// 拷贝区域中[y0, y1)的行
+static void blit_rows(const GPUBlit *blit, uint32_t y0, uint32_t y1) {
+  size_t row_bytes = (size_t)blit->width * VIRTIO_GPU_BYTES_PP;
+  unsigned int idx = 0;
+  uint64_t base = 0;
+  uint8_t *bounce = NULL;
+  size_t avail = 0;
+
+  if (y0 >= y1) {
+    return;
+  }
+
+  if (blit->swizzle == GPU_SWIZZLE_NONE && row_bytes == blit->src_stride &&
+      blit->src_stride == blit->dst_stride) {
+    // 整行且两边stride相同，一次拷贝完成
+    uint64_t offset = blit->src_offset + (uint64_t)blit->src_stride * y0;
+    if (blit_locate(blit, offset, &idx, &base, &avail) == NULL ||
+        blit_gather(blit, idx, base, offset,
+                    blit->dst + (size_t)blit->dst_stride * y0,
+                    row_bytes * (y1 - y0)) != row_bytes * (y1 - y0)) {
+      log_error("%s rows %d-%d are outside of resource backing", __func__, y0,
+                y1);
+    }
+    return;
+  }
+
+  for (uint32_t y = y0; y < y1; y++) {
+    uint64_t offset = blit->src_offset + (uint64_t)blit->src_stride * y;
+    uint8_t *dst = blit->dst + (size_t)blit->dst_stride * y;
+    uint8_t *src = blit_locate(blit, offset, &idx, &base, &avail);
+
+    if (src == NULL) {
+      log_error("%s row %d is outside of resource backing", __func__, y);
+      break;
+    }
+    if (avail < row_bytes) {
+      // 该行跨越了guest内存块的边界
+      if (blit->swizzle == GPU_SWIZZLE_NONE) {
+        blit_gather(blit, idx, base, offset, dst, row_bytes);
+        continue;
+      }
+      if (bounce == NULL && (bounce = malloc(row_bytes)) == NULL) {
+        log_error("%s cannot alloc bounce buffer", __func__);
+        break;
+      }
+      blit_gather(blit, idx, base, offset, bounce, row_bytes);
+      src = bounce;
+    }
+
+    if (blit->swizzle == GPU_SWIZZLE_NONE) {
+      memcpy(dst, src, row_bytes);
+    } else {
+      blit_swizzle(dst, src, blit->width, blit->swizzle);
+    }
+  }
+  free(bounce);
+}
+
+// 处理当前任务的下一部分，调用者需持有blit_pool.mtx
+static void blit_pool_run_band(void) {
+  GPUBlit *blit = blit_pool.blit;
+  uint32_t band = blit_pool.next_band++;
+  uint32_t bands = blit_pool.bands;
+
+  pthread_mutex_unlock(&blit_pool.mtx);
+  blit_rows(blit, (uint64_t)blit->height * band / bands,
+            (uint64_t)blit->height * (band + 1) / bands);
+  pthread_mutex_lock(&blit_pool.mtx);
+
+  if (++blit_pool.done_bands == bands) {
+    pthread_cond_signal(&blit_pool.done_cond);
+  }
+}
+
+static void *blit_worker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&blit_pool.mtx);
+  while (!blit_pool.stop) {
+    if (blit_pool.blit != NULL && blit_pool.next_band < blit_pool.bands) {
+      blit_pool_run_band();
+      continue;
+    }
+    pthread_cond_wait(&blit_pool.work_cond, &blit_pool.mtx);
+  }
+  pthread_mutex_unlock(&blit_pool.mtx);
+  return NULL;
+}
+
+int virtio_gpu_blit_pool_init(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int nr = cpus > 1 ? MIN(cpus - 1, VIRTIO_GPU_BLIT_MAX_THREADS) : 0;
+
+  pthread_mutex_lock(&blit_pool.mtx);
+  blit_pool.stop = false;
+  while (blit_pool.nr_threads < nr) {
+    if (pthread_create(&blit_pool.threads[blit_pool.nr_threads], NULL,
+                       blit_worker, NULL) != 0) {
+      log_warn("%s can only create %d blit threads", __func__,
+               blit_pool.nr_threads);
+      break;
+    }
+    blit_pool.nr_threads++;
+  }
+  pthread_mutex_unlock(&blit_pool.mtx);
+
+  log_info("virtio gpu uses %d blit threads", blit_pool.nr_threads);
+  return 0;
+}
+
+void virtio_gpu_blit_pool_destroy(void) {
+  pthread_mutex_lock(&blit_pool.mtx);
+  blit_pool.stop = true;
+  pthread_cond_broadcast(&blit_pool.work_cond);
+  pthread_mutex_unlock(&blit_pool.mtx);
+
+  for (int i = 0; i < blit_pool.nr_threads; ++i) {
+    pthread_join(blit_pool.threads[i], NULL);
+  }
+  blit_pool.nr_threads = 0;
+}
+
+void virtio_gpu_blit(GPUBlit *blit) {
+  uint64_t bytes =
+      (uint64_t)blit->width * VIRTIO_GPU_BYTES_PP * blit->height;
+  uint32_t bands = 1;
+
+  if (bytes >= VIRTIO_GPU_BLIT_PARALLEL_BYTES) {
+    bands = MIN((uint32_t)blit_pool.nr_threads + 1, blit->height);
+  }
+  if (bands <= 1) {
+    blit_rows(blit, 0, blit->height);
+    return;
+  }
+
+  pthread_mutex_lock(&blit_pool.mtx);
+  if (blit_pool.blit != NULL) {
+    // 其他工作线程的拷贝正在使用这些线程
+    pthread_mutex_unlock(&blit_pool.mtx);
+    blit_rows(blit, 0, blit->height);
+    return;
+  }
+  blit_pool.blit = blit;
+  blit_pool.bands = bands;
+  blit_pool.next_band = 0;
+  blit_pool.done_bands = 0;
+  pthread_cond_broadcast(&blit_pool.work_cond);
+  // 调用者也处理一部分，而不是只等待
+  while (blit_pool.next_band < bands) {
+    blit_pool_run_band();
+  }
+  while (blit_pool.done_bands < bands) {
+    pthread_cond_wait(&blit_pool.done_cond, &blit_pool.mtx);
+  }
+  blit_pool.blit = NULL;
+  pthread_mutex_unlock(&blit_pool.mtx);
+}
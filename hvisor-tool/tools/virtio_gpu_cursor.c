@@ -0,0 +1,119 @@
+#include "log.h"
+#include "virtio.h"
+#include "virtio_gpu.h"
+#include <stdlib.h>
+#include <string.h>
+
+// 将resource的图像拷贝到光标平面并显示
+// 光标平面使用ARGB8888，超出显示后端支持大小的部分被裁掉
+static void virtio_gpu_cursor_set_image(VirtIODevice *vdev,
+                                        GPUScanout *scanout,
+                                        GPUUpdateCursor *cursor) {
+  const GPUDisplayBackend *backend = scanout->gdev->backend;
+  GPUSimpleResource *res = NULL;
+  GPUBlit blit;
+
+  res = virtio_gpu_check_resource(vdev, cursor->resource_id, __func__, NULL);
+  if (!res) {
+    return;
+  }
+  if (virtio_gpu_drm_format(res->format) == 0) {
+    log_error("%s found cursor resource %d has unsupported format %d",
+              __func__, res->resource_id, res->format);
+    return;
+  }
+  if (scanout->cursor_addr == NULL && backend->cursor_create(scanout) < 0) {
+    return;
+  }
+
+  // 小于光标平面的图像，其余部分透明
+  memset(scanout->cursor_addr, 0, scanout->cursor_size);
+  blit.iov = res->iov;
+  blit.iov_cnt = res->iov_cnt;
+  blit.iov_offsets = res->iov_offsets;
+  blit.src_offset = res->blob_offset;
+  blit.src_stride = res->stride;
+  blit.dst = scanout->cursor_addr;
+  blit.dst_stride = scanout->cursor_pitch;
+  blit.width = MIN(res->width, scanout->cursor_width);
+  blit.height = MIN(res->height, scanout->cursor_height);
+  // 重排后alpha通道在最高字节，即ARGB8888
+  blit.swizzle = virtio_gpu_swizzle_to_xrgb(res->format);
+  virtio_gpu_blit(&blit);
+
+  if (backend->cursor_show(scanout, cursor->hot_x, cursor->hot_y) < 0) {
+    return;
+  }
+  scanout->cursor_visible = true;
+
+  log_debug("%s set cursor of scanout %d to resource %d, hot (%d, %d)",
+            __func__, cursor->pos.scanout_id, res->resource_id, cursor->hot_x,
+            cursor->hot_y);
+}
+
+void virtio_gpu_process_cursor(VirtIODevice *vdev, GPUCommand *gcmd) {
+  GPUDev *gdev = vdev->dev;
+  GPUScanout *scanout = NULL;
+  GPUUpdateCursor cursor;
+  VirtQueue *vq = &vdev->vqs[gcmd->from_queue];
+
+  virtio_gpu_trace_cmd(gdev->trace, gcmd);
+  if (iov_to_buf(gcmd->resp_iov, gcmd->resp_iov_cnt, 0, &cursor,
+                 sizeof(cursor)) != sizeof(cursor)) {
+    log_error("%s cannot fill virtio gpu cursor command with input!",
+              __func__);
+    goto out;
+  }
+  if (cursor.pos.scanout_id >= gdev->scanouts_num) {
+    log_error("%s invalid scanout id %d", __func__, cursor.pos.scanout_id);
+    goto out;
+  }
+  scanout = &gdev->scanouts[cursor.pos.scanout_id];
+  if (gdev->backend->cursor_create == NULL) {
+    // 显示后端没有光标平面，光标由guest画在画面中
+    goto out;
+  }
+
+  switch (cursor.hdr.type) {
+  case VIRTIO_GPU_CMD_UPDATE_CURSOR:
+    if (cursor.resource_id == 0) {
+      // resource_id为0表示隐藏光标
+      gdev->backend->cursor_hide(scanout);
+      scanout->cursor_visible = false;
+    } else {
+      virtio_gpu_cursor_set_image(vdev, scanout, &cursor);
+    }
+    break;
+  case VIRTIO_GPU_CMD_MOVE_CURSOR:
+    break;
+  default:
+    log_error("%s unknown cursor request type %#x", __func__, cursor.hdr.type);
+    goto out;
+  }
+
+  if (scanout->cursor_visible) {
+    gdev->backend->cursor_move(scanout, cursor.pos.x, cursor.pos.y);
+  }
+  scanout->cursor = cursor;
+
+out:
+  // cursorq的命令没有响应，只需要归还描述符
+  pthread_mutex_lock(&vq->used_ring_lock);
+  update_used_ring(vq, gcmd->resp_idx, 0);
+  pthread_mutex_unlock(&vq->used_ring_lock);
+  free(gcmd->resp_iov);
+  gcmd->resp_iov = NULL;
+}
+
+void virtio_gpu_cursor_release(GPUScanout *scanout) {
+  if (scanout->cursor_addr == NULL) {
+    return;
+  }
+
+  scanout->gdev->backend->cursor_destroy(scanout);
+
+  scanout->cursor_addr = NULL;
+  scanout->cursor_handle = 0;
+  scanout->cursor_size = 0;
+  scanout->cursor_visible = false;
+}
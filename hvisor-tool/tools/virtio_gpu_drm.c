@@ -0,0 +1,750 @@
+#include "event_monitor.h"
+#include "log.h"
+#include "virtio.h"
+#include "virtio_gpu.h"
+#include <drm/drm.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_mode.h>
+#include <fcntl.h>
+#include <linux/netlink.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+// connector是否已经被前scanout_id个scanout使用
+static bool virtio_gpu_connector_used(GPUDev *gdev, int scanout_id,
+                                      uint32_t connector_id) {
+  for (int i = 0; i < scanout_id; ++i) {
+    if (gdev->scanouts[i].connector->connector_id == connector_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// CRTC是否已经被前scanout_id个scanout使用
+static bool virtio_gpu_crtc_used(GPUDev *gdev, int scanout_id,
+                                 uint32_t crtc_id) {
+  for (int i = 0; i < scanout_id; ++i) {
+    if (gdev->scanouts[i].crtc->crtc_id == crtc_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 为scanout选择connector
+// json指定了connector时使用指定的，否则使用第一个空闲的已连接connector
+static drmModeConnector *virtio_gpu_pick_connector(GPUDev *gdev,
+                                                   int scanout_id,
+                                                   drmModeRes *res) {
+  uint32_t wanted = gdev->requested_states[scanout_id].connector_id;
+  drmModeConnector *connector = NULL;
+
+  for (int i = 0; i < res->count_connectors; ++i) {
+    if ((wanted != 0 && res->connectors[i] != wanted) ||
+        virtio_gpu_connector_used(gdev, scanout_id, res->connectors[i])) {
+      continue;
+    }
+    connector = drmModeGetConnector(gdev->card_fd, res->connectors[i]);
+    if (connector && connector->connection == DRM_MODE_CONNECTED &&
+        connector->count_modes > 0) {
+      return connector;
+    }
+    drmModeFreeConnector(connector);
+  }
+
+  if (wanted != 0) {
+    log_error("connector %d of scanout %d is not connected or already used",
+              wanted, scanout_id);
+  }
+  return NULL;
+}
+
+// 为connector选择一个encoder和空闲的CRTC
+// 优先使用connector当前的encoder和CRTC，避免重新设置显示模式
+static int virtio_gpu_pick_crtc(GPUDev *gdev, int scanout_id, drmModeRes *res,
+                                drmModeConnector *connector,
+                                drmModeEncoder **encoder, drmModeCrtc **crtc) {
+  drmModeEncoder *enc = NULL;
+
+  if (connector->encoder_id != 0) {
+    enc = drmModeGetEncoder(gdev->card_fd, connector->encoder_id);
+    if (enc && enc->crtc_id != 0 &&
+        !virtio_gpu_crtc_used(gdev, scanout_id, enc->crtc_id)) {
+      *crtc = drmModeGetCrtc(gdev->card_fd, enc->crtc_id);
+      if (*crtc) {
+        *encoder = enc;
+        return 0;
+      }
+    }
+    drmModeFreeEncoder(enc);
+  }
+
+  for (int i = 0; i < connector->count_encoders; ++i) {
+    enc = drmModeGetEncoder(gdev->card_fd, connector->encoders[i]);
+    if (!enc) {
+      continue;
+    }
+    for (int j = 0; j < res->count_crtcs; ++j) {
+      if (!(enc->possible_crtcs & (1 << j)) ||
+          virtio_gpu_crtc_used(gdev, scanout_id, res->crtcs[j])) {
+        continue;
+      }
+      *crtc = drmModeGetCrtc(gdev->card_fd, res->crtcs[j]);
+      if (*crtc) {
+        *encoder = enc;
+        return 0;
+      }
+    }
+    drmModeFreeEncoder(enc);
+  }
+  return -1;
+}
+
+// 按模式的刷新率设置scanout的刷新周期，一个周期内的flush合并为一次显示
+static void virtio_gpu_drm_update_refresh(GPUScanout *scanout,
+                                          drmModeModeInfo *mode) {
+  uint32_t refresh = mode->vrefresh ? mode->vrefresh
+                                    : VIRTIO_GPU_DEFAULT_REFRESH;
+  scanout->frame_ns = 1000000000ULL / refresh;
+}
+
+// 优先使用显示器提供的EDID，没有时(如vkms)按connector的模式列表生成
+static void virtio_gpu_drm_update_edid(GPUDev *gdev, GPUScanout *scanout,
+                                       drmModeConnector *connector) {
+  scanout->edid_size = 0;
+  for (int i = 0; i < connector->count_props; ++i) {
+    drmModePropertyPtr prop = drmModeGetProperty(gdev->card_fd,
+                                                 connector->props[i]);
+    if (prop == NULL) {
+      continue;
+    }
+    if (strcmp(prop->name, "EDID") == 0 && connector->prop_values[i] != 0) {
+      drmModePropertyBlobPtr blob =
+          drmModeGetPropertyBlob(gdev->card_fd, connector->prop_values[i]);
+      // 超出virtio_gpu_resp_edid的扩展block被丢弃
+      if (blob != NULL && blob->length >= VIRTIO_GPU_EDID_BLOCK_SIZE) {
+        scanout->edid_size = MIN(blob->length, VIRTIO_GPU_EDID_MAX_SIZE);
+        memcpy(scanout->edid, blob->data, scanout->edid_size);
+      }
+      drmModeFreePropertyBlob(blob);
+    }
+    drmModeFreeProperty(prop);
+  }
+
+  if (scanout->edid_size == 0) {
+    scanout->edid_size = virtio_gpu_edid_generate(
+        scanout->edid, connector->modes, connector->count_modes,
+        connector->mmWidth, connector->mmHeight);
+  }
+}
+
+// 为scanout设置其connector、encoder和CRTC
+static int virtio_gpu_init_scanout(GPUDev *gdev, int scanout_id,
+                                   drmModeRes *res) {
+  GPUScanout *scanout = &gdev->scanouts[scanout_id];
+  drmModeConnector *connector = NULL;
+  drmModeEncoder *encoder = NULL;
+  drmModeCrtc *crtc = NULL;
+
+  // 获取connector
+  connector = virtio_gpu_pick_connector(gdev, scanout_id, res);
+  if (!connector) {
+    log_error("%s cannot find a connector for scanout %d", __func__,
+              scanout_id);
+    return -1;
+  }
+
+  // 获取encoder和CRTC
+  if (virtio_gpu_pick_crtc(gdev, scanout_id, res, connector, &encoder, &crtc) <
+      0) {
+    log_error("%s cannot find a free CRTC for scanout %d", __func__,
+              scanout_id);
+    drmModeFreeConnector(connector);
+    return -1;
+  }
+
+  scanout->card0_fd = gdev->card_fd;
+  scanout->crtc = crtc;
+  scanout->connector = connector;
+  scanout->encoder = encoder;
+
+  ///
+  log_debug("%s set scanout[%d] crtc %x with id %d", __func__, scanout_id,
+            crtc, crtc->crtc_id);
+  log_debug("%s set scanout[%d] connector %x with id %d", __func__,
+            scanout_id, connector, connector->connector_id);
+  log_debug("%s get scanout[%d] connector mode hdisplay: %d, vdisplay: %d",
+            __func__, scanout_id, connector->modes[0].hdisplay,
+            connector->modes[0].vdisplay);
+  log_debug("%s set scanout[%d] encoder %x", __func__, scanout_id, encoder);
+  ///
+
+  scanout->width = connector->modes[0].hdisplay;
+  scanout->height = connector->modes[0].vdisplay;
+  scanout->display_width = scanout->width;
+  scanout->display_height = scanout->height;
+  scanout->connected = true;
+  virtio_gpu_drm_update_refresh(scanout, &connector->modes[0]);
+  virtio_gpu_drm_update_edid(gdev, scanout, connector);
+  return 0;
+}
+
+// 释放scanout的connector、encoder和CRTC
+static void virtio_gpu_release_scanout(GPUScanout *scanout) {
+  drmModeFreeCrtc(scanout->crtc);
+  drmModeFreeEncoder(scanout->encoder);
+  drmModeFreeConnector(scanout->connector);
+  scanout->crtc = NULL;
+  scanout->encoder = NULL;
+  scanout->connector = NULL;
+  scanout->card0_fd = -1;
+}
+
+// 打开path并为所有scanout设置输出，失败时不保留任何资源
+static int virtio_gpu_drm_open_card(GPUDev *gdev, const char *path) {
+  drmModeRes *res = NULL;
+
+  gdev->card_fd = open(path, O_RDWR | O_CLOEXEC);
+  if (gdev->card_fd < 0) {
+    return -1;
+  }
+
+  // 获取drm资源
+  // 每个scanout需要获得设备的连接器(connector)、显示控制器(CRTC)、encoder
+  res = drmModeGetResources(gdev->card_fd);
+  if (!res) {
+    // 只能渲染的card没有显示资源
+    close(gdev->card_fd);
+    gdev->card_fd = -1;
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    if (virtio_gpu_init_scanout(gdev, i, res) < 0) {
+      for (uint32_t j = 0; j < i; ++j) {
+        virtio_gpu_release_scanout(&gdev->scanouts[j]);
+      }
+      drmModeFreeResources(res);
+      close(gdev->card_fd);
+      gdev->card_fd = -1;
+      return -1;
+    }
+  }
+  drmModeFreeResources(res);
+
+  log_info("virtio gpu drm backend uses %s", path);
+  return 0;
+}
+
+// page flip完成，交给交换链的状态机继续翻页
+static void virtio_gpu_page_flip_handler(int fd, unsigned int sequence,
+                                         unsigned int tv_sec,
+                                         unsigned int tv_usec,
+                                         void *user_data) {
+  (void)fd;
+  (void)sequence;
+  (void)tv_sec;
+  (void)tv_usec;
+  virtio_gpu_flip_done(user_data);
+}
+
+// drm fd可读时由epoll线程调用，处理page flip完成事件
+static void virtio_gpu_drm_event_handler(int fd, int epoll_type, void *param) {
+  (void)epoll_type;
+  (void)param;
+  drmEventContext ev = {0};
+  ev.version = DRM_EVENT_CONTEXT_VERSION;
+  ev.page_flip_handler = virtio_gpu_page_flip_handler;
+  if (drmHandleEvent(fd, &ev) != 0) {
+    log_error("%s failed to handle drm events", __func__);
+  }
+}
+
+// 重新读取各scanout的connector，连接状态或首选模式改变时通知前端
+static void virtio_gpu_drm_probe(GPUDev *gdev) {
+  bool changed = false;
+
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    GPUScanout *scanout = &gdev->scanouts[i];
+    drmModeConnector *connector =
+        drmModeGetConnector(gdev->card_fd, scanout->connector->connector_id);
+    if (connector == NULL) {
+      continue;
+    }
+    bool connected = connector->connection == DRM_MODE_CONNECTED &&
+                     connector->count_modes > 0;
+
+    pthread_mutex_lock(&scanout->flip_mutex);
+    if (connected != scanout->connected ||
+        (connected &&
+         (connector->modes[0].hdisplay != scanout->display_width ||
+          connector->modes[0].vdisplay != scanout->display_height))) {
+      changed = true;
+      scanout->connected = connected;
+      if (connected) {
+        scanout->display_width = connector->modes[0].hdisplay;
+        scanout->display_height = connector->modes[0].vdisplay;
+        virtio_gpu_drm_update_edid(gdev, scanout, connector);
+        virtio_gpu_drm_update_refresh(scanout, &connector->modes[0]);
+        // 下一次显示时以新的模式SetCrtc
+        scanout->crtc_fb_id = 0;
+      }
+      log_info("virtio gpu scanout %d is %s (%dx%d)", i,
+               connected ? "connected" : "disconnected",
+               scanout->display_width, scanout->display_height);
+    }
+    // SetCrtc使用connector中的模式，断开时保留原来的模式列表
+    if (connected) {
+      drmModeConnector *old = scanout->connector;
+      scanout->connector = connector;
+      connector = old;
+    }
+    pthread_mutex_unlock(&scanout->flip_mutex);
+    drmModeFreeConnector(connector);
+  }
+
+  if (changed) {
+    virtio_gpu_display_changed(gdev);
+  }
+}
+
+// 内核的uevent，每条消息由'\0'分隔的KEY=VALUE组成
+// drm设备的hotplug事件带有SUBSYSTEM=drm和HOTPLUG=1
+static void virtio_gpu_drm_uevent_handler(int fd, int epoll_type,
+                                          void *param) {
+  (void)epoll_type;
+  GPUDev *gdev = param;
+  char buf[4096];
+  bool hotplug = false;
+  ssize_t len;
+
+  while ((len = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+    bool drm = false, plug = false;
+    buf[len] = '\0';
+    for (char *p = buf; p < buf + len; p += strlen(p) + 1) {
+      if (strcmp(p, "SUBSYSTEM=drm") == 0) {
+        drm = true;
+      } else if (strcmp(p, "HOTPLUG=1") == 0) {
+        plug = true;
+      }
+    }
+    hotplug |= drm && plug;
+  }
+
+  if (hotplug) {
+    virtio_gpu_drm_probe(gdev);
+  }
+}
+
+// 监听内核的uevent，失败时显示设备的改变不会通知前端
+static void virtio_gpu_drm_open_uevent(GPUDev *gdev) {
+  struct sockaddr_nl addr = {
+      .nl_family = AF_NETLINK,
+      .nl_groups = 1, // 内核发出的uevent
+  };
+
+  gdev->uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                           NETLINK_KOBJECT_UEVENT);
+  if (gdev->uevent_fd < 0) {
+    log_warn("%s cannot create uevent socket, hotplug is ignored", __func__);
+    return;
+  }
+  if (bind(gdev->uevent_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    log_warn("%s cannot bind uevent socket, hotplug is ignored", __func__);
+    close(gdev->uevent_fd);
+    gdev->uevent_fd = -1;
+    return;
+  }
+  gdev->uevent_event = add_event(gdev->uevent_fd, EPOLLIN,
+                                 virtio_gpu_drm_uevent_handler, gdev);
+  if (gdev->uevent_event == NULL) {
+    log_warn("%s cannot monitor uevent socket, hotplug is ignored", __func__);
+    close(gdev->uevent_fd);
+    gdev->uevent_fd = -1;
+  }
+}
+
+static int virtio_gpu_drm_init(GPUDev *gdev) {
+  char path[PATH_MAX];
+
+  // 打开card，所有scanout共用
+  if (gdev->card_path[0] != '\0') {
+    if (virtio_gpu_drm_open_card(gdev, gdev->card_path) < 0) {
+      log_error("%s cannot use %s for %u scanouts", __func__, gdev->card_path,
+                gdev->scanouts_num);
+      return -1;
+    }
+  } else {
+    // 没有指定card时使用第一个能为所有scanout提供输出的card，包括vkms
+    for (int i = 0; i < VIRTIO_GPU_MAX_DRM_CARDS; ++i) {
+      snprintf(path, sizeof(path), "/dev/dri/card%d", i);
+      if (virtio_gpu_drm_open_card(gdev, path) == 0) {
+        break;
+      }
+    }
+    if (gdev->card_fd < 0) {
+      log_error("%s no drm card can drive %u scanouts", __func__,
+                gdev->scanouts_num);
+      return -1;
+    }
+  }
+
+  // page flip完成的事件通过drm fd送达，由epoll线程处理
+  // 事件中带有对应的scanout，各scanout的翻页互不等待
+  if (add_event(gdev->card_fd, EPOLLIN, virtio_gpu_drm_event_handler, NULL) ==
+      NULL) {
+    log_warn("%s cannot monitor drm events, page flip is disabled", __func__);
+    for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+      gdev->scanouts[i].page_flip = false;
+    }
+  }
+
+  virtio_gpu_drm_open_uevent(gdev);
+  return 0;
+}
+
+static void virtio_gpu_drm_close(GPUDev *gdev) {
+  if (gdev->uevent_fd != -1) {
+    del_event(gdev->uevent_event);
+    gdev->uevent_event = NULL;
+    close(gdev->uevent_fd);
+    gdev->uevent_fd = -1;
+  }
+
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    virtio_gpu_release_scanout(&gdev->scanouts[i]);
+  }
+
+  // 释放所有scanout共用的card
+  if (gdev->card_fd != -1) {
+    close(gdev->card_fd);
+    gdev->card_fd = -1;
+  }
+}
+
+// 创建一个dumb buffer并注册为drm framebuffer，参数来自fb
+static int virtio_gpu_drm_create_buffer(GPUScanout *scanout,
+                                        GPUFrameBuffer *fb, int index) {
+  int card_fd = scanout->card0_fd;
+  struct drm_mode_create_dumb dumb = {0};
+  struct drm_mode_map_dumb map = {0};
+  struct drm_mode_destroy_dumb destory = {0};
+  uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+  uint32_t fb_id = 0;
+
+  dumb.width = fb->width;
+  dumb.height = fb->height;
+  dumb.bpp = fb->bytes_pp * 8;
+
+  if (drmIoctl(card_fd, DRM_IOCTL_MODE_CREATE_DUMB, &dumb) < 0) {
+    log_error("%s failed to create a drm dumb", __func__);
+    return -1;
+  } // 创建一个dumb对象
+  destory.handle = dumb.handle;
+
+  map.handle = dumb.handle;
+  // 将显存与framebuffer绑定，根据handle获得offset
+  if (drmIoctl(card_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+    log_error("%s failed to map a drm dumb", __func__);
+    drmIoctl(card_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+    return -1;
+  }
+
+  handles[0] = dumb.handle;
+  pitches[0] = dumb.pitch;
+  // 优先使用resource自身的格式，拷贝时不需要转换
+  fb->drm_format = virtio_gpu_drm_format(fb->format);
+  fb->swizzle = GPU_SWIZZLE_NONE;
+  if (fb->drm_format == 0 ||
+      drmModeAddFB2(card_fd, dumb.width, dumb.height, fb->drm_format, handles,
+                    pitches, offsets, &fb_id, 0) < 0) {
+    // card不支持该格式，使用所有card都支持的XRGB8888，拷贝时转换
+    fb->drm_format = DRM_FORMAT_XRGB8888;
+    fb->swizzle = virtio_gpu_swizzle_to_xrgb(fb->format);
+    if (drmModeAddFB2(card_fd, dumb.width, dumb.height, fb->drm_format,
+                      handles, pitches, offsets, &fb_id, 0) < 0) {
+      log_error("%s failed to add a drm_framebuffer to card", __func__);
+      drmIoctl(card_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+      return -1;
+    }
+  }
+
+  void *vaddr = mmap(0, dumb.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     card_fd, map.offset);
+  if (vaddr == MAP_FAILED) {
+    log_error("%s cannot map drm_framebuffer of scanout", __func__);
+    drmModeRmFB(card_fd, fb_id);
+    drmIoctl(card_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+    return -1;
+  }
+
+  ///
+  log_debug("%s create drm_framebuffer %d with width: %d, height: %d, "
+            "format: %d, drm format: %#x, swizzle: %d, handle: %d, fb_id: %d, "
+            "mapped to %p",
+            __func__, index, dumb.width, dumb.height, fb->format,
+            fb->drm_format, fb->swizzle, dumb.handle, fb_id, vaddr);
+  ///
+
+  fb->fb_id = fb_id;
+  // dumb buffer的每行可能有对齐，其stride不一定等于resource的stride
+  fb->stride = dumb.pitch;
+  fb->drm_dumb_handle = dumb.handle;
+  fb->drm_dumb_size = dumb.size;
+  fb->fb_addr = vaddr;
+  return 0;
+}
+
+static void virtio_gpu_drm_destroy_buffer(GPUScanout *scanout,
+                                          GPUFrameBuffer *fb, int index) {
+  int card_fd = scanout->card0_fd;
+  struct drm_mode_destroy_dumb destory = {0};
+
+  if (!fb->enabled) {
+    return;
+  }
+
+  // CRTC会在移除正在显示的framebuffer时关闭，下一次显示时重新设置
+  if (scanout->crtc_fb_id == fb->fb_id) {
+    scanout->crtc_fb_id = 0;
+  }
+
+  destory.handle = fb->drm_dumb_handle;
+  drmModeRmFB(card_fd, fb->fb_id);
+  if (fb->fb_addr != NULL) {
+    munmap(fb->fb_addr, fb->drm_dumb_size);
+  }
+  drmIoctl(card_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+
+  log_debug("%s destoryed drm_framebuffer %d with id: %d, handle: %d, size: %d",
+            __func__, index, fb->fb_id, fb->drm_dumb_handle,
+            fb->drm_dumb_size);
+
+  fb->fb_id = 0;
+  fb->drm_dumb_handle = 0;
+  fb->drm_dumb_size = 0;
+  fb->fb_addr = NULL;
+  fb->enabled = false;
+  fb->damage_cnt = 0;
+}
+
+static uint32_t virtio_gpu_buffer_fb_id(GPUScanout *scanout, int buffer) {
+  if (buffer == VIRTIO_GPU_DIRECT_BUFFER) {
+    return scanout->direct_fb_id;
+  }
+  return scanout->swapchain[buffer].fb_id;
+}
+
+static int virtio_gpu_drm_show(GPUScanout *scanout, int buffer,
+                               drmModeClip *clips, uint32_t clips_cnt) {
+  uint32_t fb_id = virtio_gpu_buffer_fb_id(scanout, buffer);
+
+  if (scanout->crtc_fb_id != fb_id) {
+    // 第一次显示，或者不支持page flip，直接设置CRTC
+    drmModeModeInfo mode = scanout->connector->modes[0];
+    if (drmModeSetCrtc(scanout->card0_fd, scanout->crtc->crtc_id, fb_id,
+                       scanout->x, scanout->y,
+                       &scanout->connector->connector_id, 1, &mode) < 0) {
+      log_error("%s failed to set crtc %d with fb %d", __func__,
+                scanout->crtc->crtc_id, fb_id);
+      return -1;
+    }
+    scanout->crtc_fb_id = fb_id;
+    return 0;
+  }
+
+  if (clips_cnt > 0) {
+    // 对于需要手动刷新的显示设备，只通知更新的区域
+    // 直接扫描dumb buffer的设备不支持DirtyFB，忽略其错误
+    drmModeDirtyFB(scanout->card0_fd, fb_id, clips, clips_cnt);
+  }
+  return 0;
+}
+
+static int virtio_gpu_drm_flip(GPUScanout *scanout, int buffer) {
+  uint32_t fb_id = virtio_gpu_buffer_fb_id(scanout, buffer);
+
+  if (drmModePageFlip(scanout->card0_fd, scanout->crtc->crtc_id, fb_id,
+                      DRM_MODE_PAGE_FLIP_EVENT, scanout) < 0) {
+    log_debug("%s crtc %d failed to flip to fb %d", __func__,
+              scanout->crtc->crtc_id, fb_id);
+    return -1;
+  }
+  scanout->crtc_fb_id = fb_id;
+  return 0;
+}
+
+static void virtio_gpu_drm_blank(GPUScanout *scanout) {
+  if (scanout->crtc_fb_id == 0) {
+    return;
+  }
+  // 关闭CRTC，下一次显示时重新设置
+  if (drmModeSetCrtc(scanout->card0_fd, scanout->crtc->crtc_id, 0, 0, 0, NULL,
+                     0, NULL) < 0) {
+    log_warn("%s failed to disable crtc %d", __func__,
+             scanout->crtc->crtc_id);
+  }
+  scanout->crtc_fb_id = 0;
+}
+
+static int virtio_gpu_drm_import_dmabuf(GPUScanout *scanout,
+                                        GPUSimpleResource *res, int dmabuf_fd,
+                                        uint32_t offset) {
+  struct drm_gem_close gem_close = {0};
+  uint32_t format = virtio_gpu_drm_format(res->format);
+  uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+
+  // gem对象持有dma-buf的引用
+  if (drmPrimeFDToHandle(scanout->card0_fd, dmabuf_fd, &res->direct_handle) <
+      0) {
+    log_warn("%s card can't import backing of resource %d", __func__,
+             res->resource_id);
+    return -1;
+  }
+
+  // backing不一定从页首开始，offset为其在dma-buf中的偏移
+  handles[0] = res->direct_handle;
+  pitches[0] = res->stride;
+  offsets[0] = offset + res->blob_offset;
+  if (drmModeAddFB2(scanout->card0_fd, res->width, res->height, format,
+                    handles, pitches, offsets, &res->direct_fb_id, 0) < 0) {
+    log_warn("%s card can't scan out resource %d with format %d, pitch %d",
+             __func__, res->resource_id, res->format, pitches[0]);
+    gem_close.handle = res->direct_handle;
+    drmIoctl(scanout->card0_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+    res->direct_handle = 0;
+    res->direct_fb_id = 0;
+    return -1;
+  }
+  res->direct_card_fd = scanout->card0_fd;
+  return 0;
+}
+
+static void virtio_gpu_drm_release_dmabuf(GPUDev *gdev,
+                                          GPUSimpleResource *res) {
+  struct drm_gem_close gem_close = {0};
+
+  // CRTC会在移除正在显示的framebuffer时关闭，下一次显示时重新设置
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    if (gdev->scanouts[i].crtc_fb_id == res->direct_fb_id) {
+      gdev->scanouts[i].crtc_fb_id = 0;
+    }
+  }
+
+  drmModeRmFB(res->direct_card_fd, res->direct_fb_id);
+  gem_close.handle = res->direct_handle;
+  drmIoctl(res->direct_card_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+}
+
+// 创建光标平面使用的dumb buffer，大小为card支持的光标大小
+static int virtio_gpu_drm_cursor_create(GPUScanout *scanout) {
+  struct drm_mode_create_dumb dumb = {0};
+  struct drm_mode_map_dumb map = {0};
+  struct drm_mode_destroy_dumb destory = {0};
+  uint64_t width = 0, height = 0;
+
+  if (drmGetCap(scanout->card0_fd, DRM_CAP_CURSOR_WIDTH, &width) < 0 ||
+      width == 0) {
+    width = VIRTIO_GPU_CURSOR_SIZE;
+  }
+  if (drmGetCap(scanout->card0_fd, DRM_CAP_CURSOR_HEIGHT, &height) < 0 ||
+      height == 0) {
+    height = VIRTIO_GPU_CURSOR_SIZE;
+  }
+
+  dumb.width = width;
+  dumb.height = height;
+  dumb.bpp = 32;
+  if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_CREATE_DUMB, &dumb) < 0) {
+    log_error("%s failed to create a drm dumb for cursor", __func__);
+    return -1;
+  }
+  destory.handle = dumb.handle;
+
+  map.handle = dumb.handle;
+  if (drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+    log_error("%s failed to map a drm dumb for cursor", __func__);
+    drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+    return -1;
+  }
+
+  void *vaddr = mmap(0, dumb.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     scanout->card0_fd, map.offset);
+  if (vaddr == MAP_FAILED) {
+    log_error("%s cannot map cursor dumb", __func__);
+    drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+    return -1;
+  }
+
+  scanout->cursor_handle = dumb.handle;
+  scanout->cursor_width = dumb.width;
+  scanout->cursor_height = dumb.height;
+  scanout->cursor_pitch = dumb.pitch;
+  scanout->cursor_size = dumb.size;
+  scanout->cursor_addr = vaddr;
+
+  log_debug("%s create a %dx%d cursor with handle: %d for crtc %d", __func__,
+            dumb.width, dumb.height, dumb.handle, scanout->crtc->crtc_id);
+  return 0;
+}
+
+static void virtio_gpu_drm_cursor_destroy(GPUScanout *scanout) {
+  struct drm_mode_destroy_dumb destory = {0};
+
+  if (scanout->crtc != NULL) {
+    drmModeSetCursor(scanout->card0_fd, scanout->crtc->crtc_id, 0, 0, 0);
+  }
+  munmap(scanout->cursor_addr, scanout->cursor_size);
+  destory.handle = scanout->cursor_handle;
+  drmIoctl(scanout->card0_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destory);
+}
+
+static int virtio_gpu_drm_cursor_show(GPUScanout *scanout, int hot_x,
+                                      int hot_y) {
+  // 不支持热点的card使用旧接口，guest给出的位置已经是图像左上角
+  if (drmModeSetCursor2(scanout->card0_fd, scanout->crtc->crtc_id,
+                        scanout->cursor_handle, scanout->cursor_width,
+                        scanout->cursor_height, hot_x, hot_y) < 0 &&
+      drmModeSetCursor(scanout->card0_fd, scanout->crtc->crtc_id,
+                       scanout->cursor_handle, scanout->cursor_width,
+                       scanout->cursor_height) < 0) {
+    log_error("%s crtc %d doesn't support cursor plane", __func__,
+              scanout->crtc->crtc_id);
+    return -1;
+  }
+  return 0;
+}
+
+static void virtio_gpu_drm_cursor_hide(GPUScanout *scanout) {
+  drmModeSetCursor(scanout->card0_fd, scanout->crtc->crtc_id, 0, 0, 0);
+}
+
+static void virtio_gpu_drm_cursor_move(GPUScanout *scanout, int x, int y) {
+  drmModeMoveCursor(scanout->card0_fd, scanout->crtc->crtc_id, x, y);
+}
+
+const GPUDisplayBackend virtio_gpu_drm_backend = {
+    .name = "drm",
+    .cacheable = true,
+    .init = virtio_gpu_drm_init,
+    .close = virtio_gpu_drm_close,
+    .create_buffer = virtio_gpu_drm_create_buffer,
+    .destroy_buffer = virtio_gpu_drm_destroy_buffer,
+    .show = virtio_gpu_drm_show,
+    .flip = virtio_gpu_drm_flip,
+    .blank = virtio_gpu_drm_blank,
+    .import_dmabuf = virtio_gpu_drm_import_dmabuf,
+    .release_dmabuf = virtio_gpu_drm_release_dmabuf,
+    .cursor_create = virtio_gpu_drm_cursor_create,
+    .cursor_destroy = virtio_gpu_drm_cursor_destroy,
+    .cursor_show = virtio_gpu_drm_cursor_show,
+    .cursor_hide = virtio_gpu_drm_cursor_hide,
+    .cursor_move = virtio_gpu_drm_cursor_move,
+};
@@ -0,0 +1,189 @@
+#include "log.h"
+#include "virtio_gpu.h"
+#include <drm/drm_mode.h>
+#include <stdio.h>
+#include <string.h>
+
+// EDID base block中4个18字节描述符的起始位置
+#define EDID_DESCRIPTOR_OFFSET 54
+#define EDID_DESCRIPTOR_SIZE 18
+#define EDID_DESCRIPTORS 4
+
+// 最后一个描述符用于显示器名称，其余用于detailed timing
+#define EDID_MAX_TIMINGS (EDID_DESCRIPTORS - 1)
+
+// 显示器名称，最多13个字符
+#define EDID_MONITOR_NAME "hvisor-gpu"
+
+void virtio_gpu_default_mode(drmModeModeInfo *mode, uint32_t width,
+                             uint32_t height) {
+  // CVT reduced blanking：水平消隐固定160像素，垂直消隐至少460us
+  uint32_t vblank = MAX(height * 284 / 10000 + 2, 3 + 6 + 6);
+
+  memset(mode, 0, sizeof(*mode));
+  mode->hdisplay = width;
+  mode->hsync_start = width + 48;
+  mode->hsync_end = mode->hsync_start + 32;
+  mode->htotal = width + 160;
+  mode->vdisplay = height;
+  mode->vsync_start = height + 3;
+  mode->vsync_end = mode->vsync_start + 6;
+  mode->vtotal = height + vblank;
+  mode->vrefresh = 60;
+  mode->clock = (uint64_t)mode->htotal * mode->vtotal * 60 / 1000;
+  mode->flags = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_NVSYNC;
+  mode->type = DRM_MODE_TYPE_PREFERRED;
+  snprintf(mode->name, sizeof(mode->name), "%dx%d", width, height);
+}
+
+// EDID的detailed timing能否表示该模式
+static bool edid_timing_valid(const drmModeModeInfo *mode) {
+  return mode->clock / 10 <= UINT16_MAX && mode->clock >= 10 &&
+         mode->hdisplay < 4096 && mode->vdisplay < 4096 &&
+         mode->htotal - mode->hdisplay < 4096 &&
+         mode->vtotal - mode->vdisplay < 4096 &&
+         mode->hsync_start - mode->hdisplay < 1024 &&
+         mode->hsync_end - mode->hsync_start < 1024 &&
+         mode->vsync_start - mode->vdisplay < 64 &&
+         mode->vsync_end - mode->vsync_start < 64;
+}
+
+// 按EDID 1.4的格式写入一个detailed timing描述符
+static void edid_put_timing(uint8_t *d, const drmModeModeInfo *mode,
+                            uint32_t width_mm, uint32_t height_mm) {
+  uint32_t hblank = mode->htotal - mode->hdisplay;
+  uint32_t vblank = mode->vtotal - mode->vdisplay;
+  uint32_t hso = mode->hsync_start - mode->hdisplay;
+  uint32_t hsw = mode->hsync_end - mode->hsync_start;
+  uint32_t vso = mode->vsync_start - mode->vdisplay;
+  uint32_t vsw = mode->vsync_end - mode->vsync_start;
+  uint32_t clock = mode->clock / 10; // 单位为10kHz
+
+  d[0] = clock & 0xff;
+  d[1] = clock >> 8;
+  d[2] = mode->hdisplay & 0xff;
+  d[3] = hblank & 0xff;
+  d[4] = ((mode->hdisplay >> 8) << 4) | (hblank >> 8);
+  d[5] = mode->vdisplay & 0xff;
+  d[6] = vblank & 0xff;
+  d[7] = ((mode->vdisplay >> 8) << 4) | (vblank >> 8);
+  d[8] = hso & 0xff;
+  d[9] = hsw & 0xff;
+  d[10] = ((vso & 0xf) << 4) | (vsw & 0xf);
+  d[11] = ((hso >> 8) << 6) | ((hsw >> 8) << 4) | ((vso >> 4) << 2) |
+          (vsw >> 4);
+  d[12] = width_mm & 0xff;
+  d[13] = height_mm & 0xff;
+  d[14] = ((width_mm >> 8) << 4) | ((height_mm >> 8) & 0xf);
+  d[15] = 0;
+  d[16] = 0;
+  // 数字分离同步，以及两个同步信号的极性
+  d[17] = 0x18;
+  if (mode->flags & DRM_MODE_FLAG_INTERLACE) {
+    d[17] |= 0x80;
+  }
+  if (mode->flags & DRM_MODE_FLAG_PVSYNC) {
+    d[17] |= 0x04;
+  }
+  if (mode->flags & DRM_MODE_FLAG_PHSYNC) {
+    d[17] |= 0x02;
+  }
+}
+
+// 显示器名称描述符，不足13个字符时以换行结束，其余用空格填充
+static void edid_put_name(uint8_t *d, const char *name) {
+  size_t len = MIN(strlen(name), 13);
+
+  memset(d, 0, 5);
+  d[3] = 0xfc;
+  memset(d + 5, ' ', 13);
+  memcpy(d + 5, name, len);
+  if (len < 13) {
+    d[5 + len] = '\n';
+  }
+}
+
+// 不使用的描述符
+static void edid_put_dummy(uint8_t *d) {
+  memset(d, 0, EDID_DESCRIPTOR_SIZE);
+  d[3] = 0x10;
+}
+
+uint32_t virtio_gpu_edid_generate(uint8_t *edid, const drmModeModeInfo *modes,
+                                  int count, uint32_t width_mm,
+                                  uint32_t height_mm) {
+  static const uint8_t header[] = {0x00, 0xff, 0xff, 0xff,
+                                   0xff, 0xff, 0xff, 0x00};
+  // sRGB的色度坐标
+  static const uint8_t srgb[] = {0xee, 0x91, 0xa3, 0x54, 0x4c,
+                                 0x99, 0x26, 0x0f, 0x50, 0x54};
+  const drmModeModeInfo *timings[EDID_MAX_TIMINGS];
+  int nr_timings = 0;
+  uint8_t sum = 0;
+
+  // 首选模式之外，不同分辨率或刷新率的模式依次放入剩余的描述符
+  for (int i = 0; i < count && nr_timings < EDID_MAX_TIMINGS; ++i) {
+    bool dup = false;
+    if (!edid_timing_valid(&modes[i])) {
+      continue;
+    }
+    for (int j = 0; j < nr_timings; ++j) {
+      if (timings[j]->hdisplay == modes[i].hdisplay &&
+          timings[j]->vdisplay == modes[i].vdisplay &&
+          timings[j]->vrefresh == modes[i].vrefresh) {
+        dup = true;
+      }
+    }
+    if (!dup) {
+      timings[nr_timings++] = &modes[i];
+    }
+  }
+  if (nr_timings == 0) {
+    log_error("%s no mode can be described by edid", __func__);
+    return 0;
+  }
+
+  if (width_mm == 0 || height_mm == 0) {
+    width_mm = timings[0]->hdisplay * 254 / (VIRTIO_GPU_DEFAULT_DPI * 10);
+    height_mm = timings[0]->vdisplay * 254 / (VIRTIO_GPU_DEFAULT_DPI * 10);
+  }
+
+  memset(edid, 0, VIRTIO_GPU_EDID_BLOCK_SIZE);
+  memcpy(edid, header, sizeof(header));
+  // 厂商"HVS"，每个字母5位，大端序
+  edid[8] = (('H' - '@') << 2) | (('V' - '@') >> 3);
+  edid[9] = ((('V' - '@') & 0x7) << 5) | ('S' - '@');
+  edid[10] = timings[0]->hdisplay & 0xff; // 产品代码
+  edid[11] = timings[0]->vdisplay & 0xff;
+  edid[17] = 2024 - 1990; // 生产年份
+  edid[18] = 1;           // EDID 1.4
+  edid[19] = 4;
+  edid[20] = 0xa0; // 数字输入，每个颜色8位
+  edid[21] = MIN((width_mm + 5) / 10, 255); // 单位为cm
+  edid[22] = MIN((height_mm + 5) / 10, 255);
+  edid[23] = 120; // gamma 2.2
+  // 默认色彩空间为sRGB，首个detailed timing为原生分辨率
+  edid[24] = 0x06;
+  memcpy(edid + 25, srgb, sizeof(srgb));
+  // 不使用established timing和standard timing
+  memset(edid + 38, 0x01, 16);
+
+  for (int i = 0; i < EDID_DESCRIPTORS; ++i) {
+    uint8_t *d = edid + EDID_DESCRIPTOR_OFFSET + i * EDID_DESCRIPTOR_SIZE;
+    if (i < nr_timings) {
+      edid_put_timing(d, timings[i], width_mm, height_mm);
+    } else if (i == EDID_DESCRIPTORS - 1) {
+      edid_put_name(d, EDID_MONITOR_NAME);
+    } else {
+      edid_put_dummy(d);
+    }
+  }
+
+  // 没有扩展block，所有字节之和为0
+  edid[126] = 0;
+  for (int i = 0; i < VIRTIO_GPU_EDID_BLOCK_SIZE - 1; ++i) {
+    sum += edid[i];
+  }
+  edid[127] = -sum;
+  return VIRTIO_GPU_EDID_BLOCK_SIZE;
+}
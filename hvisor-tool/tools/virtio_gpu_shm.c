@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include "log.h"
+#include "virtio.h"
+#include "virtio_gpu.h"
+#include <drm/drm_fourcc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// 共享内存中光标区域的大小，固定为VIRTIO_GPU_CURSOR_SIZE的正方形
+#define SHM_CURSOR_PITCH (VIRTIO_GPU_CURSOR_SIZE * VIRTIO_GPU_BYTES_PP)
+#define SHM_CURSOR_BYTES (SHM_CURSOR_PITCH * VIRTIO_GPU_CURSOR_SIZE)
+// 交换链缓冲区从这里开始
+#define SHM_BUFFERS_OFFSET (VIRTIO_GPU_SHM_HEADER_SIZE + SHM_CURSOR_BYTES)
+
+void virtio_gpu_requested_mode(GPUDev *gdev) {
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    GPURequestedState *state = &gdev->requested_states[i];
+    if (state->width != 0 && state->height != 0) {
+      gdev->scanouts[i].width = state->width;
+      gdev->scanouts[i].height = state->height;
+    }
+    gdev->scanouts[i].display_width = gdev->scanouts[i].width;
+    gdev->scanouts[i].display_height = gdev->scanouts[i].height;
+    gdev->scanouts[i].connected = true;
+  }
+}
+
+// 优先使用resource自身的格式，viewer按drm_format解释画面
+static void virtio_gpu_pick_format(GPUFrameBuffer *fb) {
+  fb->drm_format = virtio_gpu_drm_format(fb->format);
+  fb->swizzle = GPU_SWIZZLE_NONE;
+  if (fb->drm_format == 0) {
+    fb->drm_format = DRM_FORMAT_XRGB8888;
+    fb->swizzle = virtio_gpu_swizzle_to_xrgb(fb->format);
+  }
+}
+
+static void virtio_gpu_shm_close(GPUDev *gdev) {
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    GPUScanout *scanout = &gdev->scanouts[i];
+    if (scanout->shm_header != NULL) {
+      munmap(scanout->shm_header, SHM_BUFFERS_OFFSET);
+      scanout->shm_header = NULL;
+    }
+    if (scanout->shm_fd >= 0) {
+      close(scanout->shm_fd);
+      scanout->shm_fd = -1;
+    }
+  }
+}
+
+static int virtio_gpu_shm_init(GPUDev *gdev) {
+  char name[32];
+
+  virtio_gpu_requested_mode(gdev);
+
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    GPUScanout *scanout = &gdev->scanouts[i];
+
+    snprintf(name, sizeof(name), "virtio-gpu-scanout%d", i);
+    scanout->shm_fd = memfd_create(name, MFD_CLOEXEC);
+    if (scanout->shm_fd < 0) {
+      log_error("%s cannot create memfd for scanout %d", __func__, i);
+      virtio_gpu_shm_close(gdev);
+      return -1;
+    }
+    // 交换链缓冲区在SET_SCANOUT时才知道大小，先只放header和光标
+    if (ftruncate(scanout->shm_fd, SHM_BUFFERS_OFFSET) < 0) {
+      log_error("%s cannot resize memfd of scanout %d", __func__, i);
+      virtio_gpu_shm_close(gdev);
+      return -1;
+    }
+    scanout->shm_header =
+        mmap(NULL, SHM_BUFFERS_OFFSET, PROT_READ | PROT_WRITE, MAP_SHARED,
+             scanout->shm_fd, 0);
+    if (scanout->shm_header == MAP_FAILED) {
+      log_error("%s cannot map memfd of scanout %d", __func__, i);
+      scanout->shm_header = NULL;
+      virtio_gpu_shm_close(gdev);
+      return -1;
+    }
+
+    GPUShmHeader *header = scanout->shm_header;
+    header->magic = VIRTIO_GPU_SHM_MAGIC;
+    header->version = VIRTIO_GPU_SHM_VERSION;
+    header->width = scanout->width;
+    header->height = scanout->height;
+    header->cursor_offset = VIRTIO_GPU_SHM_HEADER_SIZE;
+    header->cursor_width = VIRTIO_GPU_CURSOR_SIZE;
+    header->cursor_height = VIRTIO_GPU_CURSOR_SIZE;
+    header->cursor_pitch = SHM_CURSOR_PITCH;
+
+    log_info("virtio gpu scanout %d (%dx%d) is shared at /proc/%d/fd/%d", i,
+             scanout->width, scanout->height, getpid(), scanout->shm_fd);
+  }
+  return 0;
+}
+
+static int virtio_gpu_shm_create_buffer(GPUScanout *scanout,
+                                        GPUFrameBuffer *fb, int index) {
+  GPUShmHeader *header = scanout->shm_header;
+  long page_size = sysconf(_SC_PAGESIZE);
+  uint32_t stride = fb->width * VIRTIO_GPU_BYTES_PP;
+  uint64_t offset = 0;
+
+  if (index == 0) {
+    // 每个缓冲区按页对齐，才能分别mmap
+    scanout->shm_buffer_size =
+        ((uint64_t)stride * fb->height + page_size - 1) & ~(page_size - 1);
+    if (ftruncate(scanout->shm_fd,
+                  SHM_BUFFERS_OFFSET +
+                      scanout->shm_buffer_size * VIRTIO_GPU_SWAPCHAIN_LEN) <
+        0) {
+      log_error("%s cannot resize memfd for %dx%d buffers", __func__,
+                fb->width, fb->height);
+      return -1;
+    }
+    header->width = fb->width;
+    header->height = fb->height;
+    header->stride = stride;
+    for (int i = 0; i < VIRTIO_GPU_SWAPCHAIN_LEN; ++i) {
+      header->buffer_offset[i] =
+          SHM_BUFFERS_OFFSET + scanout->shm_buffer_size * i;
+    }
+  }
+
+  offset = header->buffer_offset[index];
+  void *vaddr = mmap(NULL, scanout->shm_buffer_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, scanout->shm_fd, offset);
+  if (vaddr == MAP_FAILED) {
+    log_error("%s cannot map buffer %d of memfd", __func__, index);
+    return -1;
+  }
+
+  virtio_gpu_pick_format(fb);
+  header->drm_format = fb->drm_format;
+  header->buffers = index + 1;
+  fb->stride = stride;
+  fb->fb_addr = vaddr;
+
+  log_debug("%s create buffer %d with width: %d, height: %d, drm format: "
+            "%#x, swizzle: %d at offset %#lx",
+            __func__, index, fb->width, fb->height, fb->drm_format,
+            fb->swizzle, offset);
+  return 0;
+}
+
+static void virtio_gpu_shm_destroy_buffer(GPUScanout *scanout,
+                                          GPUFrameBuffer *fb, int index) {
+  (void)index;
+  if (!fb->enabled) {
+    return;
+  }
+
+  // 告诉viewer缓冲区已经不可用
+  scanout->shm_header->buffers = 0;
+  munmap(fb->fb_addr, scanout->shm_buffer_size);
+
+  fb->fb_addr = NULL;
+  fb->enabled = false;
+  fb->damage_cnt = 0;
+}
+
+static int virtio_gpu_shm_show(GPUScanout *scanout, int buffer,
+                               drmModeClip *clips, uint32_t clips_cnt) {
+  GPUShmHeader *header = scanout->shm_header;
+
+  if (buffer == VIRTIO_GPU_DIRECT_BUFFER) {
+    return -1;
+  }
+
+  header->front = buffer;
+  header->damage_x1 = header->width;
+  header->damage_y1 = header->height;
+  header->damage_x2 = 0;
+  header->damage_y2 = 0;
+  for (uint32_t i = 0; i < clips_cnt; ++i) {
+    header->damage_x1 = MIN(header->damage_x1, clips[i].x1);
+    header->damage_y1 = MIN(header->damage_y1, clips[i].y1);
+    header->damage_x2 = MAX(header->damage_x2, clips[i].x2);
+    header->damage_y2 = MAX(header->damage_y2, clips[i].y2);
+  }
+  // viewer看到新的frame_seq时，画面和header都已经写完
+  __atomic_add_fetch(&header->frame_seq, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static int virtio_gpu_shm_cursor_create(GPUScanout *scanout) {
+  GPUShmHeader *header = scanout->shm_header;
+
+  scanout->cursor_width = header->cursor_width;
+  scanout->cursor_height = header->cursor_height;
+  scanout->cursor_pitch = header->cursor_pitch;
+  scanout->cursor_size = SHM_CURSOR_BYTES;
+  scanout->cursor_addr = (uint8_t *)header + header->cursor_offset;
+  return 0;
+}
+
+static void virtio_gpu_shm_cursor_destroy(GPUScanout *scanout) {
+  // 光标区域随header一起映射，在close时解除
+  scanout->shm_header->cursor_visible = 0;
+}
+
+static int virtio_gpu_shm_cursor_show(GPUScanout *scanout, int hot_x,
+                                      int hot_y) {
+  GPUShmHeader *header = scanout->shm_header;
+
+  header->cursor_hot_x = hot_x;
+  header->cursor_hot_y = hot_y;
+  __atomic_store_n(&header->cursor_visible, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static void virtio_gpu_shm_cursor_hide(GPUScanout *scanout) {
+  __atomic_store_n(&scanout->shm_header->cursor_visible, 0, __ATOMIC_RELEASE);
+}
+
+static void virtio_gpu_shm_cursor_move(GPUScanout *scanout, int x, int y) {
+  scanout->shm_header->cursor_x = x;
+  scanout->shm_header->cursor_y = y;
+}
+
+const GPUDisplayBackend virtio_gpu_shm_backend = {
+    .name = "shm",
+    .init = virtio_gpu_shm_init,
+    .close = virtio_gpu_shm_close,
+    .create_buffer = virtio_gpu_shm_create_buffer,
+    .destroy_buffer = virtio_gpu_shm_destroy_buffer,
+    .show = virtio_gpu_shm_show,
+    .cursor_create = virtio_gpu_shm_cursor_create,
+    .cursor_destroy = virtio_gpu_shm_cursor_destroy,
+    .cursor_show = virtio_gpu_shm_cursor_show,
+    .cursor_hide = virtio_gpu_shm_cursor_hide,
+    .cursor_move = virtio_gpu_shm_cursor_move,
+};
+
+static int virtio_gpu_null_init(GPUDev *gdev) {
+  virtio_gpu_requested_mode(gdev);
+  // 画面不会被读取，只使用一个缓冲区以减少拷贝
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    gdev->scanouts[i].page_flip = false;
+  }
+  return 0;
+}
+
+static void virtio_gpu_null_close(GPUDev *gdev) {
+  (void)gdev;
+}
+
+int virtio_gpu_mem_create_buffer(GPUScanout *scanout, GPUFrameBuffer *fb,
+                                 int index) {
+  (void)scanout;
+  // 按行紧密排列，不需要像dumb buffer一样对齐
+  fb->stride = fb->width * VIRTIO_GPU_BYTES_PP;
+  fb->fb_addr = malloc((size_t)fb->stride * fb->height);
+  if (fb->fb_addr == NULL) {
+    log_error("%s cannot alloc buffer %d", __func__, index);
+    return -1;
+  }
+  virtio_gpu_pick_format(fb);
+  return 0;
+}
+
+void virtio_gpu_mem_destroy_buffer(GPUScanout *scanout, GPUFrameBuffer *fb,
+                                   int index) {
+  (void)scanout;
+  (void)index;
+  if (!fb->enabled) {
+    return;
+  }
+  free(fb->fb_addr);
+  fb->fb_addr = NULL;
+  fb->enabled = false;
+  fb->damage_cnt = 0;
+}
+
+static int virtio_gpu_null_show(GPUScanout *scanout, int buffer,
+                                drmModeClip *clips, uint32_t clips_cnt) {
+  (void)scanout;
+  (void)buffer;
+  (void)clips;
+  (void)clips_cnt;
+  return 0;
+}
+
+const GPUDisplayBackend virtio_gpu_null_backend = {
+    .name = "null",
+    .cacheable = true,
+    .init = virtio_gpu_null_init,
+    .close = virtio_gpu_null_close,
+    .create_buffer = virtio_gpu_mem_create_buffer,
+    .destroy_buffer = virtio_gpu_mem_destroy_buffer,
+    .show = virtio_gpu_null_show,
+};
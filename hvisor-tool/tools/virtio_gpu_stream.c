@@ -0,0 +1,531 @@
+#include "event_monitor.h"
+#include "log.h"
+#include "virtio.h"
+#include "virtio_gpu.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define TILE VIRTIO_GPU_STREAM_TILE
+#define TILE_BYTES (TILE * TILE * VIRTIO_GPU_BYTES_PP)
+
+// LZ4 block格式的参数，见lz4的lz4_Block_format.md
+#define LZ4_HASH_LOG 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // 最后5个字节必须是literal
+#define LZ4_MFLIMIT 12      // 最后一个match至少在结尾12字节之前开始
+#define LZ4_MAX_OFFSET 65535
+// n字节的输入压缩后最大的字节数
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+static uint32_t lz4_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t lz4_hash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// 长度超过token能表示的15时，剩余部分每个字节表示最多255
+static uint8_t *lz4_put_length(uint8_t *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+// 输出一个sequence：token、literal和match，match_len为0表示最后的literal
+static uint8_t *lz4_put_sequence(uint8_t *op, const uint8_t *lit,
+                                 size_t lit_len, size_t offset,
+                                 size_t match_len) {
+  uint8_t *token = op++;
+  size_t ml = match_len > 0 ? match_len - LZ4_MIN_MATCH : 0;
+
+  *token = (MIN(lit_len, 15) << 4) | MIN(ml, 15);
+  if (lit_len >= 15) {
+    op = lz4_put_length(op, lit_len - 15);
+  }
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  if (match_len == 0) {
+    return op;
+  }
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if (ml >= 15) {
+    op = lz4_put_length(op, ml - 15);
+  }
+  return op;
+}
+
+// 贪心地寻找重复的4字节序列，压缩为标准的LZ4 block，返回压缩后的字节数
+// dst至少需要LZ4_BOUND(n)字节
+static size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+  uint32_t table[1 << LZ4_HASH_LOG] = {0};
+  const uint8_t *ip = src, *anchor = src;
+  const uint8_t *end = src + n;
+  uint8_t *op = dst;
+
+  if (n > LZ4_MFLIMIT) {
+    const uint8_t *mflimit = end - LZ4_MFLIMIT;
+    const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+
+    while (ip <= mflimit) {
+      uint32_t seq = lz4_read32(ip);
+      uint32_t h = lz4_hash(seq);
+      const uint8_t *ref = src + table[h];
+
+      table[h] = ip - src;
+      if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != seq) {
+        ip++;
+        continue;
+      }
+      // 向前扩展match，literal随之变短
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const uint8_t *mp = ip + LZ4_MIN_MATCH, *mr = ref + LZ4_MIN_MATCH;
+      while (mp < matchlimit && *mp == *mr) {
+        mp++;
+        mr++;
+      }
+      op = lz4_put_sequence(op, anchor, ip - anchor, ip - ref, mp - ip);
+      ip = mp;
+      anchor = ip;
+    }
+  }
+
+  op = lz4_put_sequence(op, anchor, end - anchor, 0, 0);
+  return op - dst;
+}
+
+// tile内容的hash，相同时认为viewer已有该tile，不再发送
+static uint64_t stream_hash(const uint8_t *p, size_t n) {
+  uint64_t h = 0xcbf29ce484222325ULL ^ n;
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    uint64_t v;
+    memcpy(&v, p + i, sizeof(v));
+    h = (h ^ v) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  for (; i < n; i++) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// 断开viewer并丢弃还没有发送的消息，调用者需持有stream_mutex
+// 只在epoll线程中调用，或者在关闭设备时调用
+static void stream_disconnect(GPUDev *gdev) {
+  GPUStreamMsg *msg = NULL;
+
+  if (gdev->stream_fd < 0) {
+    return;
+  }
+  log_info("virtio gpu stream viewer disconnected");
+  del_event(gdev->stream_event);
+  gdev->stream_event = NULL;
+  close(gdev->stream_fd);
+  __atomic_store_n(&gdev->stream_fd, -1, __ATOMIC_RELAXED);
+
+  while ((msg = TAILQ_FIRST(&gdev->stream_queue)) != NULL) {
+    TAILQ_REMOVE(&gdev->stream_queue, msg, next);
+    free(msg);
+  }
+  gdev->stream_queued = 0;
+  gdev->stream_sent = 0;
+  gdev->stream_dropped = false;
+}
+
+// 将消息放入发送队列，由epoll线程在socket可写时发送
+// 队列已满时丢弃消息并返回false，调用者持有flip_mutex，不能在这里send
+static bool stream_queue(GPUDev *gdev, const uint8_t *data, size_t len) {
+  GPUStreamMsg *msg = NULL;
+  bool queued = false;
+
+  pthread_mutex_lock(&gdev->stream_mutex);
+  if (gdev->stream_fd < 0) {
+    // viewer已经断开，下一个viewer连接时会重新同步
+    pthread_mutex_unlock(&gdev->stream_mutex);
+    return true;
+  }
+  // 队列为空时总是接受，因此一个完整画面大于上限时也能发送
+  if (gdev->stream_queued == 0 ||
+      gdev->stream_queued + len <= VIRTIO_GPU_STREAM_QUEUE_BYTES) {
+    msg = malloc(sizeof(GPUStreamMsg) + len);
+  }
+  if (msg != NULL) {
+    msg->len = len;
+    memcpy(msg->data, data, len);
+    if (TAILQ_EMPTY(&gdev->stream_queue)) {
+      resume_event(gdev->stream_event);
+    }
+    TAILQ_INSERT_TAIL(&gdev->stream_queue, msg, next);
+    gdev->stream_queued += len;
+    queued = true;
+  } else {
+    gdev->stream_dropped = true;
+  }
+  pthread_mutex_unlock(&gdev->stream_mutex);
+  return queued;
+}
+
+// 标记与clip相交的tile
+static void stream_mark_tiles(GPUScanout *scanout, GPUFrameBuffer *fb,
+                              const drmModeClip *clip) {
+  uint32_t x1 = MIN(clip->x1, fb->width) / TILE;
+  uint32_t y1 = MIN(clip->y1, fb->height) / TILE;
+  uint32_t x2 = (MIN(clip->x2, fb->width) + TILE - 1) / TILE;
+  uint32_t y2 = (MIN(clip->y2, fb->height) + TILE - 1) / TILE;
+
+  for (uint32_t ty = y1; ty < y2; ++ty) {
+    memset(&scanout->stream_tile_dirty[ty * scanout->stream_tiles_x + x1], 1,
+           x2 - x1);
+  }
+}
+
+// 将buffer中内容变化的tile压缩后放入发送队列，调用者持有flip_mutex
+static int virtio_gpu_stream_show(GPUScanout *scanout, int buffer,
+                                  drmModeClip *clips, uint32_t clips_cnt) {
+  GPUDev *gdev = scanout->gdev;
+  GPUFrameBuffer *fb = NULL;
+  GPUStreamFrame *frame = (GPUStreamFrame *)scanout->stream_msg;
+  uint8_t *op = scanout->stream_msg + sizeof(GPUStreamFrame);
+  drmModeClip full;
+  bool resync = false;
+
+  if (buffer == VIRTIO_GPU_DIRECT_BUFFER) {
+    return -1;
+  }
+  if (__atomic_load_n(&gdev->stream_fd, __ATOMIC_RELAXED) < 0) {
+    // 没有viewer，连接时会发送整个画面
+    return 0;
+  }
+  if (__atomic_load_n(&gdev->stream_dropped, __ATOMIC_RELAXED)) {
+    // viewer还没有跟上，不必编码，队列发送完后发送整个画面
+    scanout->stream_resync = true;
+    return 0;
+  }
+
+  fb = &scanout->swapchain[buffer];
+  if (scanout->stream_resync) {
+    scanout->stream_resync = false;
+    resync = true;
+    full.x1 = 0;
+    full.y1 = 0;
+    full.x2 = fb->width;
+    full.y2 = fb->height;
+    clips = &full;
+    clips_cnt = 1;
+  }
+  for (uint32_t i = 0; i < clips_cnt; ++i) {
+    stream_mark_tiles(scanout, fb, &clips[i]);
+  }
+
+  frame->tiles = 0;
+  for (uint32_t ty = 0; ty < scanout->stream_tiles_y; ++ty) {
+    for (uint32_t tx = 0; tx < scanout->stream_tiles_x; ++tx) {
+      uint32_t idx = ty * scanout->stream_tiles_x + tx;
+      GPUStreamTile tile;
+      uint64_t hash = 0;
+      size_t bytes = 0;
+
+      if (!scanout->stream_tile_dirty[idx]) {
+        continue;
+      }
+      scanout->stream_tile_dirty[idx] = 0;
+
+      tile.x = tx * TILE;
+      tile.y = ty * TILE;
+      tile.width = MIN(TILE, fb->width - tile.x);
+      tile.height = MIN(TILE, fb->height - tile.y);
+      bytes = (size_t)tile.width * VIRTIO_GPU_BYTES_PP;
+      for (uint32_t y = 0; y < tile.height; ++y) {
+        memcpy(scanout->stream_tile + y * bytes,
+               (uint8_t *)fb->fb_addr + (uint64_t)(tile.y + y) * fb->stride +
+                   tile.x * VIRTIO_GPU_BYTES_PP,
+               bytes);
+      }
+      bytes *= tile.height;
+
+      // damage只说明guest写过这些区域，内容不一定改变
+      hash = stream_hash(scanout->stream_tile, bytes);
+      if (!resync && hash == scanout->stream_tile_hash[idx]) {
+        continue;
+      }
+      scanout->stream_tile_hash[idx] = hash;
+
+      tile.size = lz4_compress(scanout->stream_tile, bytes,
+                               op + sizeof(GPUStreamTile));
+      tile.encoding = GPU_STREAM_LZ4;
+      if (tile.size >= bytes) {
+        // 无法压缩的内容直接发送
+        memcpy(op + sizeof(GPUStreamTile), scanout->stream_tile, bytes);
+        tile.size = bytes;
+        tile.encoding = GPU_STREAM_RAW;
+      }
+      memcpy(op, &tile, sizeof(tile));
+      op += sizeof(GPUStreamTile) + tile.size;
+      frame->tiles++;
+    }
+  }
+  if (frame->tiles == 0) {
+    return 0;
+  }
+
+  frame->magic = VIRTIO_GPU_STREAM_MAGIC;
+  frame->scanout_id = scanout - gdev->scanouts;
+  frame->width = fb->width;
+  frame->height = fb->height;
+  frame->drm_format = fb->drm_format;
+  frame->frame_seq = ++scanout->stream_frame_seq;
+  frame->size = op - scanout->stream_msg - sizeof(GPUStreamFrame);
+  frame->padding = 0;
+  if (!stream_queue(gdev, scanout->stream_msg, op - scanout->stream_msg)) {
+    // viewer缺少这一帧，tile的hash已经不可信，之后发送整个画面
+    log_debug("%s viewer is too slow, drop frame %llu of scanout %d",
+              __func__, (unsigned long long)frame->frame_seq,
+              frame->scanout_id);
+    scanout->stream_resync = true;
+    return 0;
+  }
+
+  log_debug("%s queue %d tiles, %d bytes of scanout %d", __func__,
+            frame->tiles, frame->size, frame->scanout_id);
+  return 0;
+}
+
+// 发送队列中的消息，直到socket不可写或队列为空
+// 队列为空时停止监听EPOLLOUT，丢弃过画面时请求重新显示各scanout
+static void virtio_gpu_stream_client_handler(int fd, int epoll_type,
+                                             void *param) {
+  GPUDev *gdev = param;
+  GPUStreamMsg *msg = NULL;
+  bool resync = false;
+  ssize_t ret;
+
+  pthread_mutex_lock(&gdev->stream_mutex);
+  if (fd != gdev->stream_fd) {
+    pthread_mutex_unlock(&gdev->stream_mutex);
+    return;
+  }
+  if (epoll_type == EPOLLHUP) {
+    stream_disconnect(gdev);
+    pthread_mutex_unlock(&gdev->stream_mutex);
+    return;
+  }
+
+  while ((msg = TAILQ_FIRST(&gdev->stream_queue)) != NULL) {
+    ret = send(fd, msg->data + gdev->stream_sent, msg->len - gdev->stream_sent,
+               MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (ret <= 0) {
+      // 消息只发送了一部分时无法继续，viewer重新连接后从完整的画面开始
+      log_warn("%s cannot send frame to viewer, errno is %d", __func__, errno);
+      stream_disconnect(gdev);
+      break;
+    }
+    gdev->stream_sent += ret;
+    if (gdev->stream_sent == msg->len) {
+      TAILQ_REMOVE(&gdev->stream_queue, msg, next);
+      gdev->stream_queued -= msg->len;
+      gdev->stream_sent = 0;
+      free(msg);
+    }
+  }
+
+  if (gdev->stream_fd >= 0 && TAILQ_EMPTY(&gdev->stream_queue)) {
+    pause_event(gdev->stream_event, EPOLLRDHUP);
+    resync = gdev->stream_dropped;
+    gdev->stream_dropped = false;
+  }
+  pthread_mutex_unlock(&gdev->stream_mutex);
+
+  // guest可能不再flush，由调度线程发送丢弃之后的整个画面
+  for (uint32_t i = 0; resync && i < gdev->scanouts_num; ++i) {
+    virtio_gpu_request_present(&gdev->scanouts[i]);
+  }
+}
+
+static void virtio_gpu_stream_accept_handler(int fd, int epoll_type,
+                                             void *param) {
+  (void)epoll_type;
+  GPUDev *gdev = param;
+  int client_fd = accept(fd, NULL, NULL);
+
+  if (client_fd < 0) {
+    log_error("%s failed to accept viewer, errno is %d", __func__, errno);
+    return;
+  }
+  // 消息在epoll线程中发送，viewer不读取时不能阻塞其他设备
+  if (set_nonblocking(client_fd) < 0) {
+    close(client_fd);
+    return;
+  }
+
+  pthread_mutex_lock(&gdev->stream_mutex);
+  stream_disconnect(gdev);
+  gdev->stream_event =
+      add_event(client_fd, EPOLLOUT, virtio_gpu_stream_client_handler, gdev);
+  if (gdev->stream_event == NULL) {
+    pthread_mutex_unlock(&gdev->stream_mutex);
+    log_error("%s can't register viewer event", __func__);
+    close(client_fd);
+    return;
+  }
+  // 还没有要发送的消息
+  pause_event(gdev->stream_event, EPOLLRDHUP);
+  __atomic_store_n(&gdev->stream_fd, client_fd, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&gdev->stream_mutex);
+  log_info("virtio gpu stream viewer connected");
+
+  // 新的viewer没有任何画面，由调度线程编码各scanout正在显示的画面
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    GPUScanout *scanout = &gdev->scanouts[i];
+    pthread_mutex_lock(&scanout->flip_mutex);
+    scanout->stream_resync = true;
+    pthread_mutex_unlock(&scanout->flip_mutex);
+    virtio_gpu_request_present(scanout);
+  }
+}
+
+static void virtio_gpu_stream_free_tiles(GPUScanout *scanout) {
+  free(scanout->stream_tile_hash);
+  free(scanout->stream_tile_dirty);
+  free(scanout->stream_tile);
+  free(scanout->stream_msg);
+  scanout->stream_tile_hash = NULL;
+  scanout->stream_tile_dirty = NULL;
+  scanout->stream_tile = NULL;
+  scanout->stream_msg = NULL;
+  scanout->stream_tiles_x = 0;
+  scanout->stream_tiles_y = 0;
+}
+
+static void virtio_gpu_stream_close(GPUDev *gdev) {
+  if (gdev->stream_listen_event != NULL) {
+    del_event(gdev->stream_listen_event);
+    gdev->stream_listen_event = NULL;
+  }
+  if (gdev->stream_listen_fd >= 0) {
+    close(gdev->stream_listen_fd);
+    unlink(gdev->stream_path);
+    gdev->stream_listen_fd = -1;
+  }
+  pthread_mutex_lock(&gdev->stream_mutex);
+  stream_disconnect(gdev);
+  pthread_mutex_unlock(&gdev->stream_mutex);
+  pthread_mutex_destroy(&gdev->stream_mutex);
+
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    virtio_gpu_stream_free_tiles(&gdev->scanouts[i]);
+  }
+}
+
+static int virtio_gpu_stream_init(GPUDev *gdev) {
+  struct sockaddr_un addr;
+
+  gdev->stream_listen_fd = -1;
+  gdev->stream_fd = -1;
+  gdev->stream_event = NULL;
+  TAILQ_INIT(&gdev->stream_queue);
+  pthread_mutex_init(&gdev->stream_mutex, NULL);
+
+  if (gdev->stream_path[0] == '\0' ||
+      strlen(gdev->stream_path) >= sizeof(addr.sun_path)) {
+    log_error("%s invalid unix socket path of stream display", __func__);
+    pthread_mutex_destroy(&gdev->stream_mutex);
+    return -1;
+  }
+
+  virtio_gpu_requested_mode(gdev);
+  // 画面在显示时就已经发送，只使用一个缓冲区以减少拷贝
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    gdev->scanouts[i].page_flip = false;
+  }
+
+  gdev->stream_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (gdev->stream_listen_fd < 0) {
+    log_error("%s failed to create unix socket, errno is %d", __func__, errno);
+    pthread_mutex_destroy(&gdev->stream_mutex);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, gdev->stream_path);
+  unlink(gdev->stream_path);
+  if (bind(gdev->stream_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) <
+          0 ||
+      listen(gdev->stream_listen_fd, 1) < 0 ||
+      set_nonblocking(gdev->stream_listen_fd) < 0) {
+    log_error("%s failed to listen on %s, errno is %d", __func__,
+              gdev->stream_path, errno);
+    virtio_gpu_stream_close(gdev);
+    return -1;
+  }
+  gdev->stream_listen_event =
+      add_event(gdev->stream_listen_fd, EPOLLIN,
+                virtio_gpu_stream_accept_handler, gdev);
+  if (gdev->stream_listen_event == NULL) {
+    log_error("%s can't register stream event", __func__);
+    virtio_gpu_stream_close(gdev);
+    return -1;
+  }
+
+  log_warn("virtio gpu streams frames on %s", gdev->stream_path);
+  return 0;
+}
+
+static int virtio_gpu_stream_create_buffer(GPUScanout *scanout,
+                                           GPUFrameBuffer *fb, int index) {
+  if (index == 0) {
+    // 分辨率可能改变，按新的分辨率重新分配tile
+    uint32_t tiles_x = (fb->width + TILE - 1) / TILE;
+    uint32_t tiles_y = (fb->height + TILE - 1) / TILE;
+    size_t tiles = (size_t)tiles_x * tiles_y;
+
+    virtio_gpu_stream_free_tiles(scanout);
+    scanout->stream_tile_hash = calloc(tiles, sizeof(uint64_t));
+    scanout->stream_tile_dirty = calloc(tiles, sizeof(uint8_t));
+    scanout->stream_tile = malloc(TILE_BYTES);
+    // 最坏情况下所有tile都需要发送，且都无法压缩
+    scanout->stream_msg =
+        malloc(sizeof(GPUStreamFrame) +
+               tiles * (sizeof(GPUStreamTile) + LZ4_BOUND(TILE_BYTES)));
+    if (!scanout->stream_tile_hash || !scanout->stream_tile_dirty ||
+        !scanout->stream_tile || !scanout->stream_msg) {
+      log_error("%s cannot alloc %dx%d tiles", __func__, tiles_x, tiles_y);
+      virtio_gpu_stream_free_tiles(scanout);
+      return -1;
+    }
+    scanout->stream_tiles_x = tiles_x;
+    scanout->stream_tiles_y = tiles_y;
+    // viewer中已有的画面是旧分辨率的
+    scanout->stream_resync = true;
+  }
+  return virtio_gpu_mem_create_buffer(scanout, fb, index);
+}
+
+const GPUDisplayBackend virtio_gpu_stream_backend = {
+    .name = "stream",
+    .init = virtio_gpu_stream_init,
+    .close = virtio_gpu_stream_close,
+    .create_buffer = virtio_gpu_stream_create_buffer,
+    .destroy_buffer = virtio_gpu_mem_destroy_buffer,
+    .show = virtio_gpu_stream_show,
+};
@@ -0,0 +1,662 @@
+#include "event_monitor.h"
+#include "log.h"
+#include "virtio.h"
+#include "virtio_gpu.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GPU_TRACE_MAGIC 0x54475648 // "HVGT"
+// 2: 命令执行完后才记录，其读取的guest内存紧挨在命令之前
+#define GPU_TRACE_VERSION 2
+
+// 文件开头，回放时按此重建zone内存和scanout
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t zone_id;
+  uint32_t nr_scanouts;
+  uint32_t width[HVISOR_VIRTIO_GPU_MAX_SCANOUTS];
+  uint32_t height[HVISOR_VIRTIO_GPU_MAX_SCANOUTS];
+  uint64_t hostmem_budget;
+  uint32_t nr_rams;
+  uint32_t reserved;
+  uint64_t ram_ipa[MAX_RAMS];
+  uint64_t ram_size[MAX_RAMS];
+} __attribute__((packed)) GPUTraceHeader;
+
+enum {
+  GPU_TRACE_CMD = 1, // GPUTraceCmd，iov_cnt个长度，之后是各iov的内容
+  // GPUTraceMem，之后是rows * row_bytes字节，属于其后的第一条CMD
+  GPU_TRACE_MEM = 2,
+};
+
+// 每条记录的开头，len不包括自身
+typedef struct {
+  uint32_t type;
+  uint32_t len;
+  uint64_t time_ns;
+} __attribute__((packed)) GPUTraceRecord;
+
+typedef struct {
+  uint32_t queue;
+  uint32_t iov_cnt;
+} __attribute__((packed)) GPUTraceCmd;
+
+typedef struct {
+  uint32_t resource_id;
+  uint32_t stride;
+  uint64_t offset;
+  uint32_t row_bytes;
+  uint32_t rows;
+} __attribute__((packed)) GPUTraceMem;
+
+// 描述符链很短，超过时不记录
+#define GPU_TRACE_MAX_IOVS 64
+
+// 命令执行中读取的guest内存，data为完整的MEM记录
+typedef struct virtio_gpu_trace_snapshot {
+  struct virtio_gpu_trace_snapshot *next;
+  size_t len;
+  uint8_t data[];
+} GPUTraceSnapshot;
+
+static uint64_t trace_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+GPUTrace *virtio_gpu_trace_open(const char *path, VirtIODevice *vdev) {
+  GPUDev *gdev = vdev->dev;
+  GPUTraceHeader header;
+  GPUTrace *trace = NULL;
+  uint64_t ram_ipa[MAX_RAMS], ram_size[MAX_RAMS];
+
+  memset(&header, 0, sizeof(header));
+  header.magic = GPU_TRACE_MAGIC;
+  header.version = GPU_TRACE_VERSION;
+  header.zone_id = vdev->zone_id;
+  header.nr_scanouts = gdev->scanouts_num;
+  for (uint32_t i = 0; i < gdev->scanouts_num; ++i) {
+    header.width[i] = gdev->scanouts[i].display_width;
+    header.height[i] = gdev->scanouts[i].display_height;
+  }
+  header.hostmem_budget = gdev->hostmem_budget;
+  header.nr_rams = virtio_zone_ram_regions(vdev->zone_id, ram_ipa, ram_size);
+  for (uint32_t i = 0; i < header.nr_rams; ++i) {
+    header.ram_ipa[i] = ram_ipa[i];
+    header.ram_size[i] = ram_size[i];
+  }
+
+  trace = calloc(1, sizeof(GPUTrace));
+  if (trace == NULL) {
+    return NULL;
+  }
+  trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace->fd < 0) {
+    log_error("%s cannot open %s, errno is %d", __func__, path, errno);
+    free(trace);
+    return NULL;
+  }
+  if (write(trace->fd, &header, sizeof(header)) != sizeof(header)) {
+    log_error("%s cannot write header to %s, errno is %d", __func__, path,
+              errno);
+    close(trace->fd);
+    free(trace);
+    return NULL;
+  }
+  pthread_mutex_init(&trace->mtx, NULL);
+  trace->size = sizeof(header);
+  trace->start_ns = trace_now_ns();
+
+  log_info("virtio gpu of zone %d records commands to %s", vdev->zone_id,
+           path);
+  return trace;
+}
+
+void virtio_gpu_trace_close(GPUTrace *trace) {
+  if (trace == NULL) {
+    return;
+  }
+  log_info("virtio gpu trace closed with %lu bytes", trace->size);
+  close(trace->fd);
+  pthread_mutex_destroy(&trace->mtx);
+  free(trace);
+}
+
+// 写入一条记录，调用者需持有trace->mtx
+static void trace_write(GPUTrace *trace, struct iovec *iov, int iov_cnt,
+                        size_t len) {
+  if (trace->stopped) {
+    return;
+  }
+  if (trace->size + len > VIRTIO_GPU_TRACE_MAX_BYTES) {
+    log_warn("%s trace reaches %llu bytes, stop recording", __func__,
+             VIRTIO_GPU_TRACE_MAX_BYTES);
+    trace->stopped = true;
+    return;
+  }
+  if (writev(trace->fd, iov, iov_cnt) != (ssize_t)len) {
+    log_error("%s failed to write trace, errno is %d, stop recording",
+              __func__, errno);
+    trace->stopped = true;
+    return;
+  }
+  trace->size += len;
+}
+
+// 释放gcmd没有记录的guest内存
+static void trace_free_snapshots(GPUCommand *gcmd) {
+  GPUTraceSnapshot *snap = gcmd->trace_mem, *next = NULL;
+
+  while (snap != NULL) {
+    next = snap->next;
+    free(snap);
+    snap = next;
+  }
+  gcmd->trace_mem = NULL;
+}
+
+void virtio_gpu_trace_cmd(GPUTrace *trace, GPUCommand *gcmd) {
+  struct iovec iov[GPU_TRACE_MAX_IOVS + 3];
+  uint32_t lens[GPU_TRACE_MAX_IOVS];
+  GPUTraceRecord record;
+  GPUTraceCmd cmd;
+  GPUTraceSnapshot *snap = NULL;
+  size_t len = 0;
+
+  if (trace == NULL || gcmd->resp_iov_cnt > GPU_TRACE_MAX_IOVS) {
+    trace_free_snapshots(gcmd);
+    return;
+  }
+
+  // 记录包括响应用的描述符，回放时按相同的布局重建iov
+  cmd.queue = gcmd->from_queue;
+  cmd.iov_cnt = gcmd->resp_iov_cnt;
+  for (uint32_t i = 0; i < gcmd->resp_iov_cnt; ++i) {
+    lens[i] = gcmd->resp_iov[i].iov_len;
+    iov[3 + i] = gcmd->resp_iov[i];
+    len += lens[i];
+  }
+  len += sizeof(cmd) + sizeof(uint32_t) * cmd.iov_cnt;
+  record.type = GPU_TRACE_CMD;
+  record.len = len;
+  iov[0] = (struct iovec){&record, sizeof(record)};
+  iov[1] = (struct iovec){&cmd, sizeof(cmd)};
+  iov[2] = (struct iovec){lens, sizeof(uint32_t) * cmd.iov_cnt};
+
+  // 其他工作线程的记录不能插在命令和它读取的内存之间
+  pthread_mutex_lock(&trace->mtx);
+  record.time_ns = trace_now_ns() - trace->start_ns;
+  for (snap = gcmd->trace_mem; snap != NULL; snap = snap->next) {
+    struct iovec mem_iov = {snap->data, snap->len};
+    memcpy(snap->data + offsetof(GPUTraceRecord, time_ns), &record.time_ns,
+           sizeof(record.time_ns));
+    trace_write(trace, &mem_iov, 1, snap->len);
+  }
+  trace_write(trace, iov, 3 + cmd.iov_cnt, sizeof(record) + len);
+  pthread_mutex_unlock(&trace->mtx);
+  trace_free_snapshots(gcmd);
+}
+
+void virtio_gpu_trace_mem(GPUTrace *trace, GPUCommand *gcmd,
+                          GPUSimpleResource *res, uint64_t offset,
+                          uint32_t stride, uint32_t row_bytes, uint32_t rows) {
+  GPUTraceSnapshot *snap = NULL, **tail = &gcmd->trace_mem;
+  GPUTraceRecord record;
+  GPUTraceMem mem;
+  size_t bytes = (size_t)row_bytes * rows;
+  uint8_t *p = NULL;
+
+  if (trace == NULL || bytes == 0) {
+    return;
+  }
+
+  // 在执行时从guest backing读出，transfer之后guest可能继续修改
+  snap = malloc(sizeof(GPUTraceSnapshot) + sizeof(record) + sizeof(mem) +
+                bytes);
+  if (snap == NULL) {
+    log_error("%s cannot alloc %lu bytes", __func__, bytes);
+    return;
+  }
+  mem.resource_id = res->resource_id;
+  mem.stride = stride;
+  mem.offset = offset;
+  mem.row_bytes = row_bytes;
+  mem.rows = rows;
+  record.type = GPU_TRACE_MEM;
+  record.len = sizeof(mem) + bytes;
+  record.time_ns = 0; // 记录命令时填写
+  p = snap->data;
+  memcpy(p, &record, sizeof(record));
+  p += sizeof(record);
+  memcpy(p, &mem, sizeof(mem));
+  p += sizeof(mem);
+  for (uint32_t y = 0; y < rows; ++y) {
+    iov_to_buf_full(res->iov, res->iov_cnt, offset + (uint64_t)stride * y,
+                    p + (size_t)row_bytes * y, row_bytes);
+  }
+  snap->len = sizeof(record) + record.len;
+
+  // 按读取的顺序记录
+  snap->next = NULL;
+  while (*tail != NULL) {
+    tail = &(*tail)->next;
+  }
+  *tail = snap;
+}
+
+// 回放中一种命令的统计
+typedef struct {
+  uint32_t type;
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[VIRTIO_GPU_TRACE_BUCKETS];
+} GPUReplayStat;
+
+// 足够容纳virtio gpu的所有命令类型
+#define GPU_REPLAY_MAX_TYPES 32
+
+typedef struct {
+  GPUReplayStat stats[GPU_REPLAY_MAX_TYPES];
+  int nr_stats;
+  uint64_t cmds;
+  uint64_t skipped;  // 3D命令，回放时没有virglrenderer
+  uint64_t mem_miss; // MEM记录找不到resource或backing
+  uint64_t frames;   // 更新了scanout的flush
+  uint64_t busy_ns;  // 执行命令的总时间
+  uint64_t last_ns;  // 最后一条记录的时间，即记录的时长
+} GPUReplay;
+
+static const char *replay_cmd_name(uint32_t type) {
+  switch (type) {
+  case VIRTIO_GPU_CMD_GET_DISPLAY_INFO:
+    return "GET_DISPLAY_INFO";
+  case VIRTIO_GPU_CMD_RESOURCE_CREATE_2D:
+    return "RESOURCE_CREATE_2D";
+  case VIRTIO_GPU_CMD_RESOURCE_UNREF:
+    return "RESOURCE_UNREF";
+  case VIRTIO_GPU_CMD_SET_SCANOUT:
+    return "SET_SCANOUT";
+  case VIRTIO_GPU_CMD_RESOURCE_FLUSH:
+    return "RESOURCE_FLUSH";
+  case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
+    return "TRANSFER_TO_HOST_2D";
+  case VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING:
+    return "ATTACH_BACKING";
+  case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
+    return "DETACH_BACKING";
+  case VIRTIO_GPU_CMD_GET_EDID:
+    return "GET_EDID";
+  case VIRTIO_GPU_CMD_RESOURCE_CREATE_BLOB:
+    return "RESOURCE_CREATE_BLOB";
+  case VIRTIO_GPU_CMD_SET_SCANOUT_BLOB:
+    return "SET_SCANOUT_BLOB";
+  case VIRTIO_GPU_CMD_UPDATE_CURSOR:
+    return "UPDATE_CURSOR";
+  case VIRTIO_GPU_CMD_MOVE_CURSOR:
+    return "MOVE_CURSOR";
+  default:
+    return "OTHER";
+  }
+}
+
+static void replay_account(GPUReplay *replay, uint32_t type, uint64_t ns) {
+  GPUReplayStat *stat = NULL;
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+
+  for (int i = 0; i < replay->nr_stats && stat == NULL; ++i) {
+    if (replay->stats[i].type == type) {
+      stat = &replay->stats[i];
+    }
+  }
+  if (stat == NULL) {
+    if (replay->nr_stats == GPU_REPLAY_MAX_TYPES) {
+      return;
+    }
+    stat = &replay->stats[replay->nr_stats++];
+    stat->type = type;
+  }
+
+  // 桶i包含[2^(i-1), 2^i)微秒，桶0为不到1微秒
+  while (us != 0 && bucket < VIRTIO_GPU_TRACE_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  stat->count++;
+  stat->total_ns += ns;
+  stat->max_ns = MAX(stat->max_ns, ns);
+  stat->buckets[bucket]++;
+  replay->busy_ns += ns;
+}
+
+// 执行一条CMD记录，data在命令执行完之前都要有效
+static void replay_cmd(GPUReplay *replay, VirtIODevice *vdev, uint8_t *data,
+                       uint32_t len) {
+  GPUTraceCmd cmd;
+  GPUCommand *gcmd = NULL;
+  uint32_t *lens = NULL;
+  uint8_t *p = NULL;
+  uint64_t start = 0, ns = 0;
+  bool presented = false;
+
+  if (len < sizeof(cmd)) {
+    return;
+  }
+  memcpy(&cmd, data, sizeof(cmd));
+  if (cmd.iov_cnt == 0 || cmd.iov_cnt > GPU_TRACE_MAX_IOVS ||
+      cmd.queue >= GPU_MAX_QUEUES ||
+      len < sizeof(cmd) + sizeof(uint32_t) * cmd.iov_cnt) {
+    log_error("%s found a broken command record", __func__);
+    return;
+  }
+  lens = (uint32_t *)(data + sizeof(cmd));
+  p = data + sizeof(cmd) + sizeof(uint32_t) * cmd.iov_cnt;
+
+  gcmd = calloc(1, sizeof(GPUCommand));
+  gcmd->resp_iov = malloc(sizeof(struct iovec) * cmd.iov_cnt);
+  gcmd->resp_iov_cnt = cmd.iov_cnt;
+  gcmd->from_queue = cmd.queue;
+  for (uint32_t i = 0; i < cmd.iov_cnt; ++i) {
+    if (p + lens[i] > data + len) {
+      log_error("%s found a broken command record", __func__);
+      free(gcmd->resp_iov);
+      free(gcmd);
+      return;
+    }
+    gcmd->resp_iov[i].iov_base = p;
+    gcmd->resp_iov[i].iov_len = lens[i];
+    p += lens[i];
+  }
+  iov_to_buf(gcmd->resp_iov, gcmd->resp_iov_cnt, 0, &gcmd->control_header,
+             sizeof(gcmd->control_header));
+
+  // 没有virglrenderer，3D命令只计数
+  if ((gcmd->control_header.type >= VIRTIO_GPU_CMD_CTX_CREATE &&
+       gcmd->control_header.type <= VIRTIO_GPU_CMD_SUBMIT_3D) ||
+      gcmd->control_header.type == VIRTIO_GPU_CMD_GET_CAPSET ||
+      gcmd->control_header.type == VIRTIO_GPU_CMD_GET_CAPSET_INFO) {
+    replay->skipped++;
+    free(gcmd->resp_iov);
+    free(gcmd);
+    return;
+  }
+
+  // 不经过调度线程，deferred为false，带fence的命令也立刻响应
+  start = trace_now_ns();
+  if (cmd.queue == GPU_CURSOR_QUEUE) {
+    virtio_gpu_process_cursor(vdev, gcmd);
+  } else {
+    virtio_gpu_simple_process_cmd(gcmd, vdev);
+  }
+  ns = trace_now_ns() - start;
+
+  for (int i = 0; i < HVISOR_VIRTIO_GPU_MAX_SCANOUTS; ++i) {
+    presented = presented || gcmd->wait_seq[i] != 0;
+  }
+  if (presented && gcmd->control_header.type == VIRTIO_GPU_CMD_RESOURCE_FLUSH) {
+    replay->frames++;
+  }
+  replay->cmds++;
+  replay_account(replay, gcmd->control_header.type, ns);
+  free(gcmd);
+}
+
+// 将记录的backing内容写回resource，之后的flush从中拷贝
+static void replay_mem(GPUReplay *replay, GPUDev *gdev, uint8_t *data,
+                       uint32_t len) {
+  GPUTraceMem mem;
+  GPUSimpleResource *res = NULL;
+
+  if (len < sizeof(mem)) {
+    return;
+  }
+  memcpy(&mem, data, sizeof(mem));
+  if (len - sizeof(mem) < (uint64_t)mem.row_bytes * mem.rows) {
+    log_error("%s found a broken memory record", __func__);
+    return;
+  }
+  res = virtio_gpu_find_resource(gdev, mem.resource_id);
+  if (res == NULL || res->iov == NULL) {
+    replay->mem_miss++;
+    return;
+  }
+  for (uint32_t y = 0; y < mem.rows; ++y) {
+    buf_to_iov_full(res->iov, res->iov_cnt,
+                    mem.offset + (uint64_t)mem.stride * y,
+                    data + sizeof(mem) + (size_t)mem.row_bytes * y,
+                    mem.row_bytes);
+  }
+}
+
+static void replay_report(GPUReplay *replay, uint64_t wall_ns) {
+  printf("replayed %lu commands in %.3f ms (%.3f ms busy), %lu 3d commands "
+         "skipped, %lu memory records without backing\n",
+         replay->cmds, wall_ns / 1e6, replay->busy_ns / 1e6, replay->skipped,
+         replay->mem_miss);
+  printf("%lu frames, %.1f fps replayed, %.1f fps recorded\n", replay->frames,
+         wall_ns ? replay->frames * 1e9 / wall_ns : 0.0,
+         replay->last_ns ? replay->frames * 1e9 / replay->last_ns : 0.0);
+  printf("| %20s | %8s | %10s | %10s | latency histogram (us: count)\n",
+         "command", "count", "avg(us)", "max(us)");
+  for (int i = 0; i < replay->nr_stats; ++i) {
+    GPUReplayStat *stat = &replay->stats[i];
+    printf("| %20s | %8lu | %10.1f | %10.1f |", replay_cmd_name(stat->type),
+           stat->count, stat->total_ns / 1e3 / stat->count,
+           stat->max_ns / 1e3);
+    for (int b = 0; b < VIRTIO_GPU_TRACE_BUCKETS; ++b) {
+      if (stat->buckets[b] == 0) {
+        continue;
+      }
+      if (b == VIRTIO_GPU_TRACE_BUCKETS - 1) {
+        printf(" >=%lu: %lu", 1UL << (b - 1), stat->buckets[b]);
+      } else {
+        printf(" <%lu: %lu", 1UL << b, stat->buckets[b]);
+      }
+    }
+    printf("\n");
+  }
+}
+
+// 按记录的zone内存布局预留地址空间，只有被使用的页才会分配
+static int replay_map_rams(GPUTraceHeader *header, void **rams) {
+  if (header->zone_id >= MAX_ZONES || header->nr_rams > MAX_RAMS) {
+    log_error("%s found invalid zone %d with %d rams", __func__,
+              header->zone_id, header->nr_rams);
+    return -1;
+  }
+  for (uint32_t i = 0; i < header->nr_rams; ++i) {
+    rams[i] = mmap(NULL, header->ram_size[i], PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (rams[i] == MAP_FAILED) {
+      log_error("%s cannot reserve %#lx bytes for ram %d", __func__,
+                header->ram_size[i], i);
+      rams[i] = NULL;
+      return -1;
+    }
+    virtio_zone_ram_set(header->zone_id, i, rams[i], header->ram_ipa[i],
+                        header->ram_size[i]);
+  }
+  return 0;
+}
+
+static void replay_unmap_rams(GPUTraceHeader *header, void **rams) {
+  for (uint32_t i = 0; i < header->nr_rams; ++i) {
+    if (rams[i] != NULL) {
+      munmap(rams[i], header->ram_size[i]);
+      virtio_zone_ram_set(header->zone_id, i, NULL, 0, 0);
+    }
+  }
+}
+
+// 创建一个不属于任何zone的virtio gpu，响应写入本地的used ring
+static VirtIODevice *replay_create_device(GPUTraceHeader *header,
+                                          GPUBackendType backend,
+                                          const char *socket_path,
+                                          void **rings) {
+  GPURequestedScanouts *requested = calloc(1, sizeof(GPURequestedScanouts));
+  VirtIODevice *vdev = calloc(1, sizeof(VirtIODevice));
+
+  if (requested == NULL || vdev == NULL) {
+    free(requested);
+    free(vdev);
+    return NULL;
+  }
+  requested->nr_scanouts =
+      MIN(header->nr_scanouts, HVISOR_VIRTIO_GPU_MAX_SCANOUTS);
+  for (int i = 0; i < requested->nr_scanouts; ++i) {
+    requested->states[i].width = header->width[i];
+    requested->states[i].height = header->height[i];
+  }
+  requested->backend = backend;
+  if (socket_path != NULL) {
+    strncpy(requested->socket, socket_path, sizeof(requested->socket) - 1);
+  }
+  requested->hostmem = header->hostmem_budget;
+  // 回放不经过调度线程，推迟的显示不会被执行
+  requested->unpaced = true;
+
+  init_mmio_regs(&vdev->regs, VirtioTGPU);
+  vdev->zone_id = header->zone_id;
+  vdev->type = VirtioTGPU;
+  vdev->regs.dev_feature = GPU_SUPPORTED_FEATURES;
+  vdev->dev = init_gpu_dev(requested);
+  free(requested);
+  if (vdev->dev == NULL) {
+    free(vdev);
+    return NULL;
+  }
+  init_virtio_queue(vdev, VirtioTGPU);
+  for (uint32_t i = 0; i < vdev->vqs_len; ++i) {
+    rings[i] = calloc(1, sizeof(VirtqUsed) +
+                             sizeof(VirtqUsedElem) * VIRT_QUEUE_SIZE +
+                             sizeof(uint16_t));
+    vdev->vqs[i].num = VIRT_QUEUE_SIZE;
+    vdev->vqs[i].used_ring = rings[i];
+  }
+  // 与create_virtio_device一样，初始化失败时只释放vdev
+  if (virtio_gpu_init(vdev) != 0) {
+    free(vdev->vqs);
+    free(vdev);
+    return NULL;
+  }
+  return vdev;
+}
+
+int virtio_gpu_replay(int argc, char *argv[]) {
+  GPUBackendType backend = GPU_BACKEND_NULL;
+  const char *socket_path = NULL;
+  GPUTraceHeader header;
+  GPUTraceRecord record;
+  GPUReplay *replay = NULL;
+  VirtIODevice *vdev = NULL;
+  void *rams[MAX_RAMS] = {NULL};
+  void *rings[GPU_MAX_QUEUES] = {NULL};
+  uint8_t *data = NULL;
+  uint64_t start = 0;
+  FILE *fp = NULL;
+  int err = -1;
+
+  if (argc < 1 || argc > 3) {
+    printf("usage: hvisor virtio gpu-replay <trace> "
+           "[drm|shm|null|stream <socket>]\n");
+    return -1;
+  }
+  if (argc >= 2) {
+    if (strcmp(argv[1], "drm") == 0) {
+      backend = GPU_BACKEND_DRM;
+    } else if (strcmp(argv[1], "shm") == 0) {
+      backend = GPU_BACKEND_SHM;
+    } else if (strcmp(argv[1], "stream") == 0) {
+      backend = GPU_BACKEND_STREAM;
+    } else if (strcmp(argv[1], "null") != 0) {
+      printf("unknown gpu display %s\n", argv[1]);
+      return -1;
+    }
+  }
+  // 只有stream后端需要监听的unix socket
+  if ((backend == GPU_BACKEND_STREAM) != (argc == 3)) {
+    printf("usage: hvisor virtio gpu-replay <trace> "
+           "[drm|shm|null|stream <socket>]\n");
+    return -1;
+  }
+  if (argc == 3) {
+    socket_path = argv[2];
+  }
+
+  fp = fopen(argv[0], "rb");
+  if (fp == NULL) {
+    printf("cannot open %s: %s\n", argv[0], strerror(errno));
+    return -1;
+  }
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      header.magic != GPU_TRACE_MAGIC) {
+    printf("%s is not a virtio gpu trace\n", argv[0]);
+    fclose(fp);
+    return -1;
+  }
+  if (header.version != GPU_TRACE_VERSION) {
+    printf("%s is a version %d trace, only version %d can be replayed\n",
+           argv[0], header.version, GPU_TRACE_VERSION);
+    fclose(fp);
+    return -1;
+  }
+  // drm后端的翻页和hotplug事件、stream后端的viewer连接都由epoll线程处理
+  if (initialize_event_monitor() < 0) {
+    printf("cannot initialize event monitor\n");
+    fclose(fp);
+    return -1;
+  }
+  if (replay_map_rams(&header, rams) < 0) {
+    goto out;
+  }
+  vdev = replay_create_device(&header, backend, socket_path, rings);
+  if (vdev == NULL) {
+    printf("cannot create virtio gpu for replay\n");
+    goto out;
+  }
+
+  replay = calloc(1, sizeof(GPUReplay));
+  start = trace_now_ns();
+  // 记录在停止时可能不完整，只回放完整的部分
+  // MEM记录紧挨在读取它的命令之前，先写回guest backing再执行命令
+  while (fread(&record, sizeof(record), 1, fp) == 1) {
+    data = malloc(MAX(record.len, 1));
+    if (data == NULL || fread(data, 1, record.len, fp) != record.len) {
+      free(data);
+      break;
+    }
+    if (record.type == GPU_TRACE_CMD) {
+      replay_cmd(replay, vdev, data, record.len);
+    } else if (record.type == GPU_TRACE_MEM) {
+      replay_mem(replay, vdev->dev, data, record.len);
+    }
+    free(data);
+    replay->last_ns = record.time_ns;
+  }
+  replay_report(replay, trace_now_ns() - start);
+  err = 0;
+
+out:
+  if (vdev != NULL) {
+    virtio_gpu_close(vdev);
+  }
+  for (int i = 0; i < GPU_MAX_QUEUES; ++i) {
+    free(rings[i]);
+  }
+  replay_unmap_rams(&header, rams);
+  free(replay);
+  fclose(fp);
+  destroy_event_monitor();
+  return err;
+}
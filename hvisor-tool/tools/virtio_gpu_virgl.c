@@ -0,0 +1,600 @@
+#include "log.h"
+#include "sys/queue.h"
+#include "virtio.h"
+#include "virtio_gpu.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void virtio_gpu_get_capset_info(VirtIODevice *vdev, GPUCommand *gcmd) {
+  log_debug("entering %s", __func__);
+
+  struct virtio_gpu_get_capset_info info;
+  struct virtio_gpu_resp_capset_info resp;
+  GPUDev *gdev = vdev->dev;
+
+  VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, info);
+
+  // 没有virgl时num_capsets为0，驱动不会查询
+  if (info.capset_index >= gdev->config.num_capsets) {
+    log_error("%s trying to get capset %d", __func__, info.capset_index);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    return;
+  }
+
+  memset(&resp, 0, sizeof(resp));
+  resp.hdr.type = VIRTIO_GPU_RESP_OK_CAPSET_INFO;
+  resp.capset_id = gdev->capsets[info.capset_index].id;
+  resp.capset_max_version = gdev->capsets[info.capset_index].max_version;
+  resp.capset_max_size = gdev->capsets[info.capset_index].max_size;
+  virtio_gpu_ctrl_response(vdev, gcmd, &resp.hdr, sizeof(resp));
+}
+
+#ifdef HVISOR_VIRTIO_GPU_VIRGL
+
+#include <virglrenderer.h>
+
+// gallium的PIPE_TEXTURE_2D，只有这种resource可以作为scanout显示
+#define VIRGL_TARGET_TEXTURE_2D 2
+
+// virglrenderer完成fence时调用，只会在virgl线程的virgl_renderer_poll中发生
+static void virtio_gpu_virgl_write_fence(void *cookie, uint32_t fence) {
+  GPUDev *gdev = cookie;
+  // 创建fence时只传入了序号的低32位，按最近创建的序号恢复高位
+  uint64_t done = (gdev->virgl_fence_seq & ~0xffffffffULL) | fence;
+
+  if (done > gdev->virgl_fence_seq) {
+    done -= 1ULL << 32;
+  }
+  __atomic_store_n(&gdev->virgl_fence_done, done, __ATOMIC_RELEASE);
+  log_debug("%s virgl fence %llu done", __func__, (unsigned long long)done);
+  // 调度线程重新检查fence_queue
+  virtio_gpu_fence_wakeup(gdev);
+}
+
+static struct virgl_renderer_callbacks virtio_gpu_virgl_cbs = {
+    .version = 1,
+    .write_fence = virtio_gpu_virgl_write_fence,
+};
+
+int virtio_gpu_virgl_init(GPUDev *gdev) {
+  uint32_t ids[] = {VIRTIO_GPU_CAPSET_VIRGL, VIRTIO_GPU_CAPSET_VIRGL2};
+
+  // 默认使用llvmpipe软件渲染，不依赖host的GPU，可以通过环境变量覆盖
+  setenv("LIBGL_ALWAYS_SOFTWARE", "1", 0);
+  setenv("GALLIUM_DRIVER", "llvmpipe", 0);
+
+  if (virgl_renderer_init(gdev,
+                          VIRGL_RENDERER_USE_EGL |
+                              VIRGL_RENDERER_USE_SURFACELESS,
+                          &virtio_gpu_virgl_cbs) != 0) {
+    log_error("%s failed to init virglrenderer", __func__);
+    return -1;
+  }
+
+  gdev->config.num_capsets = 0;
+  for (int i = 0; i < VIRTIO_GPU_MAX_CAPSETS; ++i) {
+    GPUCapset *capset = &gdev->capsets[gdev->config.num_capsets];
+    capset->id = ids[i];
+    virgl_renderer_get_cap_set(ids[i], &capset->max_version,
+                               &capset->max_size);
+    if (capset->max_size == 0) {
+      continue;
+    }
+    log_info("virgl capset %d version %d size %d", capset->id,
+             capset->max_version, capset->max_size);
+    gdev->config.num_capsets++;
+  }
+  if (gdev->config.num_capsets == 0) {
+    log_error("%s virglrenderer provides no capset", __func__);
+    virgl_renderer_cleanup(gdev);
+    return -1;
+  }
+
+  gdev->virgl_fence_seq = 0;
+  gdev->virgl_fence_done = 0;
+  return 0;
+}
+
+void virtio_gpu_virgl_cleanup(GPUDev *gdev) { virgl_renderer_cleanup(gdev); }
+
+void virtio_gpu_virgl_poll(void) { virgl_renderer_poll(); }
+
+uint64_t virtio_gpu_virgl_create_fence(GPUDev *gdev, GPUCommand *gcmd) {
+  uint64_t seq = gdev->virgl_fence_seq + 1;
+
+  // fence在之前提交的所有3D命令完成后才会完成
+  if (virgl_renderer_create_fence((uint32_t)seq,
+                                  gcmd->control_header.ctx_id) != 0) {
+    log_error("%s failed to create virgl fence for ctx %d", __func__,
+              gcmd->control_header.ctx_id);
+    return 0;
+  }
+  gdev->virgl_fence_seq = seq;
+  return seq;
+}
+
+bool virtio_gpu_virgl_cmd(GPUDev *gdev, GPUCommand *gcmd) {
+  GPUSimpleResource *res = NULL;
+  uint32_t resource_id = 0;
+  size_t offset = 0;
+
+  if (!gdev->virgl) {
+    return false;
+  }
+
+  switch (gcmd->control_header.type) {
+  case VIRTIO_GPU_CMD_CTX_CREATE:
+  case VIRTIO_GPU_CMD_CTX_DESTROY:
+  case VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE:
+  case VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE:
+  case VIRTIO_GPU_CMD_RESOURCE_CREATE_3D:
+  case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D:
+  case VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D:
+  case VIRTIO_GPU_CMD_SUBMIT_3D:
+  case VIRTIO_GPU_CMD_GET_CAPSET:
+    return true;
+  // 这些2D命令的resource_id都紧跟在cmd_hdr之后
+  case VIRTIO_GPU_CMD_RESOURCE_UNREF:
+  case VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING:
+  case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
+    offset = offsetof(struct virtio_gpu_resource_unref, resource_id);
+    break;
+  case VIRTIO_GPU_CMD_RESOURCE_FLUSH:
+    offset = offsetof(struct virtio_gpu_resource_flush, resource_id);
+    break;
+  case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
+    offset = offsetof(struct virtio_gpu_transfer_to_host_2d, resource_id);
+    break;
+  default:
+    return false;
+  }
+
+  if (iov_to_buf(gcmd->resp_iov, gcmd->resp_iov_cnt, offset, &resource_id,
+                 sizeof(resource_id)) != sizeof(resource_id)) {
+    return false;
+  }
+  // 调度时没有独占的命令在执行，resource表不会改变
+  res = virtio_gpu_find_resource(gdev, resource_id);
+  return res != NULL && res->virgl;
+}
+
+static void virtio_gpu_virgl_ctx_create(GPUCommand *gcmd) {
+  struct virtio_gpu_ctx_create create;
+  int ret = 0;
+
+  VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, create);
+
+  create.nlen = MIN(create.nlen, sizeof(create.debug_name));
+  if (create.context_init != 0) {
+    // VIRTIO_GPU_F_CONTEXT_INIT，低8位为capset id
+    ret = virgl_renderer_context_create_with_flags(
+        create.hdr.ctx_id, create.context_init, create.nlen,
+        create.debug_name);
+  } else {
+    ret = virgl_renderer_context_create(create.hdr.ctx_id, create.nlen,
+                                        create.debug_name);
+  }
+  if (ret != 0) {
+    log_error("%s failed to create ctx %d, error %d", __func__,
+              create.hdr.ctx_id, ret);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_CONTEXT_ID;
+  }
+}
+
+static void virtio_gpu_virgl_ctx_resource(GPUCommand *gcmd, bool attach) {
+  struct virtio_gpu_ctx_resource ctx_res;
+
+  VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, ctx_res);
+
+  if (attach) {
+    virgl_renderer_ctx_attach_resource(ctx_res.hdr.ctx_id,
+                                       ctx_res.resource_id);
+  } else {
+    virgl_renderer_ctx_detach_resource(ctx_res.hdr.ctx_id,
+                                       ctx_res.resource_id);
+  }
+}
+
+static void virtio_gpu_virgl_resource_create_3d(VirtIODevice *vdev,
+                                                GPUCommand *gcmd) {
+  struct virtio_gpu_resource_create_3d create;
+  struct virgl_renderer_resource_create_args args;
+  GPUDev *gdev = vdev->dev;
+  GPUSimpleResource *res = NULL;
+  uint32_t bpp = 0;
+
+  VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, create);
+
+  if (create.resource_id == 0) {
+    log_error("%s trying to create 3d resource with id 0", __func__);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+    return;
+  }
+  if (virtio_gpu_find_resource(gdev, create.resource_id)) {
+    log_error("%s trying to create an existing resource with id %d", __func__,
+              create.resource_id);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+    return;
+  }
+
+  res = calloc(1, sizeof(GPUSimpleResource));
+  if (res == NULL) {
+    gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+    return;
+  }
+  res->width = create.width;
+  res->height = create.height;
+  res->format = create.format;
+  res->resource_id = create.resource_id;
+  res->virgl = true;
+
+  // 可显示的resource需要一个host缓冲区，flush时读回画面供2D流程拷贝
+  bpp = virtio_gpu_format_bpp(create.format);
+  if (create.target == VIRGL_TARGET_TEXTURE_2D && bpp != 0 &&
+      create.depth == 1 && create.array_size == 1 && create.width != 0 &&
+      create.height != 0) {
+    res->hostmem = calc_image_hostmem(bpp, create.width, create.height);
+    res->stride = res->hostmem / res->height;
+    if (!virtio_gpu_hostmem_charge(gdev, NULL, res->hostmem)) {
+      log_error("virtio gpu for zone %d out of hostmem when trying to create "
+                "3d resource %d",
+                vdev->zone_id, create.resource_id);
+      free(res);
+      gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+      return;
+    }
+    res->shadow = calloc(1, res->hostmem);
+    res->iov = malloc(sizeof(struct iovec));
+    if (res->shadow == NULL || res->iov == NULL) {
+      log_error("%s cannot alloc shadow of resource %d", __func__,
+                create.resource_id);
+      goto err;
+    }
+    res->iov[0].iov_base = res->shadow;
+    res->iov[0].iov_len = res->hostmem;
+    res->iov_cnt = 1;
+  }
+
+  memset(&args, 0, sizeof(args));
+  args.handle = create.resource_id;
+  args.target = create.target;
+  args.format = create.format;
+  args.bind = create.bind;
+  args.width = create.width;
+  args.height = create.height;
+  args.depth = create.depth;
+  args.array_size = create.array_size;
+  args.last_level = create.last_level;
+  args.nr_samples = create.nr_samples;
+  args.flags = create.flags;
+  if (virgl_renderer_resource_create(&args, NULL, 0) != 0) {
+    log_error("%s virglrenderer cannot create resource %d", __func__,
+              create.resource_id);
+    goto err;
+  }
+
+  if (virtio_gpu_resource_table_insert(gdev, res) != 0) {
+    log_error("%s cannot alloc memory for resource table", __func__);
+    virgl_renderer_resource_unref(create.resource_id);
+    goto err;
+  }
+  TAILQ_INSERT_HEAD(&gdev->resource_list, res, next);
+
+  log_debug("add a 3d resource %d to gpu dev of zone %d, target: %d width: "
+            "%d height: %d format: %d shadow: %llu bytes",
+            res->resource_id, vdev->zone_id, create.target, res->width,
+            res->height, res->format, (unsigned long long)res->hostmem);
+  return;
+
+err:
+  virtio_gpu_hostmem_uncharge(gdev, res->hostmem);
+  free(res->iov);
+  free(res->shadow);
+  free(res);
+  gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+}
+
+int virtio_gpu_virgl_readback(GPUDev *gdev, GPUSimpleResource *res,
+                              struct virtio_gpu_rect *r) {
+  (void)gdev;
+  struct virgl_box box = {r->x, r->y, 0, r->width, r->height, 1};
+  uint64_t offset =
+      (uint64_t)r->y * res->stride + r->x * VIRTIO_GPU_BYTES_PP;
+
+  if (res->shadow == NULL) {
+    return -1;
+  }
+  if (virgl_renderer_transfer_read_iov(res->resource_id, 0, 0, res->stride, 0,
+                                       &box, offset, res->iov,
+                                       res->iov_cnt) != 0) {
+    log_error("%s cannot read back resource %d", __func__, res->resource_id);
+    return -1;
+  }
+  // 读回的区域与2D resource中transfer的区域一样处理
+  virtio_gpu_damage_add(res->damage, &res->damage_cnt, r, offset,
+                        res->stride);
+  return 0;
+}
+
+static void virtio_gpu_virgl_transfer_3d(VirtIODevice *vdev, GPUCommand *gcmd,
+                                         bool to_host) {
+  struct virtio_gpu_transfer_host_3d transfer;
+  GPUSimpleResource *res = NULL;
+  int ret = 0;
+
+  VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, transfer);
+
+  struct virgl_box box = {transfer.box.x, transfer.box.y, transfer.box.z,
+                          transfer.box.w, transfer.box.h, transfer.box.d};
+  // iov为NULL时virglrenderer使用attach的backing
+  if (to_host) {
+    ret = virgl_renderer_transfer_write_iov(
+        transfer.resource_id, transfer.hdr.ctx_id, transfer.level,
+        transfer.stride, transfer.layer_stride, &box, transfer.offset, NULL, 0);
+  } else {
+    ret = virgl_renderer_transfer_read_iov(
+        transfer.resource_id, transfer.hdr.ctx_id, transfer.level,
+        transfer.stride, transfer.layer_stride, &box, transfer.offset, NULL, 0);
+  }
+  if (ret != 0) {
+    log_error("%s failed to transfer resource %d, error %d", __func__,
+              transfer.resource_id, ret);
+    gcmd->error = ret == EINVAL ? VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER
+                                : VIRTIO_GPU_RESP_ERR_UNSPEC;
+    return;
+  }
+
+  // 光标等不在scanout上的resource没有flush，在transfer后就读回shadow
+  res = virtio_gpu_find_resource(vdev->dev, transfer.resource_id);
+  if (to_host && res != NULL && res->shadow != NULL &&
+      res->scanout_bitmask == 0 && transfer.level == 0 &&
+      transfer.box.d == 1 && transfer.box.x + transfer.box.w <= res->width &&
+      transfer.box.y + transfer.box.h <= res->height) {
+    struct virtio_gpu_rect r = {transfer.box.x, transfer.box.y,
+                                transfer.box.w, transfer.box.h};
+    // 光标直接使用整个shadow，不需要damage
+    virtio_gpu_virgl_readback(vdev->dev, res, &r);
+    res->damage_cnt = 0;
+  }
+}
+
+void virtio_gpu_virgl_transfer_to_host_2d(
+    GPUSimpleResource *res, struct virtio_gpu_transfer_to_host_2d *transfer,
+    uint32_t *error) {
+  struct virgl_box box = {transfer->r.x, transfer->r.y, 0,
+                          transfer->r.width, transfer->r.height, 1};
+
+  if (virgl_renderer_transfer_write_iov(res->resource_id, 0, 0, 0, 0, &box,
+                                        transfer->offset, NULL, 0) != 0) {
+    log_error("%s failed to transfer resource %d", __func__,
+              res->resource_id);
+    *error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+  }
+}
+
+static void virtio_gpu_virgl_submit_3d(GPUCommand *gcmd) {
+  struct virtio_gpu_cmd_submit submit;
+  size_t total = 0;
+  void *buf = NULL;
+
+  VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, submit);
+
+  // 命令流不能超过guest给出的缓冲区，避免按guest填写的size分配过多内存
+  for (uint32_t i = 0; i < gcmd->resp_iov_cnt; ++i) {
+    total += gcmd->resp_iov[i].iov_len;
+  }
+  if (submit.size % sizeof(uint32_t) != 0 ||
+      submit.size > total - sizeof(submit)) {
+    log_error("%s invalid command stream size %d", __func__, submit.size);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    return;
+  }
+
+  buf = malloc(submit.size);
+  if (buf == NULL) {
+    gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+    return;
+  }
+  if (iov_to_buf(gcmd->resp_iov, gcmd->resp_iov_cnt, sizeof(submit), buf,
+                 submit.size) != submit.size) {
+    log_error("%s cannot copy command stream", __func__);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    free(buf);
+    return;
+  }
+
+  if (virgl_renderer_submit_cmd(buf, submit.hdr.ctx_id,
+                                submit.size / sizeof(uint32_t)) != 0) {
+    log_error("%s ctx %d submitted an invalid command stream", __func__,
+              submit.hdr.ctx_id);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+  }
+  free(buf);
+}
+
+static void virtio_gpu_virgl_get_capset(VirtIODevice *vdev, GPUCommand *gcmd) {
+  struct virtio_gpu_get_capset get_capset;
+  struct virtio_gpu_resp_capset *resp = NULL;
+  uint32_t max_version = 0, max_size = 0;
+
+  VIRTIO_GPU_FILL_CMD(gcmd->resp_iov, gcmd->resp_iov_cnt, get_capset);
+
+  virgl_renderer_get_cap_set(get_capset.capset_id, &max_version, &max_size);
+  if (max_size == 0 || get_capset.capset_version > max_version) {
+    log_error("%s trying to get capset %d version %d", __func__,
+              get_capset.capset_id, get_capset.capset_version);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+    return;
+  }
+
+  resp = calloc(1, sizeof(*resp) + max_size);
+  if (resp == NULL) {
+    gcmd->error = VIRTIO_GPU_RESP_ERR_OUT_OF_MEMORY;
+    return;
+  }
+  resp->hdr.type = VIRTIO_GPU_RESP_OK_CAPSET;
+  virgl_renderer_fill_caps(get_capset.capset_id, get_capset.capset_version,
+                           resp->capset_data);
+  virtio_gpu_ctrl_response(vdev, gcmd, &resp->hdr, sizeof(*resp) + max_size);
+  free(resp);
+}
+
+void virtio_gpu_virgl_attach_backing(VirtIODevice *vdev, GPUCommand *gcmd,
+                                     GPUSimpleResource *res,
+                                     uint32_t nr_entries) {
+  if (res->virgl_iov) {
+    log_error("%s found resource %d already has iov", __func__,
+              res->resource_id);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+    return;
+  }
+
+  if (virtio_gpu_create_mapping_iov(
+          vdev, nr_entries, sizeof(struct virtio_gpu_resource_attach_backing),
+          gcmd, NULL, &res->virgl_iov, &res->virgl_iov_cnt) != 0) {
+    log_error("%s failed to map guest memory to iov", __func__);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+    return;
+  }
+
+  if (virgl_renderer_resource_attach_iov(res->resource_id, res->virgl_iov,
+                                         res->virgl_iov_cnt) != 0) {
+    log_error("%s virglrenderer cannot attach backing of resource %d",
+              __func__, res->resource_id);
+    virtio_gpu_virgl_detach_backing(res);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+  }
+}
+
+void virtio_gpu_virgl_detach_backing(GPUSimpleResource *res) {
+  if (res->virgl_iov == NULL) {
+    return;
+  }
+  virgl_renderer_resource_detach_iov(res->resource_id, NULL, NULL);
+  free(res->virgl_iov);
+  res->virgl_iov = NULL;
+  res->virgl_iov_cnt = 0;
+}
+
+void virtio_gpu_virgl_resource_destroy(GPUDev *gdev, GPUSimpleResource *res) {
+  (void)gdev;
+  virtio_gpu_virgl_detach_backing(res);
+  virgl_renderer_resource_unref(res->resource_id);
+  // shadow由res->iov指向，iov在cleanup_mapping中释放
+  free(res->shadow);
+  res->shadow = NULL;
+}
+
+void virtio_gpu_virgl_process_cmd(VirtIODevice *vdev, GPUCommand *gcmd) {
+  log_debug("entering %s", __func__);
+
+  switch (gcmd->control_header.type) {
+  case VIRTIO_GPU_CMD_CTX_CREATE:
+    virtio_gpu_virgl_ctx_create(gcmd);
+    break;
+  case VIRTIO_GPU_CMD_CTX_DESTROY:
+    virgl_renderer_context_destroy(gcmd->control_header.ctx_id);
+    break;
+  case VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE:
+    virtio_gpu_virgl_ctx_resource(gcmd, true);
+    break;
+  case VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE:
+    virtio_gpu_virgl_ctx_resource(gcmd, false);
+    break;
+  case VIRTIO_GPU_CMD_RESOURCE_CREATE_3D:
+    virtio_gpu_virgl_resource_create_3d(vdev, gcmd);
+    break;
+  case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D:
+    virtio_gpu_virgl_transfer_3d(vdev, gcmd, true);
+    break;
+  case VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D:
+    virtio_gpu_virgl_transfer_3d(vdev, gcmd, false);
+    break;
+  case VIRTIO_GPU_CMD_SUBMIT_3D:
+    virtio_gpu_virgl_submit_3d(gcmd);
+    break;
+  case VIRTIO_GPU_CMD_GET_CAPSET:
+    virtio_gpu_virgl_get_capset(vdev, gcmd);
+    break;
+  default:
+    log_error("%s unknown 3d request type %#x", __func__,
+              gcmd->control_header.type);
+    gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+    break;
+  }
+}
+
+#else
+
+int virtio_gpu_virgl_init(GPUDev *gdev) {
+  (void)gdev;
+  log_error("%s hvisor-tool is built without virglrenderer, rebuild with "
+            "VIRGL=y",
+            __func__);
+  return -1;
+}
+
+void virtio_gpu_virgl_cleanup(GPUDev *gdev) {
+  (void)gdev;
+}
+
+void virtio_gpu_virgl_poll(void) {}
+
+uint64_t virtio_gpu_virgl_create_fence(GPUDev *gdev, GPUCommand *gcmd) {
+  (void)gdev;
+  (void)gcmd;
+  return 0;
+}
+
+bool virtio_gpu_virgl_cmd(GPUDev *gdev, GPUCommand *gcmd) {
+  (void)gdev;
+  (void)gcmd;
+  return false;
+}
+
+// 初始化失败时不提供VIRTIO_GPU_F_VIRGL，3D命令都是非法的
+void virtio_gpu_virgl_process_cmd(VirtIODevice *vdev, GPUCommand *gcmd) {
+  (void)vdev;
+  log_error("%s 3d request type %#x is not supported", __func__,
+            gcmd->control_header.type);
+  gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+}
+
+int virtio_gpu_virgl_readback(GPUDev *gdev, GPUSimpleResource *res,
+                              struct virtio_gpu_rect *r) {
+  (void)gdev;
+  (void)res;
+  (void)r;
+  return -1;
+}
+
+void virtio_gpu_virgl_attach_backing(VirtIODevice *vdev, GPUCommand *gcmd,
+                                     GPUSimpleResource *res,
+                                     uint32_t nr_entries) {
+  (void)vdev;
+  (void)res;
+  (void)nr_entries;
+  gcmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+}
+
+void virtio_gpu_virgl_detach_backing(GPUSimpleResource *res) {
+  (void)res;
+}
+
+void virtio_gpu_virgl_transfer_to_host_2d(
+    GPUSimpleResource *res, struct virtio_gpu_transfer_to_host_2d *transfer,
+    uint32_t *error) {
+  (void)res;
+  (void)transfer;
+  *error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+}
+
+void virtio_gpu_virgl_resource_destroy(GPUDev *gdev, GPUSimpleResource *res) {
+  (void)gdev;
+  (void)res;
+}
+
+#endif
@@ -0,0 +1,189 @@
+#include "event_monitor.h"
+#include "log.h"
+#include "virtio.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each completion interrupt costs the guest a trap and the daemon a round trip
+// through the kernel module, so the completions of chatty queues (console and
+// net tx) are reported by one interrupt after max_packets requests or
+// max_usecs, whichever comes first. The drivers reclaim tx buffers when they
+// run out of them anyway, so a late interrupt only delays the reclaiming.
+struct virtio_irq_moderation {
+  VirtQueue *vq;
+  IrqPolicy policy;
+  uint32_t pending;     // completions not notified to the driver yet
+  uint64_t deadline_ns; // when pending must be notified, 0 if nothing pending
+  uint64_t last_ns;     // the time of the previous completion
+  uint64_t rate;        // moving average of completions per second
+};
+
+// All the moderated queues share one timer in the epoll thread, which is armed
+// for the earliest deadline.
+static struct {
+  pthread_mutex_t mtx;
+  IrqModeration *mods[VIRTIO_IRQ_MAX_MODERATED];
+  int nr_mods;
+  int timerfd;
+  uint64_t armed_ns; // the deadline the timer is armed for, 0 if disarmed
+} irq_moderation = {.mtx = PTHREAD_MUTEX_INITIALIZER, .timerfd = -1};
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/// Caller must hold irq_moderation.mtx.
+static void timer_arm(uint64_t deadline_ns) {
+  struct itimerspec its;
+  if (irq_moderation.armed_ns != 0 && irq_moderation.armed_ns <= deadline_ns)
+    return;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = deadline_ns / 1000000000ULL;
+  its.it_value.tv_nsec = deadline_ns % 1000000000ULL;
+  if (timerfd_settime(irq_moderation.timerfd, TFD_TIMER_ABSTIME, &its, NULL) <
+      0) {
+    log_error("failed to arm irq moderation timer, errno is %d", errno);
+    return;
+  }
+  irq_moderation.armed_ns = deadline_ns;
+}
+
+/// Notify the pending completions of m. Caller must hold irq_moderation.mtx.
+static bool moderation_flush(IrqModeration *m) {
+  m->pending = 0;
+  m->deadline_ns = 0;
+  // the queue may have been reset by the driver
+  if (m->vq->used_ring == NULL)
+    return false;
+  return virtio_inject_irq(m->vq);
+}
+
+static void irq_timer_handler(int fd, int epoll_type, void *param) {
+  (void)epoll_type;
+  (void)param;
+  uint64_t expirations, now, next = 0;
+  IrqModeration *m;
+  if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    log_error("failed to read irq moderation timer, errno is %d", errno);
+
+  pthread_mutex_lock(&irq_moderation.mtx);
+  irq_moderation.armed_ns = 0;
+  now = now_ns();
+  for (int i = 0; i < irq_moderation.nr_mods; i++) {
+    m = irq_moderation.mods[i];
+    if (m->deadline_ns == 0)
+      continue;
+    if (m->deadline_ns <= now)
+      moderation_flush(m);
+    else if (next == 0 || m->deadline_ns < next)
+      next = m->deadline_ns;
+  }
+  if (next != 0)
+    timer_arm(next);
+  pthread_mutex_unlock(&irq_moderation.mtx);
+}
+
+int virtio_irq_moderate(VirtQueue *vq, const IrqPolicy *policy) {
+  IrqModeration *m;
+  int ret = -1;
+  // moderation can't merge anything
+  if (policy->max_packets <= 1 || policy->max_usecs == 0)
+    return 0;
+
+  pthread_mutex_lock(&irq_moderation.mtx);
+  if (irq_moderation.nr_mods >= VIRTIO_IRQ_MAX_MODERATED) {
+    log_error("too many queues with irq moderation");
+    goto out;
+  }
+  if (irq_moderation.timerfd < 0) {
+    irq_moderation.timerfd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (irq_moderation.timerfd < 0) {
+      log_error("failed to create irq moderation timer, errno is %d", errno);
+      goto out;
+    }
+    if (add_event(irq_moderation.timerfd, EPOLLIN, irq_timer_handler, NULL) ==
+        NULL) {
+      log_error("can't register irq moderation timer");
+      close(irq_moderation.timerfd);
+      irq_moderation.timerfd = -1;
+      goto out;
+    }
+  }
+  m = calloc(1, sizeof(IrqModeration));
+  m->vq = vq;
+  m->policy = *policy;
+  irq_moderation.mods[irq_moderation.nr_mods++] = m;
+  vq->irq_mod = m;
+  ret = 0;
+out:
+  pthread_mutex_unlock(&irq_moderation.mtx);
+  return ret;
+}
+
+bool virtio_irq_complete(VirtQueue *vq, uint32_t n) {
+  IrqModeration *m = vq->irq_mod;
+  uint64_t now, interval;
+  bool injected = false;
+  if (n == 0)
+    return false;
+  if (m == NULL)
+    return virtio_inject_irq(vq);
+
+  pthread_mutex_lock(&irq_moderation.mtx);
+  now = now_ns();
+  interval = now - m->last_ns;
+  if (interval == 0)
+    interval = 1;
+  // a moving average with weight 1/8, the first completion counts as slow
+  if (m->last_ns != 0)
+    m->rate = (m->rate * 7 + n * 1000000000ULL / interval) / 8;
+  m->last_ns = now;
+  m->pending += n;
+
+  if (m->pending >= m->policy.max_packets ||
+      (m->policy.adaptive && m->rate < VIRTIO_IRQ_ADAPTIVE_RATE) ||
+      (m->deadline_ns != 0 && m->deadline_ns <= now)) {
+    injected = moderation_flush(m);
+  } else if (m->deadline_ns == 0) {
+    m->deadline_ns = now + m->policy.max_usecs * 1000ULL;
+    timer_arm(m->deadline_ns);
+  }
+  pthread_mutex_unlock(&irq_moderation.mtx);
+  return injected;
+}
+
+void virtio_irq_cancel(VirtQueue *vq) {
+  IrqModeration *m = vq->irq_mod;
+  if (m == NULL)
+    return;
+  pthread_mutex_lock(&irq_moderation.mtx);
+  m->pending = 0;
+  m->deadline_ns = 0;
+  m->last_ns = 0;
+  m->rate = 0;
+  pthread_mutex_unlock(&irq_moderation.mtx);
+}
+
+void virtio_irq_unmoderate(VirtQueue *vq) {
+  IrqModeration *m = vq->irq_mod;
+  if (m == NULL)
+    return;
+  pthread_mutex_lock(&irq_moderation.mtx);
+  for (int i = 0; i < irq_moderation.nr_mods; i++) {
+    if (irq_moderation.mods[i] == m) {
+      irq_moderation.mods[i] = irq_moderation.mods[--irq_moderation.nr_mods];
+      break;
+    }
+  }
+  vq->irq_mod = NULL;
+  free(m);
+  pthread_mutex_unlock(&irq_moderation.mtx);
+}
@@ -4,6 +4,7 @@
 #include "virtio.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <linux/if_tun.h>
 #include <net/if.h>
 #include <stdlib.h>
@@ -26,6 +27,10 @@ NetDev *init_net_dev(uint8_t mac[]) {
   dev->tapfd = -1;
   dev->rx_ready = 0;
   dev->event = NULL;
+  dev->backend = NetBackendTap;
+  dev->port = NULL;
+  memset(dev->stats, 0, sizeof(dev->stats));
+  dev->pcap = NULL;
   return dev;
 }
 
@@ -63,6 +68,9 @@ int virtio_net_rxq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
     // driver.
     virtqueue_disable_notify(vq);
   }
+  // the switch asks for a notify when frames are waiting for rx buffers
+  if (net->backend == NetBackendSwitch)
+    net_switch_rx_notify(vdev);
   return 0;
 }
 /// remove the header in iov, return the new iov. the new iov num is in niov.
@@ -93,7 +101,8 @@ void virtio_net_event_handler(int fd, int epoll_type, void *param) {
   struct iovec *iov, *iov_packet;
   NetDev *net = vdev->dev;
   VirtQueue *vq = &vdev->vqs[NET_QUEUE_RX];
-  int n, len;
+  NetQueueStats *stats = &net->stats[NET_QUEUE_RX];
+  int n, len, batch = 0;
   uint16_t idx;
   if (fd != net->tapfd || epoll_type != EPOLLIN) {
     log_error("invalid event");
@@ -107,12 +116,15 @@ void virtio_net_event_handler(int fd, int epoll_type, void *param) {
   // if vq is not setup, drop the packet
   if (!net->rx_ready) {
     read(net->tapfd, trashbuf, sizeof(trashbuf));
+    stats->drops++;
     return;
   }
   // if rx_vq is empty, drop the packet
   if (virtqueue_is_empty(vq)) {
     read(net->tapfd, trashbuf, sizeof(trashbuf));
-    virtio_inject_irq(vq);
+    stats->drops++;
+    stats->ring_full++;
+    stats->irqs += virtio_inject_irq(vq);
     return;
   }
   while (!virtqueue_is_empty(vq)) {
@@ -140,10 +152,15 @@ void virtio_net_event_handler(int fd, int epoll_type, void *param) {
     vnet_header->num_buffers = 1;
 
     update_used_ring(vq, idx, len + sizeof(NetHdr));
+    net_pcap_write(net->pcap, iov_packet, n, len, NET_PCAP_INBOUND);
+    stats->packets++;
+    stats->bytes += len;
+    batch++;
     free(iov);
   }
 
-  virtio_inject_irq(vq);
+  net_stats_batch(stats, batch);
+  stats->irqs += virtio_inject_irq(vq);
   return;
 free_iov:
   free(iov);
@@ -156,7 +173,7 @@ static void virtq_tx_handle_one_request(NetDev *net, VirtQueue *vq) {
   uint16_t idx;
   static char pad[64];
   ssize_t len;
-  if (net->tapfd == -1) {
+  if (net->backend == NetBackendTap && net->tapfd == -1) {
     log_error("tap device is invalid");
     return;
   }
@@ -173,6 +190,17 @@ static void virtq_tx_handle_one_request(NetDev *net, VirtQueue *vq) {
   iov[0].iov_base += sizeof(NetHdr);
   iov[0].iov_len -= sizeof(NetHdr);
   log_debug("packet send: %d bytes", packet_len);
+  net_pcap_write(net->pcap, iov, n, packet_len, NET_PCAP_OUTBOUND);
+  net->stats[NET_QUEUE_TX].packets++;
+  net->stats[NET_QUEUE_TX].bytes += packet_len;
+
+  if (net->backend == NetBackendSwitch) {
+    // The switch copies the packet to other guests, so no padding is needed.
+    net_switch_forward(net, iov, n, packet_len);
+    update_used_ring(vq, idx, all_len);
+    free(iov);
+    return;
+  }
 
   // The mininum packet for data link layer is 64 bytes.
   if (packet_len < 64) {
@@ -183,6 +211,7 @@ static void virtq_tx_handle_one_request(NetDev *net, VirtQueue *vq) {
   len = writev(net->tapfd, iov, n);
   if (len < 0) {
     log_error("write tap failed, errno %d", errno);
+    net->stats[NET_QUEUE_TX].drops++;
   }
   update_used_ring(vq, idx, all_len);
   free(iov);
@@ -190,19 +219,36 @@ static void virtq_tx_handle_one_request(NetDev *net, VirtQueue *vq) {
 
 int virtio_net_txq_notify_handler(VirtIODevice *vdev, VirtQueue *vq) {
   log_debug("virtio_net_txq_notify_handler");
+  NetDev *net = vdev->dev;
+  uint64_t batch = 0;
   virtqueue_disable_notify(vq);
   while (!virtqueue_is_empty(vq)) {
-    virtq_tx_handle_one_request(vdev->dev, vq);
+    virtq_tx_handle_one_request(net, vq);
+    batch++;
   }
   virtqueue_enable_notify(vq);
-  // TODO: Can we don't inject irq when send packets to improve performance?
-  // Linux will recycle the used ring when send packets. virtio_inject_irq(vq);
+  net_stats_batch(&net->stats[NET_QUEUE_TX], batch);
+  if (net->backend == NetBackendSwitch)
+    net_switch_flush_irqs(net);
+  // Linux reclaims sent buffers when it sends packets, but an idle guest
+  // waits for the interrupt to free them, so tx completions are coalesced
+  // instead of being dropped.
+  net->stats[NET_QUEUE_TX].irqs += virtio_irq_complete(vq, batch);
   return 0;
 }
 
 int virtio_net_init(VirtIODevice *vdev, char *devname) {
   log_info("virtio net init");
   NetDev *net = vdev->dev;
+  if (devname == NULL) {
+    // connect to other zones through the in-daemon switch
+    net->backend = NetBackendSwitch;
+    if (net_switch_attach(vdev) < 0)
+      return -1;
+    vdev->virtio_close = virtio_net_close;
+    vdev->virtio_dump_stats = virtio_net_dump_stats;
+    return 0;
+  }
   // open tap device
   net->tapfd = open_tap(devname);
   if (net->tapfd == -1) {
@@ -224,12 +270,47 @@ int virtio_net_init(VirtIODevice *vdev, char *devname) {
     return -1;
   }
   vdev->virtio_close = virtio_net_close;
+  vdev->virtio_dump_stats = virtio_net_dump_stats;
+  return 0;
+}
+
+int virtio_net_enable_pcap(VirtIODevice *vdev, const char *path,
+                           uint32_t sample) {
+  NetDev *net = vdev->dev;
+  net->pcap = net_pcap_open(path, sample);
+  if (net->pcap == NULL)
+    return -1;
+  log_info("zone %d virtio net captures one of every %d packets to %s",
+           vdev->zone_id, net->pcap->sample, path);
   return 0;
 }
 
+void virtio_net_dump_stats(VirtIODevice *vdev) {
+  NetDev *net = vdev->dev;
+  static const char *queue_name[NET_MAX_QUEUES] = {"rx", "tx"};
+  for (int i = 0; i < NET_MAX_QUEUES; i++) {
+    NetQueueStats *s = &net->stats[i];
+    log_warn("zone %d net %s: packets %" PRIu64 " bytes %" PRIu64
+             " drops %" PRIu64 " ring_full %" PRIu64 " irqs %" PRIu64
+             " batches %" PRIu64 " avg_batch %" PRIu64 " max_batch %" PRIu64,
+             vdev->zone_id, queue_name[i], s->packets, s->bytes, s->drops,
+             s->ring_full, s->irqs, s->batches,
+             s->batches ? s->packets / s->batches : 0, s->batch_max);
+  }
+  if (net->pcap)
+    log_warn("zone %d net pcap: dropped %" PRIu64, vdev->zone_id,
+             net->pcap->dropped);
+}
+
 void virtio_net_close(VirtIODevice *vdev) {
   NetDev *dev = vdev->dev;
-  close(dev->tapfd);
+  if (dev->backend == NetBackendSwitch)
+    net_switch_detach(vdev);
+  else
+    close(dev->tapfd);
+  net_pcap_close(dev->pcap);
+  virtio_irq_unmoderate(&vdev->vqs[NET_QUEUE_RX]);
+  virtio_irq_unmoderate(&vdev->vqs[NET_QUEUE_TX]);
   free(dev->event);
   free(dev);
   free(vdev->vqs);
@@ -0,0 +1,284 @@
+#include "event_monitor.h"
+#include "log.h"
+#include "virtio.h"
+#include "virtio_net.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// pcapng block types, see https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_LINKTYPE_ETHERNET 1
+#define PCAPNG_OPT_EPB_FLAGS 2
+
+struct pcapng_shb {
+  uint32_t type;
+  uint32_t total_len;
+  uint32_t magic;
+  uint16_t major, minor;
+  int64_t section_len;
+  uint32_t total_len2;
+} __attribute__((packed));
+
+struct pcapng_idb {
+  uint32_t type;
+  uint32_t total_len;
+  uint16_t linktype;
+  uint16_t reserved;
+  uint32_t snaplen;
+  uint32_t total_len2;
+} __attribute__((packed));
+
+struct pcapng_epb_head {
+  uint32_t type;
+  uint32_t total_len;
+  uint32_t if_id;
+  uint32_t ts_high, ts_low; // microseconds since epoch
+  uint32_t cap_len;
+  uint32_t orig_len;
+} __attribute__((packed));
+
+struct pcapng_epb_tail {
+  uint16_t flags_code, flags_len;
+  uint32_t flags; // bit 0-1 is the direction
+  uint32_t opt_end;
+  uint32_t total_len;
+} __attribute__((packed));
+
+static int pcap_write_header(NetPcap *pcap) {
+  struct pcapng_shb shb = {
+      .type = PCAPNG_SHB,
+      .total_len = sizeof(shb),
+      .magic = PCAPNG_BYTE_ORDER_MAGIC,
+      .major = 1,
+      .minor = 0,
+      .section_len = -1,
+      .total_len2 = sizeof(shb),
+  };
+  struct pcapng_idb idb = {
+      .type = PCAPNG_IDB,
+      .total_len = sizeof(idb),
+      .linktype = PCAPNG_LINKTYPE_ETHERNET,
+      .snaplen = NET_PCAP_SNAPLEN,
+      .total_len2 = sizeof(idb),
+  };
+  struct iovec iov[2] = {{&shb, sizeof(shb)}, {&idb, sizeof(idb)}};
+  if (writev(pcap->fd, iov, 2) != sizeof(shb) + sizeof(idb)) {
+    log_error("failed to write pcapng header to %s, errno is %d", pcap->path,
+              errno);
+    return -1;
+  }
+  pcap->size = sizeof(shb) + sizeof(idb);
+  return 0;
+}
+
+static void pcap_timer_handler(int fd, int epoll_type, void *param) {
+  uint64_t expirations;
+  (void)epoll_type;
+  if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    log_error("failed to read pcapng timer, errno is %d", errno);
+  net_pcap_flush(param);
+}
+
+/// Write the recorded packets every NET_PCAP_FLUSH_MS in the epoll thread.
+static int pcap_start_timer(NetPcap *pcap) {
+  struct itimerspec its = {
+      .it_interval = {.tv_nsec = NET_PCAP_FLUSH_MS * 1000000L},
+      .it_value = {.tv_nsec = NET_PCAP_FLUSH_MS * 1000000L},
+  };
+  pcap->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (pcap->timerfd < 0) {
+    log_error("failed to create pcapng timer, errno is %d", errno);
+    return -1;
+  }
+  if (timerfd_settime(pcap->timerfd, 0, &its, NULL) < 0) {
+    log_error("failed to arm pcapng timer, errno is %d", errno);
+    goto err;
+  }
+  pcap->event = add_event(pcap->timerfd, EPOLLIN, pcap_timer_handler, pcap);
+  if (pcap->event == NULL) {
+    log_error("can't register pcapng timer");
+    goto err;
+  }
+  return 0;
+err:
+  close(pcap->timerfd);
+  pcap->timerfd = -1;
+  return -1;
+}
+
+NetPcap *net_pcap_open(const char *path, uint32_t sample) {
+  NetPcap *pcap = calloc(1, sizeof(NetPcap));
+  pcap->path = strdup(path);
+  pcap->sample = sample ? sample : 1;
+  pcap->timerfd = -1;
+  pcap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (pcap->fd < 0) {
+    log_error("failed to open pcapng file %s, errno is %d", path, errno);
+    goto err;
+  }
+  if (pcap_write_header(pcap) < 0)
+    goto err_close;
+  pcap->ring = malloc(NET_PCAP_RING_SIZE);
+  pthread_mutex_init(&pcap->mtx, NULL);
+  pthread_mutex_init(&pcap->flush_mtx, NULL);
+  if (pcap_start_timer(pcap) < 0) {
+    pthread_mutex_destroy(&pcap->mtx);
+    pthread_mutex_destroy(&pcap->flush_mtx);
+    free(pcap->ring);
+    goto err_close;
+  }
+  return pcap;
+err_close:
+  close(pcap->fd);
+err:
+  free(pcap->path);
+  free(pcap);
+  return NULL;
+}
+
+/// Keep the last full file as <path>.1 and start a new one.
+static int pcap_rotate(NetPcap *pcap) {
+  char old_path[PATH_MAX];
+  close(pcap->fd);
+  snprintf(old_path, sizeof(old_path), "%s.1", pcap->path);
+  rename(pcap->path, old_path);
+  pcap->fd = open(pcap->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (pcap->fd < 0) {
+    log_error("failed to reopen pcapng file %s, errno is %d", pcap->path,
+              errno);
+    return -1;
+  }
+  return pcap_write_header(pcap);
+}
+
+void net_pcap_write(NetPcap *pcap, const struct iovec *iov, int niov,
+                    int packet_len, int dir) {
+  uint8_t block[sizeof(struct pcapng_epb_head) + NET_PCAP_SNAPLEN +
+                sizeof(struct pcapng_epb_tail)];
+  struct pcapng_epb_head *head = (struct pcapng_epb_head *)block;
+  struct pcapng_epb_tail *tail;
+  struct timespec ts;
+  uint64_t us;
+  uint32_t cap_len, padded_len, total_len, pos, first;
+  size_t done = 0, len;
+
+  if (pcap == NULL || packet_len <= 0)
+    return;
+
+  pthread_mutex_lock(&pcap->mtx);
+  if (pcap->counter++ % pcap->sample != 0) {
+    pthread_mutex_unlock(&pcap->mtx);
+    return;
+  }
+  pthread_mutex_unlock(&pcap->mtx);
+
+  cap_len = MIN((uint32_t)packet_len, NET_PCAP_SNAPLEN);
+  padded_len = (cap_len + 3) & ~3U;
+  total_len = sizeof(*head) + padded_len + sizeof(*tail);
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  head->type = PCAPNG_EPB;
+  head->total_len = total_len;
+  head->if_id = 0;
+  head->ts_high = us >> 32;
+  head->ts_low = (uint32_t)us;
+  head->cap_len = cap_len;
+  head->orig_len = packet_len;
+
+  for (int i = 0; i < niov && done < cap_len; i++) {
+    len = MIN(iov[i].iov_len, cap_len - done);
+    memcpy(block + sizeof(*head) + done, iov[i].iov_base, len);
+    done += len;
+  }
+  memset(block + sizeof(*head) + done, 0, padded_len - done);
+
+  tail = (struct pcapng_epb_tail *)(block + sizeof(*head) + padded_len);
+  tail->flags_code = PCAPNG_OPT_EPB_FLAGS;
+  tail->flags_len = sizeof(tail->flags);
+  tail->flags = dir;
+  tail->opt_end = 0;
+  tail->total_len = total_len;
+
+  // the block may wrap around the end of ring
+  pthread_mutex_lock(&pcap->mtx);
+  if (pcap->head - pcap->tail + total_len > NET_PCAP_RING_SIZE) {
+    pcap->dropped++;
+    pthread_mutex_unlock(&pcap->mtx);
+    return;
+  }
+  pos = pcap->head & (NET_PCAP_RING_SIZE - 1);
+  first = MIN(total_len, NET_PCAP_RING_SIZE - pos);
+  memcpy(pcap->ring + pos, block, first);
+  memcpy(pcap->ring, block + first, total_len - first);
+  pcap->head += total_len;
+  pthread_mutex_unlock(&pcap->mtx);
+}
+
+void net_pcap_flush(NetPcap *pcap) {
+  struct iovec iov[2];
+  uint64_t head, tail;
+  uint32_t pos, len;
+  ssize_t ret;
+
+  pthread_mutex_lock(&pcap->flush_mtx);
+  pthread_mutex_lock(&pcap->mtx);
+  head = pcap->head;
+  tail = pcap->tail;
+  pthread_mutex_unlock(&pcap->mtx);
+  // Only the bytes between tail and head are written. The datapath only puts
+  // bytes after head, so ring is read without holding mtx.
+  len = head - tail;
+  if (len == 0 || pcap->fd < 0)
+    goto out;
+  if (pcap->size + len > NET_PCAP_MAX_SIZE && pcap_rotate(pcap) < 0)
+    goto out;
+  pos = tail & (NET_PCAP_RING_SIZE - 1);
+  iov[0].iov_base = pcap->ring + pos;
+  iov[0].iov_len = MIN(len, NET_PCAP_RING_SIZE - pos);
+  iov[1].iov_base = pcap->ring;
+  iov[1].iov_len = len - iov[0].iov_len;
+  ret = writev(pcap->fd, iov, 2);
+  if (ret != len)
+    log_error("failed to write pcapng file %s, errno is %d", pcap->path,
+              errno);
+  else
+    pcap->size += len;
+out:
+  // drop what couldn't be written, it would fail again
+  pthread_mutex_lock(&pcap->mtx);
+  pcap->tail = head;
+  pthread_mutex_unlock(&pcap->mtx);
+  pthread_mutex_unlock(&pcap->flush_mtx);
+}
+
+void net_pcap_close(NetPcap *pcap) {
+  if (pcap == NULL)
+    return;
+  del_event(pcap->event);
+  close(pcap->timerfd);
+  net_pcap_flush(pcap);
+  if (pcap->dropped)
+    log_warn("pcapng file %s missed %" PRIu64 " packets, the ring was full",
+             pcap->path, pcap->dropped);
+  if (pcap->fd >= 0)
+    close(pcap->fd);
+  pthread_mutex_destroy(&pcap->mtx);
+  pthread_mutex_destroy(&pcap->flush_mtx);
+  free(pcap->ring);
+  free(pcap->path);
+  free(pcap);
+}
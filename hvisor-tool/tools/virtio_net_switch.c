@@ -0,0 +1,402 @@
+#include "log.h"
+#include "virtio.h"
+#include "virtio_net.h"
+#include <linux/if_ether.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <time.h>
+
+// A frame waiting in the backlog of a port.
+struct net_switch_frame {
+  int len;
+  uint8_t data[];
+};
+
+// A port of the switch, one for each virtio net device whose backend is
+// NetBackendSwitch.
+struct net_switch_port {
+  VirtIODevice *vdev; // NULL means the port is free
+  int id;
+  // Protects the rx ring of vdev and the fields below, so that frames to
+  // different ports are delivered in parallel.
+  pthread_mutex_t mtx;
+  // Frames that arrived while the driver had no rx buffer, delivered when it
+  // provides some.
+  struct net_switch_frame *backlog[NET_SWITCH_BACKLOG];
+  unsigned int backlog_front, backlog_rear;
+  uint32_t completed; // frames delivered but not notified to the driver yet
+};
+
+// An entry of the MAC learning table.
+struct mac_entry {
+  uint8_t mac[ETH_ALEN];
+  int port;         // -1 means the entry is deleted
+  time_t last_seen; // the last time a frame was sent from mac
+  bool used;        // false means the slot has never been used
+};
+
+// Frames sent by the guests are copied from the tx ring of the source device
+// to the rx ring of the destination device directly, without going through
+// the host kernel. The zones don't map each other's memory, so the frames
+// can't be remapped instead of copied. mtx protects the MAC table and the
+// attaching of ports, it is never held while a frame is copied.
+static struct {
+  pthread_mutex_t mtx;
+  struct net_switch_port ports[NET_SWITCH_MAX_PORTS];
+  struct mac_entry table[NET_SWITCH_MAC_TABLE_SIZE];
+} net_switch = {
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .ports = {[0 ... NET_SWITCH_MAX_PORTS - 1] =
+                  {.mtx = PTHREAD_MUTEX_INITIALIZER}},
+};
+
+static inline unsigned int mac_hash(const uint8_t *mac) {
+  unsigned int h = 0;
+  for (int i = 0; i < ETH_ALEN; i++)
+    h = h * 31 + mac[i];
+  return h & (NET_SWITCH_MAC_TABLE_SIZE - 1);
+}
+
+static inline bool mac_entry_alive(struct mac_entry *e, time_t now) {
+  return e->port >= 0 && now - e->last_seen < NET_SWITCH_AGEING_SEC;
+}
+
+/// Record that mac is reachable through port. Caller must hold net_switch.mtx.
+static void mac_learn(const uint8_t *mac, int port, time_t now) {
+  unsigned int i, h = mac_hash(mac);
+  struct mac_entry *e, *free_slot = NULL;
+  for (i = 0; i < NET_SWITCH_MAC_TABLE_SIZE; i++) {
+    e = &net_switch.table[(h + i) & (NET_SWITCH_MAC_TABLE_SIZE - 1)];
+    if (!e->used) {
+      if (free_slot == NULL)
+        free_slot = e;
+      break;
+    }
+    if (memcmp(e->mac, mac, ETH_ALEN) == 0) {
+      e->port = port;
+      e->last_seen = now;
+      return;
+    }
+    if (free_slot == NULL && !mac_entry_alive(e, now))
+      free_slot = e;
+  }
+  if (free_slot == NULL) {
+    log_warn("net switch mac table is full");
+    return;
+  }
+  memcpy(free_slot->mac, mac, ETH_ALEN);
+  free_slot->port = port;
+  free_slot->last_seen = now;
+  free_slot->used = true;
+}
+
+/// Return the port mac is reachable through, or -1 if it is unknown. Caller
+/// must hold net_switch.mtx.
+static int mac_lookup(const uint8_t *mac, time_t now) {
+  unsigned int i, h = mac_hash(mac);
+  struct mac_entry *e;
+  for (i = 0; i < NET_SWITCH_MAC_TABLE_SIZE; i++) {
+    e = &net_switch.table[(h + i) & (NET_SWITCH_MAC_TABLE_SIZE - 1)];
+    if (!e->used)
+      break;
+    if (memcmp(e->mac, mac, ETH_ALEN) == 0)
+      return mac_entry_alive(e, now) ? e->port : -1;
+  }
+  return -1;
+}
+
+/// Copy bytes from src iov to dst iov, skipping dst_offset bytes of dst.
+/// \return the number of bytes copied
+static size_t iov_copy(const struct iovec *dst, int dst_cnt, size_t dst_offset,
+                       const struct iovec *src, int src_cnt, size_t bytes) {
+  int i = 0, j = 0;
+  size_t src_offset = 0, len, done = 0;
+  // seek to dst_offset
+  while (i < dst_cnt && dst_offset >= dst[i].iov_len) {
+    dst_offset -= dst[i].iov_len;
+    i++;
+  }
+  while (i < dst_cnt && j < src_cnt && done < bytes) {
+    len = MIN(dst[i].iov_len - dst_offset, src[j].iov_len - src_offset);
+    len = MIN(len, bytes - done);
+    memcpy((char *)dst[i].iov_base + dst_offset,
+           (char *)src[j].iov_base + src_offset, len);
+    done += len;
+    dst_offset += len;
+    src_offset += len;
+    if (dst_offset == dst[i].iov_len)
+      i++, dst_offset = 0;
+    if (src_offset == src[j].iov_len)
+      j++, src_offset = 0;
+  }
+  return done;
+}
+
+/// Put a frame into the rx ring of port. Caller must hold port->mtx.
+/// \return false if the driver has no rx buffer for it now
+static bool net_switch_put(struct net_switch_port *port,
+                           const struct iovec *iov, int niov, int packet_len) {
+  VirtIODevice *vdev = port->vdev;
+  NetDev *net = vdev->dev;
+  VirtQueue *vq = &vdev->vqs[NET_QUEUE_RX];
+  NetQueueStats *stats = &net->stats[NET_QUEUE_RX];
+  struct iovec *rx_iov = NULL;
+  NetHdr *vnet_header;
+  uint16_t idx;
+  size_t len;
+  int n;
+
+  if (virtqueue_is_empty(vq))
+    return false;
+  n = process_descriptor_chain(vq, &idx, &rx_iov, NULL, 0, false);
+  if (n < 1 || n > VIRTQUEUE_NET_MAX_SIZE) {
+    log_error("process_descriptor_chain failed");
+    free(rx_iov);
+    stats->drops++;
+    return true;
+  }
+  if (rx_iov[0].iov_len < sizeof(NetHdr)) {
+    log_error("invalid rx buffer of net switch port %d", port->id);
+    update_used_ring(vq, idx, 0);
+    goto out;
+  }
+
+  vnet_header = rx_iov[0].iov_base;
+  memset(vnet_header, 0, sizeof(NetHdr));
+  vnet_header->num_buffers = 1;
+
+  len = iov_copy(rx_iov, n, sizeof(NetHdr), iov, niov, packet_len);
+  if (len < (size_t)packet_len)
+    log_warn("net switch port %d truncated a packet of %d bytes to %zu bytes",
+             port->id, packet_len, len);
+  update_used_ring(vq, idx, len + sizeof(NetHdr));
+  net_pcap_write(net->pcap, iov, niov, packet_len, NET_PCAP_INBOUND);
+  stats->packets++;
+  stats->bytes += len;
+
+out:
+  free(rx_iov);
+  port->completed++;
+  return true;
+}
+
+/// Deliver the frames in the backlog of port as long as the driver provides
+/// rx buffers. Caller must hold port->mtx.
+static void net_switch_drain(struct net_switch_port *port) {
+  VirtQueue *vq = &port->vdev->vqs[NET_QUEUE_RX];
+  struct net_switch_frame *f;
+  struct iovec iov;
+  uint32_t batch = 0;
+
+  for (;;) {
+    while (!is_queue_empty(port->backlog_front, port->backlog_rear)) {
+      f = port->backlog[port->backlog_front];
+      iov.iov_base = f->data;
+      iov.iov_len = f->len;
+      if (!net_switch_put(port, &iov, 1, f->len))
+        break;
+      free(f);
+      port->backlog_front =
+          (port->backlog_front + 1) & (NET_SWITCH_BACKLOG - 1);
+      batch++;
+    }
+    if (is_queue_empty(port->backlog_front, port->backlog_rear)) {
+      virtqueue_disable_notify(vq);
+      break;
+    }
+    // ask the driver to kick rxq when it adds rx buffers
+    virtqueue_enable_notify(vq);
+    // The driver may have posted buffers before it saw the notify enabled.
+    if (virtqueue_is_empty(vq))
+      break;
+  }
+  net_stats_batch(&((NetDev *)port->vdev->dev)->stats[NET_QUEUE_RX], batch);
+}
+
+/// Keep a copy of a frame until the driver of port provides an rx buffer.
+/// Caller must hold port->mtx.
+static void net_switch_backlog_push(struct net_switch_port *port,
+                                    const struct iovec *iov, int niov,
+                                    int packet_len) {
+  NetQueueStats *stats = &((NetDev *)port->vdev->dev)->stats[NET_QUEUE_RX];
+  struct net_switch_frame *f;
+  struct iovec f_iov;
+
+  stats->ring_full++;
+  if (is_queue_full(port->backlog_front, port->backlog_rear,
+                    NET_SWITCH_BACKLOG)) {
+    log_debug("net switch port %d backlog is full, drop the packet", port->id);
+    stats->drops++;
+    return;
+  }
+  f = malloc(sizeof(*f) + packet_len);
+  f->len = packet_len;
+  f_iov.iov_base = f->data;
+  f_iov.iov_len = packet_len;
+  iov_copy(&f_iov, 1, 0, iov, niov, packet_len);
+  port->backlog[port->backlog_rear] = f;
+  port->backlog_rear = (port->backlog_rear + 1) & (NET_SWITCH_BACKLOG - 1);
+}
+
+/// Report the frames delivered to port by its rx interrupt, which is
+/// moderated like the tx completions if the device has a policy. Caller must
+/// hold port->mtx.
+static void net_switch_complete(struct net_switch_port *port) {
+  VirtIODevice *vdev = port->vdev;
+  NetDev *net = vdev->dev;
+  if (port->completed == 0)
+    return;
+  net->stats[NET_QUEUE_RX].irqs +=
+      virtio_irq_complete(&vdev->vqs[NET_QUEUE_RX], port->completed);
+  port->completed = 0;
+}
+
+/// Put a frame into the rx ring of port, or into its backlog if the driver
+/// hasn't provided any buffer. Frames are dropped if the driver hasn't set up
+/// rx yet, just like the tap backend does. Caller must hold port->mtx.
+static void net_switch_deliver(struct net_switch_port *port,
+                               const struct iovec *iov, int niov,
+                               int packet_len) {
+  NetDev *net = port->vdev->dev;
+  VirtQueue *vq = &port->vdev->vqs[NET_QUEUE_RX];
+
+  if (!net->rx_ready || vq->avail_ring == NULL) {
+    log_debug("net switch port %d rx is not ready, drop the packet", port->id);
+    net->stats[NET_QUEUE_RX].drops++;
+    return;
+  }
+  // frames in the backlog go first
+  if (is_queue_empty(port->backlog_front, port->backlog_rear) &&
+      net_switch_put(port, iov, niov, packet_len)) {
+    net_stats_batch(&net->stats[NET_QUEUE_RX], 1);
+    return;
+  }
+  net_switch_backlog_push(port, iov, niov, packet_len);
+  net_switch_drain(port);
+}
+
+/// Drop the frames in the backlog of port. Caller must hold port->mtx.
+static void net_switch_backlog_clear(struct net_switch_port *port) {
+  while (!is_queue_empty(port->backlog_front, port->backlog_rear)) {
+    free(port->backlog[port->backlog_front]);
+    port->backlog_front = (port->backlog_front + 1) & (NET_SWITCH_BACKLOG - 1);
+  }
+}
+
+int net_switch_attach(VirtIODevice *vdev) {
+  NetDev *net = vdev->dev;
+  struct net_switch_port *port;
+  pthread_mutex_lock(&net_switch.mtx);
+  for (int i = 0; i < NET_SWITCH_MAX_PORTS; i++) {
+    port = &net_switch.ports[i];
+    if (port->vdev == NULL) {
+      pthread_mutex_lock(&port->mtx);
+      port->vdev = vdev;
+      port->id = i;
+      port->backlog_front = port->backlog_rear = 0;
+      port->completed = 0;
+      pthread_mutex_unlock(&port->mtx);
+      net->port = port;
+      pthread_mutex_unlock(&net_switch.mtx);
+      log_info("zone %d virtio net attached to switch port %d", vdev->zone_id,
+               i);
+      return 0;
+    }
+  }
+  pthread_mutex_unlock(&net_switch.mtx);
+  log_error("net switch ports are full");
+  return -1;
+}
+
+void net_switch_detach(VirtIODevice *vdev) {
+  NetDev *net = vdev->dev;
+  struct net_switch_port *port = net->port;
+  if (port == NULL)
+    return;
+  pthread_mutex_lock(&net_switch.mtx);
+  // forget all the macs learned from this port
+  for (int i = 0; i < NET_SWITCH_MAC_TABLE_SIZE; i++) {
+    if (net_switch.table[i].used && net_switch.table[i].port == port->id)
+      net_switch.table[i].port = -1;
+  }
+  // wait for the frames being delivered to this port
+  pthread_mutex_lock(&port->mtx);
+  net_switch_backlog_clear(port);
+  port->vdev = NULL;
+  pthread_mutex_unlock(&port->mtx);
+  net->port = NULL;
+  pthread_mutex_unlock(&net_switch.mtx);
+}
+
+void net_switch_rx_notify(VirtIODevice *vdev) {
+  NetDev *net = vdev->dev;
+  struct net_switch_port *port = net->port;
+  if (port == NULL)
+    return;
+  pthread_mutex_lock(&port->mtx);
+  net_switch_drain(port);
+  net_switch_complete(port);
+  pthread_mutex_unlock(&port->mtx);
+}
+
+void net_switch_forward(NetDev *net, const struct iovec *iov, int niov,
+                        int packet_len) {
+  struct net_switch_port *src = net->port, *port;
+  struct ethhdr eth;
+  struct iovec eth_iov = {.iov_base = &eth, .iov_len = ETH_HLEN};
+  bool dst_ports[NET_SWITCH_MAX_PORTS] = {false};
+  time_t now;
+  int dst;
+
+  if (src == NULL) {
+    log_error("net device is not attached to switch");
+    return;
+  }
+  if (packet_len < ETH_HLEN ||
+      iov_copy(&eth_iov, 1, 0, iov, niov, ETH_HLEN) != ETH_HLEN) {
+    log_error("net switch port %d sent an invalid packet", src->id);
+    return;
+  }
+
+  now = time(NULL);
+  pthread_mutex_lock(&net_switch.mtx);
+  if (!(eth.h_source[0] & 1))
+    mac_learn(eth.h_source, src->id, now);
+
+  dst = (eth.h_dest[0] & 1) ? -1 : mac_lookup(eth.h_dest, now);
+  if (dst >= 0) {
+    dst_ports[dst] = dst != src->id;
+  } else {
+    // broadcast, multicast or unknown unicast, flood to all the other ports
+    for (int i = 0; i < NET_SWITCH_MAX_PORTS; i++)
+      dst_ports[i] = i != src->id && net_switch.ports[i].vdev != NULL;
+  }
+  pthread_mutex_unlock(&net_switch.mtx);
+
+  for (int i = 0; i < NET_SWITCH_MAX_PORTS; i++) {
+    if (!dst_ports[i])
+      continue;
+    port = &net_switch.ports[i];
+    pthread_mutex_lock(&port->mtx);
+    // the port may be detached after the lookup
+    if (port->vdev != NULL)
+      net_switch_deliver(port, iov, niov, packet_len);
+    pthread_mutex_unlock(&port->mtx);
+  }
+}
+
+void net_switch_flush_irqs(NetDev *net) {
+  struct net_switch_port *port;
+  for (int i = 0; i < NET_SWITCH_MAX_PORTS; i++) {
+    port = &net_switch.ports[i];
+    if (port == net->port)
+      continue;
+    pthread_mutex_lock(&port->mtx);
+    if (port->vdev != NULL)
+      net_switch_complete(port);
+    pthread_mutex_unlock(&port->mtx);
+  }
+}
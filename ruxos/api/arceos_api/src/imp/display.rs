@@ -18,3 +18,8 @@ pub fn ax_framebuffer_info() -> AxDisplayInfo {
 pub fn ax_framebuffer_flush() {
     ruxdisplay::framebuffer_flush()
 }
+
+/// Flushes the framebuffer, given that only the rectangle changed.
+pub fn ax_framebuffer_flush_rect(x: u32, y: u32, width: u32, height: u32) {
+    ruxdisplay::framebuffer_flush_rect(ruxdisplay::DisplayRect::new(x, y, width, height))
+}
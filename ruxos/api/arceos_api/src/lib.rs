@@ -340,6 +340,12 @@ pub mod display {
         pub fn ax_framebuffer_info() -> AxDisplayInfo;
         /// Flushes the framebuffer, i.e. show on the screen.
         pub fn ax_framebuffer_flush();
+        /// Flushes the framebuffer, given that only the rectangle changed.
+        ///
+        /// The device may still transfer the whole framebuffer. It may return
+        /// before the device finishes if another task is flushing, which then
+        /// flushes this rectangle as well.
+        pub fn ax_framebuffer_flush_rect(x: u32, y: u32, width: u32, height: u32);
     }
 }
 
@@ -7,6 +7,8 @@ use std::os::arceos::api::display as api;
 pub struct Display {
     size: Size,
     fb: &'static mut [u8],
+    // Bounding box (x1, y1, x2, y2) of the pixels drawn since the last flush.
+    dirty: Option<(u32, u32, u32, u32)>,
 }
 
 impl Display {
@@ -16,11 +18,18 @@ impl Display {
         let fb =
             unsafe { core::slice::from_raw_parts_mut(info.fb_base_vaddr as *mut u8, info.fb_size) };
         let size = Size::new(info.width, info.height);
-        Self { size, fb }
+        Self {
+            size,
+            fb,
+            dirty: None,
+        }
     }
 
-    pub fn flush(&self) {
-        api::ax_framebuffer_flush();
+    /// Shows the pixels drawn since the last flush.
+    pub fn flush(&mut self) {
+        if let Some((x1, y1, x2, y2)) = self.dirty.take() {
+            api::ax_framebuffer_flush_rect(x1, y1, x2 - x1, y2 - y1);
+        }
     }
 }
 
@@ -39,13 +48,25 @@ impl DrawTarget for Display {
         I: IntoIterator<Item = embedded_graphics::Pixel<Self::Color>>,
     {
         pixels.into_iter().for_each(|px| {
-            let idx = (px.0.y * self.size.width as i32 + px.0.x) as usize * 4;
+            // Skip pixels off the screen instead of wrapping them onto it.
+            let (Ok(x), Ok(y)) = (u32::try_from(px.0.x), u32::try_from(px.0.y)) else {
+                return;
+            };
+            if x >= self.size.width || y >= self.size.height {
+                return;
+            }
+            let idx = (y * self.size.width + x) as usize * 4;
             if idx + 2 >= self.fb.len() {
                 return;
             }
             self.fb[idx] = px.1.b();
             self.fb[idx + 1] = px.1.g();
             self.fb[idx + 2] = px.1.r();
+
+            self.dirty = Some(match self.dirty {
+                Some((x1, y1, x2, y2)) => (x1.min(x), y1.min(y), x2.max(x + 1), y2.max(y + 1)),
+                None => (x, y, x + 1, y + 1),
+            });
         });
         Ok(())
     }
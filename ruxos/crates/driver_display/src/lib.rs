@@ -27,6 +27,70 @@ pub struct DisplayInfo {
     pub fb_size: usize,
 }
 
+/// A rectangle of the framebuffer, in pixels.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct DisplayRect {
+    /// The left edge.
+    pub x: u32,
+    /// The top edge.
+    pub y: u32,
+    /// The width.
+    pub width: u32,
+    /// The height.
+    pub height: u32,
+}
+
+impl DisplayRect {
+    /// Creates a rectangle with the given position and size.
+    pub const fn new(x: u32, y: u32, width: u32, height: u32) -> Self {
+        Self {
+            x,
+            y,
+            width,
+            height,
+        }
+    }
+
+    /// Whether the rectangle covers no pixel.
+    pub const fn is_empty(&self) -> bool {
+        self.width == 0 || self.height == 0
+    }
+
+    /// The x coordinate just past the right edge, saturated at `u32::MAX`.
+    pub const fn right(&self) -> u32 {
+        self.x.saturating_add(self.width)
+    }
+
+    /// The y coordinate just past the bottom edge, saturated at `u32::MAX`.
+    pub const fn bottom(&self) -> u32 {
+        self.y.saturating_add(self.height)
+    }
+
+    /// The smallest rectangle that covers both `self` and `other`.
+    pub fn union(&self, other: &Self) -> Self {
+        if self.is_empty() {
+            return *other;
+        }
+        if other.is_empty() {
+            return *self;
+        }
+        let x = self.x.min(other.x);
+        let y = self.y.min(other.y);
+        let x2 = self.right().max(other.right());
+        let y2 = self.bottom().max(other.bottom());
+        Self::new(x, y, x2 - x, y2 - y)
+    }
+
+    /// The part of the rectangle inside a `width` x `height` screen.
+    pub fn clamp(&self, width: u32, height: u32) -> Self {
+        let x = self.x.min(width);
+        let y = self.y.min(height);
+        let x2 = self.right().min(width);
+        let y2 = self.bottom().min(height);
+        Self::new(x, y, x2 - x, y2 - y)
+    }
+}
+
 /// The framebuffer.
 ///
 /// It's a special memory buffer that mapped from the device memory.
@@ -65,4 +129,13 @@ pub trait DisplayDriverOps: BaseDriverOps {
 
     /// Flush framebuffer to the screen.
     fn flush(&mut self) -> DevResult;
+
+    /// Flush the framebuffer to the screen, given that only `rect` changed.
+    ///
+    /// A driver may flush more than `rect`. The default ignores it and calls
+    /// [`flush`](Self::flush).
+    fn flush_rect(&mut self, rect: DisplayRect) -> DevResult {
+        let _ = rect;
+        self.flush()
+    }
 }
@@ -11,7 +11,7 @@ extern crate alloc;
 use crate::as_dev_err;
 
 use driver_common::{BaseDriverOps, DevResult, DeviceType};
-use driver_display::{DisplayDriverOps, DisplayInfo, FrameBuffer};
+use driver_display::{DisplayDriverOps, DisplayInfo, DisplayRect, FrameBuffer};
 use virtio_drivers::{device::gpu::VirtIOGpu as InnerDev, transport::Transport, Hal};
 
 /// The VirtIO GPU device driver.
@@ -76,4 +76,14 @@ impl<H: Hal, T: Transport> DisplayDriverOps for VirtIoGpuDev<H, T> {
     fn flush(&mut self) -> DevResult {
         self.inner.flush().map_err(as_dev_err)
     }
+
+    fn flush_rect(&mut self, rect: DisplayRect) -> DevResult {
+        // Nothing on the screen changed, skip the round trip to the device.
+        if rect.clamp(self.info.width, self.info.height).is_empty() {
+            return Ok(());
+        }
+        // Not a partial flush: the pinned `virtio-drivers` keeps the rect
+        // transfer private, so the whole framebuffer is sent either way.
+        self.flush()
+    }
 }
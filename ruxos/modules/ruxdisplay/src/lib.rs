@@ -17,13 +17,17 @@
 extern crate log;
 
 #[doc(no_inline)]
-pub use driver_display::DisplayInfo;
+pub use driver_display::{DisplayInfo, DisplayRect};
 
-use axsync::Mutex;
+use axsync::{spin::SpinNoIrq, Mutex};
 use lazy_init::LazyInit;
 use ruxdriver::{prelude::*, AxDeviceContainer};
 
 static MAIN_DISPLAY: LazyInit<Mutex<AxDisplayDevice>> = LazyInit::new();
+static MAIN_DISPLAY_INFO: LazyInit<DisplayInfo> = LazyInit::new();
+
+/// The region drawn since the last flush that reached the device.
+static DIRTY: SpinNoIrq<DisplayRect> = SpinNoIrq::new(DisplayRect::new(0, 0, 0, 0));
 
 /// Initializes the graphics subsystem by underlayer devices.
 pub fn init_display(mut display_devs: AxDeviceContainer<AxDisplayDevice>) {
@@ -31,15 +35,53 @@ pub fn init_display(mut display_devs: AxDeviceContainer<AxDisplayDevice>) {
 
     let dev = display_devs.take_one().expect("No graphics device found!");
     info!("  use graphics device 0: {:?}", dev.device_name());
+    MAIN_DISPLAY_INFO.init_by(dev.info());
     MAIN_DISPLAY.init_by(Mutex::new(dev));
 }
 
 /// Gets the framebuffer information.
 pub fn framebuffer_info() -> DisplayInfo {
-    MAIN_DISPLAY.lock().info()
+    *MAIN_DISPLAY_INFO
 }
 
 /// Flushes the framebuffer, i.e. show on the screen.
 pub fn framebuffer_flush() {
-    MAIN_DISPLAY.lock().flush().unwrap();
+    let info = framebuffer_info();
+    framebuffer_flush_rect(DisplayRect::new(0, 0, info.width, info.height));
+}
+
+/// Flushes the framebuffer, given that only `rect` changed.
+///
+/// The device may still transfer the whole framebuffer; virtio-gpu does.
+///
+/// The rectangle is clipped to the screen and merged into the dirty region. If
+/// another task is flushing the display, this returns at once and that task
+/// flushes the merged region too, so callers never wait on the device behind
+/// each other.
+pub fn framebuffer_flush_rect(rect: DisplayRect) {
+    let info = &*MAIN_DISPLAY_INFO;
+    let rect = rect.clamp(info.width, info.height);
+    if rect.is_empty() {
+        return;
+    }
+    {
+        let mut dirty = DIRTY.lock();
+        *dirty = dirty.union(&rect);
+    }
+
+    while let Some(mut dev) = MAIN_DISPLAY.try_lock() {
+        loop {
+            let pending = core::mem::take(&mut *DIRTY.lock());
+            if pending.is_empty() {
+                break;
+            }
+            dev.flush_rect(pending).unwrap();
+        }
+        drop(dev);
+        // A task that failed `try_lock` after our last check left its region
+        // to us, so look again after unlocking.
+        if DIRTY.lock().is_empty() {
+            break;
+        }
+    }
 }